@@ -86,6 +86,10 @@
 #include "screenhack.h"
 #include "spline.h"
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 /* The normal (and max) width for a graph bar */
 #define BAR_SIZE 11
 #define MAX_SIZE 16
@@ -102,6 +106,24 @@ enum graph_mode {
   graph_none, graph_x, graph_y, graph_both, graph_speed
 };
 
+enum force_solver {
+  solver_direct, solver_tree
+};
+
+/* Above this many points, "auto" uses the tree. */
+#define TREE_POINTS 500
+
+/* Tree cells with this many points or fewer aren't split any further. */
+#define LEAF_POINTS 8
+
+/* A square of the Barnes-Hut quadtree. */
+struct quad {
+  double x, y, half;		/* center and half-width */
+  double mass, mx, my;		/* total mass and center of mass */
+  int child;			/* index of the first of 4, or -1 if a leaf */
+  int first, count;		/* the points in it, in st->order */
+};
+
 struct ball {
   double x, y;
   double vx, vy;
@@ -148,6 +170,12 @@ struct state {
   int total_ticks;
   int color_tick;
   spline *spl;
+
+  enum force_solver solver;
+  double theta;			/* Barnes-Hut opening angle */
+  struct quad *quads;
+  int nquads, quads_size;
+  int *order;
 };
 
 
@@ -211,6 +239,27 @@ attraction_init (Display *dpy, Window window)
 
   st->viscosity = get_float_resource (dpy, "viscosity", "Float");
 
+  mode_str = get_string_resource (dpy, "solver", "Solver");
+  if (!mode_str || !strcmp (mode_str, "auto"))
+    st->solver = (st->npoints > TREE_POINTS ? solver_tree : solver_direct);
+  else if (!strcmp (mode_str, "direct"))	st->solver = solver_direct;
+  else if (!strcmp (mode_str, "tree"))		st->solver = solver_tree;
+  else {
+    fprintf (stderr, "%s: solver must be direct, tree, or auto, not \"%s\"\n",
+	     progname, mode_str);
+    exit (1);
+  }
+  if (mode_str) free (mode_str);
+
+  st->theta = get_float_resource (dpy, "theta", "Float");
+  if (st->theta < 0) st->theta = 0;
+
+  if (st->solver == solver_tree)
+    {
+      st->order = (int *) malloc (st->npoints * sizeof(*st->order));
+      if (! st->order) abort();
+    }
+
   mode_str = get_string_resource (dpy, "mode", "Mode");
   if (! mode_str) st->mode = ball_mode;
   else if (!strcmp (mode_str, "balls")) 	st->mode = ball_mode;
@@ -431,35 +480,289 @@ attraction_init (Display *dpy, Window window)
   return st;
 }
 
+/* Adds the acceleration of ball i toward ball j.
+ */
+static void
+add_force (struct state *st, int i, int j, double *dx_ret, double *dy_ret)
+{
+  double x_dist, y_dist, dist, dist2;
+  x_dist = st->balls [j].x - st->balls [i].x;
+  y_dist = st->balls [j].y - st->balls [i].y;
+  dist2 = (x_dist * x_dist) + (y_dist * y_dist);
+  dist = sqrt (dist2);
+	      
+  if (dist > 0.1) /* the balls are not overlapping */
+    {
+      double new_acc = ((st->balls[j].mass / dist2) *
+                        ((dist < st->threshold) ? -1.0 : 1.0));
+      double new_acc_dist = new_acc / dist;
+      *dx_ret += new_acc_dist * x_dist;
+      *dy_ret += new_acc_dist * y_dist;
+    }
+  else
+    {		/* the balls are overlapping; move randomly */
+      *dx_ret += (frand (10.0) - 5.0);
+      *dy_ret += (frand (10.0) - 5.0);
+    }
+}
+
+
 static void
 compute_force (struct state *st, int i, double *dx_ret, double *dy_ret)
 {
   int j;
-  double x_dist, y_dist, dist, dist2;
   *dx_ret = 0;
   *dy_ret = 0;
+  for (j = 0; j < st->npoints; j++)
+    if (i != j)
+      add_force (st, i, j, dx_ret, dy_ret);
+}
+
+
+#ifdef __SSE2__
+/* compute_force for balls i and i+1 at once.  Each lane adds up its
+   ball's forces in the same order compute_force does, so the results are
+   the same down to the last bit.
+ */
+static void
+compute_force2 (struct state *st, int i)
+{
+  struct ball *b = st->balls;
+  __m128d x = _mm_set_pd (b[i+1].x, b[i].x);
+  __m128d y = _mm_set_pd (b[i+1].y, b[i].y);
+  __m128d dx = _mm_setzero_pd (), dy = _mm_setzero_pd ();
+  __m128d thresh = _mm_set1_pd (st->threshold);
+  __m128d overlap = _mm_set1_pd (0.1);
+  __m128d one = _mm_set1_pd (1.0);
+  __m128d sign_bit = _mm_set1_pd (-0.0);
+  int j;
+
   for (j = 0; j < st->npoints; j++)
     {
-      if (i == j) continue;
-      x_dist = st->balls [j].x - st->balls [i].x;
-      y_dist = st->balls [j].y - st->balls [i].y;
-      dist2 = (x_dist * x_dist) + (y_dist * y_dist);
-      dist = sqrt (dist2);
-	      
-      if (dist > 0.1) /* the balls are not overlapping */
-	{
-	  double new_acc = ((st->balls[j].mass / dist2) *
-			    ((dist < st->threshold) ? -1.0 : 1.0));
-	  double new_acc_dist = new_acc / dist;
-	  *dx_ret += new_acc_dist * x_dist;
-	  *dy_ret += new_acc_dist * y_dist;
-	}
+      __m128d x_dist = _mm_sub_pd (_mm_set1_pd (b[j].x), x);
+      __m128d y_dist = _mm_sub_pd (_mm_set1_pd (b[j].y), y);
+      __m128d dist2 = _mm_add_pd (_mm_mul_pd (x_dist, x_dist),
+                                  _mm_mul_pd (y_dist, y_dist));
+      __m128d dist = _mm_sqrt_pd (dist2);
+      __m128d sign = _mm_or_pd (one, _mm_and_pd (sign_bit,
+                                                 _mm_cmplt_pd (dist, thresh)));
+      __m128d new_acc = _mm_mul_pd (_mm_div_pd (_mm_set1_pd (b[j].mass),
+                                                dist2),
+                                    sign);
+      __m128d new_acc_dist = _mm_div_pd (new_acc, dist);
+
+      if (j == i || j == i+1 ||
+          _mm_movemask_pd (_mm_cmple_pd (dist, overlap)))
+        {
+          /* Skip the ball itself, and do overlapping ones the slow way. */
+          double sx[2], sy[2];
+          _mm_storeu_pd (sx, dx);
+          _mm_storeu_pd (sy, dy);
+          if (j != i)   add_force (st, i,   j, &sx[0], &sy[0]);
+          if (j != i+1) add_force (st, i+1, j, &sx[1], &sy[1]);
+          dx = _mm_loadu_pd (sx);
+          dy = _mm_loadu_pd (sy);
+        }
       else
-	{		/* the balls are overlapping; move randomly */
-	  *dx_ret += (frand (10.0) - 5.0);
-	  *dy_ret += (frand (10.0) - 5.0);
-	}
+        {
+          dx = _mm_add_pd (dx, _mm_mul_pd (new_acc_dist, x_dist));
+          dy = _mm_add_pd (dy, _mm_mul_pd (new_acc_dist, y_dist));
+        }
     }
+
+  _mm_storel_pd (&b[i].dx,   dx);
+  _mm_storeh_pd (&b[i+1].dx, dx);
+  _mm_storel_pd (&b[i].dy,   dy);
+  _mm_storeh_pd (&b[i+1].dy, dy);
+}
+#endif /* __SSE2__ */
+
+
+/* Fills in quad q, which covers st->order[first, first+count), and the
+   tree below it.
+ */
+static void
+build_quad (struct state *st, int q, double x, double y, double half,
+            int first, int count, int depth)
+{
+  struct quad *Q;
+  double mass = 0, mx = 0, my = 0;
+  int i;
+
+  for (i = first; i < first + count; i++)
+    {
+      const struct ball *b = &st->balls[st->order[i]];
+      mass += b->mass;
+      mx += b->mass * b->x;
+      my += b->mass * b->y;
+    }
+
+  Q = &st->quads[q];
+  Q->x = x;
+  Q->y = y;
+  Q->half = half;
+  Q->mass = mass;
+  Q->mx = (mass > 0 ? mx / mass : x);
+  Q->my = (mass > 0 ? my / mass : y);
+  Q->child = -1;
+  Q->first = first;
+  Q->count = count;
+
+  /* Stop at a few points, or when they're all on top of each other. */
+  if (count > LEAF_POINTS && depth < 40)
+    {
+      int *o = st->order + first;
+      int split[5], k, c;
+
+      if (st->nquads + 4 > st->quads_size)
+        {
+          st->quads_size = (st->nquads + 4) * 2;
+          st->quads = (struct quad *)
+            realloc (st->quads, st->quads_size * sizeof(*st->quads));
+          if (! st->quads) abort();
+        }
+      c = st->nquads;
+      st->nquads += 4;
+      st->quads[q].child = c;
+
+      /* Partition into the quadrants: left/right, then top/bottom of each.
+       */
+      split[0] = 0;
+      split[4] = count;
+      for (k = 0; k < 3; k++)
+        {
+          int lo = (k == 2 ? split[2] : 0);
+          int hi = (k == 0 ? count : k == 1 ? split[2] : count);
+          int yp = (k != 0);
+          while (lo < hi)
+            {
+              const struct ball *b = &st->balls[o[lo]];
+              if (yp ? b->y < y : b->x < x)
+                lo++;
+              else
+                {
+                  int t = o[lo]; o[lo] = o[--hi]; o[hi] = t;
+                }
+            }
+          split[k == 0 ? 2 : k == 1 ? 1 : 3] = lo;
+        }
+
+      half /= 2;
+      for (k = 0; k < 4; k++)
+        build_quad (st, c + k,
+                    x + (k & 2 ? half : -half),
+                    y + (k & 1 ? half : -half),
+                    half, first + split[k], split[k+1] - split[k], depth + 1);
+    }
+}
+
+
+static void
+build_tree (struct state *st)
+{
+  double x0 = st->balls[0].x, x1 = x0, y0 = st->balls[0].y, y1 = y0;
+  double half;
+  int i;
+
+  for (i = 0; i < st->npoints; i++)
+    {
+      const struct ball *b = &st->balls[i];
+      if (b->x < x0) x0 = b->x; else if (b->x > x1) x1 = b->x;
+      if (b->y < y0) y0 = b->y; else if (b->y > y1) y1 = b->y;
+      st->order[i] = i;
+    }
+  half = (x1 - x0 > y1 - y0 ? x1 - x0 : y1 - y0) / 2 + 1;
+
+  if (st->quads_size < 1)
+    {
+      st->quads_size = st->npoints;
+      st->quads = (struct quad *) malloc (st->quads_size * sizeof(*st->quads));
+      if (! st->quads) abort();
+    }
+  st->nquads = 1;
+  build_quad (st, 0, (x0 + x1) / 2, (y0 + y1) / 2, half, 0, st->npoints, 0);
+}
+
+
+/* compute_force, except that a square of the tree that is far enough
+   away -- entirely outside the repulsive threshold, and smaller than
+   theta times its distance -- pulls as one ball at its center of mass.
+ */
+static void
+tree_force (struct state *st, int i, double *dx_ret, double *dy_ret)
+{
+  const struct ball *b = &st->balls[i];
+  double near = (st->threshold > 0.1 ? st->threshold : 0.1);
+  int stack[4 * 40 + 4];
+  int n = 0;
+
+  *dx_ret = 0;
+  *dy_ret = 0;
+  stack[n++] = 0;
+  while (n)
+    {
+      const struct quad *Q = &st->quads[stack[--n]];
+      double gx = fabs (b->x - Q->x) - Q->half;
+      double gy = fabs (b->y - Q->y) - Q->half;
+      double gap2 = ((gx > 0 ? gx * gx : 0) + (gy > 0 ? gy * gy : 0));
+
+      if (Q->count == 0)
+        continue;
+      else if (gap2 > near * near)
+        {
+          double x_dist = Q->mx - b->x;
+          double y_dist = Q->my - b->y;
+          double dist2 = (x_dist * x_dist) + (y_dist * y_dist);
+          double size = Q->half * 2;
+          if (size * size < st->theta * st->theta * dist2)
+            {
+              double dist = sqrt (dist2);
+              double new_acc_dist = Q->mass / dist2 / dist;
+              *dx_ret += new_acc_dist * x_dist;
+              *dy_ret += new_acc_dist * y_dist;
+              continue;
+            }
+        }
+
+      if (Q->child < 0)
+        {
+          int k;
+          for (k = Q->first; k < Q->first + Q->count; k++)
+            if (st->order[k] != i)
+              add_force (st, i, st->order[k], dx_ret, dy_ret);
+        }
+      else
+        {
+          stack[n++] = Q->child;
+          stack[n++] = Q->child + 1;
+          stack[n++] = Q->child + 2;
+          stack[n++] = Q->child + 3;
+        }
+    }
+}
+
+
+/* Computes the force of attraction/repulsion on every ball.
+ */
+static void
+compute_forces (struct state *st)
+{
+  int i = 0;
+
+  if (st->solver == solver_tree)
+    {
+      build_tree (st);
+      for (i = 0; i < st->npoints; i++)
+        tree_force (st, i, &st->balls[i].dx, &st->balls[i].dy);
+      return;
+    }
+
+#ifdef __SSE2__
+  for (; i + 1 < st->npoints; i += 2)
+    compute_force2 (st, i);
+#endif
+  for (; i < st->npoints; i++)
+    compute_force (st, i, &st->balls[i].dx, &st->balls[i].dy);
 }
 
 
@@ -669,8 +972,7 @@ attraction_draw (Display *dpy, Window window, void *closure)
     }
 
   /* compute the force of attraction/repulsion among all balls */
-  for (i = 0; i < st->npoints; i++)
-    compute_force (st, i, &st->balls[i].dx, &st->balls[i].dy);
+  compute_forces (st);
 
   /* move the balls according to the forces now in effect */
   for (i = 0; i < st->npoints; i++)
@@ -1038,6 +1340,8 @@ attraction_free (Display *dpy, Window window, void *closure)
   if (st->point_stack)	free (st->point_stack);
   if (st->colors)	free (st->colors);
   if (st->spl)		free_spline (st->spl);
+  if (st->quads)	free (st->quads);
+  if (st->order)	free (st->order);
 
   free (st);
 }
@@ -1059,6 +1363,8 @@ static const char *attraction_defaults [] = {
   "*maxspeed:	true",
   "*cbounce:	true",
   "*viscosity:	1.0",
+  "*solver:	auto",
+  "*theta:	0.5",
   "*orbit:	false",
   "*colorShift:	3",
   "*segments:	500",
@@ -1088,6 +1394,8 @@ static XrmOptionDescRec attraction_options [] = {
   { "-vy",		".vy",		XrmoptionSepArg, 0 },
   { "-vmult",		".vMult",	XrmoptionSepArg, 0 },
   { "-viscosity",	".viscosity",	XrmoptionSepArg, 0 },
+  { "-solver",		".solver",	XrmoptionSepArg, 0 },
+  { "-theta",		".theta",	XrmoptionSepArg, 0 },
   { "-glow",		".glow",	XrmoptionNoArg, "true" },
   { "-noglow",		".glow",	XrmoptionNoArg, "false" },
   { "-orbit",		".orbit",	XrmoptionNoArg, "true" },
@@ -32,11 +32,16 @@
 #include <math.h>
 #include <stdint.h>
 #include "screenhack.h"
+#include "index_image.h"
 
 #ifdef HAVE_XSHM_EXTENSION
 #include "xshm.h"
 #endif /* HAVE_XSHM_EXTENSION */
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 
 /* Defines: */
 /* #define VERBOSE */
@@ -44,6 +49,10 @@
 
 typedef unsigned char	BOOL;
 
+/* Gradients are clamped to this, and pixels on the edge of the bump map get
+ * -GRADIENT_MAX so that they always miss the light map. */
+#define GRADIENT_MAX	16383
+
 
 /* Globals: */
 
@@ -118,9 +127,12 @@ typedef struct
 #endif /* HAVE_XSHM_EXTENSION */
 
 	uint8_t nColorCount;				/* Number of colors used. */
-	uint8_t bytesPerPixel;
 	uint16_t iWinWidth, iWinHeight;
 	uint16_t *aBumpMap;				/* The actual bump map. */
+	int16_t *aGradX, *aGradY;		/* Its slope to the right and downwards. */
+	uint8_t *aRowColors;			/* One row of the spotlight, as color indexes. */
+	int32_t nLastXPos, nLastYPos;	/* Where the spotlight was last drawn. */
+	Bool bRedraw;
 	SSpotLight SpotLight;
 
         int delay;
@@ -135,35 +147,11 @@ static void SetPalette(Display *, SBumps *, XWindowAttributes * );
 static void InitBumpMap(Display *, SBumps *, XWindowAttributes * );
 static void InitBumpMap_2(Display *, SBumps *);
 static void SoftenBumpMap( SBumps * );
+static void CalcGradients( SBumps * );
 
 
 
 
-/* This function pointer will point to the appropriate PutPixel*() function below. */
-static void (*MyPutPixel)( int8_t *, uint32_t );
-
-static void PutPixel32( int8_t *pData, uint32_t pixel )
-{
-	*(uint32_t *)pData = pixel;
-}
-
-static void PutPixel24( int8_t *pData, uint32_t pixel )
-{
-	pData[ 2 ] = ( pixel & 0x00FF0000 ) >> 16;
-	pData[ 1 ] = ( pixel & 0x0000FF00 ) >> 8;
-	pData[ 0 ] = ( pixel & 0x000000FF );
-}
-
-static void PutPixel16( int8_t *pData, uint32_t pixel )
-{
-	*(uint16_t *)pData = (uint16_t)pixel;
-}
-
-static void PutPixel8( int8_t *pData, uint32_t pixel )
-{
-	*(uint8_t *)pData = (uint8_t)pixel;
-}
-
 /* Creates the light map, which is a circular image... going from black around the edges
  * to white in the center. */
 static void CreateSpotLight( SSpotLight *pSpotLight, uint16_t iDiameter, uint16_t nColorCount )
@@ -181,7 +169,8 @@ static void CreateSpotLight( SSpotLight *pSpotLight, uint16_t iDiameter, uint16_
 	printf( "%s: Spot Light Diameter: %d\n", progclass, pSpotLight->nLightDiameter );
 #endif
 
-	pSpotLight->aLightMap = malloc( pSpotLight->nLightDiameter * pSpotLight->nLightDiameter * sizeof(uint8_t) );
+	/* The extra entry at the end is where everything outside the light lands. */
+	pSpotLight->aLightMap = malloc( ( pSpotLight->nLightDiameter * pSpotLight->nLightDiameter + 1 ) * sizeof(uint8_t) );
 
 	pLOffset = pSpotLight->aLightMap;
 	for( iDistY=-pSpotLight->nLightRadius; iDistY<pSpotLight->nLightRadius; ++iDistY )
@@ -197,6 +186,7 @@ static void CreateSpotLight( SSpotLight *pSpotLight, uint16_t iDiameter, uint16_
 			++pLOffset;
 		}
 	}
+	*pLOffset = 0;
 		
 	/* Initialize movement variables.	*/
 	pSpotLight->nAccelX = 0;
@@ -292,40 +282,8 @@ static void CreateBumps( SBumps *pBumps, Display *dpy, Window NewWin )
 		pBumps->pXImage->data = malloc( pBumps->pXImage->bytes_per_line * pBumps->pXImage->height * sizeof(char) );
 	}
 
-	/* For speed, access the XImage data directly using my own PutPixel routine. */
-	switch( pBumps->pXImage->bits_per_pixel )
-	{
-		case 32:
-			pBumps->bytesPerPixel = 4;
-			MyPutPixel = PutPixel32;
-			break;
-		
-		case 24:
-			pBumps->bytesPerPixel = 3;
-			MyPutPixel = PutPixel24;
-			break;
-
-		case 16:
-			pBumps->bytesPerPixel = 2;
-			MyPutPixel = PutPixel16;
-			break;
-
-		case 8:
-			pBumps->bytesPerPixel = 1;
-			MyPutPixel = PutPixel8;
-			break;
-
-		default:
-			fprintf( stderr, "%s: Unknown XImage depth.", progname );
-#ifdef HAVE_XSHM_EXTENSION
-			if( pBumps->bUseShm )
-				destroy_xshm_image( pBumps->dpy, pBumps->pXImage, &pBumps->XShmInfo );
-			else
-#endif /* HAVE_XSHM_EXTENSION */
-				XDestroyImage( pBumps->pXImage );
-			exit( 1 );
-	}
-	
+	pBumps->aRowColors = malloc( iDiameter * sizeof(uint8_t) );
+
 	GCValues.function = GXcopy;
 	GCValues.subwindow_mode = IncludeInferiors;
 	nGCFlags = GCFunction;
@@ -444,6 +402,7 @@ static void InitBumpMap_2(Display *dpy, SBumps *pBumps)
 	XClearWindow (pBumps->dpy, pBumps->Win);
 	XSync (pBumps->dpy, 0);
 
+	free( pBumps->aBumpMap );
 	pBumps->aBumpMap = malloc( pBumps->iWinWidth * pBumps->iWinHeight * sizeof(uint16_t) );
 	
 	nSoften = get_integer_resource(dpy,  "soften", "Integer" );
@@ -493,6 +452,9 @@ static void InitBumpMap_2(Display *dpy, SBumps *pBumps)
 	while( nSoften-- )
 		SoftenBumpMap( pBumps );
 
+	CalcGradients( pBumps );
+	pBumps->bRedraw = True;
+
 /*	free( pBumps->xColors );
     pBumps->xColors = 0;*/
 }
@@ -542,16 +504,116 @@ static void SoftenBumpMap( SBumps *pBumps )
 }
 
 
+/* The lighting only depends on the slope of the bump map, so work that out
+ * once per image instead of once per pixel per frame. */
+static void CalcGradients( SBumps *pBumps )
+{
+	uint32_t nCount = pBumps->iWinWidth * pBumps->iWinHeight;
+	uint16_t *pBOffset = pBumps->aBumpMap;
+	int16_t *pGradX, *pGradY;
+	int32_t iWidth, iHeight;
+	int32_t nX, nY;
+
+	free( pBumps->aGradX );
+	free( pBumps->aGradY );
+	pBumps->aGradX = pGradX = malloc( nCount * sizeof(int16_t) );
+	pBumps->aGradY = pGradY = malloc( nCount * sizeof(int16_t) );
+
+	for( iHeight=0; iHeight<pBumps->iWinHeight; iHeight++ )
+	{
+		for( iWidth=0; iWidth<pBumps->iWinWidth; iWidth++, pBOffset++, pGradX++, pGradY++ )
+		{
+			if( iHeight == 0 || iHeight >= pBumps->iWinHeight-2 ||
+				iWidth == 0 || iWidth >= pBumps->iWinWidth-2 )
+			{
+				*pGradX = *pGradY = -GRADIENT_MAX;
+				continue;
+			}
+
+			nX = pBOffset[ 1 ] - pBOffset[ 0 ];
+			nY = pBOffset[ pBumps->iWinWidth ] - pBOffset[ 0 ];
+			*pGradX = ( nX < -GRADIENT_MAX ) ? -GRADIENT_MAX : ( nX > GRADIENT_MAX ) ? GRADIENT_MAX : nX;
+			*pGradY = ( nY < -GRADIENT_MAX ) ? -GRADIENT_MAX : ( nY > GRADIENT_MAX ) ? GRADIENT_MAX : nY;
+		}
+	}
+
+	free( pBumps->aBumpMap );
+	pBumps->aBumpMap = NULL;
+}
+
+
+/* Looks up the light map color for nCount pixels of one row, starting at
+ * iLightX within the spotlight. */
+static void ShadeRow( SBumps *pBumps, uint8_t *pColors, const int16_t *pGradX, const int16_t *pGradY,
+					  int32_t iLightX, int32_t iLightY, int32_t nCount )
+{
+	const uint8_t *aLightMap = pBumps->SpotLight.aLightMap;
+	int32_t nDiameter = pBumps->SpotLight.nLightDiameter;
+	int32_t nOutside = nDiameter * nDiameter;
+	int32_t nX, nY;
+	int32_t i = 0;
+
+#ifdef __SSE2__
+	int32_t aOffsets[ 8 ];
+	__m128i vLightX = _mm_add_epi16( _mm_set1_epi16( iLightX ), _mm_setr_epi16( 0, 1, 2, 3, 4, 5, 6, 7 ) );
+	__m128i vLightY = _mm_set1_epi16( iLightY );
+	__m128i vStep = _mm_set1_epi16( 8 );
+	__m128i vDiameter = _mm_set1_epi16( nDiameter );
+	__m128i vMinus1 = _mm_set1_epi16( -1 );
+	__m128i vOutside = _mm_set1_epi32( nOutside );
+
+	for( ; i + 8 <= nCount; i += 8 )
+	{
+		__m128i vX = _mm_add_epi16( _mm_loadu_si128( (const __m128i *)( pGradX + i ) ), vLightX );
+		__m128i vY = _mm_add_epi16( _mm_loadu_si128( (const __m128i *)( pGradY + i ) ), vLightY );
+		__m128i vIn = _mm_and_si128( _mm_and_si128( _mm_cmpgt_epi16( vX, vMinus1 ), _mm_cmplt_epi16( vX, vDiameter ) ),
+									 _mm_and_si128( _mm_cmpgt_epi16( vY, vMinus1 ), _mm_cmplt_epi16( vY, vDiameter ) ) );
+		/* nY * nDiameter + nX, widened to 32 bits. */
+		__m128i vLo = _mm_mullo_epi16( vY, vDiameter );
+		__m128i vHi = _mm_mulhi_epi16( vY, vDiameter );
+		__m128i vXSign = _mm_srai_epi16( vX, 15 );
+		__m128i vOff0 = _mm_add_epi32( _mm_unpacklo_epi16( vLo, vHi ), _mm_unpacklo_epi16( vX, vXSign ) );
+		__m128i vOff1 = _mm_add_epi32( _mm_unpackhi_epi16( vLo, vHi ), _mm_unpackhi_epi16( vX, vXSign ) );
+		__m128i vIn0 = _mm_unpacklo_epi16( vIn, vIn );
+		__m128i vIn1 = _mm_unpackhi_epi16( vIn, vIn );
+		vOff0 = _mm_or_si128( _mm_and_si128( vIn0, vOff0 ), _mm_andnot_si128( vIn0, vOutside ) );
+		vOff1 = _mm_or_si128( _mm_and_si128( vIn1, vOff1 ), _mm_andnot_si128( vIn1, vOutside ) );
+		_mm_storeu_si128( (__m128i *)aOffsets, vOff0 );
+		_mm_storeu_si128( (__m128i *)( aOffsets + 4 ), vOff1 );
+
+		pColors[ i ]     = aLightMap[ aOffsets[ 0 ] ];
+		pColors[ i + 1 ] = aLightMap[ aOffsets[ 1 ] ];
+		pColors[ i + 2 ] = aLightMap[ aOffsets[ 2 ] ];
+		pColors[ i + 3 ] = aLightMap[ aOffsets[ 3 ] ];
+		pColors[ i + 4 ] = aLightMap[ aOffsets[ 4 ] ];
+		pColors[ i + 5 ] = aLightMap[ aOffsets[ 5 ] ];
+		pColors[ i + 6 ] = aLightMap[ aOffsets[ 6 ] ];
+		pColors[ i + 7 ] = aLightMap[ aOffsets[ 7 ] ];
+
+		vLightX = _mm_add_epi16( vLightX, vStep );
+	}
+#endif /* __SSE2__ */
+
+	for( ; i < nCount; i++ )
+	{
+		/* That's right folks, all the magic of bump mapping occurs in these two lines.  (kinda disappointing, isn't it?) */
+		nX = pGradX[ i ] + iLightX + i;
+		nY = pGradY[ i ] + iLightY;
+
+		pColors[ i ] = ( nX<0 || nX>=nDiameter || nY<0 || nY>=nDiameter )
+			? aLightMap[ nOutside ]
+			: aLightMap[ ( nY * nDiameter ) + nX ];
+	}
+}
+
+
 /* This is where we slap down some pixels... */
 static void Execute( SBumps *pBumps )
 {
 	int32_t nLightXPos, nLightYPos;
-	int32_t iScreenX, iScreenY;
+	int32_t iScreenY;
 	int32_t iLightX, iLightY;
-	uint16_t *pBOffset;
-	int8_t *pDOffset;
 	int32_t nX, nY;
-	uint16_t nColor;
 	int32_t nLightOffsetFar = pBumps->SpotLight.nFalloffDiameter - pBumps->SpotLight.nLightRadius;
 
 	CalcLightPos( pBumps );
@@ -559,41 +621,34 @@ static void Execute( SBumps *pBumps )
 	/* Offset to upper left hand corner. */
 	nLightXPos = pBumps->SpotLight.nXPos - pBumps->SpotLight.nFalloffRadius;
 	nLightYPos = pBumps->SpotLight.nYPos - pBumps->SpotLight.nFalloffRadius;
-	
+
+	/* Nothing changes on the screen unless the light crossed a pixel. */
+	if( !pBumps->bRedraw && nLightXPos == pBumps->nLastXPos && nLightYPos == pBumps->nLastYPos )
+		return;
+	pBumps->bRedraw = False;
+	pBumps->nLastXPos = nLightXPos;
+	pBumps->nLastYPos = nLightYPos;
+
+	/* The part of the spotlight that is on the screen. */
+	iLightX = ( nLightXPos < 0 ) ? -nLightXPos : 0;
+	nX = pBumps->SpotLight.nFalloffDiameter;
+	if( nLightXPos + nX > pBumps->iWinWidth )
+		nX = pBumps->iWinWidth - nLightXPos;
+	nX -= iLightX;
+
 	for( iScreenY=nLightYPos, iLightY=-pBumps->SpotLight.nLightRadius; iLightY<nLightOffsetFar; ++iScreenY, ++iLightY )
 	{
+		int32_t nOffset;
+		uint16_t iImageY = iLightY + pBumps->SpotLight.nLightRadius;
+
 		if( iScreenY < 0 )							continue;
 		else if( iScreenY >= pBumps->iWinHeight )	break;
+		if( nX <= 0 )								break;
 
-    /* warning: pointer targets in assignment differ in signedness
-       Should pDOffset be a int8?  I can't tell.  -jwz, 22-Jul-2003 */
-		pDOffset = (int8_t *) &pBumps->pXImage->data[ (iLightY+pBumps->SpotLight.nLightRadius) * pBumps->pXImage->bytes_per_line ];
-		pBOffset = pBumps->aBumpMap + ( iScreenY * pBumps->iWinWidth ) + nLightXPos;
-		for( iScreenX=nLightXPos, iLightX=-pBumps->SpotLight.nLightRadius; iLightX<nLightOffsetFar; ++iScreenX, ++iLightX, ++pBOffset, pDOffset+=pBumps->bytesPerPixel )
-		{
-			if( iScreenX < 0 )							continue;
-			else if( iScreenX >= pBumps->iWinWidth )	break;
-			else if( iScreenY == 0 || iScreenY >= pBumps->iWinHeight-2 ||
-					 iScreenX == 0 || iScreenX >= pBumps->iWinWidth-2 )
-			{
-				MyPutPixel( pDOffset, (uint32_t)pBumps->aColors[ 0 ] );
-				continue;
-			}
-
-			/* That's right folks, all the magic of bump mapping occurs in these two lines.  (kinda disappointing, isn't it?) */
-			nX = ( pBOffset[ 1 ] - pBOffset[ 0 ] ) + iLightX;
-			nY = ( pBOffset[ pBumps->iWinWidth ] - pBOffset[ 0 ] ) + iLightY;
-
-			if( nX<0 || nX>=pBumps->SpotLight.nLightDiameter
-			 || nY<0 || nY>=pBumps->SpotLight.nLightDiameter )
-			{
-				MyPutPixel( pDOffset, (uint32_t)pBumps->aColors[ 0 ] );
-				continue;
-			}
-				
-			nColor = pBumps->SpotLight.aLightMap[ ( nY * pBumps->SpotLight.nLightDiameter ) + nX ];
-			MyPutPixel( pDOffset, (uint32_t)pBumps->aColors[ nColor ] );
-		}
+		nOffset = ( iScreenY * pBumps->iWinWidth ) + nLightXPos + iLightX;
+		ShadeRow( pBumps, pBumps->aRowColors, pBumps->aGradX + nOffset, pBumps->aGradY + nOffset,
+				  iLightX - pBumps->SpotLight.nLightRadius, iLightY, nX );
+		index_put_row( pBumps->pXImage, iLightX, iImageY, pBumps->aRowColors, nX, pBumps->aColors );
 	}	
 
 	/* Allow the spotlight to go *slightly* off the screen by clipping the XImage. */
@@ -640,6 +695,9 @@ static void DestroyBumps( SBumps *pBumps )
 	DestroySpotLight( &pBumps->SpotLight );
 	free( pBumps->aColors );
 	free( pBumps->aBumpMap );
+	free( pBumps->aGradX );
+	free( pBumps->aGradY );
+	free( pBumps->aRowColors );
 #ifdef HAVE_XSHM_EXTENSION
 	if( pBumps->bUseShm )
 		destroy_xshm_image( pBumps->dpy, pBumps->pXImage, &pBumps->XShmInfo );
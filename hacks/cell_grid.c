@@ -0,0 +1,183 @@
+/* cell_grid.c --- a row-major cell grid stepped on the threadpool.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee.  No
+ * representations are made about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ */
+
+/* Each thread takes an equal band of the rows being stepped.  Waking the
+   threads costs more than the work on a small grid, so those are stepped
+   on the calling thread alone.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cell_grid.h"
+
+#define THREAD_CELLS 65536	/* Fewest cells worth splitting up. */
+
+struct cell_thread {
+  cell_grid *g;
+  unsigned id;
+};
+
+
+static int
+cell_thread_create (void *self_raw, struct threadpool *pool, unsigned id)
+{
+  struct cell_thread *self = (struct cell_thread *) self_raw;
+  self->g = GET_PARENT_OBJ(cell_grid, threadpool, pool);
+  self->id = id;
+  return 0;
+}
+
+
+static void
+cell_thread_destroy (void *self_raw)
+{
+}
+
+
+static unsigned long
+step_rows (cell_grid *g, int y0, int y1)
+{
+  unsigned long sum = 0;
+  int y;
+  for (y = y0; y < y1; y++)
+    sum += g->rule (g->closure, g, y, g->prev + y * g->width);
+  return sum;
+}
+
+
+static void
+cell_thread_run (void *self_raw)
+{
+  struct cell_thread *self = (struct cell_thread *) self_raw;
+  cell_grid *g = self->g;
+  unsigned count = g->threadpool.count;
+  int n = g->y1 - g->y0;
+  g->sums[self->id] =
+    step_rows (g, g->y0 + (int) (n * self->id / count),
+               g->y0 + (int) (n * (self->id + 1) / count));
+}
+
+
+cell_grid *
+cell_grid_new (Display *dpy, int width, int height)
+{
+  cell_grid *g = (cell_grid *) calloc (1, sizeof(*g));
+  if (!g) return 0;
+
+  if (cell_grid_resize (g, width, height))
+    {
+      free (g);
+      return 0;
+    }
+
+  {
+    static const struct threadpool_class cls = {
+      sizeof(struct cell_thread),
+      cell_thread_create,
+      cell_thread_destroy
+    };
+
+    if (threadpool_create (&g->threadpool, &cls, dpy,
+                           hardware_concurrency (dpy)))
+      g->threadpool.count = 0; /* See the note in thread_util.h. */
+  }
+
+  if (g->threadpool.count)
+    {
+      g->sums = (unsigned long *)
+        calloc (g->threadpool.count, sizeof(*g->sums));
+      if (!g->sums)
+        {
+          threadpool_destroy (&g->threadpool);
+          g->threadpool.count = 0;
+        }
+    }
+
+  return g;
+}
+
+
+void
+cell_grid_free (cell_grid *g)
+{
+  if (!g) return;
+  if (g->threadpool.count)
+    threadpool_destroy (&g->threadpool);
+  free (g->sums);
+  free (g->cells);
+  free (g->prev);
+  free (g);
+}
+
+
+int
+cell_grid_resize (cell_grid *g, int width, int height)
+{
+  size_t size;
+  unsigned char *cells, *prev;
+
+  if (width < 0 || height < 0) return -1;
+  size = (size_t) width * height;
+  cells = (unsigned char *) calloc (size ? size : 1, 1);
+  prev  = (unsigned char *) calloc (size ? size : 1, 1);
+  if (!cells || !prev)
+    {
+      free (cells);
+      free (prev);
+      return -1;
+    }
+
+  free (g->cells);
+  free (g->prev);
+  g->cells  = cells;
+  g->prev   = prev;
+  g->width  = width;
+  g->height = height;
+  return 0;
+}
+
+
+unsigned long
+cell_grid_step (cell_grid *g, int y0, int y1,
+                cell_grid_rule rule, void *closure)
+{
+  unsigned long sum = 0;
+  unsigned char *swap;
+
+  if (y0 < 0) y0 = 0;
+  if (y1 > g->height) y1 = g->height;
+  if (y1 < y0) y1 = y0;
+
+  g->rule = rule;
+  g->closure = closure;
+  g->y0 = y0;
+  g->y1 = y1;
+
+  if (g->threadpool.count > 1 &&
+      (size_t) (y1 - y0) * g->width >= THREAD_CELLS)
+    {
+      unsigned i;
+      threadpool_run (&g->threadpool, cell_thread_run);
+      threadpool_wait (&g->threadpool);
+      for (i = 0; i < g->threadpool.count; i++)
+        sum += g->sums[i];
+    }
+  else
+    sum = step_rows (g, y0, y1);
+
+  /* The rows that were not stepped carry over. */
+  memcpy (g->prev, g->cells, (size_t) y0 * g->width);
+  memcpy (g->prev + (size_t) y1 * g->width, g->cells + (size_t) y1 * g->width,
+          (size_t) (g->height - y1) * g->width);
+
+  swap = g->cells;
+  g->cells = g->prev;
+  g->prev = swap;
+  return sum;
+}
@@ -0,0 +1,70 @@
+/* cell_grid.h --- a row-major cell grid stepped on the threadpool.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee.  No
+ * representations are made about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ */
+
+/* A grid of one-byte cells for cellular automata that compute each
+   generation entirely from the one before.
+
+   Cells are stored row by row, and the next generation is written into a
+   second buffer that then trades places with the first, so a step reads
+   and writes memory in order and never copies the grid.  The hack supplies
+   a rule that computes one row; big grids are split into bands of rows
+   that are computed on several threads at once.
+ */
+
+#ifndef __CELL_GRID_H__
+#define __CELL_GRID_H__
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "thread_util.h"
+
+typedef struct cell_grid cell_grid;
+
+/* Fills in out, a whole row of width cells, with the next generation of
+   row y of g->cells, and returns anything the caller wants added up over
+   the step, such as the number of live cells.  Rules run on several
+   threads at once, and must only read g and write out.
+ */
+typedef unsigned long (*cell_grid_rule) (void *closure, const cell_grid *g,
+                                         int y, unsigned char *out);
+
+/* Everything but width, height, cells and prev is private.
+ */
+struct cell_grid {
+  int width, height;
+  unsigned char *cells;		/* The current generation: cells[y*width+x] */
+  unsigned char *prev;		/* The one before it, after a step. */
+
+  struct threadpool threadpool;
+  cell_grid_rule rule;
+  void *closure;
+  int y0, y1;
+  unsigned long *sums;		/* One per thread. */
+};
+
+/* Returns a grid with every cell 0, or NULL if out of memory.  The
+   display is only used to decide how many threads to run.
+ */
+extern cell_grid *cell_grid_new (Display *, int width, int height);
+extern void cell_grid_free (cell_grid *);
+
+/* Changes the size of the grid, and sets every cell to 0.  Returns -1 if
+   out of memory, in which case the grid is unchanged.
+ */
+extern int cell_grid_resize (cell_grid *, int width, int height);
+
+/* Runs the rule on rows y0 through y1-1 to make the next generation, which
+   then becomes g->cells.  The other rows are carried over unchanged.
+   Returns the sum of what the rule returned.
+ */
+extern unsigned long cell_grid_step (cell_grid *, int y0, int y1,
+                                     cell_grid_rule, void *closure);
+
+#endif /* __CELL_GRID_H__ */
@@ -0,0 +1,221 @@
+/* circle_grid.c --- finds overlapping circles with a uniform grid.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee.  No
+ * representations are made about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ */
+
+/* A bucket grid of circles, keyed by the range of cells each bounding box
+   covers.
+
+   A circle that stays inside the same range of cells from one frame to the
+   next, which at the speeds these hacks move is nearly all of them, costs
+   nothing to update.  Two circles whose ranges overlap share several cells
+   when they are large, so a pair is only reported from the top left cell
+   of the overlap, which needs no bookkeeping to avoid duplicates.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "circle_grid.h"
+
+typedef struct {
+  int *ids;
+  int count, size;
+} CELL;
+
+typedef struct {
+  int x0, y0, x1, y1;		/* Range of cells covered; x0 is -1 if absent. */
+} RANGE;
+
+struct circle_grid {
+  int cols, rows;
+  double scale;			/* Cells per unit. */
+  CELL *cells;
+
+  RANGE *ranges;
+  int ranges_size;
+
+  int *found, found_size;
+};
+
+
+circle_grid *
+circle_grid_new (int width, int height, double cell_size)
+{
+  circle_grid *g;
+
+  if (width <= 0 || height <= 0 || !(cell_size > 0))
+    return 0;
+
+  g = (circle_grid *) calloc (1, sizeof(*g));
+  if (!g) return 0;
+
+  g->cols = (int) (width / cell_size) + 1;
+  g->rows = (int) (height / cell_size) + 1;
+  g->scale = 1 / cell_size;
+  g->cells = (CELL *) calloc (g->cols * g->rows, sizeof(*g->cells));
+  if (!g->cells)
+    {
+      free (g);
+      return 0;
+    }
+  return g;
+}
+
+
+void
+circle_grid_free (circle_grid *g)
+{
+  int i;
+  if (!g) return;
+  for (i = 0; i < g->cols * g->rows; i++)
+    free (g->cells[i].ids);
+  free (g->cells);
+  free (g->ranges);
+  free (g->found);
+  free (g);
+}
+
+
+/* The cell that coordinate v falls in, clamped to 0 .. n-1.
+ */
+static int
+cell_index (double v, double scale, int n)
+{
+  double c = v * scale;
+  if (!(c >= 0)) return 0;	/* Also catches NaN. */
+  if (c >= n) return n - 1;
+  return (int) c;
+}
+
+
+static int
+cell_add (CELL *c, int id)
+{
+  if (c->count >= c->size)
+    {
+      int size = c->size ? c->size * 2 : 8;
+      int *ids = (int *) realloc (c->ids, size * sizeof(*ids));
+      if (!ids) return -1;
+      c->ids = ids;
+      c->size = size;
+    }
+  c->ids[c->count++] = id;
+  return 0;
+}
+
+
+static void
+cell_remove (CELL *c, int id)
+{
+  int i;
+  for (i = 0; i < c->count; i++)
+    if (c->ids[i] == id)
+      {
+        c->ids[i] = c->ids[--c->count];
+        return;
+      }
+}
+
+
+int
+circle_grid_move (circle_grid *g, int id, double x, double y, double radius)
+{
+  RANGE *old, r;
+  int cx, cy;
+
+  if (id < 0) return -1;
+
+  if (id >= g->ranges_size)
+    {
+      int size = g->ranges_size ? g->ranges_size : 64;
+      RANGE *ranges;
+      int *found;
+      while (size <= id) size *= 2;
+      /* The sizes only change once both buffers have grown. */
+      ranges = (RANGE *) realloc (g->ranges, size * sizeof(*ranges));
+      if (!ranges) return -1;
+      g->ranges = ranges;
+      found = (int *) realloc (g->found, size * sizeof(*found));
+      if (!found) return -1;
+      g->found = found;
+
+      for (; g->ranges_size < size; g->ranges_size++)
+        g->ranges[g->ranges_size].x0 = -1;
+      g->found_size = size;
+    }
+
+  r.x0 = cell_index (x - radius, g->scale, g->cols);
+  r.y0 = cell_index (y - radius, g->scale, g->rows);
+  r.x1 = cell_index (x + radius, g->scale, g->cols);
+  r.y1 = cell_index (y + radius, g->scale, g->rows);
+
+  old = &g->ranges[id];
+  if (old->x0 == r.x0 && old->y0 == r.y0 &&
+      old->x1 == r.x1 && old->y1 == r.y1)
+    return 0;
+
+  if (old->x0 >= 0)
+    for (cy = old->y0; cy <= old->y1; cy++)
+      for (cx = old->x0; cx <= old->x1; cx++)
+        cell_remove (&g->cells[cy * g->cols + cx], id);
+
+  old->x0 = -1;
+  for (cy = r.y0; cy <= r.y1; cy++)
+    for (cx = r.x0; cx <= r.x1; cx++)
+      if (cell_add (&g->cells[cy * g->cols + cx], id))
+        {
+          /* Back out, so that the circle is either filed or not. */
+          int ex = cx, ey = cy;
+          for (cy = r.y0; cy <= ey; cy++)
+            for (cx = r.x0; cx <= r.x1 && (cy < ey || cx < ex); cx++)
+              cell_remove (&g->cells[cy * g->cols + cx], id);
+          return -1;
+        }
+
+  *old = r;
+  return 0;
+}
+
+
+static int
+cmp_ints (const void *a, const void *b)
+{
+  return *(const int *) a - *(const int *) b;
+}
+
+
+int
+circle_grid_nearby (circle_grid *g, int id, const int **ids)
+{
+  const RANGE *r;
+  int cx, cy, n = 0;
+
+  *ids = g->found;
+  if (id < 0 || id >= g->ranges_size) return 0;
+  r = &g->ranges[id];
+  if (r->x0 < 0) return 0;
+
+  for (cy = r->y0; cy <= r->y1; cy++)
+    for (cx = r->x0; cx <= r->x1; cx++)
+      {
+        const CELL *c = &g->cells[cy * g->cols + cx];
+        int i;
+        for (i = 0; i < c->count; i++)
+          {
+            int j = c->ids[i];
+            const RANGE *o = &g->ranges[j];
+            if (j > id &&
+                cx == (r->x0 > o->x0 ? r->x0 : o->x0) &&
+                cy == (r->y0 > o->y0 ? r->y0 : o->y0))
+              g->found[n++] = j;
+          }
+      }
+
+  if (n > 1)
+    qsort (g->found, n, sizeof(*g->found), cmp_ints);
+  return n;
+}
@@ -0,0 +1,49 @@
+/* circle_grid.h --- finds overlapping circles with a uniform grid.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee.  No
+ * representations are made about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ */
+
+/* A bucket grid of moving circles, for hacks that look at every pair of
+   circles that overlap.
+
+   Each circle is filed under every grid cell that its bounding box touches,
+   and is only refiled when it moves into a different range of cells.  Two
+   circles that overlap always share a cell, so looking only at the circles
+   in the same cells finds every overlapping pair without testing all of
+   them.  Circles may wander outside the grid; the edge cells catch them.
+ */
+
+#ifndef __CIRCLE_GRID_H__
+#define __CIRCLE_GRID_H__
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+typedef struct circle_grid circle_grid;
+
+/* A grid covering a width x height area with square cells of the given
+   size, which works best at about the diameter of the larger circles.
+   Returns NULL if out of memory.
+ */
+extern circle_grid *circle_grid_new (int width, int height, double cell_size);
+extern void circle_grid_free (circle_grid *);
+
+/* Adds circle number `id', or updates it if it is already there.  Ids are
+   small non-negative integers, like indexes into the caller's own array.
+   Returns -1 if out of memory.
+ */
+extern int circle_grid_move (circle_grid *, int id,
+                             double x, double y, double radius);
+
+/* Finds the circles with ids greater than `id' that share a cell with it,
+   in increasing order, so that each pair is visited once and in the same
+   order as a loop over all of them would.  Returns how many there are, and
+   points *ids at them; the list lasts until the next call.
+ */
+extern int circle_grid_nearby (circle_grid *, int id, const int **ids);
+
+#endif /* __CIRCLE_GRID_H__ */
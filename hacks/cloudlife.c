@@ -26,6 +26,7 @@
  */
 
 #include "screenhack.h"
+#include "cell_grid.h"
 
 #ifndef MAX_WIDTH
 #include <limits.h>
@@ -48,8 +49,8 @@ struct field {
     unsigned int width;
     unsigned int max_age;
     unsigned int cell_size;
-    unsigned char *cells;
-    unsigned char *new_cells;
+    unsigned char value[256];	/* what each age counts as to neighbours */
+    cell_grid *grid;
 };
 
 struct state {
@@ -92,10 +93,23 @@ static void
     return ret;
 }
 
+static inline unsigned int 
+cell_value(unsigned char c, unsigned int age)
+{
+    if (!c) {
+	return 0;
+    } else if (c > age) {
+	return (3);
+    } else {
+	return (1);
+    }
+}
+
 static struct field *
 init_field(struct state *st)
 {
     struct field *f = xrealloc(NULL, sizeof(struct field));
+    unsigned int i;
     f->height = 0;
     f->width = 0;
     f->cell_size = get_integer_resource(st->dpy, "cellSize", "Integer");
@@ -107,36 +121,33 @@ init_field(struct state *st)
       exit (1);
     }
 
-    f->cells = NULL;
-    f->new_cells = NULL;
+    for (i = 0; i < 256; i++)
+	f->value[i] = cell_value(i, f->max_age);
+
+    f->grid = cell_grid_new(st->dpy, 0, 0);
+    if (!f->grid) {
+	fprintf(stderr, "%s: out of memory\n", progname);
+	exit(1);
+    }
     return f;
 }
 
 static void 
 resize_field(struct field * f, unsigned int w, unsigned int h)
 {
-    int s = w * h * sizeof(unsigned char);
+    if (cell_grid_resize(f->grid, w, h)) {
+	fprintf(stderr, "%s: out of memory\n", progname);
+	exit(1);
+    }
     f->width = w;
     f->height = h;
-
-    f->cells = xrealloc(f->cells, s);
-    f->new_cells = xrealloc(f->new_cells, s);
-    memset(f->cells, 0, s);
-    memset(f->new_cells, 0, s);
 }
 
 static inline unsigned char 
 *cell_at(struct field * f, unsigned int x, unsigned int y)
 {
-    return (f->cells + x * sizeof(unsigned char) + 
-                       y * f->width * sizeof(unsigned char));
-}
-
-static inline unsigned char 
-*new_cell_at(struct field * f, unsigned int x, unsigned int y)
-{
-    return (f->new_cells + x * sizeof(unsigned char) + 
-                           y * f->width * sizeof(unsigned char));
+    return (f->grid->cells + x * sizeof(unsigned char) + 
+                             y * f->width * sizeof(unsigned char));
 }
 
 static void
@@ -177,67 +188,58 @@ draw_field(struct state *st, struct field * f)
     }
 }
 
-static inline unsigned int 
-cell_value(unsigned char c, unsigned int age)
+/* Steps one row.  Each neighbour count is the sum of three column sums,
+ * which slide along the row so that every cell is only looked at three
+ * times, once from each row it neighbours.
+ */
+static unsigned long
+tick_row(void *closure, const cell_grid * g, int y, unsigned char *out)
 {
-    if (!c) {
+    const unsigned char *value = ((struct field *) closure)->value;
+    const unsigned char *up, *row, *down;
+    unsigned int left, here, right, count;
+    unsigned long live = 0;
+    int x, w = g->width;
+
+    /* The edges are off screen; they only seed the tick after
+     * populate_edges, and are cleared by it. */
+    if (y == 0 || y == g->height - 1) {
+	memset(out, 0, w);
 	return 0;
-    } else if (c > age) {
-	return (3);
-    } else {
-	return (1);
     }
-}
-
-static inline unsigned int 
-is_alive(struct field * f, unsigned int x, unsigned int y)
-{
-    unsigned int count;
-    unsigned int i, j;
-    unsigned char *p;
-
-    count = 0;
 
-    for (i = x - 1; i <= x + 1; i++) {
-	for (j = y - 1; j <= y + 1; j++) {
-	    if (y != j || x != i) {
-		count += cell_value(*cell_at(f, i, j), f->max_age);
-	    }
-	}
-    }
-
-    p = cell_at(f, x, y);
-    if (*p) {
-	if (count == 2 || count == 3) {
-	    return ((*p) + 1);
-	} else {
-	    return (0);
-	}
-    } else {
-	if (count == 3) {
-	    return (1);
+    row = g->cells + y * w;
+    up = row - w;
+    down = row + w;
+    out[0] = 0;
+    out[w - 1] = 0;
+
+    left = value[up[0]] + value[row[0]] + value[down[0]];
+    here = value[up[1]] + value[row[1]] + value[down[1]];
+    for (x = 1; x < w - 1; x++) {
+	unsigned char c = row[x];
+	right = value[up[x + 1]] + value[row[x + 1]] + value[down[x + 1]];
+	count = left + here + right - value[c];
+
+	if (c) {
+	    out[x] = (count == 2 || count == 3) ? c + 1 : 0;
 	} else {
-	    return (0);
+	    out[x] = (count == 3);
 	}
+	live += out[x];
+
+	left = here;
+	here = right;
     }
+    return live;
 }
 
 static unsigned int 
 do_tick(struct field * f)
 {
-    unsigned int x, y;
-    unsigned int count = 0;
-    for (x = 1; x < f->width - 1; x++) {
-	for (y = 1; y < f->height - 1; y++) {
-	    count += *new_cell_at(f, x, y) = is_alive(f, x, y);
-	}
-    }
-    memcpy(f->cells, f->new_cells, f->width * f->height *
-           sizeof(unsigned char));
-    return count;
+    return cell_grid_step(f->grid, 0, f->height, tick_row, f);
 }
 
-
 static unsigned int 
 random_cell(unsigned int p)
 {
@@ -384,6 +386,9 @@ static void
 cloudlife_free (Display *dpy, Window window, void *closure)
 {
   struct state *st = (struct state *) closure;
+  cell_grid_free (st->field->grid);
+  free (st->field);
+  free (st->colors);
   free (st);
 }
 
@@ -398,6 +403,7 @@ static const char *cloudlife_defaults[] = {
     "*maxAge:		64",
     "*initialDensity:	30",
     "*cellSize:		3",
+    THREAD_DEFAULTS
 #ifdef USE_IPHONE
     "*ignoreRotation:   True",
 #endif
@@ -413,6 +419,7 @@ static XrmOptionDescRec cloudlife_options[] = {
     {"-cell-size", ".cellSize", XrmoptionSepArg, 0},
     {"-initial-density", ".initialDensity", XrmoptionSepArg, 0},
     {"-max-age", ".maxAge", XrmoptionSepArg, 0},
+    THREAD_OPTIONS
     {0, 0, 0, 0}
 };
 
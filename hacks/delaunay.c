@@ -19,283 +19,685 @@
    http://paulbourke.net/papers/triangulate/triangulate.c
  */
 
+/* Incremental Delaunay triangulation by edge flipping (Lawson's algorithm).
+
+   Inserting a point finds the triangle containing it by walking across the
+   triangulation from a vertex near it (a coarse grid remembers one vertex
+   per cell), splits that triangle in three (or the edge it is on in four),
+   and then flips edges around the new vertex until every edge is locally
+   Delaunay again.
+
+   Removing a vertex deletes its triangles, fills the hole by clipping ears,
+   preferring ears whose circumcircles contain none of the hole's other
+   corners, and flips whatever edges that left non-Delaunay.
+
+   Both only touch the triangles near the point, which on average is a
+   handful, instead of rebuilding everything as the Bourke algorithm that
+   this replaces did for each new set of points.
+ */
+
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <float.h>
 
 #include "delaunay.h"
 
+#define GRID 64			/* Point-location grid cells per side. */
+
 typedef struct {
-   int p1,p2;
-} IEDGE;
-
-#define TRUE 1
-#define FALSE 0
-#define EPSILON 0.000001
-
-/*
-   Return TRUE if a point (xp,yp) is inside the circumcircle made up
-   of the points (x1,y1), (x2,y2), (x3,y3)
-   The circumcircle centre is returned in (xc,yc) and the radius r
-   NOTE: A point on the edge is inside the circumcircle
-*/
+  int v[3];			/* Counter-clockwise; v[0] is -1 if free. */
+  int n[3];			/* Across the edge opposite v[i], or -1. */
+} TRI;
+
+struct delaunay {
+  XYZ *pts;
+  int *vtri;			/* A triangle of each vertex; -1 if free. */
+  int npts, pts_size;
+  int *free_pts, nfree_pts;
+
+  TRI *tris;
+  int ntris, tris_size, nalive;
+  int *free_tris, nfree_tris;
+  int last;			/* A live triangle, to start walks from. */
+
+  int grid[GRID * GRID];	/* A vertex in each cell, or -1. */
+  double gx, gy, gsx, gsy;
+
+  int *stack, nstack, stack_size;	/* Edges to check, as t*3 + i. */
+
+  int *ring, *out, ring_size;	/* Scratch space for removals. */
+};
+
+
+/* Positive if a, b, c turn counter-clockwise (taking y as up), zero if
+   they are collinear.
+ */
+static double
+orient (const XYZ *a, const XYZ *b, const XYZ *c)
+{
+  return (b->x - a->x) * (c->y - a->y) - (b->y - a->y) * (c->x - a->x);
+}
+
+/* Splits an integer of up to 2^47 into hi * 2^16 + lo, both with its sign.
+ */
+static void
+split16 (double x, double *hi, double *lo)
+{
+  *lo = fmod (x, 65536.0);
+  *hi = (x - *lo) / 65536.0;
+}
+
+/* The sum of the three products a[i] * b[i], which must be integers under
+   2^31, with the right sign.  Each product is split into 16-bit halves so
+   that no partial sum needs more than the 53 bits a double has.
+ */
+static double
+exact_sum3 (const double *a, const double *b)
+{
+  double hi = 0, mid = 0, lo = 0, ah, al, bh, bl;
+  int i;
+  for (i = 0; i < 3; i++)
+    {
+      split16 (a[i], &ah, &al);
+      split16 (b[i], &bh, &bl);
+      hi  += ah * bh;
+      mid += ah * bl + al * bh;
+      lo  += al * bl;
+    }
+  split16 (mid, &ah, &al);
+  hi += ah;
+  lo += al * 65536.0;
+  /* |lo| < 2^35, so if hi is big enough to round, it decides the sign. */
+  return hi * 4294967296.0 + lo;
+}
+
+/* Positive if d is strictly inside the circle through a, b, c, which must
+   turn counter-clockwise.  The differences, lifts and cross products are
+   exact for integer points less than DELAUNAY_MAX_SIZE apart; only the
+   last three products and their sum can round, and when that could change
+   the sign, they are redone exactly.
+ */
+static double
+incircle (const XYZ *a, const XYZ *b, const XYZ *c, const XYZ *d)
+{
+  double adx = a->x - d->x, ady = a->y - d->y;
+  double bdx = b->x - d->x, bdy = b->y - d->y;
+  double cdx = c->x - d->x, cdy = c->y - d->y;
+  double lift[3], cross[3], det, bound;
+
+  lift[0] = adx * adx + ady * ady;
+  lift[1] = bdx * bdx + bdy * bdy;
+  lift[2] = cdx * cdx + cdy * cdy;
+  cross[0] = bdx * cdy - cdx * bdy;
+  cross[1] = cdx * ady - adx * cdy;
+  cross[2] = adx * bdy - bdx * ady;
+
+  det = lift[0] * cross[0] + lift[1] * cross[1] + lift[2] * cross[2];
+  bound = (lift[0] * fabs (cross[0]) +
+           lift[1] * fabs (cross[1]) +
+           lift[2] * fabs (cross[2])) * (4 * DBL_EPSILON);
+  if (det > bound || det < -bound)
+    return det;
+  return exact_sum3 (lift, cross);
+}
+
+
+static int
+reserve_pts (delaunay *d, int n)
+{
+  if (n > d->pts_size)
+    {
+      int size = d->pts_size * 2 + 64;
+      XYZ *pts = (XYZ *) realloc (d->pts, size * sizeof(*pts));
+      int *vtri, *free_pts;
+      if (pts) d->pts = pts;
+      vtri = (int *) realloc (d->vtri, size * sizeof(*vtri));
+      if (vtri) d->vtri = vtri;
+      free_pts = (int *) realloc (d->free_pts, size * sizeof(*free_pts));
+      if (free_pts) d->free_pts = free_pts;
+      if (!pts || !vtri || !free_pts)
+        return 0;
+      d->pts_size = size;
+    }
+  return 1;
+}
+
+static int
+reserve_tris (delaunay *d, int n)
+{
+  if (n > d->tris_size)
+    {
+      int size = d->tris_size * 2 + 128;
+      TRI *tris = (TRI *) realloc (d->tris, size * sizeof(*tris));
+      int *free_tris;
+      if (tris) d->tris = tris;
+      free_tris = (int *) realloc (d->free_tris, size * sizeof(*free_tris));
+      if (free_tris) d->free_tris = free_tris;
+      if (!tris || !free_tris)
+        return 0;
+      d->tris_size = size;
+    }
+  return 1;
+}
+
 static int
-circumcircle (double xp,double yp,
-              double x1,double y1,double x2,double y2,double x3,double y3,
-              double *xc,double *yc,double *rsqr)
+reserve_ring (delaunay *d, int n)
 {
-  double m1,m2,mx1,mx2,my1,my2;
-  double dx,dy,drsqr;
-  double fabsy1y2 = fabs(y1-y2);
-  double fabsy2y3 = fabs(y2-y3);
-
-  /* Check for coincident points */
-  if (fabsy1y2 < EPSILON && fabsy2y3 < EPSILON)
-    return(FALSE);
-
-  if (fabsy1y2 < EPSILON) {
-    m2 = - (x3-x2) / (y3-y2);
-    mx2 = (x2 + x3) / 2.0;
-    my2 = (y2 + y3) / 2.0;
-    *xc = (x2 + x1) / 2.0;
-    *yc = m2 * (*xc - mx2) + my2;
-  } else if (fabsy2y3 < EPSILON) {
-    m1 = - (x2-x1) / (y2-y1);
-    mx1 = (x1 + x2) / 2.0;
-    my1 = (y1 + y2) / 2.0;
-    *xc = (x3 + x2) / 2.0;
-    *yc = m1 * (*xc - mx1) + my1;
-  } else {
-    m1 = - (x2-x1) / (y2-y1);
-    m2 = - (x3-x2) / (y3-y2);
-    mx1 = (x1 + x2) / 2.0;
-    mx2 = (x2 + x3) / 2.0;
-    my1 = (y1 + y2) / 2.0;
-    my2 = (y2 + y3) / 2.0;
-    *xc = (m1 * mx1 - m2 * mx2 + my2 - my1) / (m1 - m2);
-    if (fabsy1y2 > fabsy2y3) {
-      *yc = m1 * (*xc - mx1) + my1;
-    } else {
-      *yc = m2 * (*xc - mx2) + my2;
+  if (n > d->ring_size)
+    {
+      int size = n * 2;
+      int *ring = (int *) realloc (d->ring, size * sizeof(*ring));
+      int *out;
+      if (ring) d->ring = ring;
+      out = (int *) realloc (d->out, size * sizeof(*out));
+      if (out) d->out = out;
+      if (!ring || !out)
+        return 0;
+      d->ring_size = size;
     }
-  }
+  return 1;
+}
 
-  dx = x2 - *xc;
-  dy = y2 - *yc;
-  *rsqr = dx*dx + dy*dy;
+/* If the stack can't grow, the edge is left unchecked: the triangulation
+   is still valid, just not quite Delaunay.
+ */
+static void
+push (delaunay *d, int t, int i)
+{
+  if (d->nstack >= d->stack_size)
+    {
+      int size = d->stack_size * 2 + 64;
+      int *stack = (int *) realloc (d->stack, size * sizeof(*stack));
+      if (!stack)
+        return;
+      d->stack = stack;
+      d->stack_size = size;
+    }
+  d->stack[d->nstack++] = t * 3 + i;
+}
 
-  dx = xp - *xc;
-  dy = yp - *yc;
-  drsqr = dx*dx + dy*dy;
 
-  /* Original
-     return((drsqr <= *rsqr) ? TRUE : FALSE);
-     Proposed by Chuck Morris */
-  return((drsqr - *rsqr) <= EPSILON ? TRUE : FALSE);
+static int *
+grid_cell (delaunay *d, const XYZ *p)
+{
+  int x = (p->x - d->gx) * d->gsx;
+  int y = (p->y - d->gy) * d->gsy;
+  if (x < 0) x = 0; else if (x >= GRID) x = GRID - 1;
+  if (y < 0) y = 0; else if (y >= GRID) y = GRID - 1;
+  return &d->grid[y * GRID + x];
 }
 
 
-/*
-   Triangulation subroutine
-   Takes as input NV vertices in array pxyz
-   Returned is a list of ntri triangular faces in the array v
-   These triangles are arranged in a consistent clockwise order.
-   The triangle array 'v' should be malloced to 3 * nv
-   The vertex array pxyz must be big enough to hold 3 more points
-   The vertex array must be sorted in increasing x values say
-   qsort(p,nv,sizeof(XYZ),XYZCompare);
-*/
-int
-delaunay (int nv,XYZ *pxyz,ITRIANGLE *v,int *ntri)
+/* These assume the room has been reserved. */
+
+static int
+new_tri (delaunay *d)
+{
+  int t = d->nfree_tris ? d->free_tris[--d->nfree_tris] : d->ntris++;
+  d->nalive++;
+  return t;
+}
+
+static void
+free_tri (delaunay *d, int t)
+{
+  d->tris[t].v[0] = -1;
+  d->free_tris[d->nfree_tris++] = t;
+  d->nalive--;
+}
+
+static void
+set_tri (delaunay *d, int t, int a, int b, int c, int na, int nb, int nc)
+{
+  TRI *T = &d->tris[t];
+  T->v[0] = a; T->v[1] = b; T->v[2] = c;
+  T->n[0] = na; T->n[1] = nb; T->n[2] = nc;
+  d->vtri[a] = d->vtri[b] = d->vtri[c] = t;
+  d->last = t;
+}
+
+/* Points u's side of the edge it shares with t back at t.
+ */
+static void
+relink (delaunay *d, int u, int t)
+{
+  TRI *U, *T;
+  int k;
+  if (u < 0) return;
+  U = &d->tris[u];
+  T = &d->tris[t];
+  for (k = 0; k < 3; k++)
+    if (U->v[k] != T->v[0] && U->v[k] != T->v[1] && U->v[k] != T->v[2])
+      {
+        U->n[k] = t;
+        return;
+      }
+}
+
+
+/* Flips the stacked edges that aren't locally Delaunay.  After an
+   insertion, only the edges opposite the new vertex can go bad; after a
+   removal, any edge of a flipped pair can.  With exact tests, this
+   always stops.
+ */
+static void
+flip (delaunay *d, int all_p)
 {
-  int *complete = NULL;
-  IEDGE *edges = NULL;
-  int nedge = 0;
-  int trimax,emax = 200;
-  int status = 0;
-
-  int inside;
-  int i,j,k;
-  double xp,yp,x1,y1,x2,y2,x3,y3,xc=0,yc=0,r=0;
-  double xmin,xmax,ymin,ymax,xmid,ymid;
-  double dx,dy,dmax;
-
-  /* Allocate memory for the completeness list, flag for each triangle */
-  trimax = 4 * nv;
-  if ((complete = malloc(trimax*sizeof(int))) == NULL) {
-    status = 1;
-    goto skip;
-  }
-
-  /* Allocate memory for the edge list */
-  if ((edges = malloc(emax*(long)sizeof(IEDGE))) == NULL) {
-    status = 2;
-    goto skip;
-  }
-
-  /*
-    Find the maximum and minimum vertex bounds.
-    This is to allow calculation of the bounding triangle
-  */
-  xmin = pxyz[0].x;
-  ymin = pxyz[0].y;
-  xmax = xmin;
-  ymax = ymin;
-  for (i=1;i<nv;i++) {
-    if (pxyz[i].x < xmin) xmin = pxyz[i].x;
-    if (pxyz[i].x > xmax) xmax = pxyz[i].x;
-    if (pxyz[i].y < ymin) ymin = pxyz[i].y;
-    if (pxyz[i].y > ymax) ymax = pxyz[i].y;
-  }
-  dx = xmax - xmin;
-  dy = ymax - ymin;
-  dmax = (dx > dy) ? dx : dy;
-  xmid = (xmax + xmin) / 2.0;
-  ymid = (ymax + ymin) / 2.0;
-
-  /*
-    Set up the supertriangle
-    This is a triangle which encompasses all the sample points.
-    The supertriangle coordinates are added to the end of the
-    vertex list. The supertriangle is the first triangle in
-    the triangle list.
-  */
-  pxyz[nv+0].x = xmid - 20 * dmax;
-  pxyz[nv+0].y = ymid - dmax;
-  pxyz[nv+0].z = 0.0;
-  pxyz[nv+1].x = xmid;
-  pxyz[nv+1].y = ymid + 20 * dmax;
-  pxyz[nv+1].z = 0.0;
-  pxyz[nv+2].x = xmid + 20 * dmax;
-  pxyz[nv+2].y = ymid - dmax;
-  pxyz[nv+2].z = 0.0;
-  v[0].p1 = nv;
-  v[0].p2 = nv+1;
-  v[0].p3 = nv+2;
-  complete[0] = FALSE;
-  *ntri = 1;
-
-  /*
-    Include each point one at a time into the existing mesh
-  */
-  for (i=0;i<nv;i++) {
-
-    xp = pxyz[i].x;
-    yp = pxyz[i].y;
-    nedge = 0;
-
-    /*
-      Set up the edge buffer.
-      If the point (xp,yp) lies inside the circumcircle then the
-      three edges of that triangle are added to the edge buffer
-      and that triangle is removed.
-    */
-    for (j=0;j<(*ntri);j++) {
-      if (complete[j])
+  while (d->nstack)
+    {
+      int e = d->stack[--d->nstack];
+      int t = e / 3, i = e % 3, j;
+      TRI *T = &d->tris[t], *U;
+      int u = T->n[i];
+      int p, a, b, q, t_bp, t_pa, u_aq, u_qb;
+
+      if (T->v[0] < 0 || u < 0)
         continue;
-      x1 = pxyz[v[j].p1].x;
-      y1 = pxyz[v[j].p1].y;
-      x2 = pxyz[v[j].p2].x;
-      y2 = pxyz[v[j].p2].y;
-      x3 = pxyz[v[j].p3].x;
-      y3 = pxyz[v[j].p3].y;
-      inside = circumcircle(xp,yp,x1,y1,x2,y2,x3,y3,&xc,&yc,&r);
-      if (xc < xp && ((xp-xc)*(xp-xc)) > r)
-        complete[j] = TRUE;
-      if (inside) {
-        /* Check that we haven't exceeded the edge list size */
-        if (nedge+3 >= emax) {
-          emax += 100;
-          if ((edges = realloc(edges,emax*(long)sizeof(IEDGE))) == NULL) {
-            status = 3;
-            goto skip;
-          }
+      U = &d->tris[u];
+      for (j = 0; j < 2 && U->n[j] != t; j++)
+        ;
+
+      p = T->v[i];
+      a = T->v[(i+1) % 3];
+      b = T->v[(i+2) % 3];
+      q = U->v[j];
+      if (incircle (&d->pts[p], &d->pts[a], &d->pts[b], &d->pts[q]) <= 0)
+        continue;
+
+      t_bp = T->n[(i+1) % 3];
+      t_pa = T->n[(i+2) % 3];
+      u_aq = U->n[(j+1) % 3];
+      u_qb = U->n[(j+2) % 3];
+
+      set_tri (d, t, p, a, q, u_aq, u, t_pa);
+      set_tri (d, u, p, q, b, u_qb, t_bp, t);
+      relink (d, u_aq, t);
+      relink (d, t_bp, u);
+
+      push (d, t, 0);
+      push (d, u, 0);
+      if (all_p)
+        {
+          push (d, t, 2);
+          push (d, u, 1);
         }
-        edges[nedge+0].p1 = v[j].p1;
-        edges[nedge+0].p2 = v[j].p2;
-        edges[nedge+1].p1 = v[j].p2;
-        edges[nedge+1].p2 = v[j].p3;
-        edges[nedge+2].p1 = v[j].p3;
-        edges[nedge+2].p2 = v[j].p1;
-        nedge += 3;
-        v[j] = v[(*ntri)-1];
-        complete[j] = complete[(*ntri)-1];
-        (*ntri)--;
-        j--;
-      }
     }
+}
 
-    /*
-      Tag multiple edges
-      Note: if all triangles are specified anticlockwise then all
-      interior edges are opposite pointing in direction.
-    */
-    for (j=0;j<nedge-1;j++) {
-      for (k=j+1;k<nedge;k++) {
-        if ((edges[j].p1 == edges[k].p2) && (edges[j].p2 == edges[k].p1)) {
-          edges[j].p1 = -1;
-          edges[j].p2 = -1;
-          edges[k].p1 = -1;
-          edges[k].p2 = -1;
-        }
-        /* Shouldn't need the following, see note above */
-        if ((edges[j].p1 == edges[k].p1) && (edges[j].p2 == edges[k].p2)) {
-          edges[j].p1 = -1;
-          edges[j].p2 = -1;
-          edges[k].p1 = -1;
-          edges[k].p2 = -1;
+
+/* Which edge of triangle t has p on its far side, or 3 if p is in t.  If
+   p is in t, *on is the edge p is on, 3 if p is a vertex, or -1.
+ */
+static int
+outside_edge (const delaunay *d, int t, const XYZ *p, int *on)
+{
+  const TRI *T = &d->tris[t];
+  int i, zero = -1, nzero = 0;
+  for (i = 0; i < 3; i++)
+    {
+      double o = orient (&d->pts[T->v[(i+1) % 3]],
+                         &d->pts[T->v[(i+2) % 3]], p);
+      if (o < 0)
+        return i;
+      if (o == 0)
+        {
+          zero = i;
+          nzero++;
         }
-      }
     }
+  *on = (nzero > 1 ? 3 : zero);
+  return 3;
+}
 
-    /*
-      Form new triangles for the current point
-      Skipping over any tagged edges.
-      All edges are arranged in clockwise order.
-    */
-    for (j=0;j<nedge;j++) {
-      if (edges[j].p1 < 0 || edges[j].p2 < 0)
-        continue;
-      if ((*ntri) >= trimax) {
-        status = 4;
-        goto skip;
-      }
-      v[*ntri].p1 = edges[j].p1;
-      v[*ntri].p2 = edges[j].p2;
-      v[*ntri].p3 = i;
-      complete[*ntri] = FALSE;
-      (*ntri)++;
+
+/* Walks from a triangle near p to the one containing it, and returns it,
+   or -1 if p is outside.  *on is as for outside_edge().
+
+   On a Delaunay triangulation this walk can't go in circles.  If a failed
+   allocation left some edges unflipped, it might, so a walk longer than
+   there are triangles gives up and looks at every triangle instead.
+ */
+static int
+locate (delaunay *d, const XYZ *p, int *on)
+{
+  int h = *grid_cell (d, p);
+  int t = (h >= 0 && d->vtri[h] >= 0 ? d->vtri[h] : d->last);
+  int steps;
+
+  for (steps = 0; steps <= d->nalive; steps++)
+    {
+      int i = outside_edge (d, t, p, on);
+      if (i == 3)
+        return t;
+      t = d->tris[t].n[i];
+      if (t < 0)
+        return -1;
+    }
+
+  for (t = 0; t < d->ntris; t++)
+    if (d->tris[t].v[0] >= 0 && outside_edge (d, t, p, on) == 3)
+      return t;
+  return -1;
+}
+
+
+static void
+split_triangle (delaunay *d, int t, int p)
+{
+  TRI *T = &d->tris[t];
+  int a = T->v[0], b = T->v[1], c = T->v[2];
+  int na = T->n[0], nb = T->n[1], nc = T->n[2];
+  int t1 = new_tri (d), t2 = new_tri (d);
+
+  set_tri (d, t,  b, c, p, t1, t2, na);
+  set_tri (d, t1, c, a, p, t2, t,  nb);
+  set_tri (d, t2, a, b, p, t,  t1, nc);
+  relink (d, nb, t1);
+  relink (d, nc, t2);
+  push (d, t,  2);
+  push (d, t1, 2);
+  push (d, t2, 2);
+}
+
+
+/* p is on the edge of t opposite corner i.
+ */
+static void
+split_edge (delaunay *d, int t, int i, int p)
+{
+  TRI *T = &d->tris[t];
+  int a = T->v[i], b = T->v[(i+1) % 3], c = T->v[(i+2) % 3];
+  int nb = T->n[(i+1) % 3], nc = T->n[(i+2) % 3];
+  int u = T->n[i];
+  int t1 = new_tri (d), t3 = -1;
+
+  if (u >= 0)
+    {
+      TRI *U = &d->tris[u];
+      int j, q, u_bq, u_qc;
+      for (j = 0; j < 2 && U->n[j] != t; j++)
+        ;
+      q = U->v[j];
+      u_bq = U->n[(j+1) % 3];
+      u_qc = U->n[(j+2) % 3];
+      t3 = new_tri (d);
+      set_tri (d, u,  b, q, p, t3, t,  u_bq);
+      set_tri (d, t3, q, c, p, t1, u,  u_qc);
+      relink (d, u_qc, t3);
+      push (d, u,  2);
+      push (d, t3, 2);
+    }
+
+  set_tri (d, t,  a, b, p, u,  t1, nc);
+  set_tri (d, t1, c, a, p, t,  t3, nb);
+  relink (d, nb, t1);
+  push (d, t,  2);
+  push (d, t1, 2);
+}
+
+
+delaunay *
+delaunay_new (double x0, double y0, double x1, double y1)
+{
+  delaunay *d;
+  int i;
+
+  if (! (x1 > x0 && y1 > y0) ||
+      x1 - x0 >= DELAUNAY_MAX_SIZE || y1 - y0 >= DELAUNAY_MAX_SIZE)
+    return 0;
+
+  d = (delaunay *) calloc (1, sizeof(*d));
+  if (!d)
+    return 0;
+  if (!reserve_pts (d, 4) || !reserve_tris (d, 2))
+    {
+      delaunay_free (d);
+      return 0;
     }
-  }
-
-  /*
-    Remove triangles with supertriangle vertices
-    These are triangles which have a vertex number greater than nv
-  */
-  for (i=0;i<(*ntri);i++) {
-    if (v[i].p1 >= nv || v[i].p2 >= nv || v[i].p3 >= nv) {
-      v[i] = v[(*ntri)-1];
-      (*ntri)--;
-      i--;
+
+  for (i = 0; i < 4; i++)
+    {
+      d->pts[i].x = (i == 1 || i == 2 ? x1 : x0);
+      d->pts[i].y = (i >= 2 ? y1 : y0);
+      d->pts[i].z = 0;
     }
-  }
+  d->npts = 4;
+
+  d->ntris = d->nalive = 2;
+  set_tri (d, 0, 0, 1, 2, -1, 1, -1);
+  set_tri (d, 1, 0, 2, 3, -1, -1, 0);
 
- skip:
-  free(edges);
-  free(complete);
-  return(status);
+  for (i = 0; i < GRID * GRID; i++)
+    d->grid[i] = -1;
+  d->gx = x0;
+  d->gy = y0;
+  d->gsx = GRID / (x1 - x0);
+  d->gsy = GRID / (y1 - y0);
+
+  return d;
+}
+
+
+void
+delaunay_free (delaunay *d)
+{
+  free (d->pts);
+  free (d->vtri);
+  free (d->free_pts);
+  free (d->tris);
+  free (d->free_tris);
+  free (d->stack);
+  free (d->ring);
+  free (d->out);
+  free (d);
 }
 
 
 int
-delaunay_xyzcompare (const void *v1, const void *v2)
+delaunay_insert (delaunay *d, const XYZ *p)
 {
-  const XYZ *p1,*p2;
-  p1 = v1;
-  p2 = v2;
-  if (p1->x < p2->x)
-    return(-1);
-  else if (p1->x > p2->x)
-    return(1);
+  int t, on, v;
+
+  if (!reserve_pts (d, d->npts + 1) ||
+      !reserve_tris (d, d->ntris + 2))
+    return -1;
+
+  t = locate (d, p, &on);
+  if (t < 0 || on == 3)
+    return -1;
+
+  v = d->nfree_pts ? d->free_pts[--d->nfree_pts] : d->npts++;
+  d->pts[v] = *p;
+  *grid_cell (d, p) = v;
+
+  if (on < 0)
+    split_triangle (d, t, v);
   else
-    return(0);
+    split_edge (d, t, on, v);
+  flip (d, 0);
+  return v;
+}
+
+
+/* Whether the triangle ring[k0], ring[k], ring[k2] can be cut off the
+   hole: it has to be convex, with no other corner of the hole in it.
+ */
+static int
+ear_p (const delaunay *d, const int *ring, int m, int k0, int k, int k2)
+{
+  const XYZ *a = &d->pts[ring[k0]];
+  const XYZ *b = &d->pts[ring[k]];
+  const XYZ *c = &d->pts[ring[k2]];
+  int j;
+  if (orient (a, b, c) <= 0)
+    return 0;
+  for (j = 0; j < m; j++)
+    if (j != k0 && j != k && j != k2)
+      {
+        const XYZ *q = &d->pts[ring[j]];
+        if (orient (a, b, q) >= 0 &&
+            orient (b, c, q) >= 0 &&
+            orient (c, a, q) >= 0)
+          return 0;
+      }
+  return 1;
+}
+
+/* Whether no other corner of the hole is inside the ear's circumcircle.
+ */
+static int
+delaunay_ear_p (const delaunay *d, const int *ring, int m,
+                int k0, int k, int k2)
+{
+  int j;
+  for (j = 0; j < m; j++)
+    if (j != k0 && j != k && j != k2 &&
+        incircle (&d->pts[ring[k0]], &d->pts[ring[k]], &d->pts[ring[k2]],
+                  &d->pts[ring[j]]) > 0)
+      return 0;
+  return 1;
+}
+
+
+void
+delaunay_remove (delaunay *d, int v)
+{
+  int *ring, *out;
+  int start, t, u, i, k, m, a = -1, b = -1;
+
+  if (v < 4 || v >= d->npts || d->vtri[v] < 0)
+    return;	/* The corners stay. */
+
+  /* Back up clockwise to the first triangle around v, if v is on the
+     edge of the rectangle; otherwise any of them will do. */
+  start = t = d->vtri[v];
+  do {
+    i = (d->tris[t].v[0] == v ? 0 : d->tris[t].v[1] == v ? 1 : 2);
+    u = d->tris[t].n[(i+2) % 3];
+    if (u < 0)
+      break;
+    t = u;
+  } while (t != start);
+  start = t;
+
+  m = 0;
+  do {
+    i = (d->tris[t].v[0] == v ? 0 : d->tris[t].v[1] == v ? 1 : 2);
+    t = d->tris[t].n[(i+1) % 3];
+    m++;
+  } while (t >= 0 && t != start);
+
+  if (!reserve_ring (d, m + 1))
+    return;
+  ring = d->ring;
+  out = d->out;
+
+  /* Collect the hole's corners counter-clockwise, and the triangle
+     outside each of its edges, and free v's triangles. */
+  t = start;
+  m = 0;
+  do {
+    TRI *T = &d->tris[t];
+    i = (T->v[0] == v ? 0 : T->v[1] == v ? 1 : 2);
+    a = T->v[(i+1) % 3];
+    b = T->v[(i+2) % 3];
+    ring[m] = a;
+    out[m] = T->n[i];
+    m++;
+    u = T->n[(i+1) % 3];
+    free_tri (d, t);
+    t = u;
+  } while (t >= 0 && t != start);
+  if (t < 0)
+    {
+      ring[m] = b;
+      out[m] = -1;	/* The edge of the rectangle that v was on. */
+      m++;
+    }
+
+  if (*grid_cell (d, &d->pts[v]) == v)
+    *grid_cell (d, &d->pts[v]) = ring[0];
+  d->vtri[v] = -1;
+  d->free_pts[d->nfree_pts++] = v;
+
+  /* Clip ears until there's one triangle left.  This never needs more
+     triangles than were just freed. */
+  d->nstack = 0;
+  while (m > 3)
+    {
+      int best = -1, k0, k2;
+      for (k = 0; k < m; k++)
+        {
+          k0 = (k + m - 1) % m;
+          k2 = (k + 1) % m;
+          if (! ear_p (d, ring, m, k0, k, k2))
+            continue;
+          if (best < 0)
+            best = k;
+          if (delaunay_ear_p (d, ring, m, k0, k, k2))
+            {
+              best = k;
+              break;
+            }
+        }
+      if (best < 0)
+        abort();
+
+      k = best;
+      k0 = (k + m - 1) % m;
+      k2 = (k + 1) % m;
+      t = new_tri (d);
+      set_tri (d, t, ring[k0], ring[k], ring[k2], out[k], -1, out[k0]);
+      relink (d, out[k], t);
+      relink (d, out[k0], t);
+      push (d, t, 0);
+      push (d, t, 2);
+
+      out[k0] = t;
+      memmove (ring + k, ring + k + 1, (m - k - 1) * sizeof(*ring));
+      memmove (out + k, out + k + 1, (m - k - 1) * sizeof(*out));
+      m--;
+    }
+
+  t = new_tri (d);
+  set_tri (d, t, ring[0], ring[1], ring[2], out[1], out[2], out[0]);
+  relink (d, out[0], t);
+  relink (d, out[1], t);
+  relink (d, out[2], t);
+  push (d, t, 0);
+  push (d, t, 1);
+  push (d, t, 2);
+
+  flip (d, 1);
+}
+
+
+const XYZ *
+delaunay_point (const delaunay *d, int v)
+{
+  return (v >= 0 && v < d->npts && d->vtri[v] >= 0 ? &d->pts[v] : 0);
+}
+
+
+int
+delaunay_count (const delaunay *d)
+{
+  return d->nalive;
+}
+
+
+int
+delaunay_triangles (const delaunay *d, ITRIANGLE *v)
+{
+  int t, n = 0;
+  for (t = 0; t < d->ntris; t++)
+    if (d->tris[t].v[0] >= 0)
+      {
+        v[n].p1 = d->tris[t].v[0];
+        v[n].p2 = d->tris[t].v[1];
+        v[n].p3 = d->tris[t].v[2];
+        n++;
+      }
+  return n;
 }
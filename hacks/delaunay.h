@@ -19,6 +19,20 @@
    http://paulbourke.net/papers/triangulate/triangulate.c
  */
 
+/* An incremental Delaunay triangulation of the points inside a rectangle,
+   which replaced the Bourke triangulator above and keeps its interface's
+   XYZ and ITRIANGLE types.
+
+   The four corners of the rectangle are always vertices (numbers 0-3),
+   and points can be inserted and removed one at a time, each touching only
+   the triangles around it, so a triangulation that changes a little can be
+   kept up to date instead of being rebuilt.
+
+   The geometric tests are exact as long as the points have integer
+   coordinates, which X11's 16-bit coordinates keep under
+   DELAUNAY_MAX_SIZE apart.
+ */
+
 #ifndef __DELAUNAY_H__
 #define __DELAUNAY_H__
 
@@ -34,19 +48,33 @@ typedef struct {
    int p1,p2,p3;
 } ITRIANGLE;
 
-/*
-   Takes as input NV vertices in array pxyz
-   Returned is a list of ntri triangular faces in the array v
-   These triangles are arranged in a consistent clockwise order.
-   The triangle array 'v' should be malloced to 3 * nv
-   The vertex array pxyz must be big enough to hold 3 more points
-   The vertex array must be sorted in increasing x values
+typedef struct delaunay delaunay;
+
+#define DELAUNAY_MAX_SIZE 32768
+
+/* Returns NULL if the rectangle is empty, DELAUNAY_MAX_SIZE or more on a
+   side, or out of memory.
  */
-extern int delaunay (int nv, XYZ *pxyz, ITRIANGLE *v, int *ntri);
+extern delaunay *delaunay_new (double x0, double y0, double x1, double y1);
+extern void delaunay_free (delaunay *);
 
-/* qsort(p,nv,sizeof(XYZ), delaunay_xyzcompare); */
-extern int delaunay_xyzcompare (const void *v1, const void *v2);
+/* Adds a point, which must be inside the rectangle or on its edge.  Returns
+   the point's vertex number, or -1 if it was outside, already there, or
+   out of memory.  Numbers of removed vertices get reused.
+ */
+extern int delaunay_insert (delaunay *, const XYZ *p);
 
+/* Removes a vertex returned by delaunay_insert().
+ */
+extern void delaunay_remove (delaunay *, int vertex);
 
-#endif /* __DELAUNAY_H__ */
+extern const XYZ *delaunay_point (const delaunay *, int vertex);
 
+/* Stores the current triangles, as counter-clockwise triples of vertex
+   numbers, into v, which must have room for delaunay_count() of them.
+   Returns the number stored.
+ */
+extern int delaunay_count (const delaunay *);
+extern int delaunay_triangles (const delaunay *, ITRIANGLE *v);
+
+#endif /* __DELAUNAY_H__ */
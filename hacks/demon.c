@@ -59,6 +59,7 @@ static const char sccsid[] = "@(#)demon.c	5.00 2000/11/01 xlockmore";
 					"*ncolors: 64    \n" \
 					"*fpsSolid: true    \n" \
 				    "*ignoreRotation: True  \n" \
+					"*useThreads: True \n" \
 
 # define demon_handle_event 0
 # define UNIFORM_COLORS
@@ -67,6 +68,8 @@ static const char sccsid[] = "@(#)demon.c	5.00 2000/11/01 xlockmore";
 # include "xlock.h"		/* in xlockmore distribution */
 #endif /* STANDALONE */
 #include "automata.h"
+#include "cell_grid.h"
+#include "dirty_cells.h"
 
 #ifdef MODE_demon
 
@@ -74,21 +77,28 @@ static const char sccsid[] = "@(#)demon.c	5.00 2000/11/01 xlockmore";
  * neighbors of 0 randomizes it between 3, 4, 6, 8, 9, and 12.
  */
 #define DEF_NEIGHBORS  "0"      /* choose random value */
+#define DEF_VERBOSE  "False"
 
 static int  neighbors;
+static Bool verbose;
 
 static XrmOptionDescRec opts[] =
 {
-	{"-neighbors", ".demon.neighbors", XrmoptionSepArg, 0}
+	{"-neighbors", ".demon.neighbors", XrmoptionSepArg, 0},
+	{"-verbose", ".demon.verbose", XrmoptionNoArg, "on"},
+	{"+verbose", ".demon.verbose", XrmoptionNoArg, "off"},
+	THREAD_OPTIONS
 };
 
 static argtype vars[] =
 {
-	{&neighbors, "neighbors", "Neighbors", DEF_NEIGHBORS, t_Int}
+	{&neighbors, "neighbors", "Neighbors", DEF_NEIGHBORS, t_Int},
+	{&verbose, "verbose", "Verbose", DEF_VERBOSE, t_Bool}
 };
 static OptionStruct desc[] =
 {
-	{"-neighbors num", "squares 4 or 8, hexagons 6, triangles 3, 9 or 12"}
+	{"-neighbors num", "squares 4 or 8, hexagons 6, triangles 3, 9 or 12"},
+	{"-/+verbose", "turn on/off printing X requests per frame"}
 };
 
 ENTRYPOINT ModeSpecOpt demon_opts =
@@ -114,12 +124,6 @@ ModStruct   demon_description =
 #define MINSIZE 4
 #define NEIGHBORKINDS 6
 
-/* Singly linked list */
-typedef struct _CellList {
-	XPoint      pt;
-	struct _CellList *next;
-} CellList;
-
 typedef struct {
 	int         generation;
 	int         xs, ys;
@@ -129,10 +133,12 @@ typedef struct {
 	int         states;
 	int         state;
 	int         redrawing, redrawpos;
-	int        *ncells;
-	CellList  **cellList;
-	unsigned char *oldcell, *newcell;
+	int         frames;
+	unsigned long requests;
+	dirty_cells *dirty;	/* Changed cells, by state */
+	cell_grid  *grid;
 	int         neighbors;
+	signed char nb[2][12][2];	/* dx, dy of each neighbor, by parity */
 	int         init_bits;
 	GC          stippledGC;
 	Pixmap      pixmaps[NUMSTIPPLES - 1];
@@ -211,88 +217,28 @@ drawcell(ModeInfo * mi, int col, int row, unsigned char state)
 	}
 }
 
-static Bool
-addtolist(ModeInfo * mi, int col, int row, unsigned char state)
-{
-	demonstruct *dp = &demons[MI_SCREEN(mi)];
-	CellList   *current;
-
-	current = dp->cellList[state];
-	if ((dp->cellList[state] = (CellList *)
-		malloc(sizeof (CellList))) == NULL) {
-		return False;
-	}
-	dp->cellList[state]->pt.x = col;
-	dp->cellList[state]->pt.y = row;
-	dp->cellList[state]->next = current;
-	dp->ncells[state]++;
-	return True;
-}
-
 #ifdef DEBUG
 static void
 print_state(ModeInfo * mi, int state)
 {
 	demonstruct *dp = &demons[MI_SCREEN(mi)];
-	CellList   *locallist;
-	int         i = 0;
-
-	locallist = dp->cellList[state];
-	(void) printf("state %d\n", state);
-	while (locallist) {
-		(void) printf("%d	x %d, y %d\n", i,
-			      locallist->pt.x, locallist->pt.y);
-		locallist = locallist->next;
-		i++;
-	}
-}
 
-#endif
-
-static void
-free_state(demonstruct * dp, int state)
-{
-	CellList   *current;
-
-	while (dp->cellList[state]) {
-		current = dp->cellList[state];
-		dp->cellList[state] = dp->cellList[state]->next;
-		(void) free((void *) current);
-	}
-	dp->cellList[state] = (CellList *) NULL;
-	if (dp->ncells != NULL)
-		dp->ncells[state] = 0;
+	(void) printf("state %d: %d cells\n", state,
+		      dirty_cells_count(dp->dirty, state));
 }
 
-
-static void
-free_list(demonstruct * dp)
-{
-	int         state;
-
-	for (state = 0; state < dp->states; state++)
-		free_state(dp, state);
-	(void) free((void *) dp->cellList);
-	dp->cellList = (CellList **) NULL;
-}
+#endif
 
 static void
 free_struct(demonstruct * dp)
 {
-	if (dp->cellList != NULL) {
-		free_list(dp);
-	}
-	if (dp->ncells != NULL) {
-		(void) free((void *) dp->ncells);
-		dp->ncells = (int *) NULL;
+	if (dp->dirty != NULL) {
+		dirty_cells_free(dp->dirty);
+		dp->dirty = (dirty_cells *) NULL;
 	}
-	if (dp->oldcell != NULL) {
-		(void) free((void *) dp->oldcell);
-		dp->oldcell = (unsigned char *) NULL;
-	}
-	if (dp->newcell != NULL) {
-		(void) free((void *) dp->newcell);
-		dp->newcell = (unsigned char *) NULL;
+	if (dp->grid != NULL) {
+		cell_grid_free(dp->grid);
+		dp->grid = (cell_grid *) NULL;
 	}
 }
 
@@ -312,13 +258,11 @@ free_demon(Display *display, demonstruct *dp)
 	free_struct(dp);
 }
 
-static Bool
+static void
 draw_state(ModeInfo * mi, int state)
 {
 	demonstruct *dp = &demons[MI_SCREEN(mi)];
 	GC          gc;
-	XRectangle *rects;
-	CellList   *current;
 
 	if (!state) {
 		XSetForeground(MI_DISPLAY(mi), MI_GC(mi), MI_BLACK_PIXEL(mi));
@@ -340,73 +284,144 @@ draw_state(ModeInfo * mi, int state)
 			  GCStipple | GCForeground | GCBackground, &gcv);
 		gc = dp->stippledGC;
 	}
-	if (dp->neighbors == 6) {	/* Draw right away, slow */
-		current = dp->cellList[state];
-		while (current) {
-			int         col, row, ccol, crow;
-
-			col = current->pt.x;
-			row = current->pt.y;
-			ccol = 2 * col + !(row & 1), crow = 2 * row;
-			dp->shape.hexagon[0].x = dp->xb + ccol * dp->xs;
-			dp->shape.hexagon[0].y = dp->yb + crow * dp->ys;
-			if (dp->xs == 1 && dp->ys == 1)
-				XDrawPoint(MI_DISPLAY(mi), MI_WINDOW(mi),
-					       gc, dp->shape.hexagon[0].x, dp->shape.hexagon[0].y);
-			else
-				XFillPolygon(MI_DISPLAY(mi), MI_WINDOW(mi), gc,
-					     dp->shape.hexagon, 6, Convex, CoordModePrevious);
-			current = current->next;
+	if (dp->neighbors == 4 || dp->neighbors == 8) {
+		/* Take advantage of XFillRectangles */
+		dirty_cells_draw(dp->dirty, state, gc);
+	} else {
+		XPoint     *cells;
+		int         n = dirty_cells_take(dp->dirty, state, &cells);
+		int         i, npoints = 0;
+
+		/* Polygons have to be drawn one at a time, but cells too small
+		   for them go out in one XDrawPoints.  Each point overwrites a
+		   cell that has already been read. */
+		for (i = 0; i < n; i++) {
+			int         col = cells[i].x, row = cells[i].y;
+
+			if (dp->neighbors == 6) {
+				int         ccol = 2 * col + !(row & 1), crow = 2 * row;
+
+				dp->shape.hexagon[0].x = dp->xb + ccol * dp->xs;
+				dp->shape.hexagon[0].y = dp->yb + crow * dp->ys;
+				if (dp->xs == 1 && dp->ys == 1)
+					cells[npoints++] = dp->shape.hexagon[0];
+				else
+					XFillPolygon(MI_DISPLAY(mi), MI_WINDOW(mi), gc,
+						     dp->shape.hexagon, 6, Convex, CoordModePrevious);
+			} else {	/* TRI */
+				int         orient = (col + row) % 2;	/* O left 1 right */
+
+				dp->shape.triangle[orient][0].x = dp->xb + col * dp->xs;
+				dp->shape.triangle[orient][0].y = dp->yb + row * dp->ys;
+				if (dp->xs <= 3 || dp->ys <= 3) {
+					cells[npoints].x = ((orient) ? -1 : 1) +
+						dp->shape.triangle[orient][0].x;
+					cells[npoints].y = dp->shape.triangle[orient][0].y;
+					npoints++;
+				} else {
+					if (orient)
+						dp->shape.triangle[orient][0].x += (dp->xs / 2 - 1);
+					else
+						dp->shape.triangle[orient][0].x -= (dp->xs / 2 - 1);
+					XFillPolygon(MI_DISPLAY(mi), MI_WINDOW(mi), gc,
+						     dp->shape.triangle[orient], 3, Convex, CoordModePrevious);
+				}
+			}
 		}
-	} else if (dp->neighbors == 4 || dp->neighbors == 8) {
-		/* Take advantage of XDrawRectangles */
-		int         ncells = 0;
+		if (npoints)
+			XDrawPoints(MI_DISPLAY(mi), MI_WINDOW(mi), gc, cells, npoints,
+				    CoordModeOrigin);
+	}
+}
 
-		/* Create Rectangle list from part of the cellList */
-		if ((rects = (XRectangle *) malloc(dp->ncells[state] *
-			 sizeof (XRectangle))) == NULL) {
-			return False;
-		}
-		current = dp->cellList[state];
-		while (current) {
-			rects[ncells].x = dp->xb + current->pt.x * dp->xs;
-			rects[ncells].y = dp->yb + current->pt.y * dp->ys;
-			rects[ncells].width = dp->xs - (dp->xs > 3);
-			rects[ncells].height = dp->ys - (dp->ys > 3);
-			current = current->next;
-			ncells++;
+/*-
+ * The neighbors of each kind of grid, as offsets.  Hexagon rows and
+ * triangles alternate between two shapes, chosen by the parity of the row
+ * or of col + row.  Smaller neighborhoods use the start of the list.
+ */
+static const signed char hex_nb[2][6][2] =
+{
+	{{1, -1}, {1, 0}, {1, 1}, {0, 1}, {-1, 0}, {0, -1}},
+	{{0, -1}, {1, 0}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}}
+};
+
+static const signed char square_nb[8][2] =
+{
+	{0, -1}, {1, 0}, {0, 1}, {-1, 0},
+	{1, -1}, {1, 1}, {-1, 1}, {-1, -1}
+};
+
+static const signed char tri_nb[2][12][2] =
+{
+	{{1, 0}, {0, -1}, {0, 1},	/* left */
+	 {0, -2}, {0, 2}, {-1, -1}, {1, -1}, {-1, 1}, {1, 1},
+	 {1, -2}, {1, 2}, {-1, 0}},
+	{{-1, 0}, {0, -1}, {0, 1},	/* right */
+	 {0, -2}, {0, 2}, {-1, -1}, {1, -1}, {-1, 1}, {1, 1},
+	 {-1, -2}, {-1, 2}, {1, 0}}
+};
+
+static void
+set_neighbors(demonstruct * dp)
+{
+	int         p, n;
+
+	for (p = 0; p < 2; p++) {
+		for (n = 0; n < dp->neighbors; n++) {
+			const signed char *d = (dp->neighbors == 6) ? hex_nb[p][n] :
+				(dp->neighbors == 4 || dp->neighbors == 8) ? square_nb[n] :
+				tri_nb[p][n];
+
+			dp->nb[p][n][0] = d[0];
+			dp->nb[p][n][1] = d[1];
 		}
-		/* Finally get to draw */
-		XFillRectangles(MI_DISPLAY(mi), MI_WINDOW(mi), gc, rects, ncells);
-		/* Free up rects list and the appropriate part of the cellList */
-		(void) free((void *) rects);
-	} else {		/* TRI */
-		current = dp->cellList[state];
-		while (current) {
-			int         col, row, orient;
-
-			col = current->pt.x;
-			row = current->pt.y;
-			orient = (col + row) % 2;	/* O left 1 right */
-			dp->shape.triangle[orient][0].x = dp->xb + col * dp->xs;
-			dp->shape.triangle[orient][0].y = dp->yb + row * dp->ys;
-			if (dp->xs <= 3 || dp->ys <= 3)
-				XDrawPoint(MI_DISPLAY(mi), MI_WINDOW(mi), gc,
-					       ((orient) ? -1 : 1) + dp->shape.triangle[orient][0].x,
-				      dp->shape.triangle[orient][0].y);
-			else {
-				if (orient)
-					dp->shape.triangle[orient][0].x += (dp->xs / 2 - 1);
-				else
-					dp->shape.triangle[orient][0].x -= (dp->xs / 2 - 1);
-				XFillPolygon(MI_DISPLAY(mi), MI_WINDOW(mi), gc,
-					     dp->shape.triangle[orient], 3, Convex, CoordModePrevious);
+	}
+}
+
+/*-
+ * A cell moves on to the next state if any neighbor is already in it.
+ * Returns how many cells changed.
+ */
+static unsigned long
+demon_row(void *closure, const cell_grid * g, int y, unsigned char *out)
+{
+	const demonstruct *dp = (const demonstruct *) closure;
+	const unsigned char *rows[5];
+	unsigned long changed = 0;
+	int         x, n, dy;
+
+	for (dy = -2; dy <= 2; dy++) {
+		int         l = y + dy;
+
+		if (l < 0)
+			l += g->height;
+		else if (l >= g->height)
+			l -= g->height;
+		rows[dy + 2] = g->cells + l * g->width;
+	}
+
+	for (x = 0; x < g->width; x++) {
+		int         p = (dp->neighbors == 6) ? (y & 1) :
+			(dp->neighbors == 4 || dp->neighbors == 8) ? 0 : ((x + y) & 1);
+		unsigned char c = rows[2][x];
+		unsigned char next = (c + 1) % dp->states;
+
+		out[x] = c;
+		for (n = 0; n < dp->neighbors; n++) {
+			int         k = x + dp->nb[p][n][0];
+
+			if (k < 0)
+				k += g->width;
+			else if (k >= g->width)
+				k -= g->width;
+			if (rows[dp->nb[p][n][1] + 2][k] == next) {
+				out[x] = next;
+				changed++;
+				break;
 			}
-			current = current->next;
 		}
 	}
-	free_state(dp, state);
-	return True;
+	return changed;
 }
 
 static void
@@ -417,10 +432,9 @@ RandomSoup(ModeInfo * mi)
 
 	for (row = 0; row < dp->nrows; ++row) {
 		for (col = 0; col < dp->ncols; ++col) {
-			dp->oldcell[col + mrow] =
+			dp->grid->cells[col + mrow] =
 				(unsigned char) LRAND() % ((unsigned char) dp->states);
-			if (!addtolist(mi, col, row, dp->oldcell[col + mrow]))
-				return; /* sparse soup */
+			dirty_cells_mark(dp->dirty, col, row, dp->grid->cells[col + mrow]);
 		}
 		mrow += dp->ncols;
 	}
@@ -487,16 +501,6 @@ init_demon (ModeInfo * mi)
 		dp->states = NRAND(-dp->states - MINSTATES + 1) + MINSTATES;
 	else if (dp->states < MINSTATES)
 		dp->states = plots[1][nk];
-	if ((dp->cellList = (CellList **) calloc(dp->states,
-		sizeof (CellList *))) == NULL) {
-		free_demon(display, dp);
-		return;
-	}
-	if ((dp->ncells = (int *) calloc(dp->states, sizeof (int))) == NULL) {
-		free_demon(display, dp);
-		return;
-	}
-
 	dp->state = 0;
 
 	dp->width = MI_WIDTH(mi);
@@ -583,17 +587,18 @@ init_demon (ModeInfo * mi)
 
 	MI_CLEARWINDOW(mi);
 
-	if ((dp->oldcell = (unsigned char *)
-		malloc(dp->ncols * dp->nrows * sizeof (unsigned char))) == NULL) {
+	if ((dp->grid = cell_grid_new(display, dp->ncols, dp->nrows)) == NULL) {
 		free_demon(display, dp);
 		return;
 	}
-
-	if ((dp->newcell = (unsigned char *)
-		malloc(dp->ncols * dp->nrows * sizeof (unsigned char))) == NULL) {
+	if ((dp->dirty = dirty_cells_new(display, MI_WINDOW(mi),
+			dp->ncols, dp->nrows, dp->states)) == NULL) {
 		free_demon(display, dp);
 		return;
 	}
+	dirty_cells_layout(dp->dirty, dp->xb, dp->yb, dp->xs, dp->ys,
+			   dp->xs - (dp->xs > 3), dp->ys - (dp->ys > 3));
+	set_neighbors(dp);
 
 	RandomSoup(mi);
 }
@@ -601,345 +606,37 @@ init_demon (ModeInfo * mi)
 ENTRYPOINT void
 draw_demon (ModeInfo * mi)
 {
-	int         i, j, k, l, mj = 0, ml;
+	int         i, j, mj = 0;
 	demonstruct *dp;
 
 	if (demons == NULL)
 		return;
 	dp = &demons[MI_SCREEN(mi)];
-	if (dp->cellList == NULL)
+	if (dp->dirty == NULL)
 		return;
 
 	MI_IS_DRAWN(mi) = True;
 	if (dp->state >= dp->states) {
-		(void) memcpy((char *) dp->newcell, (char *) dp->oldcell,
-			      dp->ncols * dp->nrows * sizeof (unsigned char));
-
-		if (dp->neighbors == 6) {
-			for (j = 0; j < dp->nrows; j++) {
-				for (i = 0; i < dp->ncols; i++) {
-					/* NE */
-					if (!(j & 1))
-						k = (i + 1 == dp->ncols) ? 0 : i + 1;
-					else
-						k = i;
-					l = (!j) ? dp->nrows - 1 : j - 1;
-					ml = l * dp->ncols;
-					if (dp->oldcell[k + ml] ==
-					    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-						dp->newcell[i + mj] = dp->oldcell[k + ml];
-					/* E */
-					k = (i + 1 == dp->ncols) ? 0 : i + 1;
-					ml = mj;
-					if (dp->oldcell[k + ml] ==
-					    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-						dp->newcell[i + mj] = dp->oldcell[k + ml];
-					/* SE */
-					if (!(j & 1))
-						k = (i + 1 == dp->ncols) ? 0 : i + 1;
-					else
-						k = i;
-					l = (j + 1 == dp->nrows) ? 0 : j + 1;
-					ml = l * dp->ncols;
-					if (dp->oldcell[k + ml] ==
-					    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-						dp->newcell[i + mj] = dp->oldcell[k + ml];
-					/* SW */
-					if (j & 1)
-						k = (!i) ? dp->ncols - 1 : i - 1;
-					else
-						k = i;
-					l = (j + 1 == dp->nrows) ? 0 : j + 1;
-					ml = l * dp->ncols;
-					if (dp->oldcell[k + ml] ==
-					    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-						dp->newcell[i + mj] = dp->oldcell[k + ml];
-					/* W */
-					k = (!i) ? dp->ncols - 1 : i - 1;
-					ml = mj;
-					if (dp->oldcell[k + ml] ==
-					    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-						dp->newcell[i + mj] = dp->oldcell[k + ml];
-					/* NW */
-					if (j & 1)
-						k = (!i) ? dp->ncols - 1 : i - 1;
-					else
-						k = i;
-					l = (!j) ? dp->nrows - 1 : j - 1;
-					ml = l * dp->ncols;
-					if (dp->oldcell[k + ml] ==
-					    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-						dp->newcell[i + mj] = dp->oldcell[k + ml];
-				}
-				mj += dp->ncols;
-			}
-		} else if (dp->neighbors == 4 || dp->neighbors == 8) {
-			for (j = 0; j < dp->nrows; j++) {
-				for (i = 0; i < dp->ncols; i++) {
-					/* N */
-					k = i;
-					l = (!j) ? dp->nrows - 1 : j - 1;
-					ml = l * dp->ncols;
-					if (dp->oldcell[k + ml] ==
-					    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-						dp->newcell[i + mj] = dp->oldcell[k + ml];
-					/* E */
-					k = (i + 1 == dp->ncols) ? 0 : i + 1;
-					ml = mj;
-					if (dp->oldcell[k + ml] ==
-					    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-						dp->newcell[i + mj] = dp->oldcell[k + ml];
-					/* S */
-					k = i;
-					l = (j + 1 == dp->nrows) ? 0 : j + 1;
-					ml = l * dp->ncols;
-					if (dp->oldcell[k + ml] ==
-					    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-						dp->newcell[i + mj] = dp->oldcell[k + ml];
-					/* W */
-					k = (!i) ? dp->ncols - 1 : i - 1;
-					/*l = j;*/
-					ml = mj;
-					if (dp->oldcell[k + ml] ==
-					    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-						dp->newcell[i + mj] = dp->oldcell[k + ml];
-				}
-				mj += dp->ncols;
-			}
-			if (dp->neighbors == 8) {
-				mj = 0;
-				for (j = 0; j < dp->nrows; j++) {
-					for (i = 0; i < dp->ncols; i++) {
-						/* NE */
-						k = (i + 1 == dp->ncols) ? 0 : i + 1;
-						l = (!j) ? dp->nrows - 1 : j - 1;
-						ml = l * dp->ncols;
-						if (dp->oldcell[k + ml] ==
-						    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-							dp->newcell[i + mj] = dp->oldcell[k + ml];
-						/* SE */
-						k = (i + 1 == dp->ncols) ? 0 : i + 1;
-						l = (j + 1 == dp->nrows) ? 0 : j + 1;
-						ml = l * dp->ncols;
-						if (dp->oldcell[k + ml] ==
-						    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-							dp->newcell[i + mj] = dp->oldcell[k + ml];
-						/* SW */
-						k = (!i) ? dp->ncols - 1 : i - 1;
-						l = (j + 1 == dp->nrows) ? 0 : j + 1;
-						ml = l * dp->ncols;
-						if (dp->oldcell[k + ml] ==
-						    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-							dp->newcell[i + mj] = dp->oldcell[k + ml];
-						/* NW */
-						k = (!i) ? dp->ncols - 1 : i - 1;
-						l = (!j) ? dp->nrows - 1 : j - 1;
-						ml = l * dp->ncols;
-						if (dp->oldcell[k + ml] ==
-						    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-							dp->newcell[i + mj] = dp->oldcell[k + ml];
-					}
-					mj += dp->ncols;
-				}
-			}
-		} else if (dp->neighbors == 3 || dp->neighbors == 9 ||
-			   dp->neighbors == 12) {
-			for (j = 0; j < dp->nrows; j++) {
-				for (i = 0; i < dp->ncols; i++) {
-					if ((i + j) % 2) {	/* right */
-						/* W */
-						k = (!i) ? dp->ncols - 1 : i - 1;
-						ml = mj;
-						if (dp->oldcell[k + ml] ==
-						    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-							dp->newcell[i + mj] = dp->oldcell[k + ml];
-					} else {	/* left */
-						/* E */
-						k = (i + 1 == dp->ncols) ? 0 : i + 1;
-						ml = mj;
-						if (dp->oldcell[k + ml] ==
-						    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-							dp->newcell[i + mj] = dp->oldcell[k + ml];
-					}
-					/* N */
-					k = i;
-					l = (!j) ? dp->nrows - 1 : j - 1;
-					ml = l * dp->ncols;
-					if (dp->oldcell[k + ml] ==
-					    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-						dp->newcell[i + mj] = dp->oldcell[k + ml];
-					/* S */
-					k = i;
-					l = (j + 1 == dp->nrows) ? 0 : j + 1;
-					ml = l * dp->ncols;
-					if (dp->oldcell[k + ml] ==
-					    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-						dp->newcell[i + mj] = dp->oldcell[k + ml];
-				}
-				mj += dp->ncols;
-			}
-			if (dp->neighbors == 9 || dp->neighbors == 12) {
-				mj = 0;
-				for (j = 0; j < dp->nrows; j++) {
-					for (i = 0; i < dp->ncols; i++) {
-						/* NN */
-						k = i;
-						if (!j)
-							l = dp->nrows - 2;
-						else if (!(j - 1))
-							l = dp->nrows - 1;
-						else
-							l = j - 2;
-						ml = l * dp->ncols;
-						if (dp->oldcell[k + ml] ==
-						    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-							dp->newcell[i + mj] = dp->oldcell[k + ml];
-						/* SS */
-						k = i;
-						if (j + 1 == dp->nrows)
-							l = 1;
-						else if (j + 2 == dp->nrows)
-							l = 0;
-						else
-							l = j + 2;
-						ml = l * dp->ncols;
-						if (dp->oldcell[k + ml] ==
-						    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-							dp->newcell[i + mj] = dp->oldcell[k + ml];
-						/* NW */
-						k = (!i) ? dp->ncols - 1 : i - 1;
-						l = (!j) ? dp->nrows - 1 : j - 1;
-						ml = l * dp->ncols;
-						if (dp->oldcell[k + ml] ==
-						    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-							dp->newcell[i + mj] = dp->oldcell[k + ml];
-						/* NE */
-						k = (i + 1 == dp->ncols) ? 0 : i + 1;
-						l = (!j) ? dp->nrows - 1 : j - 1;
-						ml = l * dp->ncols;
-						if (dp->oldcell[k + ml] ==
-						    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-							dp->newcell[i + mj] = dp->oldcell[k + ml];
-						/* SW */
-						k = (!i) ? dp->ncols - 1 : i - 1;
-						l = (j + 1 == dp->nrows) ? 0 : j + 1;
-						ml = l * dp->ncols;
-						if (dp->oldcell[k + ml] ==
-						    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-							dp->newcell[i + mj] = dp->oldcell[k + ml];
-						/* SE */
-						k = (i + 1 == dp->ncols) ? 0 : i + 1;
-						l = (j + 1 == dp->nrows) ? 0 : j + 1;
-						ml = l * dp->ncols;
-						if (dp->oldcell[k + ml] ==
-						    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-							dp->newcell[i + mj] = dp->oldcell[k + ml];
-					}
-					mj += dp->ncols;
-				}
-				if (dp->neighbors == 12) {
-					mj = 0;
-					for (j = 0; j < dp->nrows; j++) {
-						for (i = 0; i < dp->ncols; i++) {
-							if ((i + j) % 2) {	/* right */
-								/* NNW */
-								k = (!i) ? dp->ncols - 1 : i - 1;
-								if (!j)
-									l = dp->nrows - 2;
-								else if (!(j - 1))
-									l = dp->nrows - 1;
-								else
-									l = j - 2;
-								ml = l * dp->ncols;
-								if (dp->oldcell[k + ml] ==
-								    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-									dp->newcell[i + mj] = dp->oldcell[k + ml];
-								/* SSW */
-								k = (!i) ? dp->ncols - 1 : i - 1;
-								if (j + 1 == dp->nrows)
-									l = 1;
-								else if (j + 2 == dp->nrows)
-									l = 0;
-								else
-									l = j + 2;
-								ml = l * dp->ncols;
-								if (dp->oldcell[k + ml] ==
-								    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-									dp->newcell[i + mj] = dp->oldcell[k + ml];
-								/* EE */
-								k = (i + 1 == dp->ncols) ? 0 : i + 1;
-								/*l = j;*/
-								ml = mj;
-								if (dp->oldcell[k + ml] ==
-								    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-									dp->newcell[i + mj] = dp->oldcell[k + ml];
-							} else {	/* left */
-								/* NNE */
-								k = (i + 1 == dp->ncols) ? 0 : i + 1;
-								if (!j)
-									l = dp->nrows - 2;
-								else if (!(j - 1))
-									l = dp->nrows - 1;
-								else
-									l = j - 2;
-								ml = l * dp->ncols;
-								if (dp->oldcell[k + ml] ==
-								    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-									dp->newcell[i + mj] = dp->oldcell[k + ml];
-								/* SSE */
-								k = (i + 1 == dp->ncols) ? 0 : i + 1;
-								if (j + 1 == dp->nrows)
-									l = 1;
-								else if (j + 2 == dp->nrows)
-									l = 0;
-								else
-									l = j + 2;
-								ml = l * dp->ncols;
-								if (dp->oldcell[k + ml] ==
-								    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-									dp->newcell[i + mj] = dp->oldcell[k + ml];
-								/* WW */
-								k = (!i) ? dp->ncols - 1 : i - 1;
-								/*l = j;*/
-								ml = mj;
-								if (dp->oldcell[k + ml] ==
-								    (int) (dp->oldcell[i + mj] + 1) % dp->states)
-									dp->newcell[i + mj] = dp->oldcell[k + ml];
-							}
-						}
-						mj += dp->ncols;
-					}
-				}
-			}
-		}
-		mj = 0;
+		(void) cell_grid_step(dp->grid, 0, dp->nrows, demon_row, dp);
 		for (j = 0; j < dp->nrows; j++) {
 			for (i = 0; i < dp->ncols; i++)
-				if (dp->oldcell[i + mj] != dp->newcell[i + mj]) {
-					dp->oldcell[i + mj] = dp->newcell[i + mj];
-					if (!addtolist(mi, i, j, dp->oldcell[i + mj])) {
-						free_demon(MI_DISPLAY(mi), dp);
-						return;
-					}
-				}
+				if (dp->grid->cells[i + mj] != dp->grid->prev[i + mj])
+					dirty_cells_mark(dp->dirty, i, j, dp->grid->cells[i + mj]);
 			mj += dp->ncols;
 		}
 		if (++dp->generation > MI_CYCLES(mi))
 			init_demon(mi);
 		dp->state = 0;
 	} else {
-		if (dp->ncells[dp->state])
-			if (!draw_state(mi, dp->state)) {
-				free_demon(MI_DISPLAY(mi), dp);
-				return;
-			}
+		if (dirty_cells_count(dp->dirty, dp->state))
+			draw_state(mi, dp->state);
 		dp->state++;
 	}
 	if (dp->redrawing) {
 		for (i = 0; i < REDRAWSTEP; i++) {
-			if (dp->oldcell[dp->redrawpos]) {
+			if (dp->grid->cells[dp->redrawpos]) {
 				drawcell(mi, dp->redrawpos % dp->ncols, dp->redrawpos / dp->ncols,
-					 dp->oldcell[dp->redrawpos]);
+					 dp->grid->cells[dp->redrawpos]);
 			}
 			if (++(dp->redrawpos) >= dp->ncols * dp->nrows) {
 				dp->redrawing = 0;
@@ -947,6 +644,14 @@ draw_demon (ModeInfo * mi)
 			}
 		}
 	}
+	if (verbose && dp->dirty != NULL) {
+		dp->requests += dirty_cells_requests(dp->dirty);
+		if (++dp->frames % 100 == 0) {
+			(void) fprintf(stderr, "%s: %.1f X requests per frame\n",
+				       progname, dp->requests / 100.0);
+			dp->requests = 0;
+		}
+	}
 }
 
 
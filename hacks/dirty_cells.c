@@ -0,0 +1,397 @@
+/* dirty_cells.c --- batches redrawn grid cells by color.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee.  No
+ * representations are made about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ */
+
+/* Each cell remembers the color it is waiting to be drawn in, plus one, so
+   that a cell is only listed once however often it is marked.  Before
+   drawing, the list is sorted into colors with one counting pass.  Entries
+   for cells that were drawn since the last sort are dropped then.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dirty_cells.h"
+
+#ifndef HAVE_COCOA
+# include <X11/Xutil.h>
+#endif /* !HAVE_COCOA */
+
+#ifdef HAVE_XSHM_EXTENSION
+# include "xshm.h"
+#endif /* HAVE_XSHM_EXTENSION */
+
+#define SEEN 0x8000		/* In pending[], while sorting. */
+
+struct dirty_cells {
+  Display *dpy;
+  Window window;
+  int cols, rows, ncolors;
+  int x, y, xstep, ystep, width, height;
+
+  unsigned short *pending;	/* Color + 1 for each cell, or 0. */
+  int *counts;			/* Cells pending in each color. */
+
+  int *list, nlist, list_size;	/* Cells marked, by index. */
+  int *order, *start;		/* The list by color, after sorting. */
+  int order_size;
+  Bool sorted;
+
+  void *scratch;		/* XRectangles or XPoints to draw. */
+  int scratch_size;
+
+  unsigned long serial;
+
+  XImage *image;
+  unsigned long *pixels;
+  int x0, y0, x1, y1;		/* Part of the image not yet pushed. */
+# ifdef HAVE_XSHM_EXTENSION
+  XShmSegmentInfo shm_info;
+# endif /* HAVE_XSHM_EXTENSION */
+};
+
+
+dirty_cells *
+dirty_cells_new (Display *dpy, Window window, int cols, int rows, int ncolors)
+{
+  dirty_cells *d;
+
+  if (cols <= 0 || rows <= 0 || ncolors <= 0 || ncolors >= SEEN)
+    return 0;
+
+  d = (dirty_cells *) calloc (1, sizeof(*d));
+  if (!d) return 0;
+
+  d->dpy = dpy;
+  d->window = window;
+  d->cols = cols;
+  d->rows = rows;
+  d->ncolors = ncolors;
+  dirty_cells_layout (d, 0, 0, 1, 1, 1, 1);
+
+  d->pending = (unsigned short *)
+    calloc ((size_t) cols * rows, sizeof(*d->pending));
+  d->counts = (int *) calloc (ncolors, sizeof(*d->counts));
+  d->start  = (int *) calloc (ncolors + 1, sizeof(*d->start));
+  if (!d->pending || !d->counts || !d->start)
+    {
+      dirty_cells_free (d);
+      return 0;
+    }
+
+  d->serial = XNextRequest (dpy);
+  return d;
+}
+
+
+void
+dirty_cells_free (dirty_cells *d)
+{
+  if (!d) return;
+  if (d->image)
+    {
+# ifdef HAVE_XSHM_EXTENSION
+      destroy_xshm_image (d->dpy, d->image, &d->shm_info);
+# endif /* HAVE_XSHM_EXTENSION */
+    }
+  free (d->pixels);
+  free (d->pending);
+  free (d->counts);
+  free (d->list);
+  free (d->order);
+  free (d->start);
+  free (d->scratch);
+  free (d);
+}
+
+
+void
+dirty_cells_layout (dirty_cells *d, int x, int y,
+                    int xstep, int ystep, int width, int height)
+{
+  d->x = x;
+  d->y = y;
+  d->xstep = xstep;
+  d->ystep = ystep;
+  d->width = width;
+  d->height = height;
+}
+
+
+Bool
+dirty_cells_use_image (dirty_cells *d, const unsigned long *pixels)
+{
+# ifdef HAVE_XSHM_EXTENSION
+  XWindowAttributes xgwa;
+  int i, j;
+
+  if (d->image) return True;
+  if (d->xstep != 1 || d->ystep != 1 || d->width != 1 || d->height != 1)
+    return False;
+
+  d->pixels = (unsigned long *) malloc (d->ncolors * sizeof(*d->pixels));
+  if (!d->pixels) return False;
+  memcpy (d->pixels, pixels, d->ncolors * sizeof(*d->pixels));
+
+  XGetWindowAttributes (d->dpy, d->window, &xgwa);
+  d->image = create_xshm_image (d->dpy, xgwa.visual, xgwa.depth, ZPixmap, 0,
+                                &d->shm_info, d->cols, d->rows);
+  if (!d->image)
+    {
+      free (d->pixels);
+      d->pixels = 0;
+      return False;
+    }
+
+  for (j = 0; j < d->rows; j++)
+    for (i = 0; i < d->cols; i++)
+      XPutPixel (d->image, i, j, d->pixels[0]);
+  d->x0 = d->cols;
+  d->y0 = d->rows;
+  d->x1 = d->y1 = 0;
+  return True;
+# else  /* !HAVE_XSHM_EXTENSION */
+  return False;
+# endif /* !HAVE_XSHM_EXTENSION */
+}
+
+
+void
+dirty_cells_mark (dirty_cells *d, int col, int row, int color)
+{
+  int i;
+  if (col < 0 || col >= d->cols || row < 0 || row >= d->rows ||
+      color < 0 || color >= d->ncolors)
+    return;
+
+  i = row * d->cols + col;
+  if (d->pending[i])
+    {
+      if (d->pending[i] == color + 1) return;
+      d->counts[d->pending[i] - 1]--;
+    }
+  else
+    {
+      if (d->nlist >= d->list_size)
+        {
+          int size = d->list_size ? d->list_size * 2 : 1024;
+          int *list = (int *) realloc (d->list, size * sizeof(*list));
+          if (!list) return;	/* The cell just won't be redrawn. */
+          d->list = list;
+          d->list_size = size;
+        }
+      d->list[d->nlist++] = i;
+    }
+
+  d->pending[i] = color + 1;
+  d->counts[color]++;
+  d->sorted = False;
+}
+
+
+int
+dirty_cells_count (dirty_cells *d, int color)
+{
+  if (color < 0 || color >= d->ncolors) return 0;
+  return d->counts[color];
+}
+
+
+/* Drops the drawn cells from the list, and sorts the rest by color.
+ */
+static Bool
+sort_cells (dirty_cells *d)
+{
+  int i, n = 0, c;
+
+  if (d->sorted) return True;
+
+  if (d->order_size < d->list_size)
+    {
+      int *order = (int *) realloc (d->order, d->list_size * sizeof(*order));
+      if (!order) return False;
+      d->order = order;
+      d->order_size = d->list_size;
+    }
+
+  /* Drawn cells, and cells that were drawn and then marked again, so
+     appear twice, are dropped here. */
+  for (i = 0; i < d->nlist; i++)
+    {
+      int j = d->list[i];
+      if (d->pending[j] && !(d->pending[j] & SEEN))
+        {
+          d->pending[j] |= SEEN;
+          d->list[n++] = j;
+        }
+    }
+  d->nlist = n;
+
+  for (c = 0, i = 0; c < d->ncolors; c++)
+    {
+      d->start[c] = i;
+      i += d->counts[c];
+    }
+  d->start[c] = i;
+
+  for (i = 0; i < n; i++)
+    {
+      int j = d->list[i];
+      d->pending[j] &= ~SEEN;
+      d->order[d->start[d->pending[j] - 1]++] = j;
+    }
+
+  /* Each start has been moved up to the next one; put them back. */
+  for (c = d->ncolors; c > 0; c--)
+    d->start[c] = d->start[c-1];
+  d->start[0] = 0;
+
+  d->sorted = True;
+  return True;
+}
+
+
+static Bool
+grow_scratch (dirty_cells *d, int n)
+{
+  if (n > d->scratch_size)
+    {
+      void *s = realloc (d->scratch, n * sizeof(XRectangle));
+      if (!s) return False;
+      d->scratch = s;
+      d->scratch_size = n;
+    }
+  return True;
+}
+
+
+int
+dirty_cells_take (dirty_cells *d, int color, XPoint **cells)
+{
+  XPoint *points;
+  int i, n = 0;
+
+  *cells = 0;
+  if (color < 0 || color >= d->ncolors || !d->counts[color]) return 0;
+  if (!sort_cells (d) || !grow_scratch (d, d->counts[color])) return 0;
+
+  points = (XPoint *) d->scratch;
+  for (i = d->start[color]; i < d->start[color+1]; i++)
+    {
+      int j = d->order[i];
+      if (d->pending[j] != color + 1) continue;
+      d->pending[j] = 0;
+      points[n].x = j % d->cols;
+      points[n].y = j / d->cols;
+      n++;
+    }
+  d->counts[color] = 0;
+  *cells = points;
+  return n;
+}
+
+
+void
+dirty_cells_draw (dirty_cells *d, int color, GC gc)
+{
+  XPoint *cells;
+  int i, n = dirty_cells_take (d, color, &cells);
+
+  if (!n) return;
+
+  if (d->image)
+    {
+      unsigned long pixel = d->pixels[color];
+      for (i = 0; i < n; i++)
+        {
+          int x = cells[i].x, y = cells[i].y;
+          XPutPixel (d->image, x, y, pixel);
+          if (x < d->x0) d->x0 = x;
+          if (y < d->y0) d->y0 = y;
+          if (x >= d->x1) d->x1 = x + 1;
+          if (y >= d->y1) d->y1 = y + 1;
+        }
+    }
+  else if (d->width == 1 && d->height == 1)
+    {
+      for (i = 0; i < n; i++)
+        {
+          cells[i].x = d->x + cells[i].x * d->xstep;
+          cells[i].y = d->y + cells[i].y * d->ystep;
+        }
+      XDrawPoints (d->dpy, d->window, gc, cells, n, CoordModeOrigin);
+    }
+  else
+    {
+      /* XRectangles are bigger than XPoints, so fill from the end. */
+      XRectangle *rects = (XRectangle *) d->scratch;
+      for (i = n - 1; i >= 0; i--)
+        {
+          int x = cells[i].x, y = cells[i].y;
+          rects[i].x = d->x + x * d->xstep;
+          rects[i].y = d->y + y * d->ystep;
+          rects[i].width  = d->width;
+          rects[i].height = d->height;
+        }
+      XFillRectangles (d->dpy, d->window, gc, rects, n);
+    }
+}
+
+
+void
+dirty_cells_flush (dirty_cells *d, const GC *gcs)
+{
+  int c;
+  for (c = 0; c < d->ncolors; c++)
+    if (d->counts[c])
+      dirty_cells_draw (d, c, gcs[c]);
+
+# ifdef HAVE_XSHM_EXTENSION
+  if (d->image && d->x0 < d->x1)
+    {
+      XShmPutImage (d->dpy, d->window, gcs[0], d->image,
+                    d->x0, d->y0, d->x + d->x0, d->y + d->y0,
+                    d->x1 - d->x0, d->y1 - d->y0, False);
+      d->x0 = d->cols;
+      d->y0 = d->rows;
+      d->x1 = d->y1 = 0;
+    }
+# endif /* HAVE_XSHM_EXTENSION */
+}
+
+
+void
+dirty_cells_clear (dirty_cells *d, int color)
+{
+  int i, j;
+
+  for (i = 0; i < d->nlist; i++)
+    d->pending[d->list[i]] = 0;
+  d->nlist = 0;
+  memset (d->counts, 0, d->ncolors * sizeof(*d->counts));
+  d->sorted = False;
+
+  if (d->image && color >= 0 && color < d->ncolors)
+    {
+      for (j = 0; j < d->rows; j++)
+        for (i = 0; i < d->cols; i++)
+          XPutPixel (d->image, i, j, d->pixels[color]);
+      d->x0 = d->cols;
+      d->y0 = d->rows;
+      d->x1 = d->y1 = 0;
+    }
+}
+
+
+unsigned long
+dirty_cells_requests (dirty_cells *d)
+{
+  unsigned long serial = XNextRequest (d->dpy);
+  unsigned long n = serial - d->serial;
+  d->serial = serial;
+  return n;
+}
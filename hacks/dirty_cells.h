@@ -0,0 +1,85 @@
+/* dirty_cells.h --- batches redrawn grid cells by color.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee.  No
+ * representations are made about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ */
+
+/* Collects the cells of a grid that need redrawing, and draws them with one
+   request per color instead of one per cell.
+
+   A cell marked more than once before it is drawn is only drawn once, in
+   the last color it was given, which is what drawing it every time would
+   have left on the screen.  Grids of one-pixel cells can instead be kept in
+   a shared-memory image, which is written directly and pushed to the window
+   with a single request.
+ */
+
+#ifndef __DIRTY_CELLS_H__
+#define __DIRTY_CELLS_H__
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#ifdef HAVE_COCOA
+# include "jwxyz.h"
+#else /* !HAVE_COCOA */
+# include <X11/Xlib.h>
+#endif /* !HAVE_COCOA */
+
+typedef struct dirty_cells dirty_cells;
+
+/* A grid of cols x rows cells, in colors 0 to ncolors-1.  Returns NULL if
+   out of memory.
+ */
+extern dirty_cells *dirty_cells_new (Display *, Window,
+                                     int cols, int rows, int ncolors);
+extern void dirty_cells_free (dirty_cells *);
+
+/* Cell col, row covers the width x height rectangle at
+   x + col * xstep, y + row * ystep.  The default is one pixel per cell.
+ */
+extern void dirty_cells_layout (dirty_cells *, int x, int y,
+                                int xstep, int ystep, int width, int height);
+
+/* Draws one-pixel cells into a shared-memory image from now on, using
+   pixels[color].  Returns False, and changes nothing, if the cells are
+   bigger than that or the image can't be made.  The window under the grid
+   is assumed to be in color 0.
+ */
+extern Bool dirty_cells_use_image (dirty_cells *, const unsigned long *pixels);
+
+extern void dirty_cells_mark (dirty_cells *, int col, int row, int color);
+
+/* How many cells are waiting to be drawn in this color. */
+extern int dirty_cells_count (dirty_cells *, int color);
+
+/* Draws the cells waiting in this color with the given GC, and forgets
+   them.  With an image, this only writes into the image.
+ */
+extern void dirty_cells_draw (dirty_cells *, int color, GC);
+
+/* Forgets the cells waiting in this color, for hacks that draw them some
+   other way.  Returns how many there are, and points *cells at their
+   columns and rows.  The caller may write over the list, which lasts until
+   the next call.
+ */
+extern int dirty_cells_take (dirty_cells *, int color, XPoint **cells);
+
+/* Draws every color, with gcs[color], and pushes the image if there is one.
+ */
+extern void dirty_cells_flush (dirty_cells *, const GC *gcs);
+
+/* Forgets every waiting cell, for when the caller has filled the whole
+   grid with one color itself.
+ */
+extern void dirty_cells_clear (dirty_cells *, int color);
+
+/* The number of X requests made on the display since the last call, for
+   seeing how much each frame costs.
+ */
+extern unsigned long dirty_cells_requests (dirty_cells *);
+
+#endif /* __DIRTY_CELLS_H__ */
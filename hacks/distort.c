@@ -35,7 +35,9 @@
  */
 
 #include <math.h>
+#include <limits.h>
 #include "screenhack.h"
+#include "thread_util.h"
 /*#include <X11/Xmd.h>*/
 
 #ifdef HAVE_XSHM_EXTENSION
@@ -46,6 +48,17 @@
 #define CARD16 unsigned short
 #define CARD8  unsigned char
 
+#define MAX_LENSES 100
+
+/* Lens rows are drawn in chunks of this many pixels, and the frame is split
+ * between the threads in strips of this many rows.
+ */
+#define ROW_CHUNK 256
+#define STRIP_ROWS 16
+
+/* Marks a pixel of a lens whose source is too far away to store. */
+#define NO_SOURCE SHRT_MIN
+
 
 struct coo {
 	int x;
@@ -54,11 +67,31 @@ struct coo {
 	int xmove, ymove;
 };
 
+/* Where each pixel of a lens' square comes from, relative to the corner of
+ * the square.
+ */
+struct lense {
+	short *src;				/* x, y for each pixel, row by row */
+	int x1, y1, x2, y2;		/* bounding box of the sources */
+	Bool holes;				/* some pixels are NO_SOURCE */
+};
+
+/* A lens to draw into the back buffer this frame.  Lenses are drawn in the
+ * order they were queued, so a later one covers an earlier one.
+ */
+struct lense_job {
+	const struct lense *lense;	/* 0 for a reflecting lens */
+	int x, y;					/* corner of the lens' square */
+	int cx, cy;					/* reflect: centre within the square */
+	XRectangle rect;			/* the square, clipped to the frame */
+	Bool inside;				/* every source is inside the image */
+};
+
 struct state {
   Display *dpy;
   Window window;
 
-  struct coo xy_coo[10];
+  struct coo *xy_coo;
 
   int delay, radius, speed, number, blackhole, vortex, magnify, reflect, slow;
   int duration;
@@ -68,15 +101,25 @@ struct state {
   GC gc;
   unsigned long black_pixel;
 
+  /* orig_map is the grabbed image; buffer_map is the same size, and is what
+     the lenses are drawn into before the dirty parts are copied to the
+     window. */
   XImage *orig_map, *buffer_map;
-  unsigned long *buffer_map_cache;
 
-  int ***from;
-  int ****from_array;
-  int *fast_from;
+  int size;						/* 2*radius+speed+2 */
+  struct lense lense;
+  struct lense *lense_array;	/* swamp: one per radius */
+  const struct lense *from;
 
+  struct lense_job *jobs;
+  int njobs;
+  XRectangle *rects;
+
+  /* bytes per pixel when both images can be accessed directly, else 0 */
   int bpp_size;
 
+  struct threadpool threadpool;
+
 #ifdef HAVE_XSHM_EXTENSION
   Bool use_shm;
   XShmSegmentInfo shm_info;
@@ -84,11 +127,15 @@ struct state {
 
   void (*effect) (struct state *, int);
   void (*draw) (struct state *, int);
-  void (*draw_routine) (struct state *st, XImage *, XImage *, int, int, int *);
 
   async_load_state *img_loader;
 };
 
+struct distort_thread {
+  struct state *st;
+  unsigned id;
+};
+
 
 static void move_lense(struct state *, int);
 static void swamp_thing(struct state *, int);
@@ -96,15 +143,30 @@ static void new_rnd_coo(struct state *, int);
 static void init_round_lense(struct state *st);
 static void reflect_draw(struct state *, int);
 static void plain_draw(struct state *, int);
-
-static void fast_draw_8 (struct state *st, XImage *, XImage *, int, int, int *);
-static void fast_draw_16(struct state *st, XImage *, XImage *, int, int, int *);
-static void fast_draw_32(struct state *st, XImage *, XImage *, int, int, int *);
-static void generic_draw(struct state *st, XImage *, XImage *, int, int, int *);
+static void distort_pass(void *);
 
 
 static void distort_finish_loading (struct state *);
 
+#ifndef EXIT_FAILURE
+# define EXIT_FAILURE -1
+#endif
+
+static int
+distort_thread_create (void *self_raw, struct threadpool *pool, unsigned id)
+{
+  struct distort_thread *self = (struct distort_thread *) self_raw;
+  self->st = GET_PARENT_OBJ(struct state, threadpool, pool);
+  self->id = id;
+  return 0;
+}
+
+static void
+distort_thread_destroy (void *self_raw)
+{
+}
+
+
 static void *
 distort_init (Display *dpy, Window window)
 {
@@ -258,8 +320,8 @@ distort_init (Display *dpy, Window window)
 		st->speed = 2;
 	if (st->number <= 0)
 		st->number=1;
-	if (st->number >= 10)
-		st->number=1;
+	if (st->number > MAX_LENSES)
+		st->number = MAX_LENSES;
 	if (st->effect == NULL)
 		st->effect = &move_lense;
 	if (st->reflect) {
@@ -270,6 +332,28 @@ distort_init (Display *dpy, Window window)
 		st->draw = &plain_draw;
 
 	st->black_pixel = BlackPixelOfScreen( st->xgwa.screen );
+	st->size = 2*st->radius + st->speed + 2;
+
+	/* swamp_thing may queue a lens twice in one frame */
+	st->xy_coo = (struct coo *) calloc(st->number, sizeof(*st->xy_coo));
+	st->jobs = (struct lense_job *) calloc(2*st->number, sizeof(*st->jobs));
+	st->rects = (XRectangle *) calloc(2*st->number, sizeof(*st->rects));
+	if (!st->xy_coo || !st->jobs || !st->rects) {
+		perror("distort");
+		exit(EXIT_FAILURE);
+	}
+
+	{
+		static const struct threadpool_class cls = {
+			sizeof(struct distort_thread),
+			distort_thread_create,
+			distort_thread_destroy
+		};
+
+		if (threadpool_create(&st->threadpool, &cls, st->dpy,
+							  hardware_concurrency(st->dpy)))
+			st->threadpool.count = 0; /* See the note in thread_util.h. */
+	}
 
 	gcv.function = GXcopy;
 	gcv.subwindow_mode = IncludeInferiors;
@@ -284,6 +368,37 @@ distort_init (Display *dpy, Window window)
     return st;
 }
 
+static void
+free_lenses (struct state *st)
+{
+	int k;
+	free(st->lense.src);
+	st->lense.src = 0;
+	if (st->lense_array) {
+		for (k = 0; k <= st->radius; k++)
+			free(st->lense_array[k].src);
+		free(st->lense_array);
+		st->lense_array = 0;
+	}
+	st->from = 0;
+}
+
+static void
+free_images (struct state *st)
+{
+	if (st->orig_map) XDestroyImage (st->orig_map);
+	st->orig_map = 0;
+	if (st->buffer_map) {
+# ifdef HAVE_XSHM_EXTENSION
+		if (st->use_shm)
+			destroy_xshm_image (st->dpy, st->buffer_map, &st->shm_info);
+		else
+# endif /* HAVE_XSHM_EXTENSION */
+			XDestroyImage (st->buffer_map);
+	}
+	st->buffer_map = 0;
+}
+
 static void
 distort_finish_loading (struct state *st)
 {
@@ -291,15 +406,11 @@ distort_finish_loading (struct state *st)
 
     st->start_time = time ((time_t) 0);
 
-	st->buffer_map = 0;
+	free_lenses(st);
+	free_images(st);
+
 	st->orig_map = XGetImage(st->dpy, st->window, 0, 0, st->xgwa.width, st->xgwa.height,
 						 ~0L, ZPixmap);
-	st->buffer_map_cache = malloc(sizeof(unsigned long)*(2*st->radius+st->speed+2)*(2*st->radius+st->speed+2));
-
-	if (st->buffer_map_cache == NULL) {
-		perror("distort");
-		exit(EXIT_FAILURE);
-	}
 
 # ifdef HAVE_XSHM_EXTENSION
 
@@ -307,8 +418,7 @@ distort_finish_loading (struct state *st)
 	  {
 		st->buffer_map = create_xshm_image(st->dpy, st->xgwa.visual, st->orig_map->depth,
 									   ZPixmap, 0, &st->shm_info,
-									   2*st->radius + st->speed + 2,
-									   2*st->radius + st->speed + 2);
+									   st->orig_map->width, st->orig_map->height);
 		if (!st->buffer_map)
 		  st->use_shm = False;
 	  }
@@ -318,37 +428,51 @@ distort_finish_loading (struct state *st)
 	  {
 		st->buffer_map = XCreateImage(st->dpy, st->xgwa.visual,
 								  st->orig_map->depth, ZPixmap, 0, 0,
-								  2*st->radius + st->speed + 2, 2*st->radius + st->speed + 2,
+								  st->orig_map->width, st->orig_map->height,
 								  8, 0);
 		st->buffer_map->data = (char *)
 		  calloc(st->buffer_map->height, st->buffer_map->bytes_per_line);
+		if (st->buffer_map->data == NULL) {
+			perror("distort");
+			exit(EXIT_FAILURE);
+		}
 	}
 
+	st->bpp_size = 0;
 	if ((st->buffer_map->byte_order == st->orig_map->byte_order)
 			&& (st->buffer_map->depth == st->orig_map->depth)
+			&& (st->buffer_map->bits_per_pixel == st->orig_map->bits_per_pixel)
 			&& (st->buffer_map->format == ZPixmap)
 			&& (st->orig_map->format == ZPixmap)
 			&& !st->slow) {
 		switch (st->orig_map->bits_per_pixel) {
 			case 32:
-				st->draw_routine = &fast_draw_32;
 				st->bpp_size = sizeof(CARD32);
 				break;
 			case 16:
-				st->draw_routine = &fast_draw_16;
 				st->bpp_size = sizeof(CARD16);
 				break;
 			case 8:
-				st->draw_routine = &fast_draw_8;
 				st->bpp_size = sizeof(CARD8);
 				break;
 			default:
-				st->draw_routine = &generic_draw;
 				break;
 		}
+	}
+
+	/* the back buffer starts out as a copy of the image */
+	if (st->bpp_size) {
+		for (i = 0; i < st->orig_map->height; i++)
+			memcpy(st->buffer_map->data + i*st->buffer_map->bytes_per_line,
+				   st->orig_map->data + i*st->orig_map->bytes_per_line,
+				   st->orig_map->width * st->bpp_size);
 	} else {
-		st->draw_routine = &generic_draw;
+		int j;
+		for (i = 0; i < st->orig_map->height; i++)
+			for (j = 0; j < st->orig_map->width; j++)
+				XPutPixel(st->buffer_map, j, i, XGetPixel(st->orig_map, j, i));
 	}
+
 	init_round_lense(st);
 
 	for (i = 0; i < st->number; i++) {
@@ -363,50 +487,29 @@ distort_finish_loading (struct state *st)
 	}
 }
 
-/* example: initializes a "see-trough" matrix */
-/* static void make_null_lense(struct state *st)
-{
-	int i, j;
-	for (i = 0; i < 2*radius+speed+2; i++) {
-		for (j = 0 ; j < 2*radius+speed+2 ; j++) {
-			from[i][j][0]=i;
-			from[i][j][1]=j;
-		}
-	} 
-}
-*/
-static void convert(struct state *st) 
-{
-	int *p;
-	int i, j;
-	st->fast_from = calloc(1, sizeof(int)*((st->buffer_map->bytes_per_line/st->bpp_size)*(2*st->radius+st->speed+2) + 2*st->radius+st->speed+2));
-	if (st->fast_from == NULL) {
-		perror("distort");
-		exit(EXIT_FAILURE);
-	}
-	p = st->fast_from;
-	for (i = 0; i < 2*st->radius+st->speed+2; i++) {
-		for (j = 0; j < 2*st->radius+st->speed+2; j++) {
-			*(p + i + j*st->buffer_map->bytes_per_line/st->bpp_size)
-				= st->from[i][j][0] + st->xgwa.width*st->from[i][j][1];
-			if (*(p + i + j*st->buffer_map->bytes_per_line/st->bpp_size) < 0
-					|| *(p + i + j*st->buffer_map->bytes_per_line/st->bpp_size) >= st->orig_map->height*st->orig_map->width) {
-				*(p + i + j*st->buffer_map->bytes_per_line/st->bpp_size) = 0;
-			}
-		}
-	}
-}
-
 /* makes a lense with the Radius=loop and centred in
  * the point (radius, radius)
  */
-static void make_round_lense(struct state *st, int radius, int loop)
+static void make_round_lense(struct state *st, struct lense *lense,
+							 int radius, int loop)
 {
 	int i, j;
+	short *p;
+
+	lense->src = (short *) malloc(st->size * st->size * 2 * sizeof(short));
+	if (lense->src == NULL) {
+		perror("distort");
+		exit(EXIT_FAILURE);
+	}
+	lense->x1 = lense->y1 = INT_MAX;
+	lense->x2 = lense->y2 = INT_MIN;
+	lense->holes = False;
 
-	for (i = 0; i < 2*radius+st->speed+2; i++) {
-		for(j = 0; j < ((0 == st->bpp_size) ? (2*radius+st->speed+2) : (st->buffer_map->bytes_per_line/st->bpp_size)); j++) {
+	p = lense->src;
+	for (j = 0; j < st->size; j++) {
+		for (i = 0; i < st->size; i++, p += 2) {
 			double r, d;
+			int fx, fy;
 			r = sqrt ((i-radius)*(i-radius)+(j-radius)*(j-radius));
 			if (loop == 0)
 			  d=0.0;
@@ -426,20 +529,20 @@ static void make_round_lense(struct state *st, int radius, int loop)
 
         /* Avoid atan2: DOMAIN error message */
 					if ((radius-j) == 0.0 && (radius-i) == 0.0) {
-						st->from[i][j][0] = radius + cos(angle)*r;
-						st->from[i][j][1] = radius + sin(angle)*r;
+						fx = radius + cos(angle)*r;
+						fy = radius + sin(angle)*r;
 					} else {
-						st->from[i][j][0] = radius +
+						fx = radius +
 							cos(angle - atan2(radius-j, -(radius-i)))*r;
-						st->from[i][j][1] = radius +
+						fy = radius +
 							sin(angle - atan2(radius-j, -(radius-i)))*r;
 					}
 					if (st->magnify) {
 						r = sin(d*M_PI_2);
 						if (st->blackhole && r != 0) /* blackhole effect */
 							r = 1/r;
-						st->from[i][j][0] = radius + (st->from[i][j][0]-radius)*r;
-						st->from[i][j][1] = radius + (st->from[i][j][1]-radius)*r;
+						fx = radius + (fx-radius)*r;
+						fy = radius + (fy-radius)*r;
 					}
 				} else { /* default is to magnify */
 					r = sin(d*M_PI_2);
@@ -451,206 +554,366 @@ static void make_round_lense(struct state *st, int radius, int loop)
 					if (st->blackhole && r != 0) /* blackhole effect */
 						r = 1/r;
 									/* bubble effect (and blackhole) */
-					st->from[i][j][0] = radius + (i-radius)*r;
-					st->from[i][j][1] = radius + (j-radius)*r;
+					fx = radius + (i-radius)*r;
+					fy = radius + (j-radius)*r;
 				}
 			} else { /* not inside loop */
-				st->from[i][j][0] = i;
-				st->from[i][j][1] = j;
+				fx = i;
+				fy = j;
 			}
+
+			if (fx <= NO_SOURCE || fx > SHRT_MAX ||
+				fy <= NO_SOURCE || fy > SHRT_MAX) {
+				p[0] = p[1] = NO_SOURCE;
+				lense->holes = True;
+				continue;
+			}
+			p[0] = fx;
+			p[1] = fy;
+			if (fx < lense->x1) lense->x1 = fx;
+			if (fx > lense->x2) lense->x2 = fx;
+			if (fy < lense->y1) lense->y1 = fy;
+			if (fy > lense->y2) lense->y2 = fy;
 		}
 	}
+}
+
+/* lense_array contains a precalculated lens for each radius, used by
+ * swamp_thing as the lenses grow and shrink
+ */
+static void init_round_lense(struct state *st)
+{
+	int k;
 
-	/* this is really just a quick hack to keep both the compability mode with all depths and still
-	 * allow the custom optimized draw routines with the minimum amount of work */
-	if (0 != st->bpp_size) {
-		convert(st);
+	if (st->effect == &swamp_thing) {
+		st->lense_array = (struct lense *)calloc(st->radius+1, sizeof(struct lense));
+		if (st->lense_array == NULL) {
+			perror("distort");
+			exit(EXIT_FAILURE);
+		}
+		for (k=0; k <= st->radius; k++)
+			make_round_lense(st, &st->lense_array[k], st->radius, k);
+		st->from = &st->lense_array[st->radius];
+	} else { /* just one lense */
+		make_round_lense(st, &st->lense, st->radius, st->radius);
+		st->from = &st->lense;
 	}
 }
 
-#ifndef EXIT_FAILURE
-# define EXIT_FAILURE -1
-#endif
 
-static void allocate_lense(struct state *st)
+/* Works out where n pixels of row j of a lens' square, starting at column
+ * i, come from.  Sources of -1 are drawn black.
+ */
+static void
+lense_sources (const struct state *st, const struct lense_job *job,
+			   int i, int j, int n, int *sx, int *sy)
 {
-	int i, j;
-	int s = ((0 != st->bpp_size) ? (st->buffer_map->bytes_per_line/st->bpp_size) : (2*st->radius+st->speed+2));
-	/* maybe this should be redone so that from[][][] is in one block;
-	 * then pointers could be used instead of arrays in some places (and
-	 * maybe give a speedup - maybe also consume less memory)
-	 */
-	st->from = (int ***)malloc(s*sizeof(int **));
-	if (st->from == NULL) {
-		perror("distort");
-		exit(EXIT_FAILURE);
-	}
-	for (i = 0; i < s; i++) {
-		st->from[i] = (int **)malloc((2*st->radius+st->speed+2) * sizeof(int *));
-		if (st->from[i] == NULL) {
-			perror("distort");
-			exit(EXIT_FAILURE);
+	int k;
+
+	if (job->lense) {
+		const short *p = job->lense->src + (j * st->size + i) * 2;
+		for (k = 0; k < n; k++, p += 2) {
+			if (p[0] == NO_SOURCE) {
+				sx[k] = sy[k] = -1;
+			} else {
+				sx[k] = job->x + p[0];
+				sy[k] = job->y + p[1];
+			}
 		}
-		for (j = 0; j < s; j++) {
-			st->from[i][j] = (int *)malloc(2 * sizeof(int));
-			if (st->from[i][j] == NULL) {
-				perror("distort");
-				exit(EXIT_FAILURE);
+	} else {
+		/* the reflect algoritm submitted by Randy Zack <randy@acucorp.com> */
+		int rsq = st->radius * st->radius;
+		int ly = j - job->cy;
+		int lysq = ly * ly;
+		int ny = job->y + j;
+		if (ny >= st->orig_map->height) ny = st->orig_map->height-1;
+
+		for (k = 0; k < n; k++) {
+			int lx = i + k - job->cx;
+			int dist = lx * lx + lysq;
+			if (dist > rsq ||
+				ly < -st->radius || ly > st->radius ||
+				lx < -st->radius || lx > st->radius) {
+				sx[k] = job->x + i + k;
+				sy[k] = ny;
+			} else if (dist == 0) {
+				sx[k] = sy[k] = -1;
+			} else {
+				sx[k] = job->x + job->cx + (lx * rsq / dist);
+				sy[k] = job->y + job->cy + (ly * rsq / dist);
 			}
 		}
 	}
 }
 
-/* from_array in an array containing precalculated from matrices,
- * this is a double faced mem vs speed trade, it's faster, but eats
- * _a lot_ of mem for large radius (is there a bug here? I can't see it)
+/* Copies n pixels from (sx[k], sy[k]) of orig_map to row y of the back
+ * buffer, starting at x.  Sources outside the image are black.
  */
-static void init_round_lense(struct state *st)
+static void
+copy_pixels (const struct state *st, int x, int y, int n,
+			 const int *sx, const int *sy)
 {
+	XImage *src = st->orig_map, *dest = st->buffer_map;
+	unsigned w = src->width, h = src->height;
+	char *row = dest->data + y * dest->bytes_per_line;
+	int bpl = src->bytes_per_line;
 	int k;
 
-	if (st->effect == &swamp_thing) {
-		st->from_array = (int ****)malloc((st->radius+1)*sizeof(int ***));
-		for (k=0; k <= st->radius; k++) {
-			allocate_lense(st);
-			make_round_lense(st, st->radius, k);
-			st->from_array[k] = st->from;
+	switch (st->bpp_size) {
+		case 4: {
+			CARD32 *u = (CARD32 *)row + x;
+			for (k = 0; k < n; k++)
+				u[k] = ((unsigned) sx[k] < w && (unsigned) sy[k] < h
+						? *(CARD32 *)(src->data + sy[k]*bpl + sx[k]*4)
+						: st->black_pixel);
+			break;
 		}
-	} else { /* just allocate one from[][][] */
-		allocate_lense(st);
-		make_round_lense(st, st->radius,st->radius);
+		case 2: {
+			CARD16 *u = (CARD16 *)row + x;
+			for (k = 0; k < n; k++)
+				u[k] = ((unsigned) sx[k] < w && (unsigned) sy[k] < h
+						? *(CARD16 *)(src->data + sy[k]*bpl + sx[k]*2)
+						: st->black_pixel);
+			break;
+		}
+		case 1: {
+			CARD8 *u = (CARD8 *)row + x;
+			for (k = 0; k < n; k++)
+				u[k] = ((unsigned) sx[k] < w && (unsigned) sy[k] < h
+						? *(CARD8 *)(src->data + sy[k]*bpl + sx[k])
+						: st->black_pixel);
+			break;
+		}
+		default:
+			for (k = 0; k < n; k++)
+				XPutPixel(dest, x + k, y,
+						  ((unsigned) sx[k] < w && (unsigned) sy[k] < h
+						   ? XGetPixel(src, sx[k], sy[k])
+						   : st->black_pixel));
+			break;
 	}
 }
 
-/* If fast_draw_8, fast_draw_16 or fast_draw_32 are to be used, the following properties
- * of the src and dest XImages must hold (otherwise the generic, slooow, method provided
- * by X is to be used):
- *	src->byte_order == dest->byte_order
- *	src->format == ZPixmap && dest->format == ZPixmap
- *	src->depth == dest->depth == the depth the function in question asumes
- * x and y is the coordinates in src from where to cut out the image from,
- * distort_matrix is a precalculated array of how to distort the matrix
+/* The fast path: every source of this lens is known to be inside the
+ * image, so the pixels are fetched straight from the table.
  */
+#define GATHER_ROW(TYPE) do {										\
+	TYPE *u = (TYPE *)(dest->data + y * dest->bytes_per_line) + x1;	\
+	const char *t = src->data + job->y * bpl + job->x * sizeof(TYPE);	\
+	for (k = 0; k < n; k++, p += 2)									\
+		u[k] = *(const TYPE *)(t + p[1] * bpl + p[0] * sizeof(TYPE));	\
+	} while (0)
 
-static void fast_draw_8(struct state *st, XImage *src, XImage *dest, int x, int y, int *distort_matrix)
+static void
+gather_row (const struct state *st, const struct lense_job *job,
+			int y, int x1, int n)
 {
-	CARD8 *u = (CARD8 *)dest->data;
-	CARD8 *t = (CARD8 *)src->data + x + y*src->bytes_per_line/sizeof(CARD8);
+	XImage *src = st->orig_map, *dest = st->buffer_map;
+	const short *p = job->lense->src +
+		((y - job->y) * st->size + (x1 - job->x)) * 2;
+	int bpl = src->bytes_per_line;
+	int k;
 
-	while (u < (CARD8 *)(dest->data + sizeof(CARD8)*dest->height
-				*dest->bytes_per_line/sizeof(CARD8))) {
-		*u++ = t[*distort_matrix++];
+	switch (st->bpp_size) {
+		case 4: GATHER_ROW(CARD32); break;
+		case 2: GATHER_ROW(CARD16); break;
+		case 1: GATHER_ROW(CARD8);  break;
+		default: abort(); break;
 	}
 }
 
-static void fast_draw_16(struct state *st, XImage *src, XImage *dest, int x, int y, int *distort_matrix)
+#undef GATHER_ROW
+
+/* draws the part of a lens that falls in rows [y1, y2) of the frame */
+static void
+draw_lense_rows (const struct state *st, const struct lense_job *job,
+				 int y1, int y2)
 {
-	CARD16 *u = (CARD16 *)dest->data;
-	CARD16 *t = (CARD16 *)src->data + x + y*src->bytes_per_line/sizeof(CARD16);
+	int x1 = job->rect.x, x2 = job->rect.x + job->rect.width;
+	int y;
 
-	while (u < (CARD16 *)(dest->data + sizeof(CARD16)*dest->height
-				*dest->bytes_per_line/sizeof(CARD16))) {
-		*u++ = t[*distort_matrix++];
+	if (y1 < job->rect.y) y1 = job->rect.y;
+	if (y2 > job->rect.y + job->rect.height) y2 = job->rect.y + job->rect.height;
+
+	for (y = y1; y < y2; y++) {
+		if (job->inside) {
+			gather_row(st, job, y, x1, x2 - x1);
+		} else {
+			int sx[ROW_CHUNK], sy[ROW_CHUNK];
+			int x;
+			for (x = x1; x < x2; x += ROW_CHUNK) {
+				int n = x2 - x;
+				if (n > ROW_CHUNK) n = ROW_CHUNK;
+				lense_sources(st, job, x - job->x, y - job->y, n, sx, sy);
+				copy_pixels(st, x, y, n, sx, sy);
+			}
+		}
 	}
 }
 
-static void fast_draw_32(struct state *st, XImage *src, XImage *dest, int x, int y, int *distort_matrix)
+/* Each thread takes every count'th strip of rows, and draws every lens
+ * that crosses it, in order.  No two threads ever touch the same pixel,
+ * and lenses still stack the same way they would if drawn one by one.
+ */
+static void
+distort_pass (void *self_raw)
 {
-	CARD32 *u = (CARD32 *)dest->data;
-	CARD32 *t = (CARD32 *)src->data + x + y*src->bytes_per_line/sizeof(CARD32);
-
-	while (u < (CARD32 *)(dest->data + sizeof(CARD32)*dest->height
-				*dest->bytes_per_line/sizeof(CARD32))) {
-		*u++ = t[*distort_matrix++];
+	const struct distort_thread *self = (const struct distort_thread *) self_raw;
+	const struct state *st = self->st;
+	unsigned count = st->threadpool.count ? st->threadpool.count : 1;
+	int y1 = st->buffer_map->height, y2 = 0;
+	int i, y;
+
+	for (i = 0; i < st->njobs; i++) {
+		const XRectangle *r = &st->jobs[i].rect;
+		if (r->y < y1) y1 = r->y;
+		if (r->y + r->height > y2) y2 = r->y + r->height;
 	}
+
+	for (y = y1 + self->id * STRIP_ROWS; y < y2; y += count * STRIP_ROWS)
+		for (i = 0; i < st->njobs; i++)
+			draw_lense_rows(st, &st->jobs[i], y, y + STRIP_ROWS);
 }
 
-static void generic_draw(struct state *st, XImage *src, XImage *dest, int x, int y, int *distort_matrix)
+/* Queues lens k to be drawn this frame, with its square clipped to the
+ * frame.
+ */
+static struct lense_job *
+queue_lense (struct state *st, int k)
 {
-	int i, j;
-	for (i = 0; i < dest->width; i++)
-		for (j = 0; j < dest->height; j++)
-			if (st->from[i][j][0] + x >= 0 &&
-					st->from[i][j][0] + x < src->width &&
-					st->from[i][j][1] + y >= 0 &&
-					st->from[i][j][1] + y < src->height)
-				XPutPixel(dest, i, j,
-						XGetPixel(src,
-							st->from[i][j][0] + x,
-							st->from[i][j][1] + y));
+	struct lense_job *job;
+	int x1, y1, x2, y2;
+
+	if (st->njobs >= 2*st->number)
+		return 0;
+
+	job = &st->jobs[st->njobs];
+	job->x = st->xy_coo[k].x;
+	job->y = st->xy_coo[k].y;
+
+	x1 = job->x < 0 ? 0 : job->x;
+	y1 = job->y < 0 ? 0 : job->y;
+	x2 = job->x + st->size;
+	y2 = job->y + st->size;
+	if (x2 > st->buffer_map->width)  x2 = st->buffer_map->width;
+	if (y2 > st->buffer_map->height) y2 = st->buffer_map->height;
+	if (x1 >= x2 || y1 >= y2)
+		return 0;
+
+	job->rect.x = x1;
+	job->rect.y = y1;
+	job->rect.width  = x2 - x1;
+	job->rect.height = y2 - y1;
+	st->njobs++;
+	return job;
 }
 
-/* generate an XImage of from[][][] and draw it on the screen */
+/* queue the lense from[][] for lens k */
 static void plain_draw(struct state *st, int k)
 {
-	if (st->xy_coo[k].x+2*st->radius+st->speed+2 > st->orig_map->width ||
-			st->xy_coo[k].y+2*st->radius+st->speed+2 > st->orig_map->height)
-		return;
-
-	st->draw_routine(st, st->orig_map, st->buffer_map, st->xy_coo[k].x, st->xy_coo[k].y, st->fast_from);
-
-# ifdef HAVE_XSHM_EXTENSION
-	if (st->use_shm)
-		XShmPutImage(st->dpy, st->window, st->gc, st->buffer_map, 0, 0, st->xy_coo[k].x, st->xy_coo[k].y,
-				2*st->radius+st->speed+2, 2*st->radius+st->speed+2, False);
-	else
+	struct lense_job *job;
 
-	if (!st->use_shm)
-# endif
-		XPutImage(st->dpy, st->window, st->gc, st->buffer_map, 0, 0, st->xy_coo[k].x, st->xy_coo[k].y,
-				2*st->radius+st->speed+2, 2*st->radius+st->speed+2);
+	if (st->xy_coo[k].x+st->size > st->orig_map->width ||
+			st->xy_coo[k].y+st->size > st->orig_map->height)
+		return;
 
+	job = queue_lense(st, k);
+	if (!job) return;
+	job->lense = st->from;
+	job->inside = (st->bpp_size &&
+				   !st->from->holes &&
+				   job->x + st->from->x1 >= 0 &&
+				   job->y + st->from->y1 >= 0 &&
+				   job->x + st->from->x2 < st->orig_map->width &&
+				   job->y + st->from->y2 < st->orig_map->height);
 }
 
 
-/* generate an XImage from the reflect algoritm submitted by
+/* queue a lens using the reflect algoritm submitted by
  * Randy Zack <randy@acucorp.com>
- * draw really got too big and ugly so I split it up
- * it should be possible to use the from[][] to speed it up
- * (once I figure out the algorithm used :)
  */
 static void reflect_draw(struct state *st, int k)
 {
-	int i, j;
-	int	cx, cy;
-	int	ly, lysq, lx, ny, dist, rsq = st->radius * st->radius;
+	struct lense_job *job = queue_lense(st, k);
+	if (!job) return;
 
-	cx = cy = st->radius;
+	job->lense = 0;
+	job->inside = False;
+	job->cx = job->cy = st->radius;
 	if (st->xy_coo[k].ymove > 0)
-		cy += st->speed;
+		job->cy += st->speed;
 	if (st->xy_coo[k].xmove > 0)
-		cx += st->speed;
+		job->cx += st->speed;
+}
 
-	for(i = 0 ; i < 2*st->radius+st->speed+2; i++) {
-		ly = i - cy;
-		lysq = ly * ly;
-		ny = st->xy_coo[k].y + i;
-		if (ny >= st->orig_map->height) ny = st->orig_map->height-1;
-		for(j = 0 ; j < 2*st->radius+st->speed+2 ; j++) {
-			lx = j - cx;
-			dist = lx * lx + lysq;
-			if (dist > rsq ||
-				ly < -st->radius || ly > st->radius ||
-				lx < -st->radius || lx > st->radius)
-				XPutPixel( st->buffer_map, j, i,
-						   XGetPixel( st->orig_map, st->xy_coo[k].x + j, ny ));
-			else if (dist == 0)
-				XPutPixel( st->buffer_map, j, i, st->black_pixel );
-			else {
-				int	x = st->xy_coo[k].x + cx + (lx * rsq / dist);
-				int	y = st->xy_coo[k].y + cy + (ly * rsq / dist);
-				if (x < 0 || x >= st->xgwa.width ||
-					y < 0 || y >= st->xgwa.height)
-					XPutPixel( st->buffer_map, j, i, st->black_pixel );
-				else
-					XPutPixel( st->buffer_map, j, i,
-							   XGetPixel( st->orig_map, x, y ));
+/* Collapses rectangles that overlap enough that one put of their union
+ * costs no more than putting both.  Returns the new count.
+ */
+static int
+merge_rects (XRectangle *r, int n)
+{
+	Bool merged = True;
+	int i, j;
+
+	while (merged) {
+		merged = False;
+		for (i = 0; i < n; i++)
+			for (j = i + 1; j < n; j++) {
+				int x1 = r[i].x < r[j].x ? r[i].x : r[j].x;
+				int y1 = r[i].y < r[j].y ? r[i].y : r[j].y;
+				int x2 = r[i].x + r[i].width;
+				int y2 = r[i].y + r[i].height;
+				if (r[j].x + r[j].width > x2)  x2 = r[j].x + r[j].width;
+				if (r[j].y + r[j].height > y2) y2 = r[j].y + r[j].height;
+
+				if ((long) (x2 - x1) * (y2 - y1) <=
+					(long) r[i].width * r[i].height +
+					(long) r[j].width * r[j].height) {
+					r[i].x = x1;
+					r[i].y = y1;
+					r[i].width  = x2 - x1;
+					r[i].height = y2 - y1;
+					r[j] = r[--n];
+					merged = True;
+					j = i;
+				}
 			}
-		}
+	}
+	return n;
+}
+
+/* draw the queued lenses into the back buffer and put the changed parts */
+static void
+draw_lenses (struct state *st)
+{
+	int i, n;
+
+	if (st->threadpool.count) {
+		threadpool_run(&st->threadpool, distort_pass);
+		threadpool_wait(&st->threadpool);
+	} else {
+		struct distort_thread self;
+		self.st = st;
+		self.id = 0;
+		distort_pass(&self);
 	}
 
-	XPutImage(st->dpy, st->window, st->gc, st->buffer_map, 0, 0, st->xy_coo[k].x, st->xy_coo[k].y,
-			2*st->radius+st->speed+2, 2*st->radius+st->speed+2);
+	for (i = 0; i < st->njobs; i++)
+		st->rects[i] = st->jobs[i].rect;
+	n = merge_rects(st->rects, st->njobs);
+
+	for (i = 0; i < n; i++) {
+		const XRectangle *r = &st->rects[i];
+# ifdef HAVE_XSHM_EXTENSION
+		if (st->use_shm)
+			XShmPutImage(st->dpy, st->window, st->gc, st->buffer_map,
+						 r->x, r->y, r->x, r->y, r->width, r->height, False);
+		else
+# endif
+			XPutImage(st->dpy, st->window, st->gc, st->buffer_map,
+					  r->x, r->y, r->x, r->y, r->width, r->height);
+	}
+	st->njobs = 0;
 }
 
 /* create a new, random coordinate, that won't interfer with any other
@@ -727,7 +990,7 @@ static void swamp_thing(struct state *st, int k)
 		st->xy_coo[k].r_change = -abs(st->xy_coo[k].r_change);
 	
 	if (st->xy_coo[k].r <= 0) {
-		st->from = st->from_array[0];
+		st->from = &st->lense_array[0];
 		st->draw(st,k); 
 		st->xy_coo[k].r_change = abs(st->xy_coo[k].r_change);
 		new_rnd_coo(st,k);
@@ -742,7 +1005,7 @@ static void swamp_thing(struct state *st, int k)
 	if (st->xy_coo[k].r <= 0)
 		st->xy_coo[k].r=0;
 
-	st->from = st->from_array[st->xy_coo[k].r];
+	st->from = &st->lense_array[st->xy_coo[k].r];
 }
 
 
@@ -772,6 +1035,7 @@ distort_draw (Display *dpy, Window window, void *closure)
     st->effect(st,k);
     st->draw(st,k);
   }
+  draw_lenses(st);
   return st->delay;
 }
 
@@ -798,12 +1062,14 @@ static void
 distort_free (Display *dpy, Window window, void *closure)
 {
   struct state *st = (struct state *) closure;
+  if (st->threadpool.count)
+    threadpool_destroy (&st->threadpool);
   XFreeGC (st->dpy, st->gc);
-  if (st->orig_map) XDestroyImage (st->orig_map);
-  if (st->buffer_map) XDestroyImage (st->buffer_map);
-  if (st->from) free (st->from);
-  if (st->fast_from) free (st->fast_from);
-  if (st->from_array) free (st->from_array);
+  free_lenses (st);
+  free_images (st);
+  free (st->xy_coo);
+  free (st->jobs);
+  free (st->rects);
   free (st);
 }
 
@@ -814,6 +1080,7 @@ static const char *distort_defaults [] = {
 	"*dontClearRoot:		True",
 	"*background:			Black",
     "*fpsSolid:				true",
+	THREAD_DEFAULTS
 #ifdef __sgi    /* really, HAVE_READ_DISPLAY_EXTENSION */
 	"*visualID:			Best",
 #endif
@@ -858,6 +1125,7 @@ static XrmOptionDescRec distort_options [] = {
   { "-shm",       ".useSHM",      XrmoptionNoArg, "True" },
   { "-no-shm",    ".useSHM",      XrmoptionNoArg, "False" },
 #endif /* HAVE_XSHM_EXTENSION */
+  THREAD_OPTIONS
   { 0, 0, 0, 0 }
 };
 
@@ -21,6 +21,9 @@ static const char sccsid[] = "@(#)euler2d.c	5.00 2000/11/01 xlockmore";
  * other special, indirect and consequential damages.
  *
  * Revision History:
+ * 19-Oct-2026: Added eulervortices and eulertheta: many vortex points are
+ *              summed with a multipole tree, and particles are moved on
+ *              several threads.
  * 04-Nov-2000: Added an option eulerpower.  This allows for example the
  *              quasi-geostrophic equation by setting eulerpower to 2.
  * 01-Nov-2000: Allocation checks.
@@ -48,6 +51,7 @@ static const char sccsid[] = "@(#)euler2d.c	5.00 2000/11/01 xlockmore";
 					"*ncolors: 64    \n" \
 					"*fpsSolid: true    \n" \
 					"*ignoreRotation: True \n" \
+					"*useThreads: True \n" \
 
 # define euler2d_handle_event 0
 # define SMOOTH_COLORS
@@ -56,20 +60,29 @@ static const char sccsid[] = "@(#)euler2d.c	5.00 2000/11/01 xlockmore";
 # include "xlock.h"		/* in xlockmore distribution */
 #endif /* STANDALONE */
 
+#include "thread_util.h"
+
 #ifdef MODE_euler2d
 
 #define DEF_EULERTAIL "10"
+#define DEF_EULERVORTICES "20"
+#define DEF_EULERTHETA "0.5"
 
 #define DEBUG_POINTED_REGION    0
 
 static int tail_len;
 static int variable_boundary = 1;
 static float power = 1;
+static int vortices;
+static float theta;
 
 static XrmOptionDescRec opts[] =
 {
   {"-eulertail", ".euler2d.eulertail",   XrmoptionSepArg, NULL},
   {"-eulerpower", ".euler2d.eulerpower", XrmoptionSepArg, NULL},
+  {"-eulervortices", ".euler2d.eulervortices", XrmoptionSepArg, NULL},
+  {"-eulertheta", ".euler2d.eulertheta", XrmoptionSepArg, NULL},
+  THREAD_OPTIONS
 };
 static argtype vars[] =
 {
@@ -77,11 +90,17 @@ static argtype vars[] =
    "EulerTail", (char *) DEF_EULERTAIL, t_Int},
   {&power, "eulerpower",
    "EulerPower", "1", t_Float},
+  {&vortices, "eulervortices",
+   "EulerVortices", (char *) DEF_EULERVORTICES, t_Int},
+  {&theta, "eulertheta",
+   "EulerTheta", (char *) DEF_EULERTHETA, t_Float},
 };
 static OptionStruct desc[] =
 {
   {"-eulertail len", "Length of Euler2d tails"},
   {"-eulerpower power", "power of interaction law for points for Euler2d"},
+  {"-eulervortices num", "Number of vortex points for Euler2d"},
+  {"-eulertheta angle", "Opening angle of the Euler2d vortex tree, or 0"},
 };
 
 ENTRYPOINT ModeSpecOpt euler2d_opts =
@@ -101,13 +120,41 @@ ModStruct   euler2d_description = {
 #define balance_rand(v)	((LRAND()/MAXRAND*(v))-((v)/2))	/* random around 0 */
 #define positive_rand(v)	(LRAND()/MAXRAND*(v))	/* positive random */
 
-#define number_of_vortex_points 20
+/* With this many vortex points or more, and eulerpower 1, the velocities
+   come from the tree instead of summing over every vortex. */
+#define TREE_VORTICES 250
+
+/* Tree cells with this many vortex points or fewer aren't split. */
+#define LEAF_POINTS 32
+
+/* Terms kept in the multipole expansion of each tree cell. */
+#define N_TERMS 6
+
+/* Below this many particle-vortex pairs, threads cost more than they save. */
+#define THREAD_PAIRS 100000
 
 #define n_bound_p 500
 #define deg_p 6
 
 static double delta_t;
 
+/* A vortex point, or its reflection about the unit circle. */
+typedef struct {
+	double     x, y, w;
+	int        image;
+} source;
+
+/* A square of the vortex tree.
+   m[2k+0], m[2k+1] is the k'th moment, sum of w (a-c)^k over the vortices
+   a in the square, as complex numbers, about its center c.
+*/
+typedef struct {
+	double     x, y, half;
+	double     m[2*N_TERMS];
+	int        child;	/* index of the first of 4, or -1 if a leaf */
+	int        first, count;	/* the sources in it, in order */
+} quad;
+
 typedef struct {
 	int        width;
 	int        height;
@@ -163,8 +210,28 @@ typedef struct {
 	double      p_coef[2*(deg_p-1)];
 	XSegment   *boundary;
 
+/*  The vortices and their reflections, sorted into a tree when there are
+    many of them, and the positions derivs is currently working on.
+*/
+	source     *src;
+	int         nsrc;
+	int        *order;
+	quad       *quads;
+	int         nquads, quads_size;
+	int         use_tree;
+	double     *cur_x;
+	int         band_start;	/* first point the threads share out */
+
+	struct threadpool threadpool;
+
 } euler2dstruct;
 
+/* Each thread computes the velocities of one contiguous band of particles. */
+typedef struct {
+	euler2dstruct *sp;
+	unsigned    id;
+} euler2d_thread;
+
 static euler2dstruct *euler2ds = (euler2dstruct *) NULL;
 
 /*
@@ -259,36 +326,17 @@ calc_all_mod_dp2(double *x, euler2dstruct *sp)
   }
 }
 
+/* Adds up the velocity of point i due to every vortex point. */
 static void
-derivs(double *x, euler2dstruct *sp)
+direct_velocity(double *x, euler2dstruct *sp, int i)
 {
-  int i,j;
+  int j;
   double u1,u2,x1,x2,xij1,xij2,nxij;
-  double nx;
-
-  if (variable_boundary)
-    calc_all_mod_dp2(sp->x,sp);
 
+  x1 = x[2*i+0];
+  x2 = x[2*i+1];
   for (j=0;j<sp->Nvortex;j++) if (!sp->dead[j])
   {
-    nx = x[2*j+0]*x[2*j+0] + x[2*j+1]*x[2*j+1];
-    if (nx < 1e-10)
-      sp->x_is_zero[j] = 1;
-    else {
-      sp->x_is_zero[j] = 0;
-      sp->xs[2*j+0] = x[2*j+0]/nx;
-      sp->xs[2*j+1] = x[2*j+1]/nx;
-    }
-  }
-
-  (void) memset(sp->diffx,0,sizeof(double)*2*sp->N);
-
-  for (i=0;i<sp->N;i++) if (!sp->dead[i])
-  {
-    x1 = x[2*i+0];
-    x2 = x[2*i+1];
-    for (j=0;j<sp->Nvortex;j++) if (!sp->dead[j])
-    {
 /*
   Calculate the Biot-Savart kernel, that is, effect of a 
   vortex point at a = (x[2*j+0],x[2*j+1]) at the point 
@@ -311,41 +359,285 @@ derivs(double *x, euler2dstruct *sp)
 
 */
 
-      xij1 = x1 - x[2*j+0];
-      xij2 = x2 - x[2*j+1];
+    xij1 = x1 - x[2*j+0];
+    xij2 = x2 - x[2*j+1];
+    nxij = (power==1.0) ? xij1*xij1+xij2*xij2 : pow(xij1*xij1+xij2*xij2,(power+1)/2.0);
+
+    if(nxij >= 1e-4)  {
+      u1 =  xij2/nxij;
+      u2 = -xij1/nxij;
+    }
+    else
+      u1 = u2 = 0.0;
+
+    if (!sp->x_is_zero[j])
+    {
+      xij1 = x1 - sp->xs[2*j+0];
+      xij2 = x2 - sp->xs[2*j+1];
       nxij = (power==1.0) ? xij1*xij1+xij2*xij2 : pow(xij1*xij1+xij2*xij2,(power+1)/2.0);
 
-      if(nxij >= 1e-4)  {
-        u1 =  xij2/nxij;
-        u2 = -xij1/nxij;
+      if (nxij < 1e-5)
+      {
+        sp->dead[i] = 1;
+        u1 = u2 = 0.0;
       }
       else
-        u1 = u2 = 0.0;
-
-      if (!sp->x_is_zero[j])
       {
-        xij1 = x1 - sp->xs[2*j+0];
-        xij2 = x2 - sp->xs[2*j+1];
-        nxij = (power==1.0) ? xij1*xij1+xij2*xij2 : pow(xij1*xij1+xij2*xij2,(power+1)/2.0);
+        u1 -= xij2/nxij;
+        u2 += xij1/nxij;
+      }
+    }
+
+    if (!sp->dead[i])
+    {
+      sp->diffx[2*i+0] += u1*sp->w[j];
+      sp->diffx[2*i+1] += u2*sp->w[j];
+    }
+  }
+}
+
+/*
+  With power == 1, writing points as complex numbers, the velocity
+  u = (u1,u2) due to a vortex point a of vorticity w satisfies
+
+  u1 - i u2 = i w / (z-a)
+
+  and for all the vortex points in a square centered at c,
+
+  sum w / (z-a) = sum_k m_k / (z-c)^(k+1),   m_k = sum w (a-c)^k
+
+  which, cut off after N_TERMS terms, is accurate to about
+  eulertheta^N_TERMS when the corners of the square are less than
+  eulertheta times as far from c as z is.  So, as in Barnes-Hut, the
+  far away squares of a quadtree of the vortex points and their
+  reflections (with vorticity -w) can stand in for the points in
+  them, and each velocity costs O(log Nvortex) instead of O(Nvortex).
+*/
+
+/* Fills in quad q, which covers sp->order[first, first+count), and the
+   tree below it.  Returns 0 if out of memory.
+ */
+static int
+build_quad(euler2dstruct *sp, int q, double x, double y, double half,
+           int first, int count, int depth)
+{
+  quad *Q;
+  int i,k;
+
+  Q = &sp->quads[q];
+  Q->x = x;
+  Q->y = y;
+  Q->half = half;
+  Q->child = -1;
+  Q->first = first;
+  Q->count = count;
+  (void) memset(Q->m,0,sizeof(Q->m));
+
+  for (i=first;i<first+count;i++)
+  {
+    const source *S = &sp->src[sp->order[i]];
+    double d1 = S->x - x, d2 = S->y - y, p1 = S->w, p2 = 0, temp;
+    for (k=0;k<N_TERMS;k++)
+    {
+      add(Q->m[2*k+0],Q->m[2*k+1],p1,p2);
+      mult(p1,p2,d1,d2);
+    }
+  }
 
-        if (nxij < 1e-5)
+  /* Stop at a few points, or when they're all on top of each other. */
+  if (count > LEAF_POINTS && depth < 40)
+  {
+    int *o = sp->order + first;
+    int split[5], c;
+
+    if (sp->nquads + 4 > sp->quads_size)
+    {
+      quad *quads;
+      sp->quads_size = (sp->nquads + 4) * 2;
+      quads = (quad *) realloc(sp->quads, sp->quads_size * sizeof(quad));
+      if (quads == NULL)
+        return 0;
+      sp->quads = quads;
+    }
+    c = sp->nquads;
+    sp->nquads += 4;
+    sp->quads[q].child = c;
+
+    /* Partition into the quadrants: left/right, then top/bottom of each. */
+    split[0] = 0;
+    split[4] = count;
+    for (k=0;k<3;k++)
+    {
+      int lo = (k == 2 ? split[2] : 0);
+      int hi = (k == 0 ? count : k == 1 ? split[2] : count);
+      int yp = (k != 0);
+      while (lo < hi)
+      {
+        const source *S = &sp->src[o[lo]];
+        if (yp ? S->y < y : S->x < x)
+          lo++;
+        else
         {
-          sp->dead[i] = 1;
-          u1 = u2 = 0.0;
+          int t = o[lo]; o[lo] = o[--hi]; o[hi] = t;
         }
-        else
+      }
+      split[k == 0 ? 2 : k == 1 ? 1 : 3] = lo;
+    }
+
+    half /= 2;
+    for (k=0;k<4;k++)
+      if (!build_quad(sp, c + k,
+                      x + (k & 2 ? half : -half),
+                      y + (k & 1 ? half : -half),
+                      half, first + split[k], split[k+1] - split[k],
+                      depth + 1))
+        return 0;
+  }
+  return 1;
+}
+
+/* Sorts the live vortex points and their reflections into the tree.
+   Returns 0 if out of memory. */
+static int
+build_tree(euler2dstruct *sp)
+{
+  double x0,x1,y0,y1,half;
+  int j;
+
+  sp->nsrc = 0;
+  for (j=0;j<sp->Nvortex;j++) if (!sp->dead[j])
+  {
+    source *S = &sp->src[sp->nsrc++];
+    S->x = sp->cur_x[2*j+0];
+    S->y = sp->cur_x[2*j+1];
+    S->w = sp->w[j];
+    S->image = 0;
+    if (!sp->x_is_zero[j])
+    {
+      S = &sp->src[sp->nsrc++];
+      S->x = sp->xs[2*j+0];
+      S->y = sp->xs[2*j+1];
+      S->w = -sp->w[j];
+      S->image = 1;
+    }
+  }
+  if (sp->nsrc == 0)
+    return 0;
+
+  x0 = x1 = sp->src[0].x;
+  y0 = y1 = sp->src[0].y;
+  for (j=0;j<sp->nsrc;j++)
+  {
+    const source *S = &sp->src[j];
+    if (S->x < x0) x0 = S->x; else if (S->x > x1) x1 = S->x;
+    if (S->y < y0) y0 = S->y; else if (S->y > y1) y1 = S->y;
+    sp->order[j] = j;
+  }
+  half = (x1 - x0 > y1 - y0 ? x1 - x0 : y1 - y0) / 2 * 1.0001 + 1e-9;
+
+  if (sp->quads_size < 1)
+  {
+    sp->quads_size = sp->nsrc;
+    sp->quads = (quad *) malloc(sp->quads_size * sizeof(quad));
+    if (sp->quads == NULL)
+    {
+      sp->quads_size = 0;
+      return 0;
+    }
+  }
+  sp->nquads = 1;
+  return build_quad(sp, 0, (x0 + x1) / 2, (y0 + y1) / 2, half,
+                    0, sp->nsrc, 0);
+}
+
+/* direct_velocity, except that a square of the tree that is far enough
+   away is summed from its expansion. */
+static void
+tree_velocity(double *x, euler2dstruct *sp, int i)
+{
+  double x1 = x[2*i+0], x2 = x[2*i+1];
+  double u1 = 0, u2 = 0;
+  int stack[4 * 40 + 4];
+  int n = 0;
+
+  stack[n++] = 0;
+  while (n)
+  {
+    const quad *Q = &sp->quads[stack[--n]];
+    double g1 = fabs(x1 - Q->x) - Q->half;
+    double g2 = fabs(x2 - Q->y) - Q->half;
+    double gap2 = (g1 > 0 ? g1*g1 : 0) + (g2 > 0 ? g2*g2 : 0);
+
+    if (Q->count == 0)
+      continue;
+
+    /* Every point in it must be outside the cutoffs below. */
+    if (gap2 > 1e-4)
+    {
+      double d1 = x1 - Q->x, d2 = x2 - Q->y;
+      double nd = d1*d1 + d2*d2;
+      if (2 * Q->half * Q->half < theta * theta * nd)
+      {
+        double t1 = d1/nd, t2 = -d2/nd, p1 = t1, p2 = t2;
+        double f1 = 0, f2 = 0, temp;
+        int k;
+        for (k=0;k<N_TERMS;k++)
         {
-          u1 -= xij2/nxij;
-          u2 += xij1/nxij;
+          f1 += Q->m[2*k+0]*p1 - Q->m[2*k+1]*p2;
+          f2 += Q->m[2*k+0]*p2 + Q->m[2*k+1]*p1;
+          mult(p1,p2,t1,t2);
         }
+        u1 -= f2;
+        u2 -= f1;
+        continue;
       }
+    }
 
-      if (!sp->dead[i])
+    if (Q->child < 0)
+    {
+      int k;
+      for (k=Q->first;k<Q->first+Q->count;k++)
       {
-        sp->diffx[2*i+0] += u1*sp->w[j];
-        sp->diffx[2*i+1] += u2*sp->w[j];
+        const source *S = &sp->src[sp->order[k]];
+        double xij1 = x1 - S->x, xij2 = x2 - S->y;
+        double nxij = xij1*xij1+xij2*xij2;
+        if (S->image && nxij < 1e-5)
+        {
+          sp->dead[i] = 1;
+          return;
+        }
+        if (nxij >= 1e-4)
+        {
+          u1 += S->w * xij2/nxij;
+          u2 -= S->w * xij1/nxij;
+        }
       }
     }
+    else
+    {
+      stack[n++] = Q->child;
+      stack[n++] = Q->child + 1;
+      stack[n++] = Q->child + 2;
+      stack[n++] = Q->child + 3;
+    }
+  }
+
+  sp->diffx[2*i+0] = u1;
+  sp->diffx[2*i+1] = u2;
+}
+
+/* The velocities of points [from, to) at sp->cur_x. */
+static void
+calc_velocities(euler2dstruct *sp, int from, int to)
+{
+  int i;
+
+  for (i=from;i<to;i++) if (!sp->dead[i])
+  {
+    if (sp->use_tree)
+      tree_velocity(sp->cur_x,sp,i);
+    else
+      direct_velocity(sp->cur_x,sp,i);
 
     if (!sp->dead[i] && variable_boundary)
     {
@@ -360,6 +652,81 @@ derivs(double *x, euler2dstruct *sp)
   }
 }
 
+static int
+euler2d_thread_create(void *self_raw, struct threadpool *pool, unsigned id)
+{
+  euler2d_thread *self = (euler2d_thread *)self_raw;
+
+  self->sp = GET_PARENT_OBJ(euler2dstruct, threadpool, pool);
+  self->id = id;
+  return 0;
+}
+
+static void
+euler2d_thread_destroy(void *self_raw)
+{
+}
+
+static void
+euler2d_thread_run(void *self_raw)
+{
+  euler2d_thread *self = (euler2d_thread *)self_raw;
+  euler2dstruct *sp = self->sp;
+  unsigned count = sp->threadpool.count;
+  int n = sp->N - sp->band_start;
+
+  calc_velocities(sp, sp->band_start + (int)((double)n * self->id / count),
+                  sp->band_start + (int)((double)n * (self->id + 1) / count));
+}
+
+static void
+derivs(double *x, euler2dstruct *sp)
+{
+  int j;
+  double nx;
+
+  if (variable_boundary)
+    calc_all_mod_dp2(sp->x,sp);
+
+  for (j=0;j<sp->Nvortex;j++) if (!sp->dead[j])
+  {
+    nx = x[2*j+0]*x[2*j+0] + x[2*j+1]*x[2*j+1];
+    if (nx < 1e-10)
+      sp->x_is_zero[j] = 1;
+    else {
+      sp->x_is_zero[j] = 0;
+      sp->xs[2*j+0] = x[2*j+0]/nx;
+      sp->xs[2*j+1] = x[2*j+1]/nx;
+    }
+  }
+
+  (void) memset(sp->diffx,0,sizeof(double)*2*sp->N);
+
+  sp->cur_x = x;
+  sp->use_tree = (theta > 0 && power == 1.0 &&
+                  sp->Nvortex >= TREE_VORTICES && build_tree(sp));
+
+/*
+  Summing directly, a vortex point that dies stops moving the points
+  after it, so do the vortex points in order before the rest.  The tree
+  is built from the ones alive to begin with, so any order will do.
+*/
+  sp->band_start = 0;
+  if (!sp->use_tree)
+  {
+    calc_velocities(sp,0,sp->Nvortex);
+    sp->band_start = sp->Nvortex;
+  }
+
+  if (sp->threadpool.count > 1)
+  {
+    threadpool_run(&sp->threadpool, euler2d_thread_run);
+    threadpool_wait(&sp->threadpool);
+  }
+  else
+    calc_velocities(sp,sp->band_start,sp->N);
+}
+
 /*
   What perturb does is effectively
     ret = x + k,
@@ -502,6 +869,10 @@ free_euler2d(euler2dstruct *sp)
 	deallocate(sp->x_is_zero, short);
 	deallocate(sp->p, double);
 	deallocate(sp->mod_dp2, double);
+	deallocate(sp->src, source);
+	deallocate(sp->order, int);
+	deallocate(sp->quads, quad);
+	sp->quads_size = 0;
 }
 
 ENTRYPOINT void
@@ -540,8 +911,8 @@ init_euler2d (ModeInfo * mi)
 	sp->width = MI_WIDTH(mi);
 	sp->height = MI_HEIGHT(mi);
 
-	sp->N = (int)(MI_COUNT(mi)+number_of_vortex_points);
-	sp->Nvortex = number_of_vortex_points;
+	sp->N = (int)(MI_COUNT(mi)+((vortices < 1) ? 1 : vortices));
+	sp->Nvortex = (vortices < 1) ? 1 : vortices;
 
 	if (tail_len < 1) { /* minimum tail */
 	  tail_len = 1;
@@ -574,6 +945,21 @@ init_euler2d (ModeInfo * mi)
 		allocate(sp->x_is_zero, short, sp->Nvortex);
 		allocate(sp->p, double, sp->N * 2);
 		allocate(sp->mod_dp2, double, sp->N);
+		allocate(sp->src, source, sp->Nvortex * 2);
+		allocate(sp->order, int, sp->Nvortex * 2);
+	}
+
+	if (!sp->threadpool.count) {
+		static const struct threadpool_class cls = {
+			sizeof(euler2d_thread),
+			euler2d_thread_create,
+			euler2d_thread_destroy
+		};
+		unsigned count = ((double)sp->N * sp->Nvortex >= THREAD_PAIRS ?
+		                  hardware_concurrency(MI_DISPLAY(mi)) : 1);
+
+		if (threadpool_create(&sp->threadpool, &cls, MI_DISPLAY(mi), count))
+			sp->threadpool.count = 0; /* See the note in thread_util.h. */
 	}
 	for (i=0;i<tail_len;i++) {
 		sp->nold_segs[i] = 0;
@@ -870,8 +1256,11 @@ release_euler2d (ModeInfo * mi)
 	if (euler2ds != NULL) {
 		int         screen;
 
-		for (screen = 0; screen < MI_NUM_SCREENS(mi); screen++)
+		for (screen = 0; screen < MI_NUM_SCREENS(mi); screen++) {
+			if (euler2ds[screen].threadpool.count)
+				threadpool_destroy(&euler2ds[screen].threadpool);
 			free_euler2d(&euler2ds[screen]);
+		}
 		(void) free((void *) euler2ds);
 		euler2ds = (euler2dstruct *) NULL;
 	}
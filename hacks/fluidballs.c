@@ -69,6 +69,17 @@ typedef struct {
   float e;		/* coeficient of elasticity */
   float max_radius;	/* largest radius of any ball */
 
+  /* Balls can only touch balls in the same or a neighboring cell of this
+     grid, whose cells are as wide as the largest ball. */
+  float cell_size;
+  int grid_w, grid_h, grid_size;
+  int *cell_start;	/* Where each cell's balls start in cell_balls. */
+  int *cell_balls;	/* Balls, sorted by cell, then by index. */
+  int *ball_cell;	/* The cell of each ball. */
+  int *nearby;		/* Scratch: the balls that might touch one. */
+
+  XArc *arcs;		/* Scratch: the balls to erase or draw. */
+
   Bool random_sizes_p;  /* Whether balls should be various sizes up to max. */
   Bool shake_p;		/* Whether to mess with gravity when things settle. */
   Bool dbuf;            /* Whether we're using double buffering. */
@@ -81,6 +92,7 @@ typedef struct {
   int font_baseline;
   int frame_count;
   int collision_count;
+  int pair_count;	/* Pairs of balls checked for a collision. */
   char fps_str[1024];
   
   int time_tick;
@@ -362,6 +374,12 @@ fluidballs_init (Display *dpy, Window window)
   state->opx = (float *) malloc (sizeof (*state->opx) * (state->count + 1));
   state->opy = (float *) malloc (sizeof (*state->opy) * (state->count + 1));
 
+  state->cell_size  = state->max_radius * 2;
+  state->cell_balls = (int *) malloc (sizeof (int) * (state->count + 1));
+  state->ball_cell  = (int *) malloc (sizeof (int) * (state->count + 1));
+  state->nearby     = (int *) malloc (sizeof (int) * (state->count + 1));
+  state->arcs = (XArc *) malloc (sizeof (*state->arcs) * (state->count + 1));
+
   for (i=1; i<=state->count; i++)
     {
       state->px[i] = frand(extx) + state->xmin;
@@ -469,15 +487,19 @@ check_wall_clock (b_state *state, float max_d)
 			   (state->last_time.tv_sec + (state->last_time.tv_usec / 1000000.0)));
 	  float fps = state->frame_count / elapsed;
 	  float cps = state->collision_count / elapsed;
+	  float pps = state->pair_count / elapsed;
 	  
-	  sprintf (state->fps_str, "Collisions: %.3f/frame  Max motion: %.3f",
-		   cps/fps, max_d);
+	  sprintf (state->fps_str,
+                   "Collisions: %.3f/frame  Pairs checked: %.1f/frame"
+                   "  Max motion: %.3f",
+		   cps/fps, pps/fps, max_d);
 	  
 	  draw_fps_string(state);
 	}
 
       state->frame_count = 0;
       state->collision_count = 0;
+      state->pair_count = 0;
       state->last_time = now;
     }
 }
@@ -487,7 +509,7 @@ check_wall_clock (b_state *state, float max_d)
 static void
 repaint_balls (b_state *state)
 {
-  int a;
+  int a, n;
   int x1a, x2a, y1a, y2a;
   int x1b, x2b, y1b, y2b;
   float max_d = 0;
@@ -496,42 +518,54 @@ repaint_balls (b_state *state)
   XClearWindow (state->dpy, state->b);
 #endif
 
-  for (a=1; a <= state->count; a++)
+  /* Erase all the balls at their previous positions, then draw them all
+     at the new ones, so that each is one request. */
+
+  for (a=1, n=0; a <= state->count; a++)
     {
-      GC gc;
+      XArc *arc = &state->arcs[n++];
       x1a = (state->opx[a] - state->r[a] - state->xmin);
       y1a = (state->opy[a] - state->r[a] - state->ymin);
       x2a = (state->opx[a] + state->r[a] - state->xmin);
       y2a = (state->opy[a] + state->r[a] - state->ymin);
 
-      x1b = (state->px[a] - state->r[a] - state->xmin);
-      y1b = (state->py[a] - state->r[a] - state->ymin);
-      x2b = (state->px[a] + state->r[a] - state->xmin);
-      y2b = (state->py[a] + state->r[a] - state->ymin);
+      arc->x = x1a;
+      arc->y = y1a;
+      arc->width  = x2a-x1a;
+      arc->height = y2a-y1a;
+      arc->angle1 = 0;
+      arc->angle2 = 360*64;
+    }
 
 #ifndef HAVE_COCOA	/* Don't second-guess Quartz's double-buffering */
 #ifdef HAVE_DOUBLE_BUFFER_EXTENSION
-      if (!state->dbeclear_p || !state->backb)
+  if (!state->dbeclear_p || !state->backb)
 #endif /* HAVE_DOUBLE_BUFFER_EXTENSION */
-	{
-/*	  if (x1a != x1b || y1a != y1b)   -- leaves turds if we optimize this */
-	    {
-	      gc = state->erase_gc;
-	      XFillArc (state->dpy, state->b, gc,
-			x1a, y1a, x2a-x1a, y2a-y1a,
-			0, 360*64);
-	    }
-	}
+    XFillArcs (state->dpy, state->b, state->erase_gc, state->arcs, n);
 #endif /* !HAVE_COCOA */
 
+  for (a=1, n=0; a <= state->count; a++)
+    {
+      XArc *arc;
+      x1b = (state->px[a] - state->r[a] - state->xmin);
+      y1b = (state->py[a] - state->r[a] - state->ymin);
+      x2b = (state->px[a] + state->r[a] - state->xmin);
+      y2b = (state->py[a] + state->r[a] - state->ymin);
+
       if (state->mouse_ball == a)
-        gc = state->draw_gc2;
+        XFillArc (state->dpy, state->b, state->draw_gc2,
+                  x1b, y1b, x2b-x1b, y2b-y1b,
+                  0, 360*64);
       else
-        gc = state->draw_gc;
-
-      XFillArc (state->dpy, state->b, gc,
-                x1b, y1b, x2b-x1b, y2b-y1b,
-                0, 360*64);
+        {
+          arc = &state->arcs[n++];
+          arc->x = x1b;
+          arc->y = y1b;
+          arc->width  = x2b-x1b;
+          arc->height = y2b-y1b;
+          arc->angle1 = 0;
+          arc->angle2 = 360*64;
+        }
 
       if (state->shake_p)
         {
@@ -547,6 +581,8 @@ repaint_balls (b_state *state)
       state->opy[a] = state->py[a];
     }
 
+  XFillArcs (state->dpy, state->b, state->draw_gc, state->arcs, n);
+
   if (state->fps_p
 #ifdef HAVE_DOUBLE_BUFFER_EXTENSION
       && (state->backb ? state->dbeclear_p : 1)
@@ -584,12 +620,85 @@ repaint_balls (b_state *state)
 }
 
 
+/* Sorts the balls into the cells of the grid.  Balls off the window go
+   in the nearest cell, which still puts any two that touch in the same
+   or neighboring cells.
+ */
+static void
+bin_balls (b_state *state)
+{
+  int gw = (state->xmax - state->xmin) / state->cell_size + 1;
+  int gh = (state->ymax - state->ymin) / state->cell_size + 1;
+  int a, c, ncells;
+
+  if (gw < 1) gw = 1;
+  if (gh < 1) gh = 1;
+  ncells = gw * gh;
+  if (ncells > state->grid_size)
+    {
+      state->grid_size = ncells;
+      state->cell_start = (int *)
+        realloc (state->cell_start, sizeof (int) * (ncells + 1));
+      if (! state->cell_start) abort();
+    }
+  state->grid_w = gw;
+  state->grid_h = gh;
+
+  memset (state->cell_start, 0, sizeof (int) * (ncells + 1));
+  for (a=1; a <= state->count; a++)
+    {
+      int cx = (state->px[a] - state->xmin) / state->cell_size;
+      int cy = (state->py[a] - state->ymin) / state->cell_size;
+      if (cx < 0) cx = 0; else if (cx >= gw) cx = gw-1;
+      if (cy < 0) cy = 0; else if (cy >= gh) cy = gh-1;
+      c = cy * gw + cx;
+      state->ball_cell[a] = c;
+      state->cell_start[c]++;
+    }
+
+  /* Count sort, filling each cell from its end backwards so that each
+     ends up in increasing order. */
+  for (c = 1; c <= ncells; c++)
+    state->cell_start[c] += state->cell_start[c-1];
+  for (a = state->count; a >= 1; a--)
+    state->cell_balls[--state->cell_start[state->ball_cell[a]]] = a;
+}
+
+
+/* Collects the balls after `a' that might touch it into state->nearby,
+   in increasing order, and returns how many there are.
+ */
+static int
+nearby_balls (b_state *state, int a)
+{
+  int gw = state->grid_w, gh = state->grid_h;
+  int cx = state->ball_cell[a] % gw;
+  int cy = state->ball_cell[a] / gw;
+  int x, y, i, j, n = 0;
+
+  for (y = (cy > 0 ? cy-1 : 0); y <= cy+1 && y < gh; y++)
+    for (x = (cx > 0 ? cx-1 : 0); x <= cx+1 && x < gw; x++)
+      {
+        int c = y * gw + x;
+        for (i = state->cell_start[c]; i < state->cell_start[c+1]; i++)
+          {
+            int b = state->cell_balls[i];
+            if (b <= a) continue;
+            for (j = n++; j > 0 && state->nearby[j-1] > b; j--)
+              state->nearby[j] = state->nearby[j-1];
+            state->nearby[j] = b;
+          }
+      }
+  return n;
+}
+
+
 /* Implements the laws of physics: move balls to their new positions.
  */
 static void
 update_balls (b_state *state)
 {
-  int a, b;
+  int a, b, i, n;
   float d, vxa, vya, vxb, vyb, dd, cdx, cdy;
   float ma, mb, vca, vcb, dva, dvb;
   float dee2;
@@ -614,10 +723,14 @@ update_balls (b_state *state)
          state->tc);
     }
 
-  /* For each ball, compute the influence of every other ball. */
+  /* For each ball, compute the influence of every other ball that's close
+     enough to touch it, in the same order as if we checked every pair. */
+  bin_balls (state);
   for (a=1; a <= state->count -  1; a++)
-    for (b=a + 1; b <= state->count; b++)
+    for (i = 0, n = nearby_balls (state, a); i < n; i++)
       {
+         b = state->nearby[i];
+         state->pair_count++;
          d = ((state->px[a] - state->px[b]) *
               (state->px[a] - state->px[b]) +
               (state->py[a] - state->py[b]) *
@@ -788,6 +901,19 @@ static void
 fluidballs_free (Display *dpy, Window window, void *closure)
 {
   b_state *state = (b_state *) closure;
+  free (state->m);
+  free (state->r);
+  free (state->vx);
+  free (state->vy);
+  free (state->px);
+  free (state->py);
+  free (state->opx);
+  free (state->opy);
+  free (state->cell_start);
+  free (state->cell_balls);
+  free (state->ball_cell);
+  free (state->nearby);
+  free (state->arcs);
   free (state);
 }
 
@@ -32,6 +32,7 @@ fps_init (Display *dpy, Window window)
   st->dpy = dpy;
   st->window = window;
   st->clear_p = get_boolean_resource (dpy, "fpsSolid", "FPSSolid");
+  st->log_p = get_boolean_resource (dpy, "fpsLog", "FPSLog");
 
   font = get_string_resource (dpy, "fpsFont", "Font");
 
@@ -162,6 +163,34 @@ fps_compute (fps_state *st, unsigned long polys, double depth)
           if (s[L-2] == '.' && s[L-1] == '0')
             s[L-2] = 0;
         }
+
+      /* GL hacks fill these in from glx/fps-gl.c. */
+      if (st->timed_frames > 0)
+        {
+          double n = st->timed_frames;
+          sprintf (st->string + strlen(st->string),
+                   "\nCPU:   %.2f ms \nGPU:   %.2f ms%s \nSwap:  %.2f ms ",
+                   st->cpu_time  * 1000 / n,
+                   (st->gpu_frames
+                    ? st->gpu_time * 1000 / st->gpu_frames
+                    : 0),
+                   (st->gpu_timer_p ? "" : " (glFinish)"),
+                   st->swap_time * 1000 / n);
+          st->cpu_time = st->gpu_time = st->swap_time = 0;
+          st->timed_frames = st->gpu_frames = 0;
+        }
+
+      if (st->log_p)
+        {
+          char *s;
+          fprintf (stderr, "%s: ", progname);
+          for (s = st->string; *s; s++)
+            if (*s != '\n')
+              fputc (*s, stderr);
+            else if (s > st->string && s[-1] != ' ')
+              fputc (' ', stderr);
+          fputc ('\n', stderr);
+        }
     }
 
   return st->last_fps;
@@ -21,6 +21,7 @@ struct fps_state {
   int x, y;
   XFontStruct *font;
   Bool clear_p;
+  Bool log_p;
   char string[1024];
 
   /* for glx/fps-gl.c */
@@ -30,6 +31,16 @@ struct fps_state {
   void *gl_fps_data;
 # endif
 
+  /* Also for glx/fps-gl.c: where the time in each GL frame went.
+     Times are in seconds, summed since the string was last regenerated.
+   */
+  double frame_start, submit_end, swap_start;
+  double cpu_time, gpu_time, swap_time;
+  int timed_frames, gpu_frames;
+  Bool gpu_timer_p;		/* timer queries, or glFinish if not */
+  unsigned int gpu_queries[2];
+  int gpu_query_frame;
+
   GC draw_gc, erase_gc;
 
   int last_ifps;
@@ -46,6 +46,7 @@ static const char sccsid[] = "@(#)galaxy.c 4.04 97/07/28 xlockmore";
 					"*ncolors:  64   \n" \
 					"*fpsSolid:  true   \n" \
 					"*ignoreRotation: True \n" \
+					"*useThreads: True \n" \
 
 # define UNIFORM_COLORS
 # define galaxy_handle_event 0
@@ -54,6 +55,12 @@ static const char sccsid[] = "@(#)galaxy.c 4.04 97/07/28 xlockmore";
 # include "xlock.h"     /* from the xlockmore distribution */
 #endif /* !STANDALONE */
 
+#include "thread_util.h"
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 static Bool tracks;
 static Bool spin;
 static Bool dbufp;
@@ -70,6 +77,7 @@ static XrmOptionDescRec opts[] =
  {"+spin",   ".galaxy.spin",   XrmoptionNoArg, "off"},
  {"-dbuf",   ".galaxy.dbuf",   XrmoptionNoArg, "on"},
  {"+dbuf",   ".galaxy.dbuf",   XrmoptionNoArg, "off"},
+ THREAD_OPTIONS
 };
 
 static argtype vars[] =
@@ -119,26 +127,30 @@ ENTRYPOINT ModeSpecOpt galaxy_opts =
 
 
 #define COLORBASE  16
+
+/* Fewest star-galaxy pairs in a step worth waking the threads for */
+#define THREAD_PAIRS  65536
 /* colors per galaxy */
 /* #define COLORSTEP  (NUMCOLORS/COLORBASE) */
 # define COLORSTEP (MI_NCOLORS(mi)/COLORBASE)
 
 
-typedef struct {
- double      pos[3], vel[3];
-} Star;
-
-
 typedef struct {
  int         mass;
  int         nstars;
- Star       *stars;
- XPoint     *oldpoints;
- XPoint     *newpoints;
+ float      *spos[3], *svel[3]; /* the stars', nstars each, in one block */
+ int         first; /* where the stars are in the point arrays */
  double      pos[3], vel[3];
  int         galcol;
 } Galaxy;
 
+/* A galaxy as its stars see it during a step */
+typedef struct {
+ float       pos[3];
+ float       pull; /* mass * DELTAT^2 * QCONS */
+ float       near_pull; /* the pull closer in than EPSILON */
+} Center;
+
 typedef struct {
  double      mat[3][3]; /* Movement of stars(?) */
  double      scale; /* Scale */
@@ -154,8 +166,27 @@ typedef struct {
 y-axis*/
  double      rot_x; /* rotation of eye around center of universe, around
 x-axis */
+
+ /* The stars' points, grouped by color, so that each color is drawn in
+    one call */
+ XPoint     *oldpoints;
+ XPoint     *newpoints;
+ int         npoints;
+ int         colstart[COLORBASE + 1]; /* each color's first point */
+
+ /* Per-step inputs to the star update, which runs on the threads */
+ Center     *centers; /* ngalaxies of them, twice: moved, then not */
+ float       view[4]; /* cox, six, cor, sir */
+ int         nthreads;
+ Bool        threaded;
+ struct threadpool threadpool;
 } unistruct;
 
+struct galaxy_thread {
+ unistruct  *gp;
+ unsigned    id;
+};
+
 static unistruct *universes = NULL;
 
 static void
@@ -167,23 +198,27 @@ free_galaxies(unistruct * gp)
   for (i = 0; i < gp->ngalaxies; i++) {
    Galaxy     *gt = &gp->galaxies[i];
 
-   if (gt->stars != NULL)
-    (void) free((void *) gt->stars);
-   if (gt->oldpoints != NULL)
-       (void) free((void *) gt->oldpoints);
-   if (gt->newpoints != NULL)
-       (void) free((void *) gt->newpoints);
+   if (gt->spos[0] != NULL)
+    (void) free((void *) gt->spos[0]);
   }
   (void) free((void *) gp->galaxies);
   gp->galaxies = NULL;
  }
+ if (gp->oldpoints != NULL)
+  (void) free((void *) gp->oldpoints);
+ if (gp->newpoints != NULL)
+  (void) free((void *) gp->newpoints);
+ if (gp->centers != NULL)
+  (void) free((void *) gp->centers);
+ gp->oldpoints = gp->newpoints = NULL;
+ gp->centers = NULL;
 }
 
 static void
 startover(ModeInfo * mi)
 {
  unistruct  *gp = &universes[MI_SCREEN(mi)];
- int         i, j; /* more tmp */
+ int         i, j, c; /* more tmp */
  double      w1, w2; /* more tmp */
  double      d, v, w, h; /* yet more tmp */
 
@@ -211,14 +246,11 @@ startover(ModeInfo * mi)
    gt->galcol += 2; /* Mult 8; 16..31 no green stars */
   /* Galaxies still may have some green stars but are not all green. */
 
-  if (gt->stars != NULL) {
-   (void) free((void *) gt->stars);
-   gt->stars = NULL;
+  if (gt->spos[0] != NULL) {
+   (void) free((void *) gt->spos[0]);
+   gt->spos[0] = NULL;
   }
   gt->nstars = (NRAND(MAX_STARS / 2)) + MAX_STARS / 2;
-  gt->stars = (Star *) malloc(gt->nstars * sizeof (Star));
-  gt->oldpoints = (XPoint *) malloc(gt->nstars * sizeof (XPoint));
-  gt->newpoints = (XPoint *) malloc(gt->nstars * sizeof (XPoint));
 
   w1 = 2.0 * M_PI * FLOATRAND;
   w2 = 2.0 * M_PI * FLOATRAND;
@@ -251,12 +283,21 @@ startover(ModeInfo * mi)
 
   gp->size = GALAXYRANGESIZE * FLOATRAND + GALAXYMINSIZE;
 
-  for (j = 0; j < gt->nstars; ++j) {
-   Star       *st = &gt->stars[j];
-   XPoint     *oldp = &gt->oldpoints[j];
-   XPoint     *newp = &gt->newpoints[j];
+  /* Without its stars, the galaxy still moves and pulls the others. */
+  gt->spos[0] = (float *) malloc(6 * gt->nstars * sizeof (float));
+  if (gt->spos[0] == NULL) {
+   gt->nstars = 0;
+   continue;
+  }
+  gt->spos[1] = gt->spos[0] + gt->nstars;
+  gt->spos[2] = gt->spos[1] + gt->nstars;
+  gt->svel[0] = gt->spos[2] + gt->nstars;
+  gt->svel[1] = gt->svel[0] + gt->nstars;
+  gt->svel[2] = gt->svel[1] + gt->nstars;
 
+  for (j = 0; j < gt->nstars; ++j) {
    double      sinw, cosw;
+   double      pos[3], vel[3];
 
    w = 2.0 * M_PI * FLOATRAND;
    sinw = SINF(w);
@@ -265,33 +306,60 @@ startover(ModeInfo * mi)
    h = FLOATRAND * exp(-2.0 * (d / gp->size)) / 5.0 * gp->size;
    if (FLOATRAND < 0.5)
     h = -h;
-   st->pos[0] = gp->mat[0][0] * d * cosw + gp->mat[1][0] * d * sinw +
+   pos[0] = gp->mat[0][0] * d * cosw + gp->mat[1][0] * d * sinw +
 gp->mat[2][0] * h + gt->pos[0];
-   st->pos[1] = gp->mat[0][1] * d * cosw + gp->mat[1][1] * d * sinw +
+   pos[1] = gp->mat[0][1] * d * cosw + gp->mat[1][1] * d * sinw +
 gp->mat[2][1] * h + gt->pos[1];
-   st->pos[2] = gp->mat[0][2] * d * cosw + gp->mat[1][2] * d * sinw +
+   pos[2] = gp->mat[0][2] * d * cosw + gp->mat[1][2] * d * sinw +
 gp->mat[2][2] * h + gt->pos[2];
 
    v = sqrt(gt->mass * QCONS / sqrt(d * d + h * h));
-   st->vel[0] = -gp->mat[0][0] * v * sinw + gp->mat[1][0] * v * cosw +
+   vel[0] = -gp->mat[0][0] * v * sinw + gp->mat[1][0] * v * cosw +
 gt->vel[0];
-   st->vel[1] = -gp->mat[0][1] * v * sinw + gp->mat[1][1] * v * cosw +
+   vel[1] = -gp->mat[0][1] * v * sinw + gp->mat[1][1] * v * cosw +
 gt->vel[1];
-   st->vel[2] = -gp->mat[0][2] * v * sinw + gp->mat[1][2] * v * cosw +
+   vel[2] = -gp->mat[0][2] * v * sinw + gp->mat[1][2] * v * cosw +
 gt->vel[2];
 
-   st->vel[0] *= DELTAT;
-   st->vel[1] *= DELTAT;
-   st->vel[2] *= DELTAT;
-
-   oldp->x = 0;
-   oldp->y = 0;
-   newp->x = 0;
-   newp->y = 0;
+   gt->spos[0][j] = pos[0];
+   gt->spos[1][j] = pos[1];
+   gt->spos[2][j] = pos[2];
+   gt->svel[0][j] = vel[0] * DELTAT;
+   gt->svel[1][j] = vel[1] * DELTAT;
+   gt->svel[2][j] = vel[2] * DELTAT;
   }
 
  }
 
+ /* Lay the stars out by color */
+ for (c = 0; c <= COLORBASE; c++)
+  gp->colstart[c] = 0;
+ for (i = 0; i < gp->ngalaxies; ++i)
+  gp->colstart[gp->galaxies[i].galcol + 1] += gp->galaxies[i].nstars;
+ for (c = 0; c < COLORBASE; c++)
+  gp->colstart[c + 1] += gp->colstart[c];
+ gp->npoints = gp->colstart[COLORBASE];
+ for (i = 0; i < gp->ngalaxies; ++i) {
+  Galaxy     *gt = &gp->galaxies[i];
+  gt->first = gp->colstart[gt->galcol];
+  gp->colstart[gt->galcol] += gt->nstars;
+ }
+ for (c = COLORBASE; c > 0; c--)
+  gp->colstart[c] = gp->colstart[c - 1];
+ gp->colstart[0] = 0;
+
+ if (gp->oldpoints != NULL)
+  (void) free((void *) gp->oldpoints);
+ if (gp->newpoints != NULL)
+  (void) free((void *) gp->newpoints);
+ if (gp->centers != NULL)
+  (void) free((void *) gp->centers);
+ gp->oldpoints = (XPoint *) calloc(gp->npoints + 1, sizeof (XPoint));
+ gp->newpoints = (XPoint *) calloc(gp->npoints + 1, sizeof (XPoint));
+ gp->centers = (Center *) malloc(2 * gp->ngalaxies * sizeof (Center));
+ if (gp->oldpoints == NULL || gp->newpoints == NULL || gp->centers == NULL)
+  gp->npoints = 0;
+
  XClearWindow(MI_DISPLAY(mi), MI_WINDOW(mi));
 
 #if 0
@@ -302,6 +370,153 @@ gp->f_hititerations);
 #endif /*0 */
 }
 
+/* Moves stars [j0, j1) of galaxy i one step, and projects them into
+   points.  Galaxies before i have already moved this step, and the rest
+   haven't, as when everything was moved one galaxy at a time. */
+static void
+move_stars(unistruct * gp, int i, int j0, int j1)
+{
+  Galaxy     *gt = &gp->galaxies[i];
+  const Center *moved = gp->centers;
+  const Center *unmoved = gp->centers + gp->ngalaxies;
+  float      *px = gt->spos[0], *py = gt->spos[1], *pz = gt->spos[2];
+  float      *vx = gt->svel[0], *vy = gt->svel[1], *vz = gt->svel[2];
+  XPoint     *newp = gp->newpoints + gt->first;
+  float       cox = gp->view[0], six = gp->view[1];
+  float       cor = gp->view[2], sir = gp->view[3];
+  float       scale = gp->scale;
+  int         j = j0, k;
+
+#ifdef __SSE2__
+  for (; j + 4 <= j1; j += 4) {
+    __m128      p0 = _mm_loadu_ps(px + j);
+    __m128      p1 = _mm_loadu_ps(py + j);
+    __m128      p2 = _mm_loadu_ps(pz + j);
+    __m128      v0 = _mm_loadu_ps(vx + j);
+    __m128      v1 = _mm_loadu_ps(vy + j);
+    __m128      v2 = _mm_loadu_ps(vz + j);
+    __m128      epsilon = _mm_set1_ps(EPSILON);
+    __m128      x, y, lo = _mm_set1_ps(-32768), hi = _mm_set1_ps(32767);
+    __m128i     ix, iy;
+
+    for (k = 0; k < gp->ngalaxies; ++k) {
+      const Center *c = (k < i ? moved : unmoved) + k;
+      __m128      d0 = _mm_sub_ps(_mm_set1_ps(c->pos[0]), p0);
+      __m128      d1 = _mm_sub_ps(_mm_set1_ps(c->pos[1]), p1);
+      __m128      d2 = _mm_sub_ps(_mm_set1_ps(c->pos[2]), p2);
+      __m128      d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d0, d0),
+                                            _mm_mul_ps(d1, d1)),
+                                 _mm_mul_ps(d2, d2));
+      __m128      far = _mm_cmpgt_ps(d, epsilon);
+      __m128      f = _mm_div_ps(_mm_set1_ps(c->pull),
+                                 _mm_mul_ps(d, _mm_sqrt_ps(d)));
+      f = _mm_or_ps(_mm_and_ps(far, f),
+                    _mm_andnot_ps(far, _mm_set1_ps(c->near_pull)));
+      v0 = _mm_add_ps(v0, _mm_mul_ps(d0, f));
+      v1 = _mm_add_ps(v1, _mm_mul_ps(d1, f));
+      v2 = _mm_add_ps(v2, _mm_mul_ps(d2, f));
+    }
+
+    p0 = _mm_add_ps(p0, v0);
+    p1 = _mm_add_ps(p1, v1);
+    p2 = _mm_add_ps(p2, v2);
+    _mm_storeu_ps(vx + j, v0);
+    _mm_storeu_ps(vy + j, v1);
+    _mm_storeu_ps(vz + j, v2);
+    _mm_storeu_ps(px + j, p0);
+    _mm_storeu_ps(py + j, p1);
+    _mm_storeu_ps(pz + j, p2);
+
+    x = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(cox), p0),
+                              _mm_mul_ps(_mm_set1_ps(six), p2)),
+                   _mm_set1_ps(scale));
+    y = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(cor), p1),
+                              _mm_mul_ps(_mm_set1_ps(sir),
+                                         _mm_add_ps(
+                                           _mm_mul_ps(_mm_set1_ps(six), p0),
+                                           _mm_mul_ps(_mm_set1_ps(cox), p2)))),
+                   _mm_set1_ps(scale));
+    ix = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(x, lo), hi));
+    iy = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(y, lo), hi));
+    ix = _mm_add_epi32(ix, _mm_set1_epi32(gp->midx));
+    iy = _mm_add_epi32(iy, _mm_set1_epi32(gp->midy));
+    ix = _mm_packs_epi32(ix, ix);
+    iy = _mm_packs_epi32(iy, iy);
+    /* XPoints are x, y pairs of shorts */
+    _mm_storeu_si128((__m128i *) (newp + j), _mm_unpacklo_epi16(ix, iy));
+  }
+#endif /* __SSE2__ */
+
+  for (; j < j1; ++j) {
+    float       v0 = vx[j], v1 = vy[j], v2 = vz[j];
+    float       x, y;
+    int         ix, iy;
+
+    for (k = 0; k < gp->ngalaxies; ++k) {
+      const Center *c = (k < i ? moved : unmoved) + k;
+      float       d0 = c->pos[0] - px[j];
+      float       d1 = c->pos[1] - py[j];
+      float       d2 = c->pos[2] - pz[j];
+      float       d = d0 * d0 + d1 * d1 + d2 * d2;
+
+      if (d > (float) EPSILON)
+        d = c->pull / (d * (float) sqrt(d));
+      else
+        d = c->near_pull;
+      v0 += d0 * d;
+      v1 += d1 * d;
+      v2 += d2 * d;
+    }
+
+    vx[j] = v0;
+    vy[j] = v1;
+    vz[j] = v2;
+
+    px[j] += v0;
+    py[j] += v1;
+    pz[j] += v2;
+
+    x = ((cox * px[j]) - (six * pz[j])) * scale;
+    y = ((cor * py[j]) - (sir * ((six * px[j]) + (cox * pz[j])))) * scale;
+    ix = (int) (x < -32768 ? -32768 : x > 32767 ? 32767 : x) + gp->midx;
+    iy = (int) (y < -32768 ? -32768 : y > 32767 ? 32767 : y) + gp->midy;
+    newp[j].x = (ix < -32768 ? -32768 : ix > 32767 ? 32767 : ix);
+    newp[j].y = (iy < -32768 ? -32768 : iy > 32767 ? 32767 : iy);
+  }
+}
+
+
+/* Each thread moves the stars of its own run of galaxies. */
+static void
+galaxy_thread_run(void *self_raw)
+{
+  struct galaxy_thread *self = (struct galaxy_thread *) self_raw;
+  unistruct  *gp = self->gp;
+  int         i0 = gp->ngalaxies * (int) self->id / gp->nthreads;
+  int         i1 = gp->ngalaxies * (int) (self->id + 1) / gp->nthreads;
+  int         i;
+
+  for (i = i0; i < i1; ++i)
+    move_stars(gp, i, 0, gp->galaxies[i].nstars);
+}
+
+
+static int
+galaxy_thread_create(void *self_raw, struct threadpool *pool, unsigned id)
+{
+  struct galaxy_thread *self = (struct galaxy_thread *) self_raw;
+  self->gp = GET_PARENT_OBJ(unistruct, threadpool, pool);
+  self->id = id;
+  return 0;
+}
+
+
+static void
+galaxy_thread_destroy(void *self_raw)
+{
+}
+
+
 ENTRYPOINT void
 init_galaxy(ModeInfo * mi)
 {
@@ -323,6 +538,20 @@ init_galaxy(ModeInfo * mi)
  gp->scale = (double) (MI_WIN_WIDTH(mi) + MI_WIN_HEIGHT(mi)) / 8.0;
  gp->midx =  MI_WIN_WIDTH(mi)  / 2;
  gp->midy =  MI_WIN_HEIGHT(mi) / 2;
+
+ if (!gp->threaded) {
+  static const struct threadpool_class cls = {
+   sizeof(struct galaxy_thread),
+   galaxy_thread_create,
+   galaxy_thread_destroy
+  };
+
+  if (threadpool_create(&gp->threadpool, &cls, MI_DISPLAY(mi),
+                        hardware_concurrency(MI_DISPLAY(mi))))
+   gp->threadpool.count = 0; /* See the note in thread_util.h. */
+  gp->threaded = True;
+ }
+
  startover(mi);
 }
 
@@ -334,8 +563,9 @@ draw_galaxy(ModeInfo * mi)
   GC          gc = MI_GC(mi);
   unistruct  *gp = &universes[MI_SCREEN(mi)];
   double      d, eps, cox, six, cor, sir;  /* tmp */
-  int         i, j, k; /* more tmp */
+  int         i, k; /* more tmp */
   XPoint    *dummy = NULL;
+  long        pairs = 0;
 
   if (! dbufp)
     XClearWindow(MI_DISPLAY(mi), MI_WINDOW(mi));
@@ -352,47 +582,21 @@ draw_galaxy(ModeInfo * mi)
 
   eps = 1/(EPSILON * sqrt_EPSILON * DELTAT * DELTAT * QCONS);
 
+  if (gp->centers == NULL || gp->newpoints == NULL || gp->oldpoints == NULL)
+    return;
+
+  /* The galaxies pull on each other, not on the stars, so they can all be
+     moved first. */
   for (i = 0; i < gp->ngalaxies; ++i) {
     Galaxy     *gt = &gp->galaxies[i];
+    Center     *c = &gp->centers[gp->ngalaxies + i];
 
-    for (j = 0; j < gp->galaxies[i].nstars; ++j) {
-      Star       *st = &gt->stars[j];
-      XPoint     *newp = &gt->newpoints[j];
-      double      v0 = st->vel[0];
-      double      v1 = st->vel[1];
-      double      v2 = st->vel[2];
-
-      for (k = 0; k < gp->ngalaxies; ++k) {
-        Galaxy     *gtk = &gp->galaxies[k];
-        double      d0 = gtk->pos[0] - st->pos[0];
-        double      d1 = gtk->pos[1] - st->pos[1];
-        double      d2 = gtk->pos[2] - st->pos[2];
-
-        d = d0 * d0 + d1 * d1 + d2 * d2;
-        if (d > EPSILON)
-          d = gtk->mass / (d * sqrt(d)) * DELTAT * DELTAT * QCONS;
-        else
-          d = gtk->mass / (eps * sqrt(eps));
-        v0 += d0 * d;
-        v1 += d1 * d;
-        v2 += d2 * d;
-      }
-
-      st->vel[0] = v0;
-      st->vel[1] = v1;
-      st->vel[2] = v2;
-
-      st->pos[0] += v0;
-      st->pos[1] += v1;
-      st->pos[2] += v2;
-
-      newp->x = (short) (((cox * st->pos[0]) - (six * st->pos[2])) *
-                         gp->scale) + gp->midx;
-      newp->y = (short) (((cor * st->pos[1]) - (sir * ((six * st->pos[0]) +
-                                                       (cox * st->pos[2]))))
-                         * gp->scale) + gp->midy;
-
-    }
+    c->pos[0] = gt->pos[0];
+    c->pos[1] = gt->pos[1];
+    c->pos[2] = gt->pos[2];
+    c->pull = gt->mass * DELTAT * DELTAT * QCONS;
+    c->near_pull = gt->mass / (eps * sqrt(eps));
+    pairs += (long) gt->nstars * gp->ngalaxies;
 
     for (k = i + 1; k < gp->ngalaxies; ++k) {
       Galaxy     *gtk = &gp->galaxies[k];
@@ -421,20 +625,46 @@ draw_galaxy(ModeInfo * mi)
     gt->pos[1] += gt->vel[1] * DELTAT;
     gt->pos[2] += gt->vel[2] * DELTAT;
 
-    if (dbufp) {
-      XSetForeground(display, gc, MI_WIN_BLACK_PIXEL(mi));
-      XDrawPoints(display, window, gc, gt->oldpoints, gt->nstars,
-                  CoordModeOrigin);
-    }
-    XSetForeground(display, gc, MI_PIXEL(mi, COLORSTEP * gt->galcol));
-    XDrawPoints(display, window, gc, gt->newpoints, gt->nstars,
+    c = &gp->centers[i];
+    *c = gp->centers[gp->ngalaxies + i];
+    c->pos[0] = gt->pos[0];
+    c->pos[1] = gt->pos[1];
+    c->pos[2] = gt->pos[2];
+  }
+
+  gp->view[0] = cox;
+  gp->view[1] = six;
+  gp->view[2] = cor;
+  gp->view[3] = sir;
+
+  if (gp->threadpool.count > 1 && gp->ngalaxies > 1 && pairs >= THREAD_PAIRS) {
+    gp->nthreads = gp->threadpool.count;
+    threadpool_run(&gp->threadpool, galaxy_thread_run);
+    threadpool_wait(&gp->threadpool);
+  } else {
+    for (i = 0; i < gp->ngalaxies; ++i)
+      move_stars(gp, i, 0, gp->galaxies[i].nstars);
+  }
+
+  if (dbufp) {
+    XSetForeground(display, gc, MI_WIN_BLACK_PIXEL(mi));
+    XDrawPoints(display, window, gc, gp->oldpoints, gp->npoints,
                 CoordModeOrigin);
+  }
+  for (i = 0; i < COLORBASE; ++i) {
+    int         n = gp->colstart[i + 1] - gp->colstart[i];
 
-    dummy = gt->oldpoints;
-    gt->oldpoints = gt->newpoints;
-    gt->newpoints = dummy;
+    if (n == 0)
+      continue;
+    XSetForeground(display, gc, MI_PIXEL(mi, COLORSTEP * i));
+    XDrawPoints(display, window, gc, gp->newpoints + gp->colstart[i], n,
+                CoordModeOrigin);
   }
 
+  dummy = gp->oldpoints;
+  gp->oldpoints = gp->newpoints;
+  gp->newpoints = dummy;
+
   gp->step++;
   if (gp->step > gp->f_hititerations * 4)
     startover(mi);
@@ -453,8 +683,13 @@ release_galaxy(ModeInfo * mi)
  if (universes != NULL) {
   int         screen;
 
-  for (screen = 0; screen < MI_NUM_SCREENS(mi); screen++)
-   free_galaxies(&universes[screen]);
+  for (screen = 0; screen < MI_NUM_SCREENS(mi); screen++) {
+   unistruct  *gp = &universes[screen];
+
+   if (gp->threaded && gp->threadpool.count)
+    threadpool_destroy(&gp->threadpool);
+   free_galaxies(gp);
+  }
   (void) free((void *) universes);
   universes = NULL;
  }
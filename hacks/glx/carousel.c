@@ -19,6 +19,7 @@
                   "*showFPS:         False     \n" \
 	          "*fpsSolid:        True      \n" \
 	          "*useSHM:          True      \n" \
+	          "*preloadImages:   1         \n" \
 		  "*font:	   " DEF_FONT "\n" \
                   "*desktopGrabber:  xscreensaver-getimage -no-desktop %s\n" \
 		  "*grabDesktopImages:   False \n" \
@@ -139,6 +140,7 @@ static XrmOptionDescRec opts[] = {
   {"-mipmaps",      ".mipmap",        XrmoptionNoArg, "True"  },
   {"-no-mipmaps",   ".mipmap",        XrmoptionNoArg, "False" },
   {"-duration",	    ".duration",      XrmoptionSepArg, 0 },
+  {"-preload",      ".preloadImages", XrmoptionSepArg, 0 },
   {"-debug",        ".debug",         XrmoptionNoArg, "True"  },
   {"-font",         ".font",          XrmoptionSepArg, 0 },
   {"-speed",        ".speed",         XrmoptionSepArg, 0 },
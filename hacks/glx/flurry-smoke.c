@@ -56,14 +56,16 @@ void InitSmoke(SmokeV *s)
     }
 }
 
-void UpdateSmoke_ScalarBase(global_info_t *global, flurry_info_t *flurry, SmokeV *s)
+/* Releases this frame's puffs, and returns the frame rate modifier.
+   This part is the same for the scalar and vector versions of UpdateSmoke.
+ */
+static double UpdateSmoke_Emit(global_info_t *global, flurry_info_t *flurry, SmokeV *s)
 {
-    int i,j,k;
+    int i;
     float sx = flurry->star->position[0];
     float sy = flurry->star->position[1];
     float sz = flurry->star->position[2];
     double frameRate;
-    double frameRateModifier;
 
 
     s->frame++;
@@ -137,7 +139,13 @@ void UpdateSmoke_ScalarBase(global_info_t *global, flurry_info_t *flurry, SmokeV
     }
     
     frameRate = ((double) flurry->dframe)/(flurry->fTime);
-    frameRateModifier = 42.5f / frameRate;
+    return 42.5f / frameRate;
+}
+
+void UpdateSmoke_ScalarBase(global_info_t *global, flurry_info_t *flurry, SmokeV *s)
+{
+    int i,j,k;
+    double frameRateModifier = UpdateSmoke_Emit(global, flurry, s);
 
     for(i=0;i<NUMSMOKEPARTICLES/4;i++) {        
         for(k=0; k<4; k++) {
@@ -198,6 +206,194 @@ void UpdateSmoke_ScalarBase(global_info_t *global, flurry_info_t *flurry, SmokeV
     }
 }
 
+#ifdef OPT_MODE_VECTOR_SSE
+
+/* SSE2 version of UpdateSmoke_ScalarBase.  The particles are already
+   stored four to a SmokeParticleV, so each field is one __m128.  Dead
+   lanes are computed along with the live ones and then masked out.
+ */
+void UpdateSmoke_SSE(global_info_t *global, flurry_info_t *flurry, SmokeV *s)
+{
+    int i,j;
+    double frameRateModifier = UpdateSmoke_Emit(global, flurry, s);
+    int numStreams = flurry->numStreams;
+    __m128 gravityV = _mm_set1_ps((float) (gravity * frameRateModifier));
+    __m128 biasV = _mm_set1_ps(streamBias);
+    __m128 oneV = _mm_set1_ps(1.0f);
+    __m128 dragV = _mm_set1_ps(flurry->drag);
+    __m128 deltaTimeV = _mm_set1_ps((float) flurry->fDeltaTime);
+    __m128 maxSpeedV = _mm_set1_ps(25000000.0f);
+    __m128i zeroI = _mm_setzero_si128();
+    __m128i oneI = _mm_set1_epi32(1);
+
+    for(i=0;i<NUMSMOKEPARTICLES/4;i++) {
+        SmokeParticleV *p = &s->p[i];
+        __m128 px, py, pz, deltax, deltay, deltaz, stream, speed, alive;
+        __m128i dead, live, slow;
+
+        if (p->dead.i[0] && p->dead.i[1] && p->dead.i[2] && p->dead.i[3]) {
+            continue;
+        }
+
+        dead = _mm_loadu_si128((__m128i *) p->dead.i);
+        px = _mm_loadu_ps(p->position[0].f);
+        py = _mm_loadu_ps(p->position[1].f);
+        pz = _mm_loadu_ps(p->position[2].f);
+        deltax = _mm_loadu_ps(p->delta[0].f);
+        deltay = _mm_loadu_ps(p->delta[1].f);
+        deltaz = _mm_loadu_ps(p->delta[2].f);
+
+        /* which stream each lane is biased towards */
+        stream = _mm_set_ps((float) ((i*4+3) % numStreams),
+                            (float) ((i*4+2) % numStreams),
+                            (float) ((i*4+1) % numStreams),
+                            (float) ((i*4+0) % numStreams));
+
+        for(j=0;j<numStreams;j++) {
+            Spark *spark = flurry->spark[j];
+            __m128 dx = _mm_sub_ps(px, _mm_set1_ps(spark->position[0]));
+            __m128 dy = _mm_sub_ps(py, _mm_set1_ps(spark->position[1]));
+            __m128 dz = _mm_sub_ps(pz, _mm_set1_ps(spark->position[2]));
+            __m128 rsquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx),
+                                                    _mm_mul_ps(dy, dy)),
+                                         _mm_mul_ps(dz, dz));
+            __m128 bias = _mm_and_ps(_mm_cmpeq_ps(stream, _mm_set1_ps((float) j)),
+                                     biasV);
+            __m128 f = _mm_mul_ps(_mm_div_ps(gravityV, rsquared),
+                                  _mm_add_ps(oneV, bias));
+            __m128 mag = _mm_div_ps(f, _mm_sqrt_ps(rsquared));
+
+            deltax = _mm_sub_ps(deltax, _mm_mul_ps(dx, mag));
+            deltay = _mm_sub_ps(deltay, _mm_mul_ps(dy, mag));
+            deltaz = _mm_sub_ps(deltaz, _mm_mul_ps(dz, mag));
+        }
+
+        /* slow these particles down by flurry->drag */
+        deltax = _mm_mul_ps(deltax, dragV);
+        deltay = _mm_mul_ps(deltay, dragV);
+        deltaz = _mm_mul_ps(deltaz, dragV);
+
+        /* kill the ones going too fast; leave the dead ones alone */
+        speed = _mm_add_ps(_mm_add_ps(_mm_mul_ps(deltax, deltax),
+                                      _mm_mul_ps(deltay, deltay)),
+                           _mm_mul_ps(deltaz, deltaz));
+        live = _mm_cmpeq_epi32(dead, zeroI);
+        slow = _mm_castps_si128(_mm_cmplt_ps(speed, maxSpeedV));
+        dead = _mm_or_si128(dead, _mm_and_si128(_mm_andnot_si128(slow, live),
+                                                oneI));
+        _mm_storeu_si128((__m128i *) p->dead.i, dead);
+        alive = _mm_castsi128_ps(_mm_and_si128(live, slow));
+
+# define SELECT(M,A,B) _mm_or_ps(_mm_and_ps((M),(A)), _mm_andnot_ps((M),(B)))
+        /* update the position */
+        _mm_storeu_ps(p->delta[0].f, SELECT(alive, deltax, _mm_loadu_ps(p->delta[0].f)));
+        _mm_storeu_ps(p->delta[1].f, SELECT(alive, deltay, _mm_loadu_ps(p->delta[1].f)));
+        _mm_storeu_ps(p->delta[2].f, SELECT(alive, deltaz, _mm_loadu_ps(p->delta[2].f)));
+        _mm_storeu_ps(p->oldposition[0].f, SELECT(alive, px, _mm_loadu_ps(p->oldposition[0].f)));
+        _mm_storeu_ps(p->oldposition[1].f, SELECT(alive, py, _mm_loadu_ps(p->oldposition[1].f)));
+        _mm_storeu_ps(p->oldposition[2].f, SELECT(alive, pz, _mm_loadu_ps(p->oldposition[2].f)));
+        _mm_storeu_ps(p->position[0].f, _mm_add_ps(px, _mm_and_ps(alive, _mm_mul_ps(deltax, deltaTimeV))));
+        _mm_storeu_ps(p->position[1].f, _mm_add_ps(py, _mm_and_ps(alive, _mm_mul_ps(deltay, deltaTimeV))));
+        _mm_storeu_ps(p->position[2].f, _mm_add_ps(pz, _mm_and_ps(alive, _mm_mul_ps(deltaz, deltaTimeV))));
+# undef SELECT
+    }
+}
+
+#endif /* OPT_MODE_VECTOR_SSE */
+
+#ifdef OPT_MODE_VECTOR_NEON
+
+/* NEON version of UpdateSmoke_ScalarBase; see UpdateSmoke_SSE.
+ */
+void UpdateSmoke_NEON(global_info_t *global, flurry_info_t *flurry, SmokeV *s)
+{
+    int i,j;
+    double frameRateModifier = UpdateSmoke_Emit(global, flurry, s);
+    int numStreams = flurry->numStreams;
+    float32x4_t gravityV = vdupq_n_f32((float) (gravity * frameRateModifier));
+    float32x4_t oneV = vdupq_n_f32(1.0f);
+    float32x4_t biasV = vdupq_n_f32(streamBias);
+    float32x4_t dragV = vdupq_n_f32(flurry->drag);
+    float32x4_t deltaTimeV = vdupq_n_f32((float) flurry->fDeltaTime);
+    float32x4_t maxSpeedV = vdupq_n_f32(25000000.0f);
+    uint32x4_t zeroI = vdupq_n_u32(0);
+    uint32x4_t oneI = vdupq_n_u32(1);
+
+    for(i=0;i<NUMSMOKEPARTICLES/4;i++) {
+        SmokeParticleV *p = &s->p[i];
+        float32x4_t px, py, pz, deltax, deltay, deltaz, stream, speed;
+        uint32x4_t dead, live, slow, alive;
+        float lanes[4];
+        int k;
+
+        if (p->dead.i[0] && p->dead.i[1] && p->dead.i[2] && p->dead.i[3]) {
+            continue;
+        }
+
+        dead = vld1q_u32(p->dead.i);
+        px = vld1q_f32(p->position[0].f);
+        py = vld1q_f32(p->position[1].f);
+        pz = vld1q_f32(p->position[2].f);
+        deltax = vld1q_f32(p->delta[0].f);
+        deltay = vld1q_f32(p->delta[1].f);
+        deltaz = vld1q_f32(p->delta[2].f);
+
+        /* which stream each lane is biased towards */
+        for(k=0;k<4;k++) {
+            lanes[k] = (float) ((i*4+k) % numStreams);
+        }
+        stream = vld1q_f32(lanes);
+
+        for(j=0;j<numStreams;j++) {
+            Spark *spark = flurry->spark[j];
+            float32x4_t dx = vsubq_f32(px, vdupq_n_f32(spark->position[0]));
+            float32x4_t dy = vsubq_f32(py, vdupq_n_f32(spark->position[1]));
+            float32x4_t dz = vsubq_f32(pz, vdupq_n_f32(spark->position[2]));
+            float32x4_t rsquared = vaddq_f32(vaddq_f32(vmulq_f32(dx, dx),
+                                                       vmulq_f32(dy, dy)),
+                                             vmulq_f32(dz, dz));
+            uint32x4_t biased = vceqq_f32(stream, vdupq_n_f32((float) j));
+            float32x4_t bias = vreinterpretq_f32_u32(
+                vandq_u32(biased, vreinterpretq_u32_f32(biasV)));
+            float32x4_t f = vmulq_f32(vdivq_f32(gravityV, rsquared),
+                                      vaddq_f32(oneV, bias));
+            float32x4_t mag = vdivq_f32(f, vsqrtq_f32(rsquared));
+
+            deltax = vsubq_f32(deltax, vmulq_f32(dx, mag));
+            deltay = vsubq_f32(deltay, vmulq_f32(dy, mag));
+            deltaz = vsubq_f32(deltaz, vmulq_f32(dz, mag));
+        }
+
+        /* slow these particles down by flurry->drag */
+        deltax = vmulq_f32(deltax, dragV);
+        deltay = vmulq_f32(deltay, dragV);
+        deltaz = vmulq_f32(deltaz, dragV);
+
+        /* kill the ones going too fast; leave the dead ones alone */
+        speed = vaddq_f32(vaddq_f32(vmulq_f32(deltax, deltax),
+                                    vmulq_f32(deltay, deltay)),
+                          vmulq_f32(deltaz, deltaz));
+        live = vceqq_u32(dead, zeroI);
+        slow = vcltq_f32(speed, maxSpeedV);
+        dead = vorrq_u32(dead, vandq_u32(vbicq_u32(live, slow), oneI));
+        vst1q_u32(p->dead.i, dead);
+        alive = vandq_u32(live, slow);
+
+        /* update the position */
+        vst1q_f32(p->delta[0].f, vbslq_f32(alive, deltax, vld1q_f32(p->delta[0].f)));
+        vst1q_f32(p->delta[1].f, vbslq_f32(alive, deltay, vld1q_f32(p->delta[1].f)));
+        vst1q_f32(p->delta[2].f, vbslq_f32(alive, deltaz, vld1q_f32(p->delta[2].f)));
+        vst1q_f32(p->oldposition[0].f, vbslq_f32(alive, px, vld1q_f32(p->oldposition[0].f)));
+        vst1q_f32(p->oldposition[1].f, vbslq_f32(alive, py, vld1q_f32(p->oldposition[1].f)));
+        vst1q_f32(p->oldposition[2].f, vbslq_f32(alive, pz, vld1q_f32(p->oldposition[2].f)));
+        vst1q_f32(p->position[0].f, vbslq_f32(alive, vaddq_f32(px, vmulq_f32(deltax, deltaTimeV)), px));
+        vst1q_f32(p->position[1].f, vbslq_f32(alive, vaddq_f32(py, vmulq_f32(deltay, deltaTimeV)), py));
+        vst1q_f32(p->position[2].f, vbslq_f32(alive, vaddq_f32(pz, vmulq_f32(deltaz, deltaTimeV)), pz));
+    }
+}
+
+#endif /* OPT_MODE_VECTOR_NEON */
+
 #if 0
 #ifdef __ppc__
 
@@ -124,6 +124,25 @@ static int IsAltiVecAvailable(void)
 #endif
 #endif
 
+#ifdef OPT_MODE_VECTOR_SSE
+static int IsSSE2Available(void)
+{
+# if defined(__GNUC__) && !defined(__clang__) && defined(__i386__)
+    /* 32-bit builds might have been compiled with -msse2 for a newer box. */
+    return __builtin_cpu_supports("sse2");
+# else
+    return 1;  /* always there on x86_64 */
+# endif
+}
+#endif
+
+#ifdef OPT_MODE_VECTOR_NEON
+static int IsNEONAvailable(void)
+{
+    return 1;  /* always there on aarch64 */
+}
+#endif
+
 
 static
 void delete_flurry_info(flurry_info_t *flurry)
@@ -221,6 +240,14 @@ void GLSetupRC(global_info_t *global)
     global->optMode = OPT_MODE_SCALAR_BASE;
 #endif
 #endif /* 0 */
+
+    global->optMode = OPT_MODE_SCALAR_BASE;
+#ifdef OPT_MODE_VECTOR_SSE
+    if (IsSSE2Available()) global->optMode = OPT_MODE_VECTOR_SSE;
+#endif
+#ifdef OPT_MODE_VECTOR_NEON
+    if (IsNEONAvailable()) global->optMode = OPT_MODE_VECTOR_NEON;
+#endif
 }
 
 static
@@ -259,6 +286,16 @@ void GLRenderScene(global_info_t *global, flurry_info_t *flurry, double b)
 	case OPT_MODE_SCALAR_BASE:
 	    UpdateSmoke_ScalarBase(global, flurry, flurry->s);
 	    break;
+#ifdef OPT_MODE_VECTOR_SSE
+	case OPT_MODE_VECTOR_SSE:
+	    UpdateSmoke_SSE(global, flurry, flurry->s);
+	    break;
+#endif
+#ifdef OPT_MODE_VECTOR_NEON
+	case OPT_MODE_VECTOR_NEON:
+	    UpdateSmoke_NEON(global, flurry, flurry->s);
+	    break;
+#endif
 #if 0
 #ifdef __ppc__
 	case OPT_MODE_SCALAR_FRSQRTE:
@@ -286,6 +323,12 @@ void GLRenderScene(global_info_t *global, flurry_info_t *flurry, double b)
 
     switch(global->optMode) {
 	case OPT_MODE_SCALAR_BASE:
+#ifdef OPT_MODE_VECTOR_SSE
+	case OPT_MODE_VECTOR_SSE:
+#endif
+#ifdef OPT_MODE_VECTOR_NEON
+	case OPT_MODE_VECTOR_NEON:
+#endif
 #if 0
 #ifdef __ppc__
 	case OPT_MODE_SCALAR_FRSQRTE:
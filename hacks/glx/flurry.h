@@ -53,6 +53,13 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdlib.h>
 #include <math.h>
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+# include <arm_neon.h>
+#endif
+
 #include "yarandom.h"
 #include "rotator.h"
 #include "gltrackball.h"
@@ -135,6 +142,13 @@ void UpdateSmoke_VectorUnrolled(global_info_t *global, flurry_info_t *flurry, Sm
 #endif
 #endif /* 0 */
 
+#ifdef __SSE2__
+void UpdateSmoke_SSE(global_info_t *global, flurry_info_t *flurry, SmokeV *s);
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+void UpdateSmoke_NEON(global_info_t *global, flurry_info_t *flurry, SmokeV *s);
+#endif
+
 void DrawSmoke_Scalar(global_info_t *global, flurry_info_t *flurry, SmokeV *s, float);
 void DrawSmoke_Vector(global_info_t *global, flurry_info_t *flurry, SmokeV *s, float);
 
@@ -215,6 +229,14 @@ void MakeTexture(void);
 
 #define OPT_MODE_SCALAR_BASE		0x0
 
+#ifdef __SSE2__
+#define OPT_MODE_VECTOR_SSE		0x4
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define OPT_MODE_VECTOR_NEON		0x5
+#endif
+
 #if 0
 #ifdef __ppc__
 #define OPT_MODE_SCALAR_FRSQRTE		0x1
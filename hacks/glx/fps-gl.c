@@ -34,6 +34,68 @@ extern void clear_gl_error (void);
 extern void check_gl_error (const char *type);
 
 
+/* GL_ARB_timer_query / GL_EXT_timer_query let us ask how long the GPU
+   spent on a frame without stalling the pipeline.  Without them, we
+   bracket the frame with glFinish instead, which costs some throughput.
+ */
+#if defined(GL_EXT_timer_query) && !defined(HAVE_COCOA) && \
+    !defined(HAVE_JWZGLES) && defined(GLX_ARB_get_proc_address)
+# define USE_TIMER_QUERY
+static PFNGLGENQUERIESPROC               gen_queries_fn;
+static PFNGLBEGINQUERYPROC               begin_query_fn;
+static PFNGLENDQUERYPROC                 end_query_fn;
+static PFNGLGETQUERYOBJECTUI64VEXTPROC   get_query_ui64_fn;
+#endif /* USE_TIMER_QUERY */
+
+
+static double
+double_time (void)
+{
+  struct timeval now;
+# ifdef GETTIMEOFDAY_TWO_ARGS
+  struct timezone tzp;
+  gettimeofday(&now, &tzp);
+# else
+  gettimeofday(&now);
+# endif
+
+  return (now.tv_sec + ((double) now.tv_usec * 0.000001));
+}
+
+
+static void
+gpu_timer_init (fps_state *st)
+{
+# ifdef USE_TIMER_QUERY
+  const char *ext = (const char *) glGetString (GL_EXTENSIONS);
+#  define PROC(S) glXGetProcAddressARB ((const GLubyte *) (S))
+
+  if (! ext) return;
+  if (!strstr (ext, "GL_ARB_timer_query") &&
+      !strstr (ext, "GL_EXT_timer_query"))
+    return;
+
+  gen_queries_fn = (PFNGLGENQUERIESPROC) PROC ("glGenQueries");
+  begin_query_fn = (PFNGLBEGINQUERYPROC) PROC ("glBeginQuery");
+  end_query_fn   = (PFNGLENDQUERYPROC)   PROC ("glEndQuery");
+  get_query_ui64_fn = (PFNGLGETQUERYOBJECTUI64VEXTPROC)
+    PROC ("glGetQueryObjectui64v");
+  if (! get_query_ui64_fn)
+    get_query_ui64_fn = (PFNGLGETQUERYOBJECTUI64VEXTPROC)
+      PROC ("glGetQueryObjectui64vEXT");
+#  undef PROC
+
+  if (!gen_queries_fn || !begin_query_fn || !end_query_fn ||
+      !get_query_ui64_fn)
+    return;
+
+  gen_queries_fn (2, st->gpu_queries);
+  st->gpu_timer_p = True;
+  check_gl_error ("glGenQueries");
+# endif /* USE_TIMER_QUERY */
+}
+
+
 static void
 xlockmore_gl_fps_init (fps_state *st)
 {
@@ -57,6 +119,39 @@ xlockmore_gl_fps_init (fps_state *st)
   st->gl_fps_data = load_texture_font (st->dpy, "fpsFont");
 
 #endif /* !HAVE_GLBITMAP */
+
+  gpu_timer_init (st);
+}
+
+
+/* Called from xlockmore.c before each frame is drawn.
+ */
+void
+xlockmore_gl_fps_frame_start (ModeInfo *mi)
+{
+  fps_state *st = mi->fpst;
+  if (! st) return;  /* too early */
+
+# ifdef USE_TIMER_QUERY
+  if (st->gpu_timer_p)
+    {
+      /* Collect the query we issued two frames ago before reusing it.
+         That frame has been swapped since, so this shouldn't stall.
+       */
+      GLuint q = st->gpu_queries[st->gpu_query_frame & 1];
+      if (st->gpu_query_frame >= 2)
+        {
+          GLuint64EXT ns = 0;
+          get_query_ui64_fn (q, GL_QUERY_RESULT, &ns);
+          st->gpu_time += ns * 0.000000001;
+          st->gpu_frames++;
+        }
+      begin_query_fn (GL_TIME_ELAPSED_EXT, q);
+    }
+# endif /* USE_TIMER_QUERY */
+
+  st->frame_start = double_time();
+  st->submit_end  = 0;
 }
 
 
@@ -74,6 +169,23 @@ xlockmore_gl_compute_fps (Display *dpy, Window w, fps_state *fpst,
       xlockmore_gl_fps_init (fpst);
     }
 
+  /* The hack has returned, so glXSwapBuffers is done too. */
+  if (fpst->frame_start > 0 && fpst->submit_end > 0)
+    {
+      fpst->cpu_time  += fpst->submit_end - fpst->frame_start;
+      fpst->swap_time += double_time() - fpst->swap_start;
+      fpst->timed_frames++;
+    }
+# ifdef USE_TIMER_QUERY
+  else if (fpst->frame_start > 0 && fpst->gpu_timer_p)
+    {
+      /* This hack never called do_fps, so close the query here. */
+      end_query_fn (GL_TIME_ELAPSED_EXT);
+      fpst->gpu_query_frame++;
+    }
+# endif /* USE_TIMER_QUERY */
+  fpst->frame_start = 0;
+
   fps_compute (fpst, mi->polygon_count, mi->recursion_depth);
 }
 
@@ -92,6 +204,27 @@ xlockmore_gl_draw_fps (ModeInfo *mi)
       int lh = st->font->ascent + st->font->descent;
       int y = st->y;
 
+      /* Everything the hack submitted for this frame ends here, before
+         the overlay and the swap.
+       */
+      if (st->frame_start > 0)
+        {
+          st->submit_end = double_time();
+# ifdef USE_TIMER_QUERY
+          if (st->gpu_timer_p)
+            {
+              end_query_fn (GL_TIME_ELAPSED_EXT);
+              st->gpu_query_frame++;
+            }
+          else
+# endif /* USE_TIMER_QUERY */
+            {
+              glFinish();
+              st->gpu_time += double_time() - st->submit_end;
+              st->gpu_frames++;
+            }
+        }
+
       XGetWindowAttributes (st->dpy, st->window, &xgwa);
       for (s = st->string; *s; s++) 
         if (*s == '\n') lines++;
@@ -109,5 +242,7 @@ xlockmore_gl_draw_fps (ModeInfo *mi)
 # endif /* !HAVE_GLBITMAP */
                        xgwa.width, xgwa.height,
                        st->x, y, st->string, st->clear_p);
+
+      st->swap_start = double_time();
     }
 }
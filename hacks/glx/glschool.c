@@ -10,14 +10,15 @@
  */
 #include "xlockmore.h"
 #include "glschool.h"
+#include "thread_util.h"
 
 #define sws_opts			xlockmore_opts
 #define DEFAULTS    "*delay:		20000       \n" \
                     "*showFPS:      False       \n" \
                     "*wireframe:    False       \n" \
+                    "*useThreads:   True        \n" \
 
 #define refresh_glschool		(0)
-#define release_glschool		(0)
 #define glschool_handle_event	(0)
 
 #undef countof
@@ -77,6 +78,7 @@ static XrmOptionDescRec opts[] = {
 	{ "-minradius",	".minradius",	XrmoptionSepArg, 0 },
 	{ "-distcomp",	".distcomp",	XrmoptionSepArg, 0 },
 	{ "-momentum",	".momentum",	XrmoptionSepArg, 0 },
+	THREAD_OPTIONS
 };
 
 static argtype vars[] = {
@@ -113,10 +115,56 @@ typedef struct {
 	XColor		*colors;
 	School		*school;
 	GLXContext	*context;
+	struct threadpool	threadpool;
 } glschool_configuration;
 
+/* Each thread computes the accelerations for one contiguous band of fish. */
+typedef struct {
+	glschool_configuration	*sc;
+	unsigned				id;
+} glschool_thread;
+
 static glschool_configuration	*scs = NULL;
 
+static int
+glschool_thread_create(void *self_raw, struct threadpool *pool, unsigned id)
+{
+	glschool_thread	*self = (glschool_thread *)self_raw;
+
+	self->sc = GET_PARENT_OBJ(glschool_configuration, threadpool, pool);
+	self->id = id;
+	return 0;
+}
+
+static void
+glschool_thread_destroy(void *self_raw)
+{
+}
+
+static void
+glschool_thread_run(void *self_raw)
+{
+	glschool_thread	*self = (glschool_thread *)self_raw;
+	School			*school = self->sc->school;
+	unsigned		count = self->sc->threadpool.count;
+	int				nFish = SCHOOL_NFISH(school);
+
+	glschool_computeAccelerationsRange(school,
+		(int)(nFish * self->id / count), (int)(nFish * (self->id + 1) / count));
+}
+
+static void
+computeAccelerations(glschool_configuration *sc)
+{
+	if (sc->threadpool.count > 1) {
+		glschool_buildGrid(sc->school);
+		threadpool_run(&sc->threadpool, glschool_thread_run);
+		threadpool_wait(&sc->threadpool);
+	} else {
+		glschool_computeAccelerations(sc->school);
+	}
+}
+
 ENTRYPOINT void
 reshape_glschool(ModeInfo *mi, int width, int height)
 {
@@ -171,6 +219,19 @@ init_glschool(ModeInfo *mi)
 		exit(1);
 	}
 
+	{
+		static const struct threadpool_class cls = {
+			sizeof(glschool_thread),
+			glschool_thread_create,
+			glschool_thread_destroy
+		};
+		/* Not worth waking up threads for a handful of fish. */
+		unsigned count = (NFish >= 200 ? hardware_concurrency(MI_DISPLAY(mi)) : 1);
+
+		if (threadpool_create(&sc->threadpool, &cls, MI_DISPLAY(mi), count))
+			sc->threadpool.count = 0; /* See the note in thread_util.h. */
+	}
+
 	reshape_glschool(mi, width, height);
 
 	glschool_initGLEnv(DoFog);
@@ -178,7 +239,7 @@ init_glschool(ModeInfo *mi)
 	glschool_createDrawLists(&SCHOOL_BBOX(sc->school), 
                                  &sc->bboxList, &sc->goalList, &sc->fishList,
                                  &sc->fish_polys, &sc->box_polys, wire);
-	glschool_computeAccelerations(sc->school);
+	computeAccelerations(sc);
 }
 
 ENTRYPOINT void
@@ -210,7 +271,7 @@ draw_glschool(ModeInfo *mi)
                               sc->drawGoal, sc->drawBBox, 
                             sc->fish_polys, sc->box_polys,
                             &mi->polygon_count);
-	glschool_computeAccelerations(sc->school);
+	computeAccelerations(sc);
 
 	if (mi->fps_p)
 		do_fps(mi);
@@ -219,4 +280,23 @@ draw_glschool(ModeInfo *mi)
 	glXSwapBuffers(dpy, window);
 }
 
+ENTRYPOINT void
+release_glschool(ModeInfo *mi)
+{
+	int		i;
+
+	if (!scs) return;
+	for(i = 0; i < MI_NUM_SCREENS(mi); i++) {
+		glschool_configuration	*sc = &scs[i];
+		if (sc->threadpool.count) {
+			threadpool_destroy(&sc->threadpool);
+			sc->threadpool.count = 0;
+		}
+		if (sc->school) glschool_freeSchool(sc->school);
+		free(sc->colors);
+	}
+	free(scs);
+	scs = NULL;
+}
+
 XSCREENSAVER_MODULE("GLSchool", glschool)
@@ -11,6 +11,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef HAVE_CONFIG_H
 # include "config.h"
@@ -175,6 +176,24 @@ glschool_initSchool(int nFish, double accLimit, double maxV, double minV, double
 		return (School *)0;
 	}
 
+	memset(&s->grid, 0, sizeof(s->grid));
+	s->grid.fishCell = (int *)malloc(sizeof(int)*nFish*2);
+	s->grid.px = (double *)malloc(sizeof(double)*nFish*6);
+	if (s->grid.fishCell == (int *)0 || s->grid.px == (double *)0) {
+		perror("initSchool grid allocation failed: ");
+		free(s->grid.fishCell);
+		free(s->grid.px);
+		free(SCHOOL_FISHES(s));
+		free(s);
+		return (School *)0;
+	}
+	s->grid.sortedFish = s->grid.fishCell + nFish;
+	s->grid.py = s->grid.px + nFish;
+	s->grid.pz = s->grid.py + nFish;
+	s->grid.vx = s->grid.pz + nFish;
+	s->grid.vy = s->grid.vx + nFish;
+	s->grid.vz = s->grid.vy + nFish;
+
 	SCHOOL_NFISH(s) = nFish;
 	SCHOOL_ACCLIMIT(s) = accLimit;
 	SCHOOL_MAXVEL(s) = maxV;
@@ -195,6 +214,9 @@ glschool_initSchool(int nFish, double accLimit, double maxV, double minV, double
 void
 glschool_freeSchool(School *s)
 {
+	free(s->grid.cellStart);
+	free(s->grid.fishCell);
+	free(s->grid.px);
 	free(SCHOOL_FISHES(s));
 	free(s);
 }
@@ -254,38 +276,155 @@ glschool_computeNormalAndThetaToPlusZ(double *v, double *xV)
 }
 
 
+/* How far away a fish can be and still count as a neighbor, or 0 if
+   that can't be bounded (a non-positive distExp.)
+ */
+static double
+neighborReach(School *s)
+{
+	double	minRadius = SCHOOL_MINRADIUS(s);
+	double	reach;
+
+	if (SCHOOL_DISTEXP(s) <= 0.0) return 0.0;
+	if (minRadius < 0.1) minRadius = 0.1;
+	reach = minRadius + SCHOOL_DISTCOMP(s);
+	return (reach > 0.0 ? reach : 0.0);
+}
+
+
+static int
+gridCoord(FishGrid *g, int i, double pos)
+{
+	int		c;
+
+	if (g->cellSize <= 0.0) return 0;
+	c = (int)floor((pos - g->mins[i]) / g->cellSize);
+	if (c < 0) c = 0;
+	if (c >= g->dims[i]) c = g->dims[i] - 1;
+	return c;
+}
+
+
+void
+glschool_buildGrid(School *s)
+{
+	int		i;
+	int		c;
+	Fish	*f = (Fish *)0;
+	FishGrid	*g = &s->grid;
+	int		nFish = SCHOOL_NFISH(s);
+	BBox	*bbox = &SCHOOL_BBOX(s);
+	int		maxCells = 4*nFish + 64;
+
+	/* Cells at least as wide as the neighbor reach, so that neighbors are
+	   always in adjacent cells; but not so many that most are empty.
+	 */
+	g->cellSize = neighborReach(s);
+	for(;;) {
+		g->nCells = 1;
+		for(i = 0; i < 3; i++) {
+			g->mins[i] = BBOX_IMIN(bbox, i);
+			g->dims[i] = (g->cellSize > 0.0 ? (int)(BBOX_IRANGE(bbox, i) / g->cellSize) : 1);
+			if (g->dims[i] < 1) g->dims[i] = 1;
+			g->nCells *= g->dims[i];
+		}
+		if (g->nCells <= maxCells) break;
+		g->cellSize *= 1.25;
+	}
+
+	if (g->allocCells < g->nCells + 1) {
+		free(g->cellStart);
+		g->allocCells = g->nCells + 1;
+		if ((g->cellStart = (int *)malloc(sizeof(int)*g->allocCells)) == (int *)0) {
+			perror("buildGrid allocation failed: ");
+			exit(1);
+		}
+	}
+
+	/* Counting sort of the fish by cell. */
+	memset(g->cellStart, 0, sizeof(int)*(g->nCells + 1));
+	for(i = 0, f = SCHOOL_FISHES(s); i < nFish; i++, f++) {
+		c = (gridCoord(g, 2, FISH_Z(f))*g->dims[1] + gridCoord(g, 1, FISH_Y(f)))*g->dims[0]
+			+ gridCoord(g, 0, FISH_X(f));
+		g->fishCell[i] = c;
+		g->cellStart[c+1]++;
+	}
+	for(c = 0; c < g->nCells; c++)
+		g->cellStart[c+1] += g->cellStart[c];
+
+	for(i = 0, f = SCHOOL_FISHES(s); i < nFish; i++, f++) {
+		int		k = g->cellStart[g->fishCell[i]]++;
+		g->sortedFish[k] = i;
+		g->px[k] = FISH_X(f);  g->py[k] = FISH_Y(f);  g->pz[k] = FISH_Z(f);
+		g->vx[k] = FISH_VX(f); g->vy[k] = FISH_VY(f); g->vz[k] = FISH_VZ(f);
+	}
+	/* Each start was advanced to the next cell's start; shift them back. */
+	for(c = g->nCells; c > 0; c--)
+		g->cellStart[c] = g->cellStart[c-1];
+	g->cellStart[0] = 0;
+}
+
+
+/* Sums up the fish near "ref".  glschool_buildGrid must have been called
+   since the fish last moved.
+ */
 int
 glschool_computeGroupVectors(School *s, Fish *ref, double *avoidance, double *centroid, double *avgVel)
 {
-	int		i;
+	int		k;
+	int		y, z;
 	double	dist;
 	double	adjDist;
 	double	diffVect[3];
 	int		neighborCount = 0;
-	Fish	*test = (Fish *)0;
-	int		nFish = SCHOOL_NFISH(s);
+	FishGrid	*g = &s->grid;
+	int		refIndex = ref - SCHOOL_FISHES(s);
+	int		cell = g->fishCell[refIndex];
+	int		cx = cell % g->dims[0];
+	int		cy = (cell / g->dims[0]) % g->dims[1];
+	int		cz = cell / (g->dims[0] * g->dims[1]);
+	double	reach = neighborReach(s);
+	double	reach2 = reach*reach;
 	double	distExp = SCHOOL_DISTEXP(s);
 	double	distComp = SCHOOL_DISTCOMP(s);
 	double	minRadiusExp = SCHOOL_MINRADIUSEXP(s);
-	Fish	*fishes = SCHOOL_FISHES(s);
 
-	for(i = 0, test = fishes; i < nFish; i++, test++) {
-		if (test == ref) continue;
+	for(z = (cz > 0 ? cz-1 : 0); z <= cz+1 && z < g->dims[2]; z++)
+	for(y = (cy > 0 ? cy-1 : 0); y <= cy+1 && y < g->dims[1]; y++) {
+		int		row = (z*g->dims[1] + y)*g->dims[0];
+		int		start = g->cellStart[row + (cx > 0 ? cx-1 : 0)];
+		int		end = g->cellStart[row + (cx+1 < g->dims[0] ? cx+2 : g->dims[0])];
+
+		/* The cells in a row are contiguous in the sorted arrays. */
+		for(k = start; k < end; k++) {
+			double	d2;
+
+			diffVect[0] = FISH_X(ref) - g->px[k];
+			diffVect[1] = FISH_Y(ref) - g->py[k];
+			diffVect[2] = FISH_Z(ref) - g->pz[k];
+			d2 = diffVect[0]*diffVect[0] + diffVect[1]*diffVect[1] + diffVect[2]*diffVect[2];
 
-		getDifferenceVector(FISH_POS(ref), FISH_POS(test), diffVect);
+			/* cheap rejection, before the sqrt and pow */
+			if (reach > 0.0 && d2 > reach2) continue;
+			if (g->sortedFish[k] == refIndex) continue;
 
-		dist = norm(diffVect) - distComp;
-		if (dist < 0.0) dist = 0.1;
+			dist = sqrt(d2) - distComp;
+			if (dist < 0.0) dist = 0.1;
 
-		adjDist = pow(dist, distExp);
-		if (adjDist > minRadiusExp) continue;
+			adjDist = pow(dist, distExp);
+			if (adjDist > minRadiusExp) continue;
 
-		neighborCount++;
+			neighborCount++;
 
-		addVector(avgVel, FISH_VEL(test));
-		addVector(centroid, FISH_POS(test));
+			avgVel[0] += g->vx[k];
+			avgVel[1] += g->vy[k];
+			avgVel[2] += g->vz[k];
+			centroid[0] += g->px[k];
+			centroid[1] += g->py[k];
+			centroid[2] += g->pz[k];
 
-		addScaledVector(avoidance, diffVect, 1.0/adjDist);
+			addScaledVector(avoidance, diffVect, 1.0/adjDist);
+		}
 	}
 	if (neighborCount > 0) {
 		scaleVector(avgVel, 1.0/neighborCount);
@@ -297,6 +436,17 @@ glschool_computeGroupVectors(School *s, Fish *ref, double *avoidance, double *ce
 
 void
 glschool_computeAccelerations(School *s)
+{
+	glschool_buildGrid(s);
+	glschool_computeAccelerationsRange(s, 0, SCHOOL_NFISH(s));
+}
+
+
+/* Computes the accelerations of fish [start, end).  Different ranges can be
+   done in parallel, since each fish only writes to itself.
+ */
+void
+glschool_computeAccelerationsRange(School *s, int start, int end)
 {
 	int		i;
 	int		j;
@@ -309,7 +459,6 @@ glschool_computeAccelerations(School *s)
 	double	centroid[3];
 	double	avoidance[3];
 	Fish	*ref = (Fish *)0;
-	int		nFish = SCHOOL_NFISH(s);
 	double	*goal = SCHOOL_GOAL(s);
 	double	distExp = SCHOOL_DISTEXP(s);
 	double	distComp = SCHOOL_DISTCOMP(s);
@@ -321,7 +470,7 @@ glschool_computeAccelerations(School *s)
 	double	minRadius = SCHOOL_MINRADIUS(s);
 	Fish	*fishes = SCHOOL_FISHES(s);
 
-	for(i = 0, ref = fishes; i < nFish; i++, ref++) {
+	for(i = start, ref = fishes + start; i < end; i++, ref++) {
 		clearVector(avgVel);
 		clearVector(centroid);
 		clearVector(avoidance);
@@ -61,6 +61,24 @@ typedef struct {
 #define FISH_IOLDVEL(f, i)	((f)->oldVel[(i)])
 #define FISH_IAVGVEL(f, i)	((f)->avgVel[(i)])
 
+/* A uniform grid over the bounding box, rebuilt every step, so that each
+   fish only has to look at the fish in its own and the adjacent cells.
+   The positions and velocities are copied out in cell order, one array
+   per coordinate, so the neighbor loop runs over contiguous memory.
+ */
+typedef struct {
+	double		cellSize;
+	double		mins[3];
+	int			dims[3];
+	int			nCells;
+	int			allocCells;
+	int			*cellStart;		/* nCells+1 offsets into the arrays below */
+	int			*fishCell;		/* cell of each fish, in school order */
+	int			*sortedFish;	/* school index of each sorted fish */
+	double		*px, *py, *pz;	/* sorted positions */
+	double		*vx, *vy, *vz;	/* sorted velocities */
+} FishGrid;
+
 typedef struct {
 	int			nFish;
 	double		maxVel;
@@ -80,6 +98,7 @@ typedef struct {
 	double		boxRanges[3];
 	BBox		theBox;
 	Fish		*theFish;
+	FishGrid	grid;
 } School;
 
 #define SCHOOL_NFISH(s)			((s)->nFish)
@@ -120,6 +139,8 @@ extern void		glschool_newGoal(School *);
 extern void		glschool_setBBox(School *, double, double, double, double, double, double);
 
 extern void		glschool_computeAccelerations(School *);
+extern void		glschool_buildGrid(School *);
+extern void		glschool_computeAccelerationsRange(School *, int, int);
 extern double		glschool_computeNormalAndThetaToPlusZ(double *, double *);
 int			glschool_computeGroupVectors(School *, Fish *, double *, double *, double *);
 
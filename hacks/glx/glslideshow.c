@@ -73,6 +73,7 @@
                   "*showFPS:         False                \n" \
 	          "*fpsSolid:        True                 \n" \
 	          "*useSHM:          True                 \n" \
+	          "*preloadImages:   1                    \n" \
 		  "*titleFont:       -*-helvetica-medium-r-normal-*-180-*\n" \
                   "*desktopGrabber:  xscreensaver-getimage -no-desktop %s\n" \
 		  "*grabDesktopImages:   False \n" \
@@ -210,6 +211,7 @@ static XrmOptionDescRec opts[] = {
   {"-clip",         ".letterbox",     XrmoptionNoArg, "False" },
   {"-mipmaps",      ".mipmap",        XrmoptionNoArg, "True"  },
   {"-no-mipmaps",   ".mipmap",        XrmoptionNoArg, "False" },
+  {"-preload",      ".preloadImages", XrmoptionSepArg, 0 },
   {"-debug",        ".debug",         XrmoptionNoArg, "True"  },
 };
 
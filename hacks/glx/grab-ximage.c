@@ -35,8 +35,18 @@
 # include "jwzgles.h"
 #endif /* HAVE_JWZGLES */
 
+#ifndef HAVE_COCOA
+# include <X11/Intrinsic.h>	/* for XtAppAddInput, etc */
+#endif
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
 #include "grab-ximage.h"
 #include "grabscreen.h"
+#include "resources.h"
+#include "thread_util.h"
 #include "visual.h"
 
 /* If REFORMAT_IMAGE_DATA is defined, then we convert Pixmaps to textures
@@ -62,7 +72,6 @@
 
 
 #ifdef HAVE_XSHM_EXTENSION
-# include "resources.h"
 # include "xshm.h"
 #endif /* HAVE_XSHM_EXTENSION */
 
@@ -136,24 +145,20 @@ spread_bits (unsigned char value, unsigned char width)
 }
 
 
+/* Creates an empty 32-bit RGBA XImage the size of the given one, and
+   reads the colormap if there is one.  This talks to the server, so it
+   happens on the main thread; convert_ximage_to_rgba32 does the rest.
+ */
 static XImage *
-convert_ximage_to_rgba32 (Screen *screen, XImage *image)
+make_rgba32_ximage (Screen *screen, XImage *from, XColor **colors_ret)
 {
   Display *dpy = DisplayOfScreen (screen);
   Visual *visual = DefaultVisualOfScreen (screen);
-
-  int x, y;
-  unsigned long crpos=0, cgpos=0, cbpos=0, capos=0; /* bitfield positions */
-  unsigned long srpos=0, sgpos=0, sbpos=0;
-  unsigned long srmsk=0, sgmsk=0, sbmsk=0;
-  unsigned long srsiz=0, sgsiz=0, sbsiz=0;
   XColor *colors = 0;
-  unsigned char spread_map[3][256];
 
   /* Note: height+2 in "to" to work around an array bounds overrun
      in gluBuild2DMipmaps / gluScaleImage.
    */
-  XImage *from = image;
   XImage *to = XCreateImage (dpy, visual, 32,  /* depth */
                              ZPixmap, 0, 0, from->width, from->height + 2,
                              32, /* bitmap pad */
@@ -179,6 +184,24 @@ convert_ximage_to_rgba32 (Screen *screen, XImage *image)
       XQueryColors (dpy, cmap, colors, ncolors);
     }
 
+  *colors_ret = colors;
+  return to;
+}
+
+
+/* Fills in the image made by make_rgba32_ximage.  This only touches
+   client-side memory, so it is safe to run on a worker thread.
+ */
+static void
+convert_ximage_to_rgba32 (XImage *from, XImage *to, XColor *colors)
+{
+  int x, y;
+  unsigned long crpos=0, cgpos=0, cbpos=0, capos=0; /* bitfield positions */
+  unsigned long srpos=0, sgpos=0, sbpos=0;
+  unsigned long srmsk=0, sgmsk=0, sbmsk=0;
+  unsigned long srsiz=0, sgsiz=0, sbsiz=0;
+  unsigned char spread_map[3][256];
+
   if (colors == 0)  /* truecolor */
     {
       srmsk = (unsigned int)to->red_mask;
@@ -242,10 +265,6 @@ convert_ximage_to_rgba32 (Screen *screen, XImage *image)
 
         XPutPixel (to, x, y, cp);
       }
-
-  if (colors) free (colors);
-
-  return to;
 }
 
 #endif /* REFORMAT_IMAGE_DATA */
@@ -303,68 +322,7 @@ halve_image (XImage *ximage, XRectangle *geom)
 }
 
 
-#ifdef REFORMAT_IMAGE_DATA
-
-/* Pulls the Pixmap bits from the server and returns an XImage
-   in some format acceptable to OpenGL.
- */
-static XImage *
-pixmap_to_gl_ximage (Screen *screen, Window window, Pixmap pixmap)
-{
-  Display *dpy = DisplayOfScreen (screen);
-  unsigned int width, height, depth;
-
-# ifdef HAVE_XSHM_EXTENSION
-  Bool use_shm = get_boolean_resource (dpy, "useSHM", "Boolean");
-  XShmSegmentInfo shm_info;
-# endif /* HAVE_XSHM_EXTENSION */
-
-  XImage *server_ximage = 0;
-  XImage *client_ximage = 0;
-
-  {
-    Window root;
-    int x, y;
-    unsigned int bw;
-    XGetGeometry (dpy, pixmap, &root, &x, &y, &width, &height, &bw, &depth);
-  }
-
-  if (width < 5 || height < 5)  /* something's gone wrong somewhere... */
-    return 0;
-
-  /* Convert the server-side Pixmap to a client-side GL-ordered XImage.
-   */
-# ifdef HAVE_XSHM_EXTENSION
-  if (use_shm)
-    {
-      Visual *visual = DefaultVisualOfScreen (screen);
-      server_ximage = create_xshm_image (dpy, visual, depth,
-                                         ZPixmap, 0, &shm_info,
-                                         width, height);
-      if (server_ximage)
-        XShmGetImage (dpy, pixmap, server_ximage, 0, 0, ~0L);
-      else
-        use_shm = False;
-    }
-# endif /* HAVE_XSHM_EXTENSION */
-
-  if (!server_ximage)
-    server_ximage = XGetImage (dpy, pixmap, 0, 0, width, height, ~0L, ZPixmap);
-
-  client_ximage = convert_ximage_to_rgba32 (screen, server_ximage);
-
-# ifdef HAVE_XSHM_EXTENSION
-  if (use_shm)
-    destroy_xshm_image (dpy, server_ximage, &shm_info);
-  else
-# endif /* HAVE_XSHM_EXTENSION */
-    XDestroyImage (server_ximage);
-
-  return client_ximage;
-}
-
-
-# else /* ! REFORMAT_IMAGE_DATA */
+#ifndef REFORMAT_IMAGE_DATA
 
 typedef struct {
   unsigned int depth, red_mask, green_mask, blue_mask;	/* when this... */
@@ -484,31 +442,93 @@ gl_settings_for_ximage (XImage *image,
 
 #endif /* ! REFORMAT_IMAGE_DATA */
 
-typedef struct {
+
+
+/* Loading an image happens in four stages:
+
+     1. load_image_async forks xscreensaver-getimage to draw the image
+        into a Pixmap;
+     2. on the main thread, the Pixmap is pulled from the server into an
+        XImage (Xlib isn't thread-safe, so this can't happen elsewhere);
+     3. on a worker thread, the XImage is converted to RGBA and, if
+        mipmaps are wanted, scaled down into a full mipmap chain;
+     4. back on the GL thread, the finished image is handed to GL and
+        the caller's callback is run.
+
+   Only 2 and 4 cost the hack any frame time, and 4 is now just the upload.
+
+   Finished images are kept in a queue for each window and size.  The
+   "preloadImages" resource says how many images to have ready before
+   anyone asks for them, so that a slideshow's next image is usually
+   waiting by the time it is wanted.
+ */
+
+#define MAX_MIP_LEVELS 16
+
+typedef struct texture_queue texture_queue;
+
+typedef struct texture_request texture_request;
+struct texture_request {
   GLXContext glx_context;
-  Pixmap pixmap;
-  int pix_width, pix_height, pix_depth;
   int texid;
-  Bool mipmap_p;
-  double load_time;
-
-  /* Used in async mode
-   */
   void (*callback) (const char *filename, XRectangle *geometry,
                     int iw, int ih, int tw, int th,
                     void *closure);
   void *closure;
+  texture_request *next;
+};
 
-  /* Used in sync mode
-   */
-  char **filename_return;
-  XRectangle *geometry_return;
-  int *image_width_return;
-  int *image_height_return;
-  int *texture_width_return;
-  int *texture_height_return;
+typedef struct texture_image texture_image;
+struct texture_image {
+  texture_queue *queue;
+  Pixmap pixmap;
+  char *filename;
+  XRectangle geometry;
 
-} img_closure;
+  XImage *ximage;		/* What gets uploaded */
+  GLint type, format;
+# ifndef REFORMAT_IMAGE_DATA
+  GLint swap;
+# else  /* REFORMAT_IMAGE_DATA */
+  XImage *server_ximage;	/* What it was converted from */
+  XColor *colors;
+#  ifdef HAVE_XSHM_EXTENSION
+  Bool shm_p;
+  XShmSegmentInfo shm_info;
+#  endif /* HAVE_XSHM_EXTENSION */
+# endif /* REFORMAT_IMAGE_DATA */
+
+  /* The mipmap chain, if the worker built one.  Level 0 may point into
+     ximage->data. */
+  int nlevels;
+  int level_width[MAX_MIP_LEVELS], level_height[MAX_MIP_LEVELS];
+  unsigned char *level_data[MAX_MIP_LEVELS];
+
+  double load_time, cvt_time, ready_time;
+  texture_image *next;
+};
+
+struct texture_queue {
+  Screen *screen;
+  Window window;
+  int pix_width, pix_height, pix_depth;
+  Bool mipmap_p;
+  GLint max_size;
+  int preload;
+  int loading;			/* Images somewhere in stages 1-3 */
+  texture_image *ready;		/* Images done with stage 3 */
+  texture_request *requests;	/* Callers waiting for an image */
+  Bool deliver_pending_p;
+  Bool stale_p;			/* The window has changed size since */
+  texture_queue *next;
+};
+
+static texture_queue *texture_queues = 0;
+
+static struct {
+  int count;
+  double total, max;
+} upload_stats;
 
 
 /* Returns the current time in seconds as a double.
@@ -538,6 +558,238 @@ to_pow2 (int value)
 }
 
 
+#ifdef REFORMAT_IMAGE_DATA
+
+/* Returns the largest power of 2 that is not larger than value.
+   This is the size gluBuild2DMipmaps would have scaled to.
+ */
+static int
+floor_pow2 (int value)
+{
+  int i = 1;
+  while (i * 2 <= value) i <<= 1;
+  return i;
+}
+
+
+/* Box-filters an RGBA image down to a smaller size.
+ */
+static void
+scale_rgba (const unsigned char *from, int fw, int fh, int fbpl,
+            unsigned char *to, int tw, int th)
+{
+  int x, y, xx, yy, i;
+  for (y = 0; y < th; y++)
+    {
+      int y0 = (int) ((long) y * fh / th);
+      int y1 = (int) ((long) (y+1) * fh / th);
+      if (y1 <= y0) y1 = y0 + 1;
+      for (x = 0; x < tw; x++)
+        {
+          int x0 = (int) ((long) x * fw / tw);
+          int x1 = (int) ((long) (x+1) * fw / tw);
+          unsigned long sum[4] = { 0, 0, 0, 0 };
+          unsigned long n;
+          if (x1 <= x0) x1 = x0 + 1;
+          n = (unsigned long) (x1 - x0) * (y1 - y0);
+          for (yy = y0; yy < y1; yy++)
+            {
+              const unsigned char *s = from + yy * fbpl + x0 * 4;
+              for (xx = x0; xx < x1; xx++, s += 4)
+                for (i = 0; i < 4; i++)
+                  sum[i] += s[i];
+            }
+          for (i = 0; i < 4; i++)
+            *to++ = (sum[i] + n/2) / n;
+        }
+    }
+}
+
+
+/* Runs on the worker thread: builds the mipmap chain that
+   gluBuild2DMipmaps would have, so that only the glTexImage2D
+   calls are left for the GL thread.
+ */
+static void
+build_mipmaps (texture_image *img)
+{
+  XImage *ximage = img->ximage;
+  int max_size = img->queue->max_size;
+  int w = floor_pow2 (ximage->width);
+  int h = floor_pow2 (ximage->height);
+  int n = 0;
+
+  while (max_size > 0 && (w > max_size || h > max_size))
+    {
+      if (w > 1) w /= 2;
+      if (h > 1) h /= 2;
+    }
+
+  if (w == ximage->width && h == ximage->height &&
+      ximage->bytes_per_line == w * 4)
+    img->level_data[n] = (unsigned char *) ximage->data;
+  else
+    {
+      img->level_data[n] = (unsigned char *) malloc (w * h * 4);
+      if (! img->level_data[n]) return;
+      scale_rgba ((unsigned char *) ximage->data,
+                  ximage->width, ximage->height, ximage->bytes_per_line,
+                  img->level_data[n], w, h);
+    }
+  img->level_width[n]  = w;
+  img->level_height[n] = h;
+
+  while ((w > 1 || h > 1) && n+1 < MAX_MIP_LEVELS)
+    {
+      int w2 = (w > 1 ? w/2 : 1);
+      int h2 = (h > 1 ? h/2 : 1);
+      unsigned char *d = (unsigned char *) malloc (w2 * h2 * 4);
+      if (! d) break;
+      scale_rgba (img->level_data[n], w, h, w * 4, d, w2, h2);
+      n++;
+      img->level_data[n]   = d;
+      img->level_width[n]  = w = w2;
+      img->level_height[n] = h = h2;
+    }
+
+  img->nlevels = n + 1;
+}
+
+#endif /* REFORMAT_IMAGE_DATA */
+
+
+/* Stage 3: everything that only touches client-side memory.
+ */
+static void
+prepare_image (texture_image *img)
+{
+# ifdef REFORMAT_IMAGE_DATA
+  if (img->ximage)
+    {
+      convert_ximage_to_rgba32 (img->server_ximage, img->ximage, img->colors);
+      if (img->queue->mipmap_p)
+        build_mipmaps (img);
+    }
+# endif /* REFORMAT_IMAGE_DATA */
+}
+
+
+static void
+free_texture_image (texture_image *img)
+{
+  Display *dpy = DisplayOfScreen (img->queue->screen);
+  int i;
+
+  for (i = 0; i < img->nlevels; i++)
+    if (!img->ximage || img->level_data[i] != (unsigned char *) img->ximage->data)
+      free (img->level_data[i]);
+  if (img->ximage) XDestroyImage (img->ximage);
+  if (img->pixmap) XFreePixmap (dpy, img->pixmap);
+  if (img->filename) free (img->filename);
+  free (img);
+}
+
+
+/* Pulls the Pixmap bits from the server.
+ */
+static void
+pull_pixmap (texture_image *img)
+{
+  texture_queue *q = img->queue;
+  Display *dpy = DisplayOfScreen (q->screen);
+  unsigned int width, height, depth;
+
+  {
+    Window root;
+    int x, y;
+    unsigned int bw;
+    XGetGeometry (dpy, img->pixmap, &root, &x, &y, &width, &height, &bw,
+                  &depth);
+  }
+
+  if (width < 5 || height < 5)  /* something's gone wrong somewhere... */
+    return;
+
+# ifdef REFORMAT_IMAGE_DATA
+
+  /* Get the server-side Pixmap as an XImage in whatever form the server
+     hands us; the worker will convert it to a client-side GL-ordered one.
+   */
+#  ifdef HAVE_XSHM_EXTENSION
+  if (get_boolean_resource (dpy, "useSHM", "Boolean"))
+    {
+      Visual *visual = DefaultVisualOfScreen (q->screen);
+      img->server_ximage = create_xshm_image (dpy, visual, depth,
+                                              ZPixmap, 0, &img->shm_info,
+                                              width, height);
+      if (img->server_ximage)
+        {
+          XShmGetImage (dpy, img->pixmap, img->server_ximage, 0, 0, ~0L);
+          img->shm_p = True;
+        }
+    }
+#  endif /* HAVE_XSHM_EXTENSION */
+
+  if (!img->server_ximage)
+    img->server_ximage = XGetImage (dpy, img->pixmap, 0, 0, width, height,
+                                    ~0L, ZPixmap);
+  if (img->server_ximage)
+    img->ximage = make_rgba32_ximage (q->screen, img->server_ximage,
+                                      &img->colors);
+  img->format = GL_RGBA;
+  img->type = GL_UNSIGNED_BYTE;
+
+# else /* ! REFORMAT_IMAGE_DATA */
+  {
+    Visual *visual = DefaultVisualOfScreen (q->screen);
+
+    img->ximage = XCreateImage (dpy, visual, q->pix_depth, ZPixmap, 0, 0,
+                                q->pix_width, q->pix_height, 32, 0);
+
+    /* Note: height+2 in "to" to be to work around an array bounds overrun
+       in gluBuild2DMipmaps / gluScaleImage. */
+    img->ximage->data = (char *)
+      calloc (img->ximage->height+2, img->ximage->bytes_per_line);
+
+    if (!img->ximage->data ||
+        !XGetSubImage (dpy, img->pixmap, 0, 0,
+                       img->ximage->width, img->ximage->height,
+                       ~0L, img->ximage->format, img->ximage, 0, 0))
+      {
+        XDestroyImage (img->ximage);
+        img->ximage = 0;
+      }
+    else
+      gl_settings_for_ximage (img->ximage, &img->type, &img->format,
+                              &img->swap);
+  }
+# endif /* ! REFORMAT_IMAGE_DATA */
+}
+
+
+/* Frees whatever the worker no longer needs.  On the main thread.
+ */
+static void
+release_server_ximage (texture_image *img)
+{
+# ifdef REFORMAT_IMAGE_DATA
+  Display *dpy = DisplayOfScreen (img->queue->screen);
+  if (img->server_ximage)
+    {
+#  ifdef HAVE_XSHM_EXTENSION
+      if (img->shm_p)
+        destroy_xshm_image (dpy, img->server_ximage, &img->shm_info);
+      else
+#  endif /* HAVE_XSHM_EXTENSION */
+        XDestroyImage (img->server_ximage);
+      img->server_ximage = 0;
+    }
+  if (img->colors) free (img->colors);
+  img->colors = 0;
+# endif /* REFORMAT_IMAGE_DATA */
+}
+
+
 /* Loads the given XImage into GL's texture memory.
    The image may be of any size.
    If mipmap_p is true, then make mipmaps instead of just a single texture.
@@ -647,194 +899,556 @@ ximage_to_texture (XImage *ximage,
 }
 
 
-static void load_texture_async_cb (Screen *screen,
-                                        Window window, Drawable drawable,
-                                        const char *name, XRectangle *geometry,
-                                        void *closure);
+/* Loads a mipmap chain made by build_mipmaps into GL's texture memory.
+   If the card can't take the biggest level, the next one down is tried,
+   the same as ximage_to_texture does by shrinking the image.
+   Writes to stderr and returns False on error.
+ */
+static Bool
+mipmaps_to_texture (texture_image *img, int *width_return,
+                    int *height_return, XRectangle *geometry)
+{
+  int max_reduction = 7;
+  int first = 0;
+  int orig_width  = img->ximage->width;
+  int orig_height = img->ximage->height;
+  int width  = orig_width;
+  int height = orig_height;
+  int i;
+
+  while (1)
+    {
+      GLenum err = 0;
+
+      if (debug_p)
+        fprintf (stderr, "%s: mipmap %d x %d (%d x %d)\n",
+                 progname, width, height,
+                 img->level_width[first], img->level_height[first]);
 
+      for (i = first; i < img->nlevels && !err; i++)
+        {
+          glTexImage2D (GL_TEXTURE_2D, i - first, 3,
+                        img->level_width[i], img->level_height[i], 0,
+                        GL_RGBA, GL_UNSIGNED_BYTE, img->level_data[i]);
+          err = glGetError();
+        }
 
-/* Grabs an image of the desktop (or another random image file) and
-   loads the image into GL's texture memory.
-   When the callback is called, the image data will have been loaded
-   into texture number `texid' (via glBindTexture.)
+      if (! err)
+        break;
 
-   If an error occurred, width/height will be 0.
+      while (glGetError() != GL_NO_ERROR)
+        ;  /* clear any lingering errors */
+
+      if (first >= max_reduction || first + 1 >= img->nlevels)
+        {
+          const char *s = (char *) gluErrorString (err);
+          fprintf (stderr,
+                   "\n"
+                   "%s: %dx%d texture failed, even after reducing to %dx%d:\n"
+                   "%s: The error was: \"%s\".\n"
+                   "%s: probably this means "
+                   "\"your video card is worthless and weak\"?\n\n",
+                   progname, orig_width, orig_height, width, height,
+                   progname, (s ? s : "unknown error"),
+                   progname);
+          return False;
+        }
+
+      first++;
+      width  /= 2;
+      height /= 2;
+      geometry->x /= 2;
+      geometry->y /= 2;
+      geometry->width  /= 2;
+      geometry->height /= 2;
+    }
+
+  /* As with gluBuild2DMipmaps, report the image size as the texture size:
+     the whole image is stretched over the texture. */
+  img->ximage->width  = width;
+  img->ximage->height = height;
+  *width_return  = width;
+  *height_return = height;
+  return True;
+}
+
+
+/* Stage 4: hands the image to GL and runs the callback.
  */
-void
-load_texture_async (Screen *screen, Window window,
-                    GLXContext glx_context,
-                    int desired_width, int desired_height,
-                    Bool mipmap_p,
-                    GLuint texid,
-                    void (*callback) (const char *filename,
-                                      XRectangle *geometry,
-                                      int image_width,
-                                      int image_height,
-                                      int texture_width,
-                                      int texture_height,
-                                      void *closure),
-                    void *closure)
+static void
+deliver_image (texture_image *img, texture_request *req)
 {
-  Display *dpy = DisplayOfScreen (screen);
-  XWindowAttributes xgwa;
-  img_closure *data = (img_closure *) calloc (1, sizeof(*data));
+  texture_queue *q = img->queue;
+  Display *dpy = DisplayOfScreen (q->screen);
+  Bool ok;
+  int iw=0, ih=0, tw=0, th=0;
+  double tex_time, done_time;
+
+  if (req->glx_context)
+    glXMakeCurrent (dpy, q->window, req->glx_context);
+
+  tex_time = double_time();
+
+  if (! img->ximage)
+    ok = False;
+  else
+    {
+      iw = img->ximage->width;
+      ih = img->ximage->height;
+      if (req->texid != -1)
+        glBindTexture (GL_TEXTURE_2D, req->texid);
+
+      glPixelStorei (GL_UNPACK_ALIGNMENT, img->ximage->bitmap_pad / 8);
+# ifndef REFORMAT_IMAGE_DATA
+      glPixelStorei (GL_UNPACK_SWAP_BYTES, !img->swap);
+# endif
+      if (img->nlevels > 0)
+        ok = mipmaps_to_texture (img, &tw, &th, &img->geometry);
+      else
+        ok = ximage_to_texture (img->ximage, img->type, img->format,
+                                &tw, &th, &img->geometry, q->mipmap_p);
+      if (ok)
+        {
+          iw = img->ximage->width;	/* in case the image was shrunk */
+          ih = img->ximage->height;
+        }
+    }
+
+  if (! ok)
+    iw = ih = tw = th = 0;
+
+  done_time = double_time();
+
+  upload_stats.count++;
+  upload_stats.total += done_time - tex_time;
+  if (done_time - tex_time > upload_stats.max)
+    upload_stats.max = done_time - tex_time;
 
   if (debug_p)
-    data->load_time = double_time();
+    fprintf (stderr,
+             /* prints: A + B + C + D = E
+                A = file I/O time (happens in background)
+                B = time to pull bits from server and convert them
+                    (only the pull happens in this process)
+                C = time spent waiting in the queue
+                D = time to hand the texture to GL (this process)
+                E = total elapsed time from "start loading" to "see image"
+
+                D, and the pull part of B, are responsible for any
+                frame-rate glitches.
+              */
+             "%s: loading elapsed: %.2f + %.2f + %.2f + %.3f = %.2f sec"
+             " (%d uploads, %.3f avg, %.3f max)\n",
+             progname,
+             img->cvt_time   - img->load_time,
+             img->ready_time - img->cvt_time,
+             tex_time        - img->ready_time,
+             done_time       - tex_time,
+             done_time       - img->load_time,
+             upload_stats.count, upload_stats.total / upload_stats.count,
+             upload_stats.max);
+
+  if (req->callback)
+    req->callback (img->filename, &img->geometry, iw, ih, tw, th,
+                   req->closure);
+}
 
-  data->texid       = texid;
-  data->mipmap_p    = mipmap_p;
-  data->glx_context = glx_context;
-  data->callback    = callback;
-  data->closure     = closure;
 
-  XGetWindowAttributes (dpy, window, &xgwa);
-  data->pix_width  = xgwa.width;
-  data->pix_height = xgwa.height;
-  data->pix_depth  = xgwa.depth;
+/* A queue for a size the window no longer has serves the requests it
+   already took, and then goes away.  Images that finish loading after
+   that are dropped.  Returns True if q was freed.
+ */
+static Bool
+retire_queue (texture_queue *q)
+{
+  texture_queue **qq;
 
-  if (desired_width  && desired_width  < xgwa.width)
-    data->pix_width  = desired_width;
-  if (desired_height && desired_height < xgwa.height)
-    data->pix_height = desired_height;
+  if (! q->stale_p || q->requests)
+    return False;
+
+  while (q->ready)
+    {
+      texture_image *img = q->ready;
+      q->ready = img->next;
+      free_texture_image (img);
+    }
+
+  /* Images still loading, and pending timers, point back at q. */
+  if (q->loading || q->deliver_pending_p)
+    return False;
+
+  for (qq = &texture_queues; *qq; qq = &(*qq)->next)
+    if (*qq == q)
+      {
+        *qq = q->next;
+        break;
+      }
+  free (q);
+  return True;
+}
+
+
+static void start_loading (texture_queue *q);
+
+/* Starts more images loading until the ready images, plus the ones on
+   the way, cover the outstanding requests and the preload count.
+ */
+static void
+fill_queue (texture_queue *q)
+{
+  int supply = q->loading;
+  int demand = q->preload;
+  texture_image *img;
+  texture_request *req;
+
+  for (img = q->ready; img; img = img->next) supply++;
+  for (req = q->requests; req; req = req->next) demand++;
+
+  for (; supply < demand; supply++)
+    start_loading (q);
+}
+
+
+static void
+deliver_cb (XtPointer closure, XtIntervalId *id)
+{
+  texture_queue *q = (texture_queue *) closure;
+  q->deliver_pending_p = False;
+
+  while (q->ready && q->requests)
+    {
+      texture_image *img = q->ready;
+      texture_request *req = q->requests;
+      q->ready = img->next;
+      q->requests = req->next;
+      deliver_image (img, req);
+      free_texture_image (img);
+      free (req);
+    }
+
+  if (! retire_queue (q))
+    fill_queue (q);
+}
+
+
+/* Uploads happen from a timer rather than directly, so that the callback
+   never runs before load_texture_async has returned.
+ */
+static void
+schedule_delivery (texture_queue *q)
+{
+  if (q->ready && q->requests && !q->deliver_pending_p)
+    {
+      XtAppContext app =
+        XtDisplayToApplicationContext (DisplayOfScreen (q->screen));
+      q->deliver_pending_p = True;
+      XtAppAddTimeOut (app, 0, deliver_cb, (XtPointer) q);
+    }
+}
+
+
+/* Called on the main thread once the worker is done with an image.
+ */
+static void
+image_ready (texture_image *img)
+{
+  texture_queue *q = img->queue;
+  texture_image **tail;
+
+  release_server_ximage (img);
+  img->ready_time = double_time();
 
-  data->pixmap = XCreatePixmap (dpy, window, data->pix_width, data->pix_height,
-                                data->pix_depth);
-  load_image_async (screen, window, data->pixmap, 
-                    load_texture_async_cb, data);
+  q->loading--;
+  for (tail = &q->ready; *tail; tail = &(*tail)->next)
+    ;
+  *tail = img;
+
+  if (! retire_queue (q))
+    schedule_delivery (q);
 }
 
 
-/* Once we have an XImage, this loads it into GL.
-   This is used in both synchronous and asynchronous mode.
+#if HAVE_PTHREAD
+
+/* A single worker thread does stage 3 for every queue, in order.
+   It tells the main thread about finished images through a pipe, so that
+   the Xt event loop picks them up like any other input.
  */
+static pthread_mutex_t worker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+static texture_image *worker_todo = 0;
+static texture_image *worker_done = 0;
+static int worker_pipe[2];
+static Bool worker_started_p = False;
+
+static void *
+worker_thread (void *arg)
+{
+  while (1)
+    {
+      texture_image *img, **tail;
+      char c = 0;
+
+      PTHREAD_VERIFY (pthread_mutex_lock (&worker_mutex));
+      while (! worker_todo)
+        PTHREAD_VERIFY (pthread_cond_wait (&worker_cond, &worker_mutex));
+      img = worker_todo;
+      worker_todo = img->next;
+      img->next = 0;
+      PTHREAD_VERIFY (pthread_mutex_unlock (&worker_mutex));
+
+      prepare_image (img);
+
+      PTHREAD_VERIFY (pthread_mutex_lock (&worker_mutex));
+      for (tail = &worker_done; *tail; tail = &(*tail)->next)
+        ;
+      *tail = img;
+      PTHREAD_VERIFY (pthread_mutex_unlock (&worker_mutex));
+
+      if (write (worker_pipe[1], &c, 1) < 0)
+        perror ("grab-ximage: worker pipe");
+    }
+  return 0;
+}
+
+
 static void
-load_texture_async_cb (Screen *screen, Window window, Drawable drawable,
-                       const char *name, XRectangle *geometry, void *closure)
+worker_done_cb (XtPointer closure, int *fd, XtInputId *id)
+{
+  texture_image *done;
+  char buf[64];
+
+  if (read (worker_pipe[0], buf, sizeof(buf)) < 0)
+    return;
+
+  PTHREAD_VERIFY (pthread_mutex_lock (&worker_mutex));
+  done = worker_done;
+  worker_done = 0;
+  PTHREAD_VERIFY (pthread_mutex_unlock (&worker_mutex));
+
+  while (done)
+    {
+      texture_image *next = done->next;
+      done->next = 0;
+      image_ready (done);
+      done = next;
+    }
+}
+
+
+/* Starts the worker if need be.  Returns False if it can't be started,
+   in which case the work is done on the main thread.
+ */
+static Bool
+start_worker (Display *dpy)
+{
+  pthread_t thread;
+  pthread_attr_t attr;
+  int err;
+
+  if (worker_started_p)
+    return True;
+
+  if (pipe (worker_pipe))
+    {
+      perror ("grab-ximage: pipe");
+      return False;
+    }
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  err = pthread_create (&thread, &attr, worker_thread, 0);
+  pthread_attr_destroy (&attr);
+  if (err)
+    {
+      close (worker_pipe[0]);
+      close (worker_pipe[1]);
+      return False;
+    }
+
+  XtAppAddInput (XtDisplayToApplicationContext (dpy), worker_pipe[0],
+                 (XtPointer) XtInputReadMask, worker_done_cb, 0);
+  worker_started_p = True;
+  return True;
+}
+
+#endif /* HAVE_PTHREAD */
+
+
+/* Stage 2, and the hand-off to stage 3.
+ */
+static void
+image_loaded_cb (Screen *screen, Window window, Drawable drawable,
+                 const char *name, XRectangle *geometry, void *closure)
 {
   Display *dpy = DisplayOfScreen (screen);
-  Bool ok;
-  XImage *ximage;
-  GLint type, format;
-  int iw=0, ih=0, tw=0, th=0;
-  double cvt_time=0, tex_time=0, done_time=0;
-  img_closure *data = (img_closure *) closure;
-  /* copy closure data to stack and free the original before running cb */
-  img_closure dd = *data;
-  memset (data, 0, sizeof (*data));
-  free (data);
-  data = 0;
-
-  if (dd.glx_context)
-    glXMakeCurrent (dpy, window, dd.glx_context);
-
-  if (geometry->width <= 0 || geometry->height <= 0)
+  texture_image *img = (texture_image *) closure;
+  texture_queue *q = img->queue;
+
+  img->filename = (name ? strdup (name) : 0);
+  img->geometry = *geometry;
+
+  if (img->geometry.width <= 0 || img->geometry.height <= 0)
     {
       /* This can happen if an old version of xscreensaver-getimage
          is installed. */
-      geometry->x = 0;
-      geometry->y = 0;
-      geometry->width  = dd.pix_width;
-      geometry->height = dd.pix_height;
+      img->geometry.x = 0;
+      img->geometry.y = 0;
+      img->geometry.width  = q->pix_width;
+      img->geometry.height = q->pix_height;
     }
 
-  if (geometry->width <= 0 || geometry->height <= 0)
+  if (img->geometry.width <= 0 || img->geometry.height <= 0)
     abort();
 
-  if (debug_p)
-    cvt_time = double_time();
+  img->cvt_time = double_time();
 
-# ifdef REFORMAT_IMAGE_DATA
-  ximage = pixmap_to_gl_ximage (screen, window, dd.pixmap);
-  format = GL_RGBA;
-  type = GL_UNSIGNED_BYTE;
+  pull_pixmap (img);
+  XFreePixmap (dpy, img->pixmap);
+  img->pixmap = 0;
 
-#else /* ! REFORMAT_IMAGE_DATA */
-  {
-    Visual *visual = DefaultVisualOfScreen (screen);
-    GLint swap;
-
-    ximage = XCreateImage (dpy, visual, dd.pix_depth, ZPixmap, 0, 0,
-                           dd.pix_width, dd.pix_height, 32, 0);
+# if HAVE_PTHREAD
+  if (img->ximage && start_worker (dpy))
+    {
+      texture_image **tail;
+      PTHREAD_VERIFY (pthread_mutex_lock (&worker_mutex));
+      for (tail = &worker_todo; *tail; tail = &(*tail)->next)
+        ;
+      *tail = img;
+      PTHREAD_VERIFY (pthread_cond_signal (&worker_cond));
+      PTHREAD_VERIFY (pthread_mutex_unlock (&worker_mutex));
+      return;
+    }
+# endif /* HAVE_PTHREAD */
 
-    /* Note: height+2 in "to" to be to work around an array bounds overrun
-       in gluBuild2DMipmaps / gluScaleImage. */
-    ximage->data = (char *) calloc (ximage->height+2, ximage->bytes_per_line);
+  prepare_image (img);
+  image_ready (img);
+}
 
-    if (!ximage->data ||
-        !XGetSubImage (dpy, dd.pixmap, 0, 0, ximage->width, ximage->height,
-                       ~0L, ximage->format, ximage, 0, 0))
-      {
-        XDestroyImage (ximage);
-        ximage = 0;
-      }
 
-    gl_settings_for_ximage (ximage, &type, &format, &swap);
-    glPixelStorei (GL_UNPACK_SWAP_BYTES, !swap);
-  }
-#endif /* REFORMAT_IMAGE_DATA */
+/* Stage 1.
+ */
+static void
+start_loading (texture_queue *q)
+{
+  Display *dpy = DisplayOfScreen (q->screen);
+  texture_image *img = (texture_image *) calloc (1, sizeof(*img));
+
+  img->queue = q;
+  img->load_time = double_time();
+  img->pixmap = XCreatePixmap (dpy, q->window, q->pix_width, q->pix_height,
+                               q->pix_depth);
+  q->loading++;
+  load_image_async (q->screen, q->window, img->pixmap, image_loaded_cb, img);
+}
 
-  XFreePixmap (dpy, dd.pixmap);
-  dd.pixmap = 0;
 
-  if (debug_p)
-    tex_time = double_time();
+static texture_queue *
+find_queue (Screen *screen, Window window, GLXContext glx_context,
+            int desired_width, int desired_height, Bool mipmap_p)
+{
+  Display *dpy = DisplayOfScreen (screen);
+  XWindowAttributes xgwa;
+  texture_queue *q;
+  int w, h;
 
-  if (! ximage)
-    ok = False;
-  else
+  XGetWindowAttributes (dpy, window, &xgwa);
+  w = xgwa.width;
+  h = xgwa.height;
+  if (desired_width  && desired_width  < xgwa.width)
+    w = desired_width;
+  if (desired_height && desired_height < xgwa.height)
+    h = desired_height;
+
+  for (q = texture_queues; q; q = q->next)
+    if (q->window == window && q->pix_width == w && q->pix_height == h &&
+        q->pix_depth == xgwa.depth && q->mipmap_p == mipmap_p &&
+        !q->stale_p)
+      return q;
+
+  /* If the window changed size, images preloaded at the old size aren't
+     going to be wanted any more. */
+  q = texture_queues;
+  while (q)
     {
-      iw = ximage->width;
-      ih = ximage->height;
-      if (dd.texid != -1)
-        glBindTexture (GL_TEXTURE_2D, dd.texid);
-
-      glPixelStorei (GL_UNPACK_ALIGNMENT, ximage->bitmap_pad / 8);
-      ok = ximage_to_texture (ximage, type, format, &tw, &th, geometry,
-                              dd.mipmap_p);
-      if (ok)
+      texture_queue *next = q->next;
+      if (q->window == window)
         {
-          iw = ximage->width;	/* in case the image was shrunk */
-          ih = ximage->height;
+          q->preload = 0;
+          q->stale_p = True;
+          retire_queue (q);
         }
+      q = next;
     }
 
-  if (ximage) XDestroyImage (ximage);
+  q = (texture_queue *) calloc (1, sizeof(*q));
+  q->screen     = screen;
+  q->window     = window;
+  q->pix_width  = w;
+  q->pix_height = h;
+  q->pix_depth  = xgwa.depth;
+  q->mipmap_p   = mipmap_p;
+  q->preload    = get_integer_resource (dpy, "preloadImages", "Integer");
+  if (q->preload < 0) q->preload = 0;
+
+  if (glx_context)
+    glXMakeCurrent (dpy, window, glx_context);
+  glGetIntegerv (GL_MAX_TEXTURE_SIZE, &q->max_size);
+
+  q->next = texture_queues;
+  texture_queues = q;
+  return q;
+}
 
-  if (! ok)
-    iw = ih = tw = th = 0;
 
-  if (debug_p)
-    done_time = double_time();
+/* Grabs an image of the desktop (or another random image file) and
+   loads the image into GL's texture memory.
+   When the callback is called, the image data will have been loaded
+   into texture number `texid' (via glBindTexture.)
 
-  if (debug_p)
-    fprintf (stderr,
-             /* prints: A + B + C = D
-                A = file I/O time (happens in background)
-                B = time to pull bits from server (this process)
-                C = time to convert bits to GL textures (this process)
-                D = total elapsed time from "want image" to "see image"
+   If an error occurred, width/height will be 0.
+ */
+void
+load_texture_async (Screen *screen, Window window,
+                    GLXContext glx_context,
+                    int desired_width, int desired_height,
+                    Bool mipmap_p,
+                    GLuint texid,
+                    void (*callback) (const char *filename,
+                                      XRectangle *geometry,
+                                      int image_width,
+                                      int image_height,
+                                      int texture_width,
+                                      int texture_height,
+                                      void *closure),
+                    void *closure)
+{
+  texture_queue *q = find_queue (screen, window, glx_context,
+                                 desired_width, desired_height, mipmap_p);
+  texture_request *req = (texture_request *) calloc (1, sizeof(*req));
+  texture_request **tail;
+
+  req->texid       = texid;
+  req->glx_context = glx_context;
+  req->callback    = callback;
+  req->closure     = closure;
+
+  for (tail = &q->requests; *tail; tail = &(*tail)->next)
+    ;
+  *tail = req;
+
+  fill_queue (q);
+  schedule_delivery (q);
+}
 
-                B+C is responsible for any frame-rate glitches.
-              */
-             "%s: loading elapsed: %.2f + %.2f + %.2f = %.2f sec\n",
-             progname,
-             cvt_time  - dd.load_time,
-             tex_time  - cvt_time,
-             done_time - tex_time,
-             done_time - dd.load_time);
-
-  if (dd.callback)
-    /* asynchronous mode */
-    dd.callback (name, geometry, iw, ih, tw, th, dd.closure);
-  else
-    {
-      /* synchronous mode */
-      if (dd.filename_return)       *dd.filename_return       = (char *) name;
-      if (dd.geometry_return)       *dd.geometry_return       = *geometry;
-      if (dd.image_width_return)    *dd.image_width_return    = iw;
-      if (dd.image_height_return)   *dd.image_height_return   = ih;
-      if (dd.texture_width_return)  *dd.texture_width_return  = tw;
-      if (dd.texture_height_return) *dd.texture_height_return = th;
-    }
+
+void
+texture_upload_stats (int *count_ret, double *avg_ret, double *max_ret)
+{
+  if (count_ret) *count_ret = upload_stats.count;
+  if (avg_ret)
+    *avg_ret = (upload_stats.count
+                ? upload_stats.total / upload_stats.count
+                : 0);
+  if (max_ret) *max_ret = upload_stats.max;
 }
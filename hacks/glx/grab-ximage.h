@@ -59,6 +59,11 @@
    into texture number `texid' (via glBindTexture.)
 
    If an error occurred, width/height will be 0.
+
+   The conversion and mipmapping happen on a background thread, and only
+   the upload itself happens on this one.  If the "preloadImages" resource
+   is N, then N more images are loaded ahead of time, so that the next
+   call is likely to find one already waiting.
  */
 void load_texture_async (Screen *, Window, GLXContext,
                          int desired_width, int desired_height,
@@ -73,4 +78,10 @@ void load_texture_async (Screen *, Window, GLXContext,
                                            void *closure),
                          void *closure);
 
+/* How long the GL side of loading textures has taken so far: the number
+   of textures, and the average and longest time per texture, in seconds.
+   The rest of the work happens in the background and isn't counted.
+ */
+void texture_upload_stats (int *count, double *avg_secs, double *max_secs);
+
 #endif /* __GRAB_XIMAGE_H__ */
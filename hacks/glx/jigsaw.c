@@ -55,7 +55,8 @@
 		  "*wireframe:		False	\n" \
 		  "*desktopGrabber:   xscreensaver-getimage -no-desktop %s\n" \
 		  "*grabDesktopImages:	False	\n" \
-		  "*chooseRandomImages:	True	\n"
+		  "*chooseRandomImages:	True	\n" \
+		  "*preloadImages:	1	\n"
 
 
 # define refresh_jigsaw 0
@@ -164,6 +165,7 @@ static XrmOptionDescRec opts[] = {
   { "-thickness",  ".thickness",   XrmoptionSepArg, 0 },
   { "-wobble",     ".wobble",      XrmoptionNoArg, "True" },
   { "+wobble",     ".wobble",      XrmoptionNoArg, "False" },
+  { "-preload",    ".preloadImages", XrmoptionSepArg, 0 },
   { "-debug",      ".debug",       XrmoptionNoArg, "True" },
 };
 
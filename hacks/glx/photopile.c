@@ -18,6 +18,7 @@
                   "*showFPS:         False     \n" \
                   "*fpsSolid:        True      \n" \
                   "*useSHM:          True      \n" \
+                  "*preloadImages:   1         \n" \
                   "*font:          " DEF_FONT "\n" \
                   "*desktopGrabber:  xscreensaver-getimage -no-desktop %s\n" \
                   "*grabDesktopImages:   False \n" \
@@ -129,6 +130,7 @@ static XrmOptionDescRec opts[] = {
   {"-no-clip",      ".clip",          XrmoptionNoArg, "False" },
   {"-shadows",      ".shadows",       XrmoptionNoArg, "True"  },
   {"-no-shadows",   ".shadows",       XrmoptionNoArg, "False" },
+  {"-preload",      ".preloadImages", XrmoptionSepArg, 0 },
   {"-debug",        ".debug",         XrmoptionNoArg, "True"  },
   {"-font",         ".font",          XrmoptionSepArg, 0 },
 };
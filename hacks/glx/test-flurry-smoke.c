@@ -0,0 +1,210 @@
+/* test-flurry-smoke.c --- checks flurry's vector smoke update against the
+ * scalar one.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee.  No
+ * representations are made about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * Usage: test-flurry-smoke [frames]
+ *
+ * Runs flurry's star, sparks and smoke the way flurry.c does, with a fixed
+ * frame time, for each number of streams from 1 to 8.  Every frame, the
+ * smoke is copied twice and each copy is updated once: by
+ * UpdateSmoke_ScalarBase, and by the SSE2 or NEON version.  Emitting puffs
+ * is switched off for those two calls, since it draws random numbers.
+ * The same particles must die in both, and the live ones must end up in
+ * nearly the same place: the scalar version does some of its arithmetic
+ * in double, so they can differ in the last bits.
+ */
+
+#include "flurry.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define FRAME_TIME (1.0 / 60)
+#define TOLERANCE 1e-4
+
+#if defined(OPT_MODE_VECTOR_SSE)
+# define UpdateSmoke_Vector UpdateSmoke_SSE
+# define VECTOR_NAME "SSE2"
+#elif defined(OPT_MODE_VECTOR_NEON)
+# define UpdateSmoke_Vector UpdateSmoke_NEON
+# define VECTOR_NAME "NEON"
+#endif
+
+#ifdef UpdateSmoke_Vector
+
+/* How far apart lane k of two vectors of three fields is, relative to the
+   length of the first, or absolute if that is less than 1.  The delta
+   is a sum of pulls that can nearly cancel, so it is only as accurate as
+   its length, not as each component.
+ */
+static double
+compare (const floatToVector *a, const floatToVector *b, int k,
+         double *worst)
+{
+  double d2 = 0, m2 = 0, d;
+  int j;
+  for (j = 0; j < 3; j++)
+    {
+      double e = a[j].f[k] - b[j].f[k];
+      d2 += e * e;
+      m2 += (double) a[j].f[k] * a[j].f[k];
+    }
+  d = sqrt (m2 > 1 ? d2 / m2 : d2);
+  if (d > *worst) *worst = d;
+  return d;
+}
+
+/* Returns the number of particles that differ too much, and updates the
+   largest relative difference seen.
+ */
+static int
+compare_smoke (const SmokeV *a, const SmokeV *b, double *worst)
+{
+  int i, k, bad = 0;
+  for (i = 0; i < NUMSMOKEPARTICLES/4; i++)
+    for (k = 0; k < 4; k++)
+      {
+        double d = 0, e;
+        if (a->p[i].dead.i[k] != b->p[i].dead.i[k])
+          {
+            bad++;
+            continue;
+          }
+        if (a->p[i].dead.i[k])
+          continue;
+        e = compare (a->p[i].position, b->p[i].position, k, worst);
+        if (e > d) d = e;
+        e = compare (a->p[i].oldposition, b->p[i].oldposition, k, worst);
+        if (e > d) d = e;
+        e = compare (a->p[i].delta, b->p[i].delta, k, worst);
+        if (e > d) d = e;
+        if (d > TOLERANCE)
+          bad++;
+      }
+  return bad;
+}
+
+int
+main (int argc, char **argv)
+{
+  int frames = (argc > 1 ? atoi (argv[1]) : 1000);
+  global_info_t global;
+  flurry_info_t flurry;
+  SmokeV *a, *b;
+  int streams, frame, i, k, errors = 0;
+  double worst = 0;
+  long live = 0;
+
+  a = (SmokeV *) malloc (sizeof(*a));
+  b = (SmokeV *) malloc (sizeof(*b));
+  if (!a || !b)
+    {
+      fprintf (stderr, "%s: out of memory\n", argv[0]);
+      exit (1);
+    }
+
+  memset (&global, 0, sizeof(global));
+  global.sys_glWidth = 1024;
+  global.sys_glHeight = 768;
+  global.flurry = &flurry;
+
+  for (streams = 1; streams <= 8; streams++)
+    {
+      memset (&flurry, 0, sizeof(flurry));
+      flurry.numStreams = streams;
+      flurry.streamExpansion = 10000;
+      flurry.currentColorMode = tiedyeColorMode;
+      flurry.briteFactor = 1;
+      flurry.fTime = 100;
+
+      flurry.s = (SmokeV *) malloc (sizeof(SmokeV));
+      flurry.star = (Star *) malloc (sizeof(Star));
+      if (!flurry.s || !flurry.star)
+        {
+          fprintf (stderr, "%s: out of memory\n", argv[0]);
+          exit (1);
+        }
+      InitSmoke (flurry.s);
+      InitStar (flurry.star);
+      flurry.star->rotSpeed = 1;
+      for (i = 0; i < MAX_SPARKS; i++)
+        {
+          flurry.spark[i] = (Spark *) malloc (sizeof(Spark));
+          if (!flurry.spark[i])
+            {
+              fprintf (stderr, "%s: out of memory\n", argv[0]);
+              exit (1);
+            }
+          InitSpark (flurry.spark[i]);
+          flurry.spark[i]->mystery = 1800 * (i + 1) / 13;
+          UpdateSpark (&global, &flurry, flurry.spark[i]);
+        }
+      for (i = 0; i < NUMSMOKEPARTICLES/4; i++)
+        for (k = 0; k < 4; k++)
+          flurry.s->p[i].dead.i[k] = 1;
+
+      for (frame = 0; frame < frames; frame++)
+        {
+          int bad;
+
+          flurry.dframe++;
+          flurry.fOldTime = flurry.fTime;
+          flurry.fTime += FRAME_TIME;
+          flurry.fDeltaTime = flurry.fTime - flurry.fOldTime;
+          flurry.drag = (float) pow (0.9965, flurry.fDeltaTime * 85.0);
+
+          UpdateStar (&global, &flurry, flurry.star);
+          for (i = 0; i < flurry.numStreams; i++)
+            UpdateSpark (&global, &flurry, flurry.spark[i]);
+
+          memcpy (a, flurry.s, sizeof(*a));
+          a->lastParticleTime = flurry.fTime;
+          memcpy (b, a, sizeof(*b));
+          UpdateSmoke_ScalarBase (&global, &flurry, a);
+          UpdateSmoke_Vector (&global, &flurry, b);
+
+          bad = compare_smoke (a, b, &worst);
+          if (bad)
+            {
+              fprintf (stderr, "%s: %d streams, frame %d: %d particles differ\n",
+                       argv[0], streams, frame, bad);
+              errors++;
+            }
+          for (i = 0; i < NUMSMOKEPARTICLES/4; i++)
+            for (k = 0; k < 4; k++)
+              if (!a->p[i].dead.i[k])
+                live++;
+
+          /* Carry on from the scalar update, with the usual puffs. */
+          UpdateSmoke_ScalarBase (&global, &flurry, flurry.s);
+        }
+
+      free (flurry.s);
+      free (flurry.star);
+      for (i = 0; i < MAX_SPARKS; i++)
+        free (flurry.spark[i]);
+    }
+
+  printf ("%s against scalar: %ld particle updates over %d frames,\n"
+          "  largest relative difference %.2g\n",
+          VECTOR_NAME, live, 8 * frames, worst);
+
+  free (a);
+  free (b);
+  return (errors ? 1 : 0);
+}
+
+#else  /* !UpdateSmoke_Vector */
+
+int
+main (int argc, char **argv)
+{
+  printf ("%s: no vector smoke update on this machine\n", argv[0]);
+  return 0;
+}
+
+#endif /* !UpdateSmoke_Vector */
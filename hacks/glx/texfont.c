@@ -45,16 +45,41 @@ extern void check_gl_error (const char *type);
 /* screenhack.h */
 extern char *progname;
 
+/* Where one character lives in the glyph atlas, and how big it is.
+ */
+typedef struct {
+  int lbearing, rbearing, ascent, descent, width;
+  int page;                     /* which texture, or -1 if not drawable */
+  GLfloat s0, t0, s1, t1;       /* tex coords of points A and C, below */
+} texfont_glyph;
+
+/* A string that has been laid out into one vertex array.  The vertexes
+   are 4 floats each (s, t, x, y), 6 per character (two triangles), and
+   are sorted by texture page so that each page is one glDrawArrays.
+ */
+typedef struct {
+  char *string;
+  GLfloat *verts;
+  int *page_start;              /* npages+1 offsets into verts, in vertexes */
+} texfont_layout;
+
+#ifndef TEXFONT_CACHE_SIZE
+# define TEXFONT_CACHE_SIZE 16  /* set to 0 to disable the layout cache */
+#endif
+
 struct texture_font_data {
   Display *dpy;
   XFontStruct *font;
-  int cell_width, cell_height;  /* maximal charcell */
-  int tex_width, tex_height;    /* size of each texture */
 
-  int grid_mag;			/* 1,  2,  4, or 8 */
-  int ntextures;		/* 1,  4, 16, or 64 (grid_mag ^ 2) */
+  texfont_glyph glyphs[256];
 
-  GLuint texid[64];		/* must hold ntextures */
+  int npages;                   /* how many textures the atlas fills */
+  GLuint *texid;
+
+# if TEXFONT_CACHE_SIZE > 0
+  texfont_layout *cache[TEXFONT_CACHE_SIZE];
+  int cache_next;
+# endif
 };
 
 
@@ -159,6 +184,23 @@ bitmap_to_texture (Display *dpy, Pixmap p, Visual *visual, int *wP, int *hP)
 }
 
 
+/* Size of a glyph's ink box in the atlas, plus a gutter so that
+   neighbors don't bleed into each other at lower mipmap levels.
+ */
+#define GLYPH_PAD 2
+#define GLYPH_W(g) ((g)->rbearing - (g)->lbearing + 1 + GLYPH_PAD*2)
+#define GLYPH_H(g) ((g)->ascent   + (g)->descent  + 1 + GLYPH_PAD*2)
+
+static int
+glyph_height_cmp (const void *a, const void *b)
+{
+  const texfont_glyph *ga = *(const texfont_glyph **) a;
+  const texfont_glyph *gb = *(const texfont_glyph **) b;
+  int d = GLYPH_H(gb) - GLYPH_H(ga);
+  return (d ? d : GLYPH_W(gb) - GLYPH_W(ga));
+}
+
+
 /* Loads the font named by the X resource "res" and returns
    a texture-font object.
 */
@@ -230,118 +272,135 @@ load_texture_font (Display *dpy, char *res)
   data->dpy = dpy;
   data->font = f;
 
-  /* Figure out how many textures to use.
-     E.g., if we need 1024x1024 bits, use four 512x512 textures,
-     to be gentle to machines with low texture size limits.
+  /* Pack every character's ink box into as few textures as possible,
+     rather than giving each one a max_bounds-sized cell.  Glyphs are
+     placed tallest-first on shelves, and a new texture is started when
+     a square page fills up.
    */
   {
-    int w = to_pow2 (16 * (f->max_bounds.rbearing - f->min_bounds.lbearing));
-    int h = to_pow2 (16 * (f->max_bounds.ascent   + f->max_bounds.descent));
-    int i = (w > h ? w : h);
+    texfont_glyph *sorted[256];
+    int nsorted = 0;
+    int area = 0, widest = 0;
+    int page_w;
+    int shelf_x = 0, shelf_y = 0, shelf_h = 0;
+    int *page_heights;
+    int i;
+
+    for (i = 0; i < 256; i++)
+      {
+        texfont_glyph *g = &data->glyphs[i];
+        XCharStruct *cs = (f->per_char &&
+                           i >= f->min_char_or_byte2 &&
+                           i <= f->max_char_or_byte2
+                           ? &f->per_char[i - f->min_char_or_byte2]
+                           : 0);
+        g->lbearing = (cs ? cs->lbearing : f->min_bounds.lbearing);
+        g->rbearing = (cs ? cs->rbearing : f->max_bounds.rbearing);
+        g->ascent   = (cs ? cs->ascent   : f->max_bounds.ascent);
+        g->descent  = (cs ? cs->descent  : f->max_bounds.descent);
+        g->width    = (cs ? cs->width    : f->max_bounds.width);
+        g->page = -1;
+
+        if (g->width > 0 && i != ' ')
+          {
+            int w = GLYPH_W(g);
+            sorted[nsorted++] = g;
+            area += w * GLYPH_H(g);
+            if (w > widest) widest = w;
+          }
+      }
 
-    if      (i <= 512)  data->grid_mag = 1;  /*  1 tex of 16x16 chars */
-    else if (i <= 1024) data->grid_mag = 2;  /*  4 tex of 8x8 chars */
-    else if (i <= 2048) data->grid_mag = 4;  /* 16 tex of 4x4 chars */
-    else                data->grid_mag = 8;  /* 32 tex of 2x2 chars */
+    qsort (sorted, nsorted, sizeof(*sorted), glyph_height_cmp);
 
-    data->ntextures = data->grid_mag * data->grid_mag;
+    /* Square-ish and no bigger than 512, to be gentle to machines with
+       low texture size limits, unless a single glyph needs more.
+     */
+    page_w = 1;
+    while (page_w * page_w < area + area / 4 && page_w < 512)
+      page_w <<= 1;
+    page_w = to_pow2 (widest > page_w ? widest : page_w);
 
-# if 0
-    fprintf (stderr,
-             "%s: %dx%d grid of %d textures of %dx%d chars (%dx%d bits)\n",
-             progname,
-             data->grid_mag, data->grid_mag,
-             data->ntextures,
-             16 / data->grid_mag, 16 / data->grid_mag,
-             i, i);
-# endif
-  }
+    page_heights = (int *) calloc (nsorted + 1, sizeof(*page_heights));
+    data->npages = (nsorted ? 1 : 0);
 
-  for (which = 0; which < data->ntextures; which++)
-    {
-      /* Create a pixmap big enough to fit every character in the font.
-         (modulo the "ntextures" scaling.)
-         Make it square-ish, since GL likes dimensions to be powers of 2.
-       */
-      XGCValues gcv;
-      GC gc;
-      Pixmap p;
-      int cw = f->max_bounds.rbearing - f->min_bounds.lbearing;
-      int ch = f->max_bounds.ascent   + f->max_bounds.descent;
-      int grid_size = (16 / data->grid_mag);
-      int w = cw * grid_size;
-      int h = ch * grid_size;
-      int i;
-
-      data->cell_width  = cw;
-      data->cell_height = ch;
-
-      p = XCreatePixmap (dpy, root, w, h, xgwa.depth);
-      gcv.font = f->fid;
-      gcv.foreground = BlackPixelOfScreen (xgwa.screen);
-      gcv.background = BlackPixelOfScreen (xgwa.screen);
-      gc = XCreateGC (dpy, p, (GCFont|GCForeground|GCBackground), &gcv);
-      XFillRectangle (dpy, p, gc, 0, 0, w, h);
-      XSetForeground (dpy, gc, WhitePixelOfScreen (xgwa.screen));
-      for (i = 0; i < 256 / data->ntextures; i++)
-        {
-          int ii = (i + (which * 256 / data->ntextures));
-          char c = (char) ii;
-          int x = (i % grid_size) * cw;
-          int y = (i / grid_size) * ch;
-
-          /* See comment in print_texture_string for bit layout explanation.
-           */
-          int lbearing = (f->per_char && ii >= f->min_char_or_byte2
-                          ? f->per_char[ii - f->min_char_or_byte2].lbearing
-                          : f->min_bounds.lbearing);
-          int ascent   = (f->per_char && ii >= f->min_char_or_byte2
-                          ? f->per_char[ii - f->min_char_or_byte2].ascent
-                          : f->max_bounds.ascent);
-          int width    = (f->per_char && ii >= f->min_char_or_byte2
-                          ? f->per_char[ii - f->min_char_or_byte2].width
-                          : f->max_bounds.width);
-
-          if (width == 0) continue;
-          XDrawString (dpy, p, gc, x - lbearing, y + ascent, &c, 1);
-        }
-      XFreeGC (dpy, gc);
+    for (i = 0; i < nsorted; i++)
+      {
+        texfont_glyph *g = sorted[i];
+        int w = GLYPH_W(g);
+        int h = GLYPH_H(g);
+        if (shelf_x + w > page_w)		/* next shelf */
+          {
+            shelf_y += shelf_h;
+            shelf_x = 0;
+            shelf_h = 0;
+          }
+        if (shelf_y + h > page_w && shelf_y > 0)	/* next page */
+          {
+            page_heights[data->npages-1] = shelf_y;
+            data->npages++;
+            shelf_x = shelf_y = shelf_h = 0;
+          }
+        g->page = data->npages - 1;
+        g->s0 = shelf_x;  /* pixels for now; normalized below */
+        g->t0 = shelf_y;
+        shelf_x += w;
+        if (h > shelf_h) shelf_h = h;
+      }
+    if (data->npages)
+      page_heights[data->npages-1] = shelf_y + shelf_h;
 
-      glGenTextures (1, &data->texid[which]);
-      glBindTexture (GL_TEXTURE_2D, data->texid[which]);
-      check_gl_error ("texture font load");
-      data->tex_width  = w;
-      data->tex_height = h;
+    data->texid = (GLuint *) calloc (data->npages + 1, sizeof(*data->texid));
 
-#if 0  /* debugging: write the bitmap to a pgm file */
+    for (which = 0; which < data->npages; which++)
       {
-        char file[255];
-        XImage *image;
-        int x, y;
-        FILE *ff;
-        sprintf (file, "/tmp/%02d.pgm", which);
-        image = XGetImage (dpy, p, 0, 0, w, h, ~0L, ZPixmap);
-        ff = fopen (file, "w");
-        fprintf (ff, "P5\n%d %d\n255\n", w, h);
-        for (y = 0; y < h; y++)
-          for (x = 0; x < w; x++) {
-            unsigned long pix = XGetPixel (image, x, y);
-            unsigned long r = (pix & xgwa.visual->red_mask);
-            r = ((r >> 24) | (r >> 16) | (r >> 8) | r);
-            fprintf (ff, "%c", (char) r);
+        XGCValues gcv;
+        GC gc;
+        Pixmap p;
+        int w = page_w;
+        int h = to_pow2 (page_heights[which]);
+
+        p = XCreatePixmap (dpy, root, w, h, xgwa.depth);
+        gcv.font = f->fid;
+        gcv.foreground = BlackPixelOfScreen (xgwa.screen);
+        gcv.background = BlackPixelOfScreen (xgwa.screen);
+        gc = XCreateGC (dpy, p, (GCFont|GCForeground|GCBackground), &gcv);
+        XFillRectangle (dpy, p, gc, 0, 0, w, h);
+        XSetForeground (dpy, gc, WhitePixelOfScreen (xgwa.screen));
+
+        for (i = 0; i < 256; i++)
+          {
+            texfont_glyph *g = &data->glyphs[i];
+            char c = (char) i;
+            int ax, ay;
+            if (g->page != which) continue;
+
+            /* See comment in print_texture_string for bit layout. */
+            ax = g->s0 + GLYPH_PAD;
+            ay = g->t0 + GLYPH_PAD;
+            XDrawString (dpy, p, gc, ax - g->lbearing, ay + g->ascent, &c, 1);
+
+            g->s0 = (GLfloat) ax / w;
+            g->t0 = (GLfloat) ay / h;
+            g->s1 = (GLfloat) (ax + g->rbearing - g->lbearing + 1) / w;
+            g->t1 = (GLfloat) (ay + g->ascent   + g->descent  + 1) / h;
           }
-        fclose (ff);
-        XDestroyImage (image);
-        fprintf (stderr, "%s: wrote %s (%d x %d)\n", progname, file,
-                 f->max_bounds.rbearing - f->min_bounds.lbearing,
-                 f->max_bounds.ascent   + f->max_bounds.descent);
+        XFreeGC (dpy, gc);
+
+        glGenTextures (1, &data->texid[which]);
+        glBindTexture (GL_TEXTURE_2D, data->texid[which]);
+        check_gl_error ("texture font load");
+
+# if 0
+        fprintf (stderr, "%s: texture font page %d of %d: %dx%d\n",
+                 progname, which + 1, data->npages, w, h);
+# endif
+
+        bitmap_to_texture (dpy, p, xgwa.visual, &w, &h);
+        XFreePixmap (dpy, p);
       }
-#endif /* 0 */
 
-      bitmap_to_texture (dpy, p, xgwa.visual, 
-                         &data->tex_width, &data->tex_height);
-      XFreePixmap (dpy, p);
-    }
+    free (page_heights);
+  }
 
   /* Reset to the caller's default */
   glBindTexture (GL_TEXTURE_2D, old_texture);
@@ -382,46 +441,40 @@ texture_string_width (texture_font_data *data, const char *c,
 }
 
 
-/* Draws the string in the scene at the current point.
+/* Lays out the string into a single vertex array, one run per texture page.
    Newlines, tab stops and subscripts are honored.
  */
-void
-print_texture_string (texture_font_data *data, const char *string)
+static texfont_layout *
+layout_texture_string (texture_font_data *data, const char *string)
 {
   XFontStruct *f = data->font;
-  GLfloat line_height = f->ascent + f->descent;
+  int line_height = f->ascent + f->descent;
 # ifdef DO_SUBSCRIPTS
-  GLfloat sub_shift = (line_height * 0.3);
+  int sub_shift = (line_height * 0.3);
   Bool sub_p = False;
 # endif /* DO_SUBSCRIPTS */
   int cw = texture_string_width (data, "m", 0);
   int tabs = cw * 7;
-  int x, y;
-  unsigned int i;
-  GLint old_texture = 0;
-  GLfloat omatrix[16];
-  int ofront;
-
-  glGetIntegerv (GL_TEXTURE_BINDING_2D, &old_texture);
-  glGetIntegerv (GL_FRONT_FACE, &ofront);
-  glGetFloatv (GL_TEXTURE_MATRIX, omatrix);
-
-  clear_gl_error ();
-
-  glPushMatrix();
-
-  glNormal3f (0, 0, 1);
-  glFrontFace (GL_CW);
-
-  glMatrixMode (GL_TEXTURE);
-  glLoadIdentity ();
-  glMatrixMode (GL_MODELVIEW);
-
+  int len = strlen (string);
+  texfont_layout *l = (texfont_layout *) calloc (1, sizeof(*l));
+  unsigned char *gc = (unsigned char *) malloc (len + 1);
+  int *gx = (int *) malloc ((len + 1) * sizeof(*gx));
+  int *gy = (int *) malloc ((len + 1) * sizeof(*gy));
+  int *fill;
+  int n = 0;
+  int x, y, i, p;
+
+  l->string = strdup (string);
+  l->page_start = (int *) calloc (data->npages + 1, sizeof(*l->page_start));
+
+  /* First pass: positions, and how many characters land on each page.
+   */
   x = 0;
   y = 0;
-  for (i = 0; i < strlen(string); i++)
+  for (i = 0; i < len; i++)
     {
       unsigned char c = string[i];
+      texfont_glyph *g = &data->glyphs[c];
       if (c == '\n')
         {
           y -= line_height;
@@ -446,109 +499,186 @@ print_texture_string (texture_font_data *data, const char *string)
 # endif /* DO_SUBSCRIPTS */
       else
         {
-          /* For a small font, the texture is divided into 16x16 rectangles
-             whose size are the max_bounds charcell of the font.  Within each
-             rectangle, the individual characters' charcells sit in the upper
-             left.
-
-             For a larger font, the texture will itself be subdivided, to
-             keep the texture sizes small (in that case we deal with, e.g.,
-             4 grids of 8x8 characters instead of 1 grid of 16x16.)
-
-             Within each texture:
-
-               [A]----------------------------
-                |     |           |   |      |
-                |   l |         w |   | r    |
-                |   b |         i |   | b    |
-                |   e |         d |   | e    |
-                |   a |         t |   | a    |
-                |   r |         h |   | r    |
-                |   i |           |   | i    |
-                |   n |           |   | n    |
-                |   g |           |   | g    |
-                |     |           |   |      |
-                |----[B]----------|---|      |
-                |     |   ascent  |   |      |
-                |     |           |   |      |
-                |     |           |   |      |
-                |--------------------[C]     |
-                |         descent            |
-                |                            | cell_width,
-                ------------------------------ cell_height
-
-             We want to make a quad from point A to point C.
-             We want to position that quad so that point B lies at x,y.
-           */
-          int lbearing = (f->per_char && c >= f->min_char_or_byte2
-                          ? f->per_char[c - f->min_char_or_byte2].lbearing
-                          : f->min_bounds.lbearing);
-          int rbearing = (f->per_char && c >= f->min_char_or_byte2
-                          ? f->per_char[c - f->min_char_or_byte2].rbearing
-                          : f->max_bounds.rbearing);
-          int ascent   = (f->per_char && c >= f->min_char_or_byte2
-                          ? f->per_char[c - f->min_char_or_byte2].ascent
-                          : f->max_bounds.ascent);
-          int descent  = (f->per_char && c >= f->min_char_or_byte2
-                          ? f->per_char[c - f->min_char_or_byte2].descent
-                          : f->max_bounds.descent);
-          int cwidth   = (f->per_char && c >= f->min_char_or_byte2
-                          ? f->per_char[c - f->min_char_or_byte2].width
-                          : f->max_bounds.width);
-
-          unsigned char cc = c % (256 / data->ntextures);
-
-          int gs = (16 / data->grid_mag);		  /* grid size */
-
-          int ax = ((int) cc % gs) * data->cell_width;    /* point A */
-          int ay = ((int) cc / gs) * data->cell_height;
-
-          int bx = ax - lbearing;                         /* point B */
-          int by = ay + ascent;
-
-          int cx = bx + rbearing + 1;                     /* point C */
-          int cy = by + descent  + 1;
-
-          GLfloat tax = (GLfloat) ax / data->tex_width;  /* tex coords of A */
-          GLfloat tay = (GLfloat) ay / data->tex_height;
-
-          GLfloat tcx = (GLfloat) cx / data->tex_width;  /* tex coords of C */
-          GLfloat tcy = (GLfloat) cy / data->tex_height;
-
-          GLfloat qx0 = x + lbearing;			 /* quad top left */
-          GLfloat qy0 = y + ascent;
-          GLfloat qx1 = qx0 + rbearing - lbearing;       /* quad bot right */
-          GLfloat qy1 = qy0 - (ascent + descent);
-
-          if (cwidth > 0 && c != ' ')
+          if (g->page >= 0)
             {
-              int which = c / (256 / data->ntextures);
-              if (which >= data->ntextures) abort();
-              glBindTexture (GL_TEXTURE_2D, data->texid[which]);
-
-              glBegin (GL_QUADS);
-              glTexCoord2f (tax, tay); glVertex3f (qx0, qy0, 0);
-              glTexCoord2f (tcx, tay); glVertex3f (qx1, qy0, 0);
-              glTexCoord2f (tcx, tcy); glVertex3f (qx1, qy1, 0);
-              glTexCoord2f (tax, tcy); glVertex3f (qx0, qy1, 0);
-              glEnd();
-#if 0
-              glDisable(GL_TEXTURE_2D);
-              glBegin (GL_LINE_LOOP);
-              glTexCoord2f (tax, tay); glVertex3f (qx0, qy0, 0);
-              glTexCoord2f (tcx, tay); glVertex3f (qx1, qy0, 0);
-              glTexCoord2f (tcx, tcy); glVertex3f (qx1, qy1, 0);
-              glTexCoord2f (tax, tcy); glVertex3f (qx0, qy1, 0);
-              glEnd();
-              glEnable(GL_TEXTURE_2D);
-#endif
+              gc[n] = c;
+              gx[n] = x;
+              gy[n] = y;
+              n++;
+              l->page_start[g->page + 1] += 6;
             }
-
-          x += cwidth;
+          x += g->width;
         }
+    }
+
+  for (p = 0; p < data->npages; p++)
+    l->page_start[p + 1] += l->page_start[p];
+
+  l->verts = (GLfloat *) malloc ((l->page_start[data->npages] + 1) *
+                                 4 * sizeof(*l->verts));
+
+  /* Second pass: emit two triangles per character.
+
+     Within the atlas, each character's ink box sits at point A:
+
+       [A]----------------------------
+        |     |           |   |      |
+        |   l |         w |   | r    |
+        |   b |         i |   | b    |
+        |   e |         d |   | e    |
+        |   a |         t |   | a    |
+        |   r |         h |   | r    |
+        |   i |           |   | i    |
+        |   n |           |   | n    |
+        |   g |           |   | g    |
+        |     |           |   |      |
+        |----[B]----------|---|      |
+        |     |   ascent  |   |      |
+        |     |           |   |      |
+        |     |           |   |      |
+        |--------------------[C]     |
+        |         descent            |
+        |                            |
+        ------------------------------
+
+     We want to make a quad from point A to point C.
+     We want to position that quad so that point B lies at x,y.
+   */
+  fill = (int *) malloc ((data->npages + 1) * sizeof(*fill));
+  for (p = 0; p < data->npages; p++)
+    fill[p] = l->page_start[p];
+
+  for (i = 0; i < n; i++)
+    {
+      texfont_glyph *g = &data->glyphs[gc[i]];
+      GLfloat qx0, qy0, qx1, qy1, *v;
+
+      qx0 = gx[i] + g->lbearing;		/* quad top left */
+      qy0 = gy[i] + g->ascent;
+      qx1 = qx0 + g->rbearing - g->lbearing;	/* quad bot right */
+      qy1 = qy0 - (g->ascent + g->descent);
+
+      v = l->verts + fill[g->page] * 4;
+      fill[g->page] += 6;
+
+# define VERT(S,T,X,Y) *v++ = (S); *v++ = (T); *v++ = (X); *v++ = (Y)
+      VERT (g->s0, g->t0, qx0, qy0);
+      VERT (g->s1, g->t0, qx1, qy0);
+      VERT (g->s1, g->t1, qx1, qy1);
+      VERT (g->s0, g->t0, qx0, qy0);
+      VERT (g->s1, g->t1, qx1, qy1);
+      VERT (g->s0, g->t1, qx0, qy1);
+# undef VERT
+    }
+
+  free (fill);
+  free (gc);
+  free (gx);
+  free (gy);
+  return l;
+}
+
+
+static void
+free_texture_layout (texfont_layout *l)
+{
+  free (l->string);
+  free (l->verts);
+  free (l->page_start);
+  free (l);
+}
+
+
+/* Returns the layout of the string, from the cache if we've seen it lately.
+   The returned layout belongs to the font unless *free_p is set.
+ */
+static texfont_layout *
+get_texture_layout (texture_font_data *data, const char *string, Bool *free_p)
+{
+  texfont_layout *l;
+# if TEXFONT_CACHE_SIZE > 0
+  int i;
+  for (i = 0; i < TEXFONT_CACHE_SIZE; i++)
+    if (data->cache[i] && !strcmp (data->cache[i]->string, string))
+      {
+        *free_p = False;
+        return data->cache[i];
       }
+
+  l = layout_texture_string (data, string);
+  if (data->cache[data->cache_next])
+    free_texture_layout (data->cache[data->cache_next]);
+  data->cache[data->cache_next] = l;
+  data->cache_next = (data->cache_next + 1) % TEXFONT_CACHE_SIZE;
+  *free_p = False;
+# else  /* !TEXFONT_CACHE_SIZE */
+  l = layout_texture_string (data, string);
+  *free_p = True;
+# endif /* !TEXFONT_CACHE_SIZE */
+  return l;
+}
+
+
+/* Draws the string in the scene at the current point.
+   Newlines, tab stops and subscripts are honored.
+ */
+void
+print_texture_string (texture_font_data *data, const char *string)
+{
+  texfont_layout *l;
+  Bool free_p = False;
+  int p;
+  GLint old_texture = 0;
+  GLfloat omatrix[16];
+  int ofront;
+  GLboolean overt, otex, onorm, ocolor;
+
+  glGetIntegerv (GL_TEXTURE_BINDING_2D, &old_texture);
+  glGetIntegerv (GL_FRONT_FACE, &ofront);
+  glGetFloatv (GL_TEXTURE_MATRIX, omatrix);
+  overt  = glIsEnabled (GL_VERTEX_ARRAY);
+  otex   = glIsEnabled (GL_TEXTURE_COORD_ARRAY);
+  onorm  = glIsEnabled (GL_NORMAL_ARRAY);
+  ocolor = glIsEnabled (GL_COLOR_ARRAY);
+
+  clear_gl_error ();
+
+  l = get_texture_layout (data, string, &free_p);
+
+  glPushMatrix();
+
+  glNormal3f (0, 0, 1);
+  glFrontFace (GL_CW);
+
+  glMatrixMode (GL_TEXTURE);
+  glLoadIdentity ();
+  glMatrixMode (GL_MODELVIEW);
+
+  if (onorm)  glDisableClientState (GL_NORMAL_ARRAY);
+  if (ocolor) glDisableClientState (GL_COLOR_ARRAY);
+  glEnableClientState (GL_VERTEX_ARRAY);
+  glEnableClientState (GL_TEXTURE_COORD_ARRAY);
+  glTexCoordPointer (2, GL_FLOAT, 4 * sizeof(GLfloat), l->verts);
+  glVertexPointer   (2, GL_FLOAT, 4 * sizeof(GLfloat), l->verts + 2);
+
+  for (p = 0; p < data->npages; p++)
+    {
+      int n = l->page_start[p + 1] - l->page_start[p];
+      if (n <= 0) continue;
+      glBindTexture (GL_TEXTURE_2D, data->texid[p]);
+      glDrawArrays (GL_TRIANGLES, l->page_start[p], n);
+    }
+
+  if (!overt)  glDisableClientState (GL_VERTEX_ARRAY);
+  if (!otex)   glDisableClientState (GL_TEXTURE_COORD_ARRAY);
+  if (onorm)   glEnableClientState (GL_NORMAL_ARRAY);
+  if (ocolor)  glEnableClientState (GL_COLOR_ARRAY);
+
   glPopMatrix();
 
+  if (free_p)
+    free_texture_layout (l);
+
   /* Reset to the caller's default */
   glBindTexture (GL_TEXTURE_2D, old_texture);
   glFrontFace (ofront);
@@ -568,8 +698,14 @@ free_texture_font (texture_font_data *data)
   int i;
   if (data->font)
     XFreeFont (data->dpy, data->font);
-  for (i = 0; i < data->ntextures; i++)
+  for (i = 0; i < data->npages; i++)
     if (data->texid[i])
       glDeleteTextures (1, &data->texid[i]);
+  free (data->texid);
+# if TEXFONT_CACHE_SIZE > 0
+  for (i = 0; i < TEXFONT_CACHE_SIZE; i++)
+    if (data->cache[i])
+      free_texture_layout (data->cache[i]);
+# endif
   free (data);
 }
@@ -52,6 +52,7 @@
 
 #include <math.h>
 #include "screenhack.h"
+#include "circle_grid.h"
 
 
 /* this program goes faster if some functions are inline.  The following is
@@ -69,6 +70,9 @@
 #define MAX(x,y) ((x < y) ? y : x)
 #endif
 
+/* Circles have a radius of at most 60; see build_field. */
+#define GRID_CELL 128
+
 static const char *interaggregate_defaults[] = 
 {
     ".background: white",
@@ -85,6 +89,7 @@ static const char *interaggregate_defaults[] =
     "*baseOrbits: 75",
     "*baseOnCenter: False",
     "*drawCenters: False",
+    "*verbose: False",
 #ifdef USE_IPHONE
     "*ignoreRotation: True",
 #endif
@@ -102,6 +107,7 @@ static XrmOptionDescRec interaggregate_options[] =
     {"-base-orbits", ".baseOrbits", XrmoptionSepArg, 0},
     {"-base-on-center", ".baseOnCenter", XrmoptionNoArg, "true"}, 
     {"-draw-centers", ".drawCenters", XrmoptionNoArg, "true"}, 
+    {"-verbose", ".verbose", XrmoptionNoArg, "true"}, 
     {0, 0, 0, 0}
 };
 
@@ -180,6 +186,9 @@ struct field
     int num_circles;
     Circle* circles;
 
+    /* which circles are near which */
+    circle_grid *grid;
+
     int percent_orbits;
     int base_orbits;
     Bool base_on_center;
@@ -205,8 +214,8 @@ struct field
     Bool draw_centers;
 
     /* for profiling whatnot */ 
-    int possible_intersections;
-    int intersection_count;
+    unsigned long possible_intersections;
+    unsigned long intersection_count;
 };
 
 
@@ -224,6 +233,7 @@ init_field(void)
     f->width = 0;
     f->num_circles = 0;
     f->circles = NULL;
+    f->grid = NULL;
     f->percent_orbits = 0;
     f->base_orbits = 0;
     f->base_on_center = False;
@@ -510,6 +520,20 @@ static void free_circles(struct field *f)
     }
 }
 
+/* Tell the grid where circle i is now */
+static void file_circle(struct field *f, int i)
+{
+    Circle *circle = f->circles + i;
+
+    if ( circle_grid_move(f->grid, i, circle->x, circle->y,
+			  circle->radius) )
+    {
+        fprintf(stderr, "%s: Failed to allocate grid\n",
+                progname);
+	exit(1);
+    }
+}
+
 static void build_field(Display *dpy, Window window, XWindowAttributes xgwa, GC fgc, 
 		 struct field *f) 
 {
@@ -537,6 +561,15 @@ static void build_field(Display *dpy, Window window, XWindowAttributes xgwa, GC
 	exit(1);
     }
 
+    circle_grid_free(f->grid);
+    f->grid = circle_grid_new(f->width, f->height, GRID_CELL);
+    if ( f->grid == NULL )
+    {
+        fprintf(stderr, "%s: Failed to allocate grid\n",
+                progname);
+	exit(1);
+    }
+
     for(i = 0; i < f->num_circles; ++i)
     {
 	int j;
@@ -625,6 +658,8 @@ static void build_field(Display *dpy, Window window, XWindowAttributes xgwa, GC
 	    painter->color = 
 		f->parsedcolors[(int)(frand(0.999) * f->numcolors)];
 	}
+
+	file_circle(f, i);
     }
 }
 
@@ -687,25 +722,20 @@ static void moveCircles(struct field *f)
 	    else if ( circle->y >= f->height ) circle->y -= f->height;
 #endif
 	}
+
+	file_circle(f, i);
     }
 }
 
 static void drawIntersections(Display *dpy, Window window, GC fgc, struct field *f)
 {
-    int i,j;
-
-    /* One might be tempted to think 'hey, this is a crude algorithm
-     * that is going to check each of the n (n-1) / 2 possible
-     * intersections!  Why not try bsp trees, quad trees, etc, etc,
-     * etc'
-     *
-     * In practice the time spent drawing the intersection of two
-     * circles dwarfs the time takes to check for intersection.
-     * Profiling on a 640x480 screen with 100 circles shows possible
-     * speed gains to be only a couple of percent.
-     * 
-     * But hey, if you're bored, go have fun.  Let me know how it
-     * turns out.
+    int i,k;
+
+    /* Checking each of the n (n-1) / 2 possible intersections is
+     * nothing next to drawing them with 100 circles, but with
+     * thousands of them on a big screen it is most of the work.  So
+     * only the circles that the grid says are close by get checked,
+     * in the same order as before.
      */
 
 
@@ -717,14 +747,15 @@ static void drawIntersections(Display *dpy, Window window, GC fgc, struct field
 	{
 	    /* the default branch */
 
-	    for(j = i + 1; j < f->num_circles; ++j)
+	    const int *near;
+	    int num_near = circle_grid_nearby(f->grid, i, &near);
+
+	    for(k = 0; k < num_near; ++k)
 	    {
 		double d, dsqr, dx, dy;
-		Circle *c2 = f->circles + j;
+		Circle *c2 = f->circles + near[k];
 
-#ifdef TIME_ME
 		++f->possible_intersections;
-#endif
 		dx = c2->x - c1->x;
 		dy = c2->y - c1->y;
 
@@ -750,9 +781,7 @@ static void drawIntersections(Display *dpy, Window window, GC fgc, struct field
 		     * intersection 
 		     */
 
-#ifdef TIME_ME
 		    ++f->intersection_count;
-#endif
 
 		    /* unit vector in direction of c1 to c2 */
 		    bx = dx / d;
@@ -799,6 +828,7 @@ struct state {
 
   unsigned int max_cycles;
   int growth_delay;
+  Bool verbose;
   GC fgc;
   XGCValues gcv;
   XWindowAttributes xgwa;
@@ -828,6 +858,7 @@ interaggregate_init (Display *dpy, Window window)
     st->f->base_orbits = (get_integer_resource(st->dpy, "baseOrbits", "Integer"));
     st->f->base_on_center = (get_boolean_resource(st->dpy, "baseOnCenter", "Boolean"));
     st->f->draw_centers = (get_boolean_resource(st->dpy, "drawCenters", "Boolean"));
+    st->verbose = (get_boolean_resource(st->dpy, "verbose", "Boolean"));
 
     if (st->f->num_circles <= 1) 
     {
@@ -910,6 +941,17 @@ interaggregate_draw (Display *dpy, Window window, void *closure)
 
   st->f->cycles++;
 
+  if (st->verbose && (st->f->cycles % 100) == 0)
+    {
+      fprintf (stderr,
+               "%s: %d circles: %.1f pairs checked per frame out of %d,"
+               " %.1f intersecting\n",
+               progname, st->f->num_circles,
+               st->f->possible_intersections / 100.0,
+               st->f->num_circles * (st->f->num_circles - 1) / 2,
+               st->f->intersection_count / 100.0);
+      st->f->possible_intersections = st->f->intersection_count = 0;
+    }
 
   if (st->f->cycles >= st->max_cycles && st->max_cycles != 0)
     {
@@ -931,7 +973,7 @@ interaggregate_draw (Display *dpy, Window window, void *closure)
       fprintf(stderr, "fps: %d %f %f\n", 
               frames, tdiff, frames / tdiff );
 
-      fprintf(stderr, "intersections: %d %d %f\n", 
+      fprintf(stderr, "intersections: %lu %lu %f\n", 
               f->intersection_count, f->possible_intersections, 
               ((double)f->intersection_count) / 
               f->possible_intersections);
@@ -967,6 +1009,7 @@ static void
 interaggregate_free (Display *dpy, Window window, void *closure)
 {
   struct state *st = (struct state *) closure;
+  circle_grid_free (st->f->grid);
   free (st);
 }
 
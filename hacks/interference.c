@@ -55,6 +55,14 @@ typedef unsigned char uint8_t;
 
 #endif
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#ifdef __AVX2__
+# include <immintrin.h>
+#endif
+
 /*
 Tested on an Intel(R) Pentium(R) 4 CPU 3.00GHz (family 15, model 6, 2 cores),
 1 GB PC2-4200, nouveau - Gallium 0.4 on NV44, X.Org version: 1.13.3. A very
@@ -156,8 +164,6 @@ static XrmOptionDescRec interference_options [] = {
 };
 
 struct inter_source {
-  int x;
-  int y;
   double x_theta;
   double y_theta;
 };
@@ -218,9 +224,11 @@ struct inter_context {
   unsigned* wave_height;
     
   /*
-   * Interference sources
+   * Interference sources, with their positions kept apart for the row kernel
    */
   struct inter_source* source;
+  int* source_xs;
+  int* source_ys;
 };
 
 struct inter_thread
@@ -233,6 +241,10 @@ struct inter_thread
 #endif
 
   unsigned* result_row;
+
+  /* For each source on the current row: x in the low 16 bits, -dy in the high
+     16 bits, so that one 16-bit subtraction from (px, 0) gives (dx, dy). */
+  uint32_t* source_offsets;
 };
 
 #ifdef HAVE_DOUBLE_BUFFER_EXTENSION
@@ -390,6 +402,8 @@ static void inter_free(Display* dpy, struct inter_context* c)
 
   free(c->wave_height);
   free(c->source);
+  free(c->source_xs);
+  free(c->source_ys);
 }
 
 static void abort_on_error(int error)
@@ -426,9 +440,16 @@ static int inter_thread_create(
   if(!self->result_row)
     return ENOMEM;
 
+  self->source_offsets = malloc(c->count * sizeof(uint32_t));
+  if(!self->source_offsets) {
+    free(self->result_row);
+    return ENOMEM;
+  }
+
 #ifdef USE_XIMAGE
   self->row = malloc((c->w / c->grid_size) * sizeof(uint32_t));
   if(!self->row) {
+    free(self->source_offsets);
     free(self->result_row);
     return ENOMEM;
   }
@@ -443,9 +464,123 @@ static void inter_thread_destroy(void* self_raw)
 #ifdef USE_XIMAGE
   free(self->row);
 #endif
+  free(self->source_offsets);
   free(self->result_row);
 }
 
+/*
+ * The wave height at cell i of a row is the sum over the sources of
+ * wave_height[FAST_TABLE(dx*dx + dy*dy)], where (dx, dy) runs from the cell's
+ * center to the source. The squared distances come straight out of
+ * _mm_madd_epi16 on interleaved (dx, dy) pairs, so the SIMD paths give exactly
+ * the same sums as the scalar one; only the table lookups are scalar on SSE2.
+ */
+
+static int inter_table_index(const struct inter_context* c, int dist0)
+{
+  int dist1;
+#if defined USE_FAST_SQRT_BIGTABLE2
+  dist1 = FAST_TABLE(dist0);
+#elif defined USE_FAST_SQRT_HACKISH
+  dist1 = fast_log2(dist0);
+#else
+  dist1 = sqrt(dist0);
+#endif
+  /* wave_height[c->radius] is zero. */
+  return dist1 < c->radius ? dist1 : c->radius;
+}
+
+#if defined USE_FAST_SQRT_BIGTABLE2 && (defined __SSE2__ || defined __AVX2__)
+# define FAST_TABLE_BIAS \
+  ((FAST_SQRT_CUTOFF << (FAST_SQRT_DISCARD_BITS2 - FAST_SQRT_DISCARD_BITS1)) - \
+   FAST_SQRT_CUTOFF)
+#endif
+
+static void inter_row_heights(const struct inter_context* c,
+                              const uint32_t* source_offsets,
+                              unsigned* result_row, unsigned n)
+{
+  int g = c->grid_size;
+  unsigned i = 0;
+  int k;
+
+#if defined USE_FAST_SQRT_BIGTABLE2 && defined __AVX2__
+  {
+    const __m256i cutoff = _mm256_set1_epi32(FAST_SQRT_CUTOFF);
+    const __m256i bias = _mm256_set1_epi32(FAST_TABLE_BIAS);
+    const __m256i radius = _mm256_set1_epi32(c->radius);
+    const __m256i step = _mm256_set1_epi32(8 * g);
+    /* (px, 0) for eight cells. */
+    __m256i px = _mm256_add_epi32(_mm256_set1_epi32(g/2),
+                                  _mm256_mullo_epi32(_mm256_set1_epi32(g),
+                                    _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+
+    for(; i + 8 <= n; i += 8) {
+      __m256i sum = _mm256_setzero_si256();
+      for(k = 0; k < c->count; k++) {
+        __m256i d = _mm256_sub_epi16(px, _mm256_set1_epi32(source_offsets[k]));
+        __m256i dist = _mm256_madd_epi16(d, d);
+        __m256i is_near = _mm256_cmpgt_epi32(cutoff, dist);
+        __m256i idx = _mm256_blendv_epi8(
+          _mm256_srli_epi32(_mm256_add_epi32(dist, bias), FAST_SQRT_DISCARD_BITS2),
+          _mm256_srli_epi32(dist, FAST_SQRT_DISCARD_BITS1),
+          is_near);
+        idx = _mm256_min_epi32(idx, radius);
+        sum = _mm256_add_epi32(sum,
+          _mm256_i32gather_epi32((const int *)c->wave_height, idx, 4));
+      }
+      _mm256_storeu_si256((__m256i *)(result_row + i), sum);
+      px = _mm256_add_epi32(px, step);
+    }
+  }
+#elif defined USE_FAST_SQRT_BIGTABLE2 && defined __SSE2__
+  {
+    const __m128i cutoff = _mm_set1_epi32(FAST_SQRT_CUTOFF);
+    const __m128i bias = _mm_set1_epi32(FAST_TABLE_BIAS);
+    const __m128i radius = _mm_set1_epi32(c->radius);
+    const __m128i step = _mm_set1_epi32(4 * g);
+    __m128i px = _mm_setr_epi32(g/2, g/2 + g, g/2 + 2*g, g/2 + 3*g);
+    uint32_t idx[4];
+
+    for(; i + 4 <= n; i += 4) {
+      unsigned sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+      for(k = 0; k < c->count; k++) {
+        __m128i d = _mm_sub_epi16(px, _mm_set1_epi32(source_offsets[k]));
+        __m128i dist = _mm_madd_epi16(d, d);
+        __m128i is_near = _mm_cmplt_epi32(dist, cutoff);
+        __m128i ix = _mm_or_si128(
+          _mm_and_si128(is_near, _mm_srli_epi32(dist, FAST_SQRT_DISCARD_BITS1)),
+          _mm_andnot_si128(is_near,
+            _mm_srli_epi32(_mm_add_epi32(dist, bias), FAST_SQRT_DISCARD_BITS2)));
+        __m128i too_far = _mm_cmpgt_epi32(ix, radius);
+        ix = _mm_or_si128(_mm_andnot_si128(too_far, ix), _mm_and_si128(too_far, radius));
+        _mm_storeu_si128((__m128i *)idx, ix);
+        sum0 += c->wave_height[idx[0]];
+        sum1 += c->wave_height[idx[1]];
+        sum2 += c->wave_height[idx[2]];
+        sum3 += c->wave_height[idx[3]];
+      }
+      result_row[i]     = sum0;
+      result_row[i + 1] = sum1;
+      result_row[i + 2] = sum2;
+      result_row[i + 3] = sum3;
+      px = _mm_add_epi32(px, step);
+    }
+  }
+#endif
+
+  for(; i < n; i++) {
+    int px = g/2 + g*i;
+    unsigned sum = 0;
+    for(k = 0; k < c->count; k++) {
+      int dx = px - (int16_t)(source_offsets[k] & 0xffff);
+      int dy = (int16_t)(source_offsets[k] >> 16);
+      sum += c->wave_height[inter_table_index(c, dx*dx + dy*dy)];
+    }
+    result_row[i] = sum;
+  }
+}
+
 /*
 A higher performance design would have input and output queues, so that when
 worker threads finish with one frame, they can pull the next work order from
@@ -461,67 +596,27 @@ static void inter_thread_run(void* self_raw)
 
   int i, j, k;
   unsigned result;
-  int dist1;
   int g = c->grid_size;
   unsigned w_div_g = c->w/g;
+  unsigned rows = c->h/g;
 
-  int dx, dy, g2 = 2 * g * g;
-  int px, py, px2g;
-
-  int dist0, ddist;
+  /* Each thread gets one contiguous band of rows. */
+  unsigned j0 = rows * self->thread_id / c->threadpool.count;
+  unsigned j1 = rows * (self->thread_id + 1) / c->threadpool.count;
 
 #ifdef USE_XIMAGE
-  unsigned img_y = g * self->thread_id;
-  void *scanline = c->ximage->data + c->ximage->bytes_per_line * g * self->thread_id;
+  unsigned img_y = g * j0;
+  void *scanline = c->ximage->data + c->ximage->bytes_per_line * g * j0;
 #endif
 
-  for(j = self->thread_id; j < c->h/g; j += c->threadpool.count) {
-    px = g/2;
-    py = j*g + px;
-
-    memset(self->result_row, 0, w_div_g * sizeof(unsigned));
-
-    for(k = 0; k < c->count; k++) {
-
-      dx = px - c->source[k].x;
-      dy = py - c->source[k].y;
-
-      dist0 = dx*dx + dy*dy;
-      ddist = -2 * g * c->source[k].x;
+  for(j = j0; j < j1; j++) {
+    int py = j*g + g/2;
 
-      /* px2g = g*(px*2 + g); */
-      px2g = g2;
-
-      for(i = 0; i < w_div_g; i++) {
-        /*
-         * Discarded possibilities for improving performance here:
-         * 1. Using octagon-based distance estimation
-         *    (Which causes giant octagons to appear.)
-         * 2. Square root approximation by reinterpret-casting IEEE floats to
-         *    integers.
-         *    (Which causes angles to appear when two waves interfere.)
-         */
-
-/*      int_float u;
-        u.f = dx*dx + dy*dy;
-        u.i = (1 << 29) + (u.i >> 1) - (1 << 22);
-        dist = u.f; */
+    for(k = 0; k < c->count; k++)
+      self->source_offsets[k] = (uint16_t)c->source_xs[k] |
+                                ((uint32_t)(uint16_t)(c->source_ys[k] - py) << 16);
 
-#if defined USE_FAST_SQRT_BIGTABLE2
-        dist1 = FAST_TABLE(dist0);
-#elif defined USE_FAST_SQRT_HACKISH
-        dist1 = fast_log2(dist0);
-#else
-        dist1 = sqrt(dist0);
-#endif
-
-        if(dist1 < c->radius)
-          self->result_row[i] += c->wave_height[dist1];
-
-        dist0 += px2g + ddist;
-        px2g += g2;
-      }
-    }
+    inter_row_heights(c, self->source_offsets, self->result_row, w_div_g);
 
     for(i = 0; i < w_div_g; i++) {
 
@@ -614,8 +709,8 @@ static void inter_thread_run(void* self_raw)
 # endif
     {
 # if defined HAVE_XSHM_EXTENSION || defined USE_BIG_XIMAGE
-      scanline = (char *)scanline + c->ximage->bytes_per_line * g * c->threadpool.count;
-      img_y += g * c->threadpool.count;
+      scanline = (char *)scanline + c->ximage->bytes_per_line * g;
+      img_y += g;
 # endif
     }
 
@@ -894,7 +989,7 @@ static void inter_init(Display* dpy, Window win, struct inter_context* c)
   c->radius = radius;
 #endif
 
-  c->wave_height = calloc(c->radius, sizeof(unsigned));
+  c->wave_height = calloc(c->radius + 1, sizeof(unsigned));
   check_no_mem(dpy, c, c->wave_height);
 
   for(i = 0; i < c->radius; i++) {
@@ -917,6 +1012,10 @@ static void inter_init(Display* dpy, Window win, struct inter_context* c)
 
   c->source = calloc(c->count, sizeof(struct inter_source));
   check_no_mem(dpy, c, c->source);
+  c->source_xs = calloc(c->count, sizeof(int));
+  check_no_mem(dpy, c, c->source_xs);
+  c->source_ys = calloc(c->count, sizeof(int));
+  check_no_mem(dpy, c, c->source_ys);
 
   for(i = 0; i < c->count; i++) {
     c->source[i].x_theta = frand(2.0)*3.14159;
@@ -931,12 +1030,6 @@ static void inter_init(Display* dpy, Window win, struct inter_context* c)
 #define source_y(c, i) \
   (c->h/2 + ((int)(cos(c->source[i].y_theta)*((float)c->h/2.0))))
 
-/*
- * This is somewhat suboptimal. Calculating the distance per-pixel is going to
- * be a lot slower than using now-ubiquitous SIMD CPU instructions to do four
- * or eight pixels at a time.
- */
-
 #ifdef TEST_PATTERN
 static uint32_t
 _alloc_color(struct inter_context *c, uint16_t r, uint16_t g, uint16_t b)
@@ -1000,8 +1093,8 @@ static unsigned long do_inter(struct inter_context* c)
     c->source[i].y_theta += (elapsed*c->speed/1000.0);
     if(c->source[i].y_theta > 2.0*3.14159)
       c->source[i].y_theta -= 2.0*3.14159;
-    c->source[i].x = source_x(c, i);
-    c->source[i].y = source_y(c, i);
+    c->source_xs[i] = source_x(c, i);
+    c->source_ys[i] = source_y(c, i);
   }
 
   threadpool_run(&c->threadpool, inter_thread_run);
@@ -33,6 +33,7 @@
 #include <math.h>
 #include "screenhack.h"
 #include "hsv.h"
+#include "circle_grid.h"
 
 /* this program goes faster if some functions are inline.  The following is
  * borrowed from ifs.c */
@@ -70,6 +71,9 @@ struct field {
 
     int initial_discs;
     Disc *discs;
+
+    /* which discs are near which */
+    circle_grid *grid;
     
     unsigned int num;
 
@@ -86,6 +90,10 @@ struct field {
     /* Offscreen image we draw to */
     Pixmap off_map;
     unsigned char *off_alpha;
+
+    /* for -verbose */
+    unsigned long pairs_checked;
+    unsigned long intersections;
 };
 
 
@@ -100,6 +108,8 @@ struct state {
 
   XColor *colors;
   int ncolors;
+
+  Bool verbose;
 };
 
 
@@ -120,6 +130,7 @@ static struct field *init_field(void)
     f->width = 0;
     f->initial_discs = 0;
     f->discs = NULL;
+    f->grid = NULL;
     f->num = 0;
     f->maxrider = 0;
     f->maxradius = 0;
@@ -128,6 +139,8 @@ static struct field *init_field(void)
     f->bgcolor = 0;
     f->off_alpha = NULL;
     f->visdepth = 0;
+    f->pairs_checked = 0;
+    f->intersections = 0;
     return f;
 }
 
@@ -214,6 +227,11 @@ static inline void move_disc(struct field *f, int dnum)
     /* increase to destination radius */
     if (d->r < d->dr)
         d->r += 0.1;
+
+    if (circle_grid_move(f->grid, dnum, d->x, d->y, d->r)) {
+	fprintf(stderr, "%s: out of memory\n", progname);
+	exit(1);
+    }
 }
 
 static inline void 
@@ -292,9 +310,16 @@ render_disc(struct state *st, Drawable drawable, GC fgc, struct field *f, int dn
     float dx, dy, d;
     float a, p2x, p2y, h, p3ax, p3ay, p3bx, p3by;
     unsigned long c;
-
-    /* Find intersecting points with all ascending discs */
-    for (n = di->id + 1; n < f->num; n++) {
+    const int *near;
+    int k, num_near;
+
+    /* Find intersecting points with all ascending discs that are close by.
+       The discs after this one haven't moved yet this frame, so the grid
+       still has them where they are. */
+    num_near = circle_grid_nearby(f->grid, di->id, &near);
+    f->pairs_checked += num_near;
+    for (k = 0; k < num_near; k++) {
+        n = near[k];
         dx = f->discs[n].x - di->x;
         dy = f->discs[n].y - di->y;
         d = sqrt(dx * dx + dy * dy);
@@ -303,6 +328,8 @@ render_disc(struct state *st, Drawable drawable, GC fgc, struct field *f, int dn
         if (d < (f->discs[n].r + di->r)) {
             /* complete containment test */
             if (d > abs(f->discs[n].r - di->r)) {
+                f->intersections++;
+
                 /* find solutions */
                 a = (di->r * di->r - f->discs[n].r * f->discs[n].r + d * d) / (2 * d);
                 p2x = di->x + a * (f->discs[n].x - di->x) / d;
@@ -368,6 +395,27 @@ static void build_img(Display *dpy, Window window, struct field *f)
 
 }
 
+/* The grid depends on the window size, so is rebuilt along with the image */
+static void build_grid(struct field *f)
+{
+    int i;
+
+    if (f->grid)
+        circle_grid_free(f->grid);
+    f->grid = circle_grid_new(f->width, f->height, 2 * (f->maxradius + 5));
+    if (!f->grid) {
+	fprintf(stderr, "%s: out of memory\n", progname);
+	exit(1);
+    }
+
+    for (i = 0; i < f->num; i++)
+        if (circle_grid_move(f->grid, i, f->discs[i].x, f->discs[i].y,
+                             f->discs[i].r)) {
+            fprintf(stderr, "%s: out of memory\n", progname);
+            exit(1);
+        }
+}
+
 static inline void blank_img(Display *dpy, Window window, XWindowAttributes xgwa, GC fgc, struct field *f) 
 {
     memset(f->off_alpha, 0, sizeof(unsigned char) * f->width * f->height);
@@ -480,6 +528,10 @@ intermomentary_init (Display *dpy, Window window)
         make_disc(st->f, x, y, bt * fx / 1000.0, bt * fy / 1000.0, r);
         
     }
+
+    build_grid(st->f);
+
+    st->verbose = get_boolean_resource(dpy, "verbose", "Boolean");
     
     return st;
 }
@@ -500,6 +552,7 @@ intermomentary_draw (Display *dpy, Window window, void *closure)
       st->f->visdepth = st->xgwa.depth;
 
       build_img(dpy, window, st->f);
+      build_grid(st->f);
     }
   }
 
@@ -522,6 +575,16 @@ intermomentary_draw (Display *dpy, Window window, void *closure)
 
   st->f->cycles++;
 
+  if (st->verbose && (st->f->cycles % 100) == 0) {
+    fprintf (stderr,
+             "%s: %d discs: %.1f pairs checked per frame out of %d,"
+             " %.1f intersecting\n",
+             progname, (int) st->f->num, st->f->pairs_checked / 100.0,
+             (int) (st->f->num * (st->f->num - 1) / 2),
+             st->f->intersections / 100.0);
+    st->f->pairs_checked = st->f->intersections = 0;
+  }
+
   return st->draw_delay;
 }
 
@@ -542,6 +605,7 @@ static void
 intermomentary_free (Display *dpy, Window window, void *closure)
 {
   struct state *st = (struct state *) closure;
+  circle_grid_free (st->f->grid);
   free (st);
 }
 
@@ -554,6 +618,7 @@ static const char *intermomentary_defaults[] = {
     "*maxRiders: 40",
     "*maxRadius: 100",
     "*colors: 256",
+    "*verbose: False",
 #ifdef USE_IPHONE
     "*ignoreRotation: True",
 #endif
@@ -568,6 +633,7 @@ static XrmOptionDescRec intermomentary_options[] = {
     {"-max-riders", ".maxRiders", XrmoptionSepArg, 0},
     {"-max-radius", ".maxRadius", XrmoptionSepArg, 0},
     { "-colors",    ".colors",    XrmoptionSepArg, 0 },
+    {"-verbose", ".verbose", XrmoptionNoArg, "true"},
     {0, 0, 0, 0}
 };
 
@@ -44,17 +44,36 @@ static const char sccsid[] = "@(#)julia.c	4.03 97/04/10 xlockmore";
 					"*ncolors:		  200    \n" \
 					"*fpsSolid:		  true   \n" \
 					"*ignoreRotation: True   \n" \
+					"*useSHM:		  True   \n" \
+					"*useThreads:	  True   \n" \
 
 # define UNIFORM_COLORS
 # include "xlockmore.h"				/* in xscreensaver distribution */
+# include "escape_time.h"
 #else  /* !STANDALONE */
 # include "xlock.h"					/* in xlockmore distribution */
 #endif /* !STANDALONE */
 
 
 #define DEF_MOUSE "False"
+#define DEF_ESCAPE "False"
 
-ENTRYPOINT ModeSpecOpt julia_opts = { 0, };
+static Bool escape;
+
+static XrmOptionDescRec opts[] =
+{
+	{"-escape", ".julia.escape", XrmoptionNoArg, "on"},
+	{"+escape", ".julia.escape", XrmoptionNoArg, "off"},
+	{"-threads", ".julia.useThreads", XrmoptionNoArg, "on"},
+	{"+threads", ".julia.useThreads", XrmoptionNoArg, "off"},
+};
+static argtype vars[] =
+{
+	{&escape, "escape", "Escape", DEF_ESCAPE, t_Bool},
+};
+
+ENTRYPOINT ModeSpecOpt julia_opts =
+{sizeof opts / sizeof opts[0], opts, sizeof vars / sizeof vars[0], vars, NULL};
 
 
 #define numpoints ((0x2<<jp->depth)-1)
@@ -82,6 +101,9 @@ typedef struct {
     Bool        button_down_p;
     int         mouse_x, mouse_y;
 
+	struct escape_time *et;	/* the filled-in set, with -escape */
+	Bool        done;		/* et has finished the picture for this c */
+	XPoint      circle;		/* where the c marker was last drawn */
 } juliastruct;
 
 static juliastruct *julias = NULL;
@@ -89,6 +111,11 @@ static juliastruct *julias = NULL;
 /* How many segments to draw per cycle when redrawing */
 #define REDRAWSTEP 3
 
+/* With -escape: the iteration limit, and how many seconds of each frame
+   go into refining the picture. */
+#define MAXITER 256
+#define ESCAPE_BUDGET 0.02
+
 static void
 apply(juliastruct * jp, register double xr, register double xi, int d)
 {
@@ -250,6 +277,32 @@ init_julia(ModeInfo * mi)
 	jp->buffer = 0;
 	jp->redrawing = 0;
 	jp->erase = 0;
+
+	if (jp->et) {
+		escape_time_free(jp->et);
+		jp->et = NULL;
+	}
+	if (escape) {
+		unsigned long pixels[255];
+		int         npixels = MIN(MI_NPIXELS(mi), 255);
+		Bool        use_shm = False;
+
+# ifdef HAVE_XSHM_EXTENSION
+		use_shm = mi->use_shm;
+# endif
+		if (npixels > 2)
+			for (i = 0; i < npixels; i++)
+				pixels[i] = MI_PIXEL(mi, i);
+		else {
+			npixels = 1;
+			pixels[0] = MI_WIN_WHITE_PIXEL(mi);
+		}
+		jp->et = escape_time_new(display, MI_VISUAL(mi), MI_DEPTH(mi),
+								 MI_WIN_WIDTH(mi), MI_WIN_HEIGHT(mi), use_shm,
+								 pixels, npixels, MI_WIN_BLACK_PIXEL(mi));
+		jp->done = True;
+		jp->circle.x = jp->circle.y = -jp->circsize;
+	}
 	XClearWindow(display, window);
 }
 
@@ -308,6 +361,52 @@ else if (xl>x) \
 XFillRectangle(d,w,g,xl,yl,xs,ys)
 
 
+/* With -escape, each frame refines the escape-time picture of the current
+   c for a little while, and c only moves on once the picture is finished
+   (or every frame while the mouse is dragging it around). */
+static void
+draw_escape(ModeInfo * mi, juliastruct * jp)
+{
+	Display    *display = MI_DISPLAY(mi);
+	Window      window = MI_WINDOW(mi);
+
+	if (jp->done || jp->button_down_p) {
+		struct escape_time_view v;
+
+		incr(mi, jp);
+		jp->inc++;
+		v.x = -2;
+		v.y = -2;
+		v.dx = 2.0 / jp->centerx;
+		v.dy = 2.0 / jp->centery;
+		v.cr = jp->cr;
+		v.ci = jp->ci;
+		v.julia_p = True;
+		v.max_iter = MAXITER;
+		escape_time_start(jp->et, &v);
+	}
+	jp->done = escape_time_render(jp->et, ESCAPE_BUDGET);
+
+	/* Erase the old marker by sending its rows again. */
+	escape_time_damage(jp->et, jp->circle.y - jp->circsize / 2 - 2,
+					   jp->circsize + 4);
+	escape_time_put(jp->et, window, MI_GC(mi), 0, 0);
+
+	jp->circle.x = (int) (jp->centerx * jp->cr / 2) + jp->centerx - 2;
+	jp->circle.y = (int) (jp->centery * jp->ci / 2) + jp->centery - 2;
+	XSetForeground(display, jp->stippledGC, MI_WIN_WHITE_PIXEL(mi));
+#ifndef HAVE_COCOA
+	XSetTSOrigin(display, jp->stippledGC, jp->circle.x, jp->circle.y);
+	XSetStipple(display, jp->stippledGC, jp->pixmap);
+	XSetFillStyle(display, jp->stippledGC, FillOpaqueStippled);
+#endif /* HAVE_COCOA */
+	XDrawArc(display, window, jp->stippledGC,
+             jp->circle.x-jp->circsize/2,
+             jp->circle.y-jp->circsize/2,
+             jp->circsize, jp->circsize,
+             0, 360*64);
+}
+
 ENTRYPOINT void
 draw_julia (ModeInfo * mi)
 {
@@ -320,6 +419,11 @@ draw_julia (ModeInfo * mi)
 	int         k = 64, rnd = 0, i, j;
 	XPoint     *xp = jp->pointBuffer[jp->buffer], old_circle, new_circle;
 
+	if (jp->et) {
+		draw_escape(mi, jp);
+		return;
+	}
+
 	old_circle.x = (int) (jp->centerx * jp->cr / 2) + jp->centerx - 2;
 	old_circle.y = (int) (jp->centery * jp->ci / 2) + jp->centery - 2;
 	incr(mi, jp);
@@ -431,6 +535,8 @@ release_julia (ModeInfo * mi)
 						(void) free((void *) jp->pointBuffer[buffer]);
 				(void) free((void *) jp->pointBuffer);
 			}
+			if (jp->et)
+				escape_time_free(jp->et);
 			if (jp->stippledGC != None)
 				XFreeGC(display, jp->stippledGC);
 			if (jp->pixmap != None)
@@ -452,6 +558,8 @@ refresh_julia (ModeInfo * mi)
 
 	jp->redrawing = 1;
 	jp->redrawpos = 0;
+	if (jp->et)
+		escape_time_damage(jp->et, 0, MI_WIN_HEIGHT(mi));
 }
 
 XSCREENSAVER_MODULE ("Julia", julia)
@@ -100,6 +100,7 @@ static const char sccsid[] = "@(#)loop.c	5.01 2000/03/15 xlockmore";
 # include "xlock.h"		/* in xlockmore distribution */
 #endif /* STANDALONE */
 #include "automata.h"
+#include "dirty_cells.h"
 
 #ifdef MODE_loop
 
@@ -107,22 +108,28 @@ static const char sccsid[] = "@(#)loop.c	5.01 2000/03/15 xlockmore";
  * neighbors of 0 randomizes between 4 and 6.
  */
 #define DEF_NEIGHBORS  "0"      /* choose random value */
+#define DEF_VERBOSE  "False"
 
 static int  neighbors;
+static Bool verbose;
 
 static XrmOptionDescRec opts[] =
 {
-	{"-neighbors", ".loop.neighbors", XrmoptionSepArg, 0}
+	{"-neighbors", ".loop.neighbors", XrmoptionSepArg, 0},
+	{"-verbose", ".loop.verbose", XrmoptionNoArg, "on"},
+	{"+verbose", ".loop.verbose", XrmoptionNoArg, "off"}
 };
 
 static argtype vars[] =
 {
-	{&neighbors, "neighbors", "Neighbors", DEF_NEIGHBORS, t_Int}
+	{&neighbors, "neighbors", "Neighbors", DEF_NEIGHBORS, t_Int},
+	{&verbose, "verbose", "Verbose", DEF_VERBOSE, t_Bool}
 };
 
 static OptionStruct desc[] =
 {
-	{"-neighbors num", "squares 4 or hexagons 6"}
+	{"-neighbors num", "squares 4 or hexagons 6"},
+	{"-/+verbose", "turn on/off printing X requests per frame"}
 };
 
 ENTRYPOINT ModeSpecOpt loop_opts =
@@ -194,12 +201,6 @@ static int  local_neighbors = 0;
 #define ANGLES 360
 #define MAXNEIGHBORS 6
 
-/* Singly linked list */
-typedef struct _CellList {
-	XPoint      pt;
-	struct _CellList *next;
-} CellList;
-
 typedef struct {
 	int         init_bits;
 	int         generation;
@@ -212,8 +213,9 @@ typedef struct {
 	int         redrawing, redrawpos;
 	Bool        dead, clockwise;
 	unsigned char *newcells, *oldcells;
-	int         ncells[COLORS];
-	CellList   *cellList[COLORS];
+	dirty_cells *dirty;	/* Changed cells, by state */
+	int         frames;
+	unsigned long requests;
 	unsigned long colors[COLORS];
 	GC          stippledGC;
 	Pixmap      pixmaps[COLORS];
@@ -881,41 +883,12 @@ static void
 print_state(ModeInfo * mi, int state)
 {
 	loopstruct *lp = &loops[MI_SCREEN(mi)];
-	CellList   *locallist = lp->cellList[state];
-	int         i = 0;
-
-	(void) printf("state %d\n", state);
-	while (locallist) {
-		(void) printf("%d x %d, y %d\n", i,
-			      locallist->pt.x, locallist->pt.y);
-		locallist = locallist->next;
-		i++;
-	}
-}
-
-#endif
 
-static void
-free_state(loopstruct * lp, int state)
-{
-	CellList   *current;
-
-	while (lp->cellList[state]) {
-		current = lp->cellList[state];
-		lp->cellList[state] = lp->cellList[state]->next;
-		(void) free((void *) current);
-	}
-	lp->ncells[state] = 0;
+	(void) printf("state %d: %d cells\n", state,
+		      dirty_cells_count(lp->dirty, state));
 }
 
-static void
-free_list(loopstruct * lp)
-{
-	int         state;
-
-	for (state = 0; state < COLORS; state++)
-		free_state(lp, state);
-}
+#endif
 
 static void
 free_loop(Display *display, loopstruct * lp)
@@ -939,36 +912,19 @@ free_loop(Display *display, loopstruct * lp)
 		(void) free((void *) lp->newcells);
 		lp->newcells = (unsigned char *) NULL;
 	}
-	free_list(lp);
-}
-
-static Bool
-addtolist(ModeInfo * mi, int col, int row, unsigned char state)
-{
-	loopstruct *lp = &loops[MI_SCREEN(mi)];
-	CellList   *current = lp->cellList[state];
-
-	if ((lp->cellList[state] = (CellList *) malloc(sizeof (CellList))) ==
-			NULL) {
-		lp->cellList[state] = current;
-		free_loop(MI_DISPLAY(mi), lp);
-		return False;
+	if (lp->dirty != NULL) {
+		dirty_cells_free(lp->dirty);
+		lp->dirty = (dirty_cells *) NULL;
 	}
-	lp->cellList[state]->pt.x = col;
-	lp->cellList[state]->pt.y = row;
-	lp->cellList[state]->next = current;
-	lp->ncells[state]++;
-	return True;
 }
 
-static Bool
+static void
 draw_state(ModeInfo * mi, int state)
 {
 	loopstruct *lp = &loops[MI_SCREEN(mi)];
 	Display    *display = MI_DISPLAY(mi);
 	GC          gc;
 	XGCValues   gcv;
-	CellList   *current = lp->cellList[state];
 
 	if (MI_NPIXELS(mi) >= COLORS) {
 		gc = MI_GC(mi);
@@ -987,49 +943,35 @@ draw_state(ModeInfo * mi, int state)
 		gc = lp->stippledGC;
 	}
 
-	if (local_neighbors == 6) {       /* Draw right away, slow */
-		while (current) {
+	if (local_neighbors == 6) {
+		XPoint     *cells;
+		int         n = dirty_cells_take(lp->dirty, state, &cells);
+		int         i, npoints = 0;
+
+		/* Polygons have to be drawn one at a time, but cells too small
+		   for them go out in one XDrawPoints.  Each point overwrites a
+		   cell that has already been read. */
+		for (i = 0; i < n; i++) {
 			int	 col, row, ccol, crow;
 
-			col = current->pt.x;
-			row = current->pt.y;
+			col = cells[i].x - lp->bx;
+			row = cells[i].y - lp->by;
 			ccol = 2 * col + !(row & 1), crow = 2 * row;
 			lp->shape.hexagon[0].x = lp->xb + ccol * lp->xs;
 			lp->shape.hexagon[0].y = lp->yb + crow * lp->ys;
 			if (lp->xs == 1 && lp->ys == 1)
-				XDrawPoint(display, MI_WINDOW(mi), gc,
-					lp->shape.hexagon[0].x, lp->shape.hexagon[0].y);
+				cells[npoints++] = lp->shape.hexagon[0];
 			else
 				XFillPolygon(display, MI_WINDOW(mi), gc,
 				  	lp->shape.hexagon, 6, Convex, CoordModePrevious);
-			current = current->next;
 		}
+		if (npoints)
+			XDrawPoints(display, MI_WINDOW(mi), gc, cells, npoints,
+				    CoordModeOrigin);
 	} else {
 		/* Take advantage of XFillRectangles */
-		XRectangle *rects;
-		int         nrects = 0;
-
-		/* Create Rectangle list from part of the cellList */
-		if ((rects = (XRectangle *) malloc(lp->ncells[state] *
-				sizeof (XRectangle))) == NULL) {
-			return False;
-		}
-
-		while (current) {
-			rects[nrects].x = lp->xb + current->pt.x * lp->xs;
-			rects[nrects].y = lp->yb + current->pt.y * lp->ys;
-			rects[nrects].width = lp->xs - (lp->xs > 3);
-			rects[nrects].height = lp->ys - (lp->ys > 3);
-			current = current->next;
-			nrects++;
-		}
-		/* Finally get to draw */
-		XFillRectangles(display, MI_WINDOW(mi), gc, rects, nrects);
-		/* Free up rects list and the appropriate part of the cellList */
-		(void) free((void *) rects);
+		dirty_cells_draw(lp->dirty, state, gc);
 	}
-	free_state(lp, state);
-	return True;
 }
 
 static Bool
@@ -1491,7 +1433,6 @@ init_loop (ModeInfo * mi)
 		lp->colors[3] = MI_PIXEL(mi, 5 * MI_NPIXELS(mi) / REALCOLORS);	/* MAGENTA */
 		lp->colors[7] = MI_WHITE_PIXEL(mi);
 	}
-	free_list(lp);
 	lp->generation = 0;
 	lp->width = MI_WIDTH(mi);
 	lp->height = MI_HEIGHT(mi);
@@ -1587,6 +1528,17 @@ init_loop (ModeInfo * mi)
 		free_loop(display, lp);
 		return;
 	}
+	/* The tracker covers the border too, so it is offset by one cell. */
+	if (lp->dirty != NULL)
+		dirty_cells_free(lp->dirty);
+	if ((lp->dirty = dirty_cells_new(display, MI_WINDOW(mi),
+			lp->bncols, lp->bnrows, COLORS)) == NULL) {
+		free_loop(display, lp);
+		return;
+	}
+	dirty_cells_layout(lp->dirty, lp->xb - lp->bx * lp->xs,
+			   lp->yb - lp->by * lp->ys, lp->xs, lp->ys,
+			   lp->xs - (lp->xs > 3), lp->ys - (lp->ys > 3));
 	if (!init_table()) {
 		release_loop(mi);
 		return;
@@ -1639,8 +1591,7 @@ draw_loop (ModeInfo * mi)
 			if (*z != *znew) {
 				lp->dead = False;
 				*z = *znew;
-				if (!addtolist(mi, i - lp->bx, j - lp->by, *znew))
-					return;
+				dirty_cells_mark(lp->dirty, i, j, *znew);
 				if (i == lp->mincol && i > lp->bx)
 					lp->mincol--;
 				if (j == lp->minrow && j > lp->by)
@@ -1653,10 +1604,16 @@ draw_loop (ModeInfo * mi)
 		}
 	}
 	for (i = 0; i < COLORS; i++)
-		if (!draw_state(mi, i)) {
-			free_loop(MI_DISPLAY(mi), lp);
-			return;
+		if (dirty_cells_count(lp->dirty, i))
+			draw_state(mi, i);
+	if (verbose) {
+		lp->requests += dirty_cells_requests(lp->dirty);
+		if (++lp->frames % 100 == 0) {
+			(void) fprintf(stderr, "%s: %.1f X requests per frame\n",
+				       progname, lp->requests / 100.0);
+			lp->requests = 0;
 		}
+	}
 	if (++lp->generation > MI_CYCLES(mi) || lp->dead) {
 		init_loop(mi);
 		return;
@@ -17,6 +17,11 @@
 
 #include <math.h>
 #include "screenhack.h"
+#include "index_image.h"
+
+#ifdef HAVE_XSHM_EXTENSION
+# include "xshm.h"
+#endif /* HAVE_XSHM_EXTENSION */
 
 /*#define VERBOSE*/ 
 
@@ -48,6 +53,16 @@ struct state {
   XImage *pImage;
   GC gc;
   int draw_i;
+
+  /* The part of st->blub that the blobs covered last frame, and whether the
+     whole image needs to be redrawn anyway. */
+  int dirty_x1, dirty_y1, dirty_x2, dirty_y2;
+  Bool redraw_all;
+
+  Bool use_shm, shared;
+#ifdef HAVE_XSHM_EXTENSION
+  XShmSegmentInfo shminfo;
+#endif /* HAVE_XSHM_EXTENSION */
 };
 
 
@@ -62,11 +77,13 @@ static void init_blob(struct state *st, BLOB *blob)
 
 static void Execute( struct state *st )
 {
-	int i, j, k;
+	int i, k;
+	int x1 = st->iWinWidth, y1 = st->iWinHeight, x2 = 0, y2 = 0;
+	unsigned char max = st->iColorCount - 1;
 
-	/* clear st->blub array */
-	for (i = 0; i < st->iWinHeight; ++i)
-	  memset(st->blub[i], 0, st->iWinWidth * sizeof(unsigned char));
+	/* clear what the st->blobs left in the st->blub array last frame */
+	for (i = st->dirty_y1; i < st->dirty_y2; ++i)
+	  memset(st->blub[i] + st->dirty_x1, 0, st->dirty_x2 - st->dirty_x1);
 
 	/* move st->blobs */
 	for (i = 0; i < st->nBlobCount; i++)
@@ -75,49 +92,84 @@ static void Execute( struct state *st )
 	  st->blobs[i].ypos += -st->delta + (int)((st->delta + .5f) * frand(2.0));
 	}
 
-	/* draw st->blobs to st->blub array */
+	/* draw st->blobs to st->blub array, clipped to the window */
 	for (k = 0; k < st->nBlobCount; ++k)
 	  { 
-	    if (st->blobs[k].ypos > -st->dradius && st->blobs[k].xpos > -st->dradius && st->blobs[k].ypos < st->iWinHeight && st->blobs[k].xpos < st->iWinWidth)
+	    BLOB *b = st->blobs + k;
+	    if (b->ypos > -st->dradius && b->xpos > -st->dradius && b->ypos < st->iWinHeight && b->xpos < st->iWinWidth)
 	      {
-		for (i = 0; i < st->dradius; ++i)
-		  {
-		    if (st->blobs[k].ypos + i >= 0 && st->blobs[k].ypos + i < st->iWinHeight)
-		      {
-			for (j = 0; j < st->dradius; ++j)
-			  {
-			    if (st->blobs[k].xpos + j >= 0 && st->blobs[k].xpos + j < st->iWinWidth)
-			      {
-				if (st->blub[st->blobs[k].ypos + i][st->blobs[k].xpos + j] < st->iColorCount-1)
-				  {
-				    if (st->blub[st->blobs[k].ypos + i][st->blobs[k].xpos + j] + st->blob[i][j] > st->iColorCount-1)
-				      st->blub[st->blobs[k].ypos + i][st->blobs[k].xpos + j] = st->iColorCount-1;
-				    else 
-				      st->blub[st->blobs[k].ypos + i][st->blobs[k].xpos + j] += st->blob[i][j];     
-				  }
-			      }
-			  }
-		      }
-		  }
+		int bx1 = b->xpos < 0 ? 0 : b->xpos;
+		int by1 = b->ypos < 0 ? 0 : b->ypos;
+		int bx2 = b->xpos + st->dradius;
+		int by2 = b->ypos + st->dradius;
+		if (bx2 > st->iWinWidth)  bx2 = st->iWinWidth;
+		if (by2 > st->iWinHeight) by2 = st->iWinHeight;
+
+		for (i = by1; i < by2; ++i)
+		  index_add_clamp (st->blub[i] + bx1,
+				   st->blob[i - b->ypos] + bx1 - b->xpos,
+				   bx2 - bx1, max);
+
+		if (bx1 < x1) x1 = bx1;
+		if (by1 < y1) y1 = by1;
+		if (bx2 > x2) x2 = bx2;
+		if (by2 > y2) y2 = by2;
 	      }
 	    else
-	      init_blob(st, st->blobs + k);
+	      init_blob(st, b);
 	  }
 
-	memset( st->pImage->data, 0, st->pImage->bytes_per_line * st->pImage->height);
+	if (x1 >= x2 || y1 >= y2)
+	  x1 = y1 = x2 = y2 = 0;
 
-	/* draw st->blub array to screen */
-	for (i = 0; i < st->iWinHeight; ++i)
-	  {
-	    for (j = 0; j < st->iWinWidth; ++j)
-	      {
-		if (st->aiColorVals[st->blub[i][j]] > 0)
-		  XPutPixel( st->pImage, j, i, st->aiColorVals[st->blub[i][j]] );
-	      }
-	  }
-
-	XPutImage( st->dpy, st->window, st->gc, st->pImage,
-		   0, 0, 0, 0, st->iWinWidth, st->iWinHeight );
+	/* Everything outside this frame's and last frame's boxes is still
+	   color 0 in the image, so only the union of the two is redrawn. */
+	{
+	  int ux1 = x1, uy1 = y1, ux2 = x2, uy2 = y2;
+
+	  if (st->redraw_all)
+	    {
+	      ux1 = uy1 = 0;
+	      ux2 = st->iWinWidth;
+	      uy2 = st->iWinHeight;
+	      st->redraw_all = False;
+	    }
+	  else if (st->dirty_x1 < st->dirty_x2)
+	    {
+	      if (ux1 >= ux2)
+		{
+		  ux1 = st->dirty_x1; uy1 = st->dirty_y1;
+		  ux2 = st->dirty_x2; uy2 = st->dirty_y2;
+		}
+	      else
+		{
+		  if (st->dirty_x1 < ux1) ux1 = st->dirty_x1;
+		  if (st->dirty_y1 < uy1) uy1 = st->dirty_y1;
+		  if (st->dirty_x2 > ux2) ux2 = st->dirty_x2;
+		  if (st->dirty_y2 > uy2) uy2 = st->dirty_y2;
+		}
+	    }
+
+	  st->dirty_x1 = x1; st->dirty_y1 = y1;
+	  st->dirty_x2 = x2; st->dirty_y2 = y2;
+
+	  if (ux1 >= ux2 || uy1 >= uy2)
+	    return;
+
+	  /* draw st->blub array to screen */
+	  for (i = uy1; i < uy2; ++i)
+	    index_put_row (st->pImage, ux1, i, st->blub[i] + ux1, ux2 - ux1,
+			   st->aiColorVals);
+
+#ifdef HAVE_XSHM_EXTENSION
+	  if (st->shared)
+	    XShmPutImage( st->dpy, st->window, st->gc, st->pImage,
+			  ux1, uy1, ux1, uy1, ux2 - ux1, uy2 - uy1, False );
+	  else
+#endif /* HAVE_XSHM_EXTENSION */
+	    XPutImage( st->dpy, st->window, st->gc, st->pImage,
+		       ux1, uy1, ux1, uy1, ux2 - ux1, uy2 - uy1 );
+	}
 }
 
 static unsigned long * SetPalette(struct state *st )
@@ -226,9 +278,25 @@ static void Initialize( struct state *st )
 	/*  Create the GC. */
 	st->gc = XCreateGC( st->dpy, st->window, 0, &gcValues );
 
-	st->pImage = XCreateImage( st->dpy, XWinAttribs.visual, XWinAttribs.depth, ZPixmap, 0, NULL,
-							  XWinAttribs.width, XWinAttribs.height, BitmapPad( st->dpy ), 0 );
-	(st->pImage)->data = calloc((st->pImage)->bytes_per_line, (st->pImage)->height);
+	st->pImage = 0;
+	st->shared = False;
+#ifdef HAVE_XSHM_EXTENSION
+	st->use_shm = get_boolean_resource( st->dpy, "useSHM", "Boolean" );
+	if (st->use_shm)
+	  {
+	    st->pImage = create_xshm_image( st->dpy, XWinAttribs.visual, XWinAttribs.depth, ZPixmap,
+					    NULL, &st->shminfo, XWinAttribs.width, XWinAttribs.height );
+	    if (st->pImage)
+	      st->shared = True;
+	  }
+#endif /* HAVE_XSHM_EXTENSION */
+
+	if (!st->pImage)
+	  {
+	    st->pImage = XCreateImage( st->dpy, XWinAttribs.visual, XWinAttribs.depth, ZPixmap, 0, NULL,
+				      XWinAttribs.width, XWinAttribs.height, BitmapPad( st->dpy ), 0 );
+	    (st->pImage)->data = calloc((st->pImage)->bytes_per_line, (st->pImage)->height);
+	  }
 
 	st->iWinWidth = XWinAttribs.width;
 	st->iWinHeight = XWinAttribs.height;
@@ -265,7 +333,7 @@ static void Initialize( struct state *st )
 	/* create st->blub array */
 	st->blub = malloc( st->iWinHeight * sizeof(unsigned char*));
 	for (i = 0; i < st->iWinHeight; ++i)
-	  st->blub[i] = malloc( st->iWinWidth * sizeof(unsigned char));
+	  st->blub[i] = calloc( st->iWinWidth, sizeof(unsigned char));
 
 	/* create st->blob */
 	for (i = -st->radius; i < st->radius; ++i)
@@ -339,7 +407,6 @@ metaballs_draw (Display *dpy, Window window, void *closure)
       XWindowAttributes XWinAttribs;
       XGetWindowAttributes( st->dpy, st->window, &XWinAttribs );
 
-      memset( st->pImage->data, 0, st->pImage->bytes_per_line * st->pImage->height );
       XFreeColors( st->dpy, XWinAttribs.colormap, st->aiColorVals, st->iColorCount, 0 );
       free( st->aiColorVals );
       st->aiColorVals = SetPalette( st );
@@ -349,6 +416,7 @@ metaballs_draw (Display *dpy, Window window, void *closure)
           init_blob(st, st->blobs + i);
         }
       st->draw_i = 0;
+      st->redraw_all = True;
     }
 
   Execute( st );
@@ -382,10 +450,15 @@ metaballs_event (Display *dpy, Window window, void *closure, XEvent *event)
 static void
 metaballs_free (Display *dpy, Window window, void *closure)
 {
-#if 0
   struct state *st = (struct state *) closure;
-	free( st->pImage->data );
-	XDestroyImage( st->pImage );
+  int i;
+#ifdef HAVE_XSHM_EXTENSION
+	if (st->shared)
+	  destroy_xshm_image( st->dpy, st->pImage, &st->shminfo );
+	else
+#endif /* HAVE_XSHM_EXTENSION */
+	  XDestroyImage( st->pImage );
+	XFreeGC( st->dpy, st->gc );
 	free( st->aiColorVals );
 	free( st->blobs );
 	for (i = 0; i < st->iWinHeight; ++i)
@@ -394,7 +467,8 @@ metaballs_free (Display *dpy, Window window, void *closure)
 	for (i = 0; i < st->dradius; ++i)
 	  free( st->blob[i] );
 	free( st->blob );
-#endif
+	free( st->sColor );
+	free( st );
 }
 
 
@@ -408,6 +482,9 @@ static const char *metaballs_defaults [] = {
   "*delay:    10000",
   "*radius:   100",
   "*delta:   3",
+#ifdef HAVE_XSHM_EXTENSION
+  "*useSHM:   True",
+#endif /* HAVE_XSHM_EXTENSION */
 #ifdef USE_IPHONE
   "*ignoreRotation: True",
 #endif
@@ -422,6 +499,10 @@ static XrmOptionDescRec metaballs_options [] = {
   { "-cycles",  ".cycles",  XrmoptionSepArg, 0 },
   { "-radius",  ".radius",  XrmoptionSepArg, 0 },
   { "-delta",  ".delta",  XrmoptionSepArg, 0 },
+#ifdef HAVE_XSHM_EXTENSION
+  { "-shm",     ".useSHM",  XrmoptionNoArg, "True" },
+  { "-no-shm",  ".useSHM",  XrmoptionNoArg, "False" },
+#endif /* HAVE_XSHM_EXTENSION */
   { 0, 0, 0, 0 }
 };
 
@@ -63,6 +63,7 @@
 #include <math.h>
 #include "screenhack.h"
 #include "spline.h"
+#include "dirty_cells.h"
 
 #define FLOAT float
 #define RAND_FLOAT (((FLOAT) (random() & 0xffff)) / ((FLOAT) 0x10000))
@@ -95,6 +96,8 @@ struct state {
   int blastcount;
 
   GC *coloredGCs;
+  unsigned long *pixels;
+  dirty_cells *dirty;
 
   int windowWidth;
   int windowHeight;
@@ -118,6 +121,10 @@ struct state {
 
   int warned;
   int delay;
+
+  Bool verbose;
+  int frames;
+  unsigned long requests;
 };
 
 
@@ -181,6 +188,7 @@ static void setup_random_colormap (struct state *st, XWindowAttributes *xgwa)
     {
 	gcv.foreground = colors[n].pixel;
 	st->coloredGCs[n] = XCreateGC (st->dpy, st->window, GCForeground, &gcv);
+	st->pixels[n] = colors[n].pixel;
     }
 
     free (colors);
@@ -234,6 +242,7 @@ static void setup_original_colormap (struct state *st, XWindowAttributes *xgwa)
     {
 	gcv.foreground = colors[n].pixel;
 	st->coloredGCs[n] = XCreateGC (st->dpy, st->window, GCForeground, &gcv);
+	st->pixels[n] = colors[n].pixel;
     }
 
     free (colors);
@@ -298,6 +307,7 @@ setup_display (struct state *st)
     }
 
     st->coloredGCs = (GC *) calloc (sizeof(GC), st->count * 2);
+    st->pixels = (unsigned long *) calloc (sizeof(*st->pixels), st->count * 2);
 
     st->diaglim  = get_float_resource (st->dpy, "diaglim", "Float");
     if (st->diaglim < 1.0)
@@ -456,16 +466,30 @@ setup_display (struct state *st)
     {
 	setup_random_colormap (st, &xgwa);
     }
+
+    if (!st->arr_width) st->arr_width = 1;
+    if (!st->arr_height) st->arr_height = 1;
+
+    st->dirty = dirty_cells_new (st->dpy, st->window, st->arr_width,
+                                 st->arr_height, st->count * 2);
+    if (!st->dirty)
+      {
+        fprintf (stderr, "%s: out of memory allocating %dx%d grid\n",
+                 progname, st->arr_width, st->arr_height);
+        exit (1);
+      }
+    dirty_cells_layout (st->dirty, st->xOffset, st->yOffset,
+                        st->xSize, st->ySize, st->xSize, st->ySize);
+    if (get_boolean_resource (st->dpy, "useSHM", "Boolean"))
+      dirty_cells_use_image (st->dirty, st->pixels);
+
+    st->verbose = get_boolean_resource (st->dpy, "verbose", "Boolean");
 }
 
+/* Cells are drawn all at once, at the end of update(). */
 static void drawblock (struct state *st, int x, int y, unsigned char c)
 {
-  if (st->xSize == 1 && st->ySize == 1)
-    XDrawPoint (st->dpy, st->window, st->coloredGCs[c], x + st->xOffset, y + st->yOffset);
-  else
-    XFillRectangle (st->dpy, st->window, st->coloredGCs[c],
-		    x * st->xSize + st->xOffset, y * st->ySize + st->yOffset,
-		    st->xSize, st->ySize);
+  dirty_cells_mark (st->dirty, x, y, c);
 }
 
 static void setup_arr (struct state *st)
@@ -479,9 +503,7 @@ static void setup_arr (struct state *st)
 
     XFillRectangle (st->dpy, st->window, st->coloredGCs[0], 0, 0, 
 		    st->windowWidth, st->windowHeight);
-    
-    if (!st->arr_width) st->arr_width = 1;
-    if (!st->arr_height) st->arr_height = 1;
+    dirty_cells_clear (st->dirty, 0);
 
     st->arr = (cell *) calloc (sizeof(cell), st->arr_width * st->arr_height);  
     if (!st->arr)
@@ -664,6 +686,8 @@ static void update (struct state *st)
 	    drawblock (st, cell_x(a), cell_y(a), a->col + st->count);
 	}
     }
+
+    dirty_cells_flush (st->dirty, st->coloredGCs);
 }
 
 static void *
@@ -688,6 +712,18 @@ petri_draw (Display *dpy, Window window, void *closure)
 {
   struct state *st = (struct state *) closure;
   update (st);
+
+  if (st->verbose)
+    {
+      st->requests += dirty_cells_requests (st->dirty);
+      if (++st->frames % 100 == 0)
+        {
+          fprintf (stderr, "%s: %.1f X requests per frame\n",
+                   progname, st->requests / 100.0);
+          st->requests = 0;
+        }
+    }
+
   return st->delay;
 }
 
@@ -707,6 +743,8 @@ static void
 petri_free (Display *dpy, Window window, void *closure)
 {
   struct state *st = (struct state *) closure;
+  dirty_cells_free (st->dirty);
+  free (st->pixels);
   free (st);
 }
 
@@ -732,6 +770,12 @@ static const char *petri_defaults [] = {
   "*originalcolors:	false",
   "*memThrottle:        22M",	/* don't malloc more than this much.
                                    Scale the pixels up if necessary. */
+  "*verbose:		false",
+#ifdef HAVE_XSHM_EXTENSION
+  "*useSHM:		True",
+#else
+  "*useSHM:		False",
+#endif
 #ifdef USE_IPHONE
   "*ignoreRotation:     True",
 #endif
@@ -754,6 +798,9 @@ static XrmOptionDescRec petri_options [] = {
   { "-maxdeathspeed",	 ".maxdeathspeed",	XrmoptionSepArg, 0 },
   { "-originalcolors",	 ".originalcolors",	XrmoptionNoArg,  "true" },
   { "-mem-throttle",	 ".memThrottle",	XrmoptionSepArg,  0 },
+  { "-verbose",		 ".verbose",		XrmoptionNoArg,  "true" },
+  { "-shm",		 ".useSHM",		XrmoptionNoArg,  "True" },
+  { "-no-shm",		 ".useSHM",		XrmoptionNoArg,  "False" },
   { 0, 0, 0, 0 }
 };
 
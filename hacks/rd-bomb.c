@@ -20,11 +20,16 @@
 #include <math.h>
 
 #include "screenhack.h"
+#include "thread_util.h"
 
 #ifdef HAVE_XSHM_EXTENSION
 # include "xshm.h"
 #endif /* HAVE_XSHM_EXTENSION */
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 /* costs ~6% speed */
 #define dither_when_mapped 1
 
@@ -43,7 +48,9 @@ struct state {
   int pdepth;
 
   int frame, epoch_time;
+  int substeps;
   unsigned short *r1, *r2, *r1b, *r2b;
+  unsigned long pixels[256];	/* colors[i % ncolors].pixel */
   int width, height, npix;
   int radius;
   int reaction;
@@ -63,6 +70,14 @@ struct state {
   double array_dx, array_dy;
   XWindowAttributes xgwa;
   int delay;
+
+  struct threadpool threadpool;
+  char *pix_buf;		/* Where this pass draws, or 0 for no drawing. */
+};
+
+struct rd_thread {
+  struct state *st;
+  unsigned id;
 };
 
 static void random_colors(struct state *st);
@@ -131,11 +146,284 @@ pixack_init(struct state *st, int *size_h, int *size_v)
 #define test_pattern_hyper 0
 
 
+#ifdef __SSE2__
+
+/* Exact x / 5 and x / 12 for 0 <= x < 2^20: the float estimate is off by at
+   most one either way, and gets corrected. */
+static __m128i
+div5_epi32 (__m128i x)
+{
+  __m128i q = _mm_cvttps_epi32 (_mm_mul_ps (_mm_cvtepi32_ps (x),
+                                            _mm_set1_ps (1.0f / 5)));
+  __m128i q5 = _mm_add_epi32 (_mm_slli_epi32 (q, 2), q);
+  q = _mm_add_epi32 (q, _mm_cmpgt_epi32 (q5, x));
+  q5 = _mm_add_epi32 (_mm_slli_epi32 (q, 2), q);
+  return _mm_sub_epi32 (q, _mm_cmpgt_epi32 (_mm_sub_epi32 (x, q5),
+                                            _mm_set1_epi32 (4)));
+}
+
+static __m128i
+div12_epi32 (__m128i x)
+{
+  __m128i q = _mm_cvttps_epi32 (_mm_mul_ps (_mm_cvtepi32_ps (x),
+                                            _mm_set1_ps (1.0f / 12)));
+  __m128i q12 = _mm_add_epi32 (_mm_slli_epi32 (q, 3), _mm_slli_epi32 (q, 2));
+  q = _mm_add_epi32 (q, _mm_cmpgt_epi32 (q12, x));
+  q12 = _mm_add_epi32 (_mm_slli_epi32 (q, 3), _mm_slli_epi32 (q, 2));
+  return _mm_sub_epi32 (q, _mm_cmpgt_epi32 (_mm_sub_epi32 (x, q12),
+                                            _mm_set1_epi32 (11)));
+}
+
+/* Packs two vectors of 0..mx ints into unsigned shorts. */
+static __m128i
+pack_epu16 (__m128i lo, __m128i hi)
+{
+  const __m128i bias = _mm_set1_epi32 (0x8000);
+  return _mm_xor_si128 (_mm_packs_epi32 (_mm_sub_epi32 (lo, bias),
+                                         _mm_sub_epi32 (hi, bias)),
+                        _mm_set1_epi16 ((short) 0x8000));
+}
+
+/* n * d, for the reaction rates of 2, 3 and 4. */
+static __m128i
+times_epi32 (__m128i d, int n)
+{
+  switch (n) {
+  case 4:  return _mm_slli_epi32 (d, 2);
+  case 3:  return _mm_add_epi32 (_mm_add_epi32 (d, d), d);
+  default: return _mm_add_epi32 (d, d);
+  }
+}
+
+static __m128i
+clamp_epi32 (__m128i x)
+{
+  const __m128i top = _mm_set1_epi32 (mx);
+  __m128i over = _mm_cmpgt_epi32 (x, top);
+  x = _mm_and_si128 (x, _mm_cmpgt_epi32 (x, _mm_set1_epi32 (-1)));
+  return _mm_or_si128 (_mm_andnot_si128 (over, x), _mm_and_si128 (over, top));
+}
+
+#endif /* __SSE2__ */
+
+
+/* One step of the reaction/diffusion for row i, from r1/r2 into r1b/r2b. */
+static void
+pixack_row (const struct state *st, int i)
+{
+  int j = 0;
+  int w2 = st->width + 2;
+  const unsigned short *i1 = st->r1 + 1 + w2 * (i + 1);
+  const unsigned short *i2 = st->r2 + 1 + w2 * (i + 1);
+  unsigned short *o1 = st->r1b + 1 + w2 * (i + 1);
+  unsigned short *o2 = st->r2b + 1 + w2 * (i + 1);
+
+  /* John E. Pearson "Complex Patterns in a Simple System"
+     Science, July 1993 */
+  int k1 = st->reaction == 0 ? 4 : st->reaction == 1 ? 3 : 2;
+  int k2 = st->reaction == 0 ? 4 : 3;
+  int f1 = st->reaction == 1 ? 27 : 28;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i f1v = _mm_set1_epi16 (f1 << 6);   /* mulhi: (x*f1) >> 10 */
+  const __m128i f2v = _mm_set1_epi16 (80 << 6);
+
+  for (; j + 8 <= st->width; j += 8) {
+# define LOAD(p, o) _mm_loadu_si128 ((const __m128i *) ((p) + j + (o)))
+# define LO(v) _mm_unpacklo_epi16 ((v), zero)
+# define HI(v) _mm_unpackhi_epi16 ((v), zero)
+    __m128i c1 = LOAD (i1, 0), c2 = LOAD (i2, 0);
+    __m128i n1 = LOAD (i1, 1), s1 = LOAD (i1, -1);
+    __m128i e1 = LOAD (i1, w2), w1 = LOAD (i1, -w2);
+    __m128i n2 = LOAD (i2, 1), s2 = LOAD (i2, -1);
+    __m128i e2 = LOAD (i2, w2), w2v = LOAD (i2, -w2);
+    __m128i a_lo = _mm_add_epi32 (_mm_add_epi32 (LO (n1), LO (s1)),
+                                  _mm_add_epi32 (LO (e1), LO (w1)));
+    __m128i a_hi = _mm_add_epi32 (_mm_add_epi32 (HI (n1), HI (s1)),
+                                  _mm_add_epi32 (HI (e1), HI (w1)));
+    __m128i b_lo = _mm_add_epi32 (_mm_add_epi32 (LO (n2), LO (s2)),
+                                  _mm_add_epi32 (LO (e2), LO (w2v)));
+    __m128i b_hi = _mm_add_epi32 (_mm_add_epi32 (HI (n2), HI (s2)),
+                                  _mm_add_epi32 (HI (e2), HI (w2v)));
+    __m128i r1, r2, t, uvv, d_lo, d_hi, x_lo, x_hi;
+
+    switch (st->diffusion) {
+    case 0:
+      r1 = pack_epu16 (div5_epi32 (_mm_add_epi32 (a_lo, LO (c1))),
+                       div5_epi32 (_mm_add_epi32 (a_hi, HI (c1))));
+      r2 = pack_epu16 (
+             div12_epi32 (_mm_add_epi32 (b_lo, _mm_slli_epi32 (LO (c2), 3))),
+             div12_epi32 (_mm_add_epi32 (b_hi, _mm_slli_epi32 (HI (c2), 3))));
+      break;
+    case 1:
+      r1 = pack_epu16 (_mm_srli_epi32 (a_lo, 2), _mm_srli_epi32 (a_hi, 2));
+      r2 = pack_epu16 (
+             _mm_srli_epi32 (_mm_add_epi32 (b_lo, _mm_slli_epi32 (LO (c2), 2)), 3),
+             _mm_srli_epi32 (_mm_add_epi32 (b_hi, _mm_slli_epi32 (HI (c2), 2)), 3));
+      break;
+    default:
+      a_lo = _mm_add_epi32 (_mm_add_epi32 (LO (e1), LO (w1)),
+               _mm_slli_epi32 (_mm_add_epi32 (_mm_add_epi32 (LO (c1), LO (n1)),
+                                              LO (s1)), 1));
+      a_hi = _mm_add_epi32 (_mm_add_epi32 (HI (e1), HI (w1)),
+               _mm_slli_epi32 (_mm_add_epi32 (_mm_add_epi32 (HI (c1), HI (n1)),
+                                              HI (s1)), 1));
+      r1 = pack_epu16 (_mm_srli_epi32 (a_lo, 3), _mm_srli_epi32 (a_hi, 3));
+      r2 = pack_epu16 (
+             _mm_srli_epi32 (_mm_add_epi32 (b_lo, _mm_slli_epi32 (LO (c2), 2)), 3),
+             _mm_srli_epi32 (_mm_add_epi32 (b_hi, _mm_slli_epi32 (HI (c2), 2)), 3));
+      break;
+    }
+
+    /* uvv, including the wraparound of r1*r2 in a signed int: the high
+       half of the product is signed, then multiplied by unsigned r2. */
+    t = _mm_mulhi_epu16 (r1, r2);
+    uvv = _mm_add_epi16 (_mm_mulhi_epi16 (t, r2),
+                         _mm_and_si128 (t, _mm_srai_epi16 (r2, 15)));
+#  define SLO(v) _mm_unpacklo_epi16 ((v), _mm_srai_epi16 ((v), 15))
+#  define SHI(v) _mm_unpackhi_epi16 ((v), _mm_srai_epi16 ((v), 15))
+
+    t = _mm_mulhi_epu16 (_mm_xor_si128 (r1, _mm_set1_epi16 (-1)), f1v);
+    d_lo = _mm_sub_epi32 (LO (t), SLO (uvv));
+    d_hi = _mm_sub_epi32 (HI (t), SHI (uvv));
+    x_lo = clamp_epi32 (_mm_add_epi32 (LO (r1), times_epi32 (d_lo, k1)));
+    x_hi = clamp_epi32 (_mm_add_epi32 (HI (r1), times_epi32 (d_hi, k1)));
+    _mm_storeu_si128 ((__m128i *) (o1 + j), pack_epu16 (x_lo, x_hi));
+
+    t = _mm_mulhi_epu16 (r2, f2v);
+    d_lo = _mm_sub_epi32 (SLO (uvv), LO (t));
+    d_hi = _mm_sub_epi32 (SHI (uvv), HI (t));
+    x_lo = clamp_epi32 (_mm_add_epi32 (LO (r2), times_epi32 (d_lo, k2)));
+    x_hi = clamp_epi32 (_mm_add_epi32 (HI (r2), times_epi32 (d_hi, k2)));
+    _mm_storeu_si128 ((__m128i *) (o2 + j), pack_epu16 (x_lo, x_hi));
+#  undef SLO
+#  undef SHI
+# undef LOAD
+# undef LO
+# undef HI
+  }
+#endif /* __SSE2__ */
+
+  for (; j < st->width; j++) {
+    int uvv, r1 = 0, r2 = 0;
+    switch (st->diffusion) {
+    case 0:
+      r1 = i1[j] + i1[j+1] + i1[j-1] + i1[j+w2] + i1[j-w2];
+      r1 = r1 / 5;
+      r2 = (i2[j]<<3) + i2[j+1] + i2[j-1] + i2[j+w2] + i2[j-w2];
+      r2 = r2 / 12;
+      break;
+    case 1:
+      r1 = i1[j+1] + i1[j-1] + i1[j+w2] + i1[j-w2];
+      r1 = r1 >> 2;
+      r2 = (i2[j]<<2) + i2[j+1] + i2[j-1] + i2[j+w2] + i2[j-w2];
+      r2 = r2 >> 3;
+      break;
+    case 2:
+      r1 = (i1[j]<<1) + (i1[j+1]<<1) + (i1[j-1]<<1) + i1[j+w2] + i1[j-w2];
+      r1 = r1 >> 3;
+      r2 = (i2[j]<<2) + i2[j+1] + i2[j-1] + i2[j+w2] + i2[j-w2];
+      r2 = r2 >> 3;
+      break;
+    }
+
+    /* r1 * r2 used to overflow an int here, and the patterns depend on
+       it wrapping around, so do that on purpose. */
+    uvv = (short) (((unsigned) r1 * r2) >> bps);
+    uvv = (uvv * r2) >> bps;
+    r1 += k1 * (((f1 * (mx-r1)) >> 10) - uvv);
+    r2 += k2 * (uvv - ((80 * r2) >> 10));
+    if (r1 > mx) r1 = mx;
+    if (r2 > mx) r2 = mx;
+    if (r1 < 0) r1 = 0;
+    if (r2 < 0) r2 = 0;
+    o1[j] = r1;
+    o2[j] = r2;
+  }
+}
+
+
+/* Maps row i of r1b to pixels. */
+static void
+pixack_draw_row (const struct state *st, char *pix_buf, int i)
+{
+  int j;
+  int w2 = st->width + 2;
+  const unsigned short *o1 = st->r1b + 1 + w2 * (i + 1);
+  char *q = pix_buf + st->image->bytes_per_line * i;
+  short *qq = (short *) q;
+  int   *qqq = (int *) q;
+
+  /* this is terrible.  here i want to assume ncolors = 256. */
+  if (st->mapped)
+    for (j = 0; j < st->width; j++)
+#if dither_when_mapped
+      q[j] = st->pixels[st->mc[o1[j]]];
+#else
+      q[j] = st->pixels[o1[j]>>8];
+#endif
+  else if (st->pdepth == 8)
+    for (j = 0; j < st->width; j++)
+      q[j] = st->pixels[o1[j]>>8];
+  else if (st->pdepth == 16)
+    for (j = 0; j < st->width; j++)
+#if dither_when_mapped
+      qq[j] = st->pixels[st->mc[o1[j]]];
+#else
+      qq[j] = st->pixels[o1[j]>>8];
+#endif
+  else if (st->pdepth == 32)
+    for (j = 0; j < st->width; j++)
+#if dither_when_mapped
+      qqq[j] = (int) st->pixels[st->mc[o1[j]]];
+#else
+      qqq[j] = st->pixels[o1[j]>>8];
+#endif
+  else
+    abort();
+}
+
+
+/* Each thread steps (and maybe draws) one band of rows. */
+static void
+pixack_pass (void *self_raw)
+{
+  struct rd_thread *self = (struct rd_thread *) self_raw;
+  const struct state *st = self->st;
+  unsigned count = st->threadpool.count ? st->threadpool.count : 1;
+  int i0 = st->height * self->id / count;
+  int i1 = st->height * (self->id + 1) / count;
+  int i;
+
+  for (i = i0; i < i1; i++) {
+    pixack_row (st, i);
+    if (st->pix_buf)
+      pixack_draw_row (st, st->pix_buf, i);
+  }
+}
+
+
+static int
+rd_thread_create (void *self_raw, struct threadpool *pool, unsigned id)
+{
+  struct rd_thread *self = (struct rd_thread *) self_raw;
+  self->st = GET_PARENT_OBJ(struct state, threadpool, pool);
+  self->id = id;
+  return 0;
+}
+
+static void
+rd_thread_destroy (void *self_raw)
+{
+}
+
+
 /* returns the pixels.  called many times. */
 static void
 pixack_frame(struct state *st, char *pix_buf) 
 {
-  int i, j;
+  int i, j, step;
   int w2 = st->width + 2;
   unsigned short *t;
 #if test_pattern_hyper
@@ -159,6 +447,8 @@ pixack_frame(struct state *st, char *pix_buf)
     }
 
     random_colors(st);
+    for (i = 0; i < 256; i++)
+      st->pixels[i] = st->colors[i % st->ncolors].pixel;
 
     XSetWindowBackground(st->dpy, st->window, st->colors[255 % st->ncolors].pixel);
     XClearWindow(st->dpy, st->window);
@@ -185,109 +475,37 @@ pixack_frame(struct state *st, char *pix_buf)
     if (2 == st->reaction && 2 == st->diffusion)
       st->reaction = st->diffusion = 0;
   }
-  for (i = 0; i <= st->width+1; i++) {
-    st->r1[i] = st->r1[i + w2 * st->height];
-    st->r2[i] = st->r2[i + w2 * st->height];
-    st->r1[i + w2 * (st->height + 1)] = st->r1[i + w2];
-    st->r2[i + w2 * (st->height + 1)] = st->r2[i + w2];
-  }
-  for (i = 0; i <= st->height+1; i++) {
-    st->r1[w2 * i] = st->r1[st->width + w2 * i];
-    st->r2[w2 * i] = st->r2[st->width + w2 * i];
-    st->r1[w2 * i + st->width + 1] = st->r1[w2 * i + 1];
-    st->r2[w2 * i + st->width + 1] = st->r2[w2 * i + 1];
-  }
-  for (i = 0; i < st->height; i++) {
-    int ii = i + 1;
-    char *q = pix_buf + st->width * i;
-    short *qq = ((short *) pix_buf) + st->width * i;
-/*  long  *qqq = ((long *) pix_buf) + st->width * i;  -- crashes on Alpha */
-    int   *qqq = ((int  *) pix_buf) + st->width * i;
-    unsigned short *i1 = st->r1 + 1 + w2 * ii;
-    unsigned short *i2 = st->r2 + 1 + w2 * ii;
-    unsigned short *o1 = st->r1b + 1 + w2 * ii;
-    unsigned short *o2 = st->r2b + 1 + w2 * ii;
-    for (j = 0; j < st->width; j++) {
-#if test_pattern_hyper
-      int r1 = (i * j + (st->frame&127)*frame)&65535;
-#else
-      int uvv, r1 = 0, r2 = 0;
-      switch (st->diffusion) {
-      case 0:
-	r1 = i1[j] + i1[j+1] + i1[j-1] + i1[j+w2] + i1[j-w2];
-	r1 = r1 / 5;
-	r2 = (i2[j]<<3) + i2[j+1] + i2[j-1] + i2[j+w2] + i2[j-w2];
-	r2 = r2 / 12;
-	break;
-      case 1:
-	r1 = i1[j+1] + i1[j-1] + i1[j+w2] + i1[j-w2];
-	r1 = r1 >> 2;
-	r2 = (i2[j]<<2) + i2[j+1] + i2[j-1] + i2[j+w2] + i2[j-w2];
-	r2 = r2 >> 3;
-	break;
-      case 2:
-	r1 = (i1[j]<<1) + (i1[j+1]<<1) + (i1[j-1]<<1) + i1[j+w2] + i1[j-w2];
-	r1 = r1 >> 3;
-	r2 = (i2[j]<<2) + i2[j+1] + i2[j-1] + i2[j+w2] + i2[j-w2];
-	r2 = r2 >> 3;
-	break;
-      }
-
-      /* John E. Pearson "Complex Patterns in a Simple System"
-	 Science, July 1993 */
-
-      uvv = (((r1 * r2) >> bps) * r2) >> bps;
-      switch (st->reaction) {  /* costs 4% */
-      case 0:
-	r1 += 4 * (((28 * (mx-r1)) >> 10) - uvv);
-	r2 += 4 * (uvv - ((80 * r2) >> 10));
-	break;
-      case 1:
-	r1 += 3 * (((27 * (mx-r1)) >> 10) - uvv);
-	r2 += 3 * (uvv - ((80 * r2) >> 10));
-	break;
-      case 2:
-	r1 += 2 * (((28 * (mx-r1)) >> 10) - uvv);
-	r2 += 3 * (uvv - ((80 * r2) >> 10));
-	break;
-      }
-      if (r1 > mx) r1 = mx;
-      if (r2 > mx) r2 = mx;
-      if (r1 < 0) r1 = 0;
-      if (r2 < 0) r2 = 0;
-      o1[j] = r1;
-      o2[j] = r2;
-#endif
 
-      /* this is terrible.  here i want to assume ncolors = 256.
-	 should lose double indirection */
+  for (step = 0; step < st->substeps; step++) {
+    for (i = 0; i <= st->width+1; i++) {
+      st->r1[i] = st->r1[i + w2 * st->height];
+      st->r2[i] = st->r2[i + w2 * st->height];
+      st->r1[i + w2 * (st->height + 1)] = st->r1[i + w2];
+      st->r2[i + w2 * (st->height + 1)] = st->r2[i + w2];
+    }
+    for (i = 0; i <= st->height+1; i++) {
+      st->r1[w2 * i] = st->r1[st->width + w2 * i];
+      st->r2[w2 * i] = st->r2[st->width + w2 * i];
+      st->r1[w2 * i + st->width + 1] = st->r1[w2 * i + 1];
+      st->r2[w2 * i + st->width + 1] = st->r2[w2 * i + 1];
+    }
 
-      if (st->mapped)
-#if dither_when_mapped
-	q[j] = st->colors[st->mc[r1]  % st->ncolors].pixel;
-#else
-      q[j] = st->colors[(r1>>8) % st->ncolors].pixel;
-#endif
-      else if (st->pdepth == 8)
-	q[j] = st->colors[(r1>>8) % st->ncolors].pixel;
-      else if (st->pdepth == 16)
-#if dither_when_mapped
-	qq[j] = st->colors[st->mc[r1] % st->ncolors].pixel;
-#else
-	qq[j] = st->colors[(r1>>8) % st->ncolors].pixel;
-#endif
-      else if (st->pdepth == 32)
-#if dither_when_mapped
-	qqq[j] = (int)st->colors[st->mc[r1] % st->ncolors].pixel;
-#else
-	qqq[j] = st->colors[(r1>>8) % st->ncolors].pixel;
-#endif
-      else
-	abort();
+    /* Only the last step of a frame gets drawn. */
+    st->pix_buf = (step == st->substeps - 1) ? pix_buf : 0;
+
+    if (st->threadpool.count) {
+      threadpool_run (&st->threadpool, pixack_pass);
+      threadpool_wait (&st->threadpool);
+    } else {
+      struct rd_thread self;
+      self.st = st;
+      self.id = 0;
+      pixack_pass (&self);
     }
+
+    t = st->r1; st->r1 = st->r1b; st->r1b = t;
+    t = st->r2; st->r2 = st->r2b; st->r2b = t;  
   }
-  t = st->r1; st->r1 = st->r1b; st->r1b = t;
-  t = st->r2; st->r2 = st->r2b; st->r2b = t;  
 }
 
 
@@ -307,6 +525,7 @@ static const char *rd_defaults [] = {
   "*size:	1.0",
   "*delay:	30000",
   "*colors:	255",
+  "*substeps:	1",
 #ifdef HAVE_XSHM_EXTENSION
   "*useSHM:	True",
 #else
@@ -315,6 +534,7 @@ static const char *rd_defaults [] = {
 #ifdef USE_IPHONE
   "*ignoreRotation: True",
 #endif
+  THREAD_DEFAULTS
   0
 };
 
@@ -331,6 +551,8 @@ static XrmOptionDescRec rd_options [] = {
   { "-ncolors",		".colors",	XrmoptionSepArg, 0 },
   { "-shm",		".useSHM",	XrmoptionNoArg, "True" },
   { "-no-shm",		".useSHM",	XrmoptionNoArg, "False" },
+  { "-substeps",	".substeps",	XrmoptionSepArg, 0 },
+  THREAD_OPTIONS
   { 0, 0, 0, 0 }
 };
 
@@ -383,6 +605,8 @@ rd_init (Display *dpy, Window win)
   st->window = win;
 
   st->delay = get_integer_resource (st->dpy, "delay", "Float");
+  st->substeps = get_integer_resource (st->dpy, "substeps", "Integer");
+  if (st->substeps < 1) st->substeps = 1;
 
 #ifdef HAVE_XSHM_EXTENSION
   st->use_shm = get_boolean_resource(st->dpy, "useSHM", "Boolean");
@@ -521,6 +745,18 @@ rd_init (Display *dpy, Window win)
 			   st->width, st->height, 8, 0);
     }
 
+  {
+    static const struct threadpool_class cls = {
+      sizeof(struct rd_thread),
+      rd_thread_create,
+      rd_thread_destroy
+    };
+
+    if (threadpool_create (&st->threadpool, &cls, st->dpy,
+                           hardware_concurrency (st->dpy)))
+      st->threadpool.count = 0; /* See the note in thread_util.h. */
+  }
+
   return st;
 }
 
@@ -592,6 +828,23 @@ rd_event (Display *dpy, Window window, void *closure, XEvent *event)
 static void
 rd_free (Display *dpy, Window window, void *closure)
 {
+  struct state *st = (struct state *) closure;
+  if (st->threadpool.count)
+    threadpool_destroy (&st->threadpool);
+#ifdef HAVE_XSHM_EXTENSION
+  if (st->use_shm)
+    destroy_xshm_image (dpy, st->image, &st->shm_info);
+  else
+#endif
+    XDestroyImage (st->image);	/* and st->pd */
+  XFreeGC (dpy, st->gc);
+  free (st->r1);
+  free (st->r2);
+  free (st->r1b);
+  free (st->r2b);
+  free (st->mc);
+  free (st->colors);
+  free (st);
 }
 
 XSCREENSAVER_MODULE_2 ("RDbomb", rdbomb, rd)
@@ -44,6 +44,17 @@
 
 #include <math.h>
 #include "screenhack.h"
+#include "thread_util.h"
+
+#ifdef HAVE_STDINT_H
+# include <stdint.h>
+#else
+typedef unsigned int uint32_t;
+#endif
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 typedef enum {ripple_drop, ripple_blob, ripple_box, ripple_stir} ripple_mode;
 
@@ -94,7 +105,7 @@ struct state {
   int duration;
   time_t start_time;
 
-  void (*draw_transparent) (struct state *st, short *src);
+  void (*draw_transparent) (struct state *st, short *src, int down0, int down1);
 
   async_load_state *img_loader;
 
@@ -102,6 +113,19 @@ struct state {
   Bool use_shm;
   XShmSegmentInfo shm_info;
 #endif /* HAVE_XSHM_EXTENSION */
+
+  /* Both images are 32 bits per pixel in our own byte order, so the
+     renderers can skip XGetPixel/XPutPixel. */
+  Bool direct_p;
+
+  /* Each frame is a few passes over the rows, split across the threads. */
+  struct threadpool threadpool;
+  short *wave_src, *wave_dest;
+};
+
+struct ripple_thread {
+  struct state *st;
+  unsigned id;
 };
 
 
@@ -132,6 +156,32 @@ static unsigned long grayscale(struct state *st, unsigned long color);
 /*      -------------------------------------------             */
 
 
+#define DIRECT_PIXEL(img, x, y) \
+  (((uint32_t *) ((img)->data + (y) * (img)->bytes_per_line))[x])
+
+#define GET_ORIG(st, x, y) \
+  ((st)->direct_p \
+   ? (unsigned long) DIRECT_PIXEL((st)->orig_map, (x), (y)) \
+   : XGetPixel((st)->orig_map, (x), (y)))
+
+#define PUT_BUFFER(st, x, y, p) do { \
+  if ((st)->direct_p) \
+    DIRECT_PIXEL((st)->buffer_map, (x), (y)) = (uint32_t) (p); \
+  else \
+    XPutPixel((st)->buffer_map, (x), (y), (p)); \
+  } while (0)
+
+
+static Bool
+direct_image_p(XImage *image)
+{
+  union { int i; char c[sizeof(int)]; } u;
+  u.i = 1;
+  return (image->bits_per_pixel == 32 &&
+          image->byte_order == (u.c[0] ? LSBFirst : MSBFirst));
+}
+
+
 static int
 map_color(struct state *st, int grey)
 {
@@ -146,12 +196,13 @@ map_color(struct state *st, int grey)
 
 
 static void
-draw_ripple(struct state *st, short *src)
+draw_ripple(struct state *st, short *src, int down0, int down1)
 {
   int across, down;
-  char *dirty = st->dirty_buffer;
+  char *dirty = st->dirty_buffer + down0 * st->width;
 
-  for (down = 0; down < st->height - 1; down++, src += 1, dirty += 1)
+  src += down0 * st->width;
+  for (down = down0; down < down1; down++, src += 1, dirty += 1)
     for (across = 0; across < st->width - 1; across++, src++, dirty++) {
       int v1, v2, v3, v4;
       v1 = (int)*src;
@@ -170,10 +221,10 @@ draw_ripple(struct state *st, short *src)
           dx = ((v3 - v1) + (v4 - v2)) << st->light; /* light from top */
         } else
           dx = 0;
-        XPutPixel(st->buffer_map,(across<<1),  (down<<1),  map_color(st, dx + v1));
-        XPutPixel(st->buffer_map,(across<<1)+1,(down<<1),  map_color(st, dx + ((v1 + v2) >> 1)));
-        XPutPixel(st->buffer_map,(across<<1),  (down<<1)+1,map_color(st, dx + ((v1 + v3) >> 1)));
-        XPutPixel(st->buffer_map,(across<<1)+1,(down<<1)+1,map_color(st, dx + ((v1 + v4) >> 1)));
+        PUT_BUFFER(st,(across<<1),  (down<<1),  map_color(st, dx + v1));
+        PUT_BUFFER(st,(across<<1)+1,(down<<1),  map_color(st, dx + ((v1 + v2) >> 1)));
+        PUT_BUFFER(st,(across<<1),  (down<<1)+1,map_color(st, dx + ((v1 + v3) >> 1)));
+        PUT_BUFFER(st,(across<<1)+1,(down<<1)+1,map_color(st, dx + ((v1 + v4) >> 1)));
       }
     }
 }
@@ -184,13 +235,13 @@ draw_ripple(struct state *st, short *src)
 
 /* Uses the horizontal gradient as an offset to create a warp effect  */
 static void
-draw_transparent_vanilla(struct state *st, short *src)
+draw_transparent_vanilla(struct state *st, short *src, int down0, int down1)
 {
   int across, down, pixel;
   char *dirty = st->dirty_buffer;
 
-  pixel = 0;
-  for (down = 0; down < st->height - 2; down++, pixel += 2)
+  pixel = down0 * st->width;
+  for (down = down0; down < down1; down++, pixel += 2)
     for (across = 0; across < st->width-2; across++, pixel++) {
       int gradx, grady, gradx1, grady1;
       int x0, x1, x2, y1, y2;
@@ -226,14 +277,14 @@ draw_transparent_vanilla(struct state *st, short *src)
         dirty[pixel] = DIRTY;
 
       if (dirty[pixel] > 0) {
-        XPutPixel(st->buffer_map, (across<<1),  (down<<1),
-                  grayscale(st, XGetPixel(st->orig_map, (across<<1) + gradx, (down<<1) + grady)));
-        XPutPixel(st->buffer_map, (across<<1)+1,(down<<1),
-                  grayscale(st, XGetPixel(st->orig_map, (across<<1) + gradx1,(down<<1) + grady)));
-        XPutPixel(st->buffer_map, (across<<1),  (down<<1)+1,
-                  grayscale(st, XGetPixel(st->orig_map, (across<<1) + gradx, (down<<1) + grady1)));
-        XPutPixel(st->buffer_map, (across<<1)+1,(down<<1)+1,
-                  grayscale(st, XGetPixel(st->orig_map, (across<<1) + gradx1,(down<<1) + grady1)));
+        PUT_BUFFER(st, (across<<1),  (down<<1),
+                   GET_ORIG(st, (across<<1) + gradx, (down<<1) + grady));
+        PUT_BUFFER(st, (across<<1)+1,(down<<1),
+                   GET_ORIG(st, (across<<1) + gradx1,(down<<1) + grady));
+        PUT_BUFFER(st, (across<<1),  (down<<1)+1,
+                   GET_ORIG(st, (across<<1) + gradx, (down<<1) + grady1));
+        PUT_BUFFER(st, (across<<1)+1,(down<<1)+1,
+                   GET_ORIG(st, (across<<1) + gradx1,(down<<1) + grady1));
       }
     }
 }
@@ -324,13 +375,13 @@ grayscale(struct state *st, unsigned long color)
 
 
 static void
-draw_transparent_light(struct state *st, short *src)
+draw_transparent_light(struct state *st, short *src, int down0, int down1)
 {
   int across, down, pixel;
   char *dirty = st->dirty_buffer;
 
-  pixel = 0;
-  for (down = 0; down < st->height - 2; down++, pixel += 2)
+  pixel = down0 * st->width;
+  for (down = down0; down < down1; down++, pixel += 2)
     for (across = 0; across < st->width-2; across++, pixel++) {
       int gradx, grady, gradx1, grady1;
       int x0, x1, x2, y1, y2;
@@ -375,24 +426,24 @@ draw_transparent_light(struct state *st, short *src)
           dx = (grady + (src[pixel+st->width+1]-x1)) << (st->light-4);
 
         if (dx != 0) {
-          XPutPixel(st->buffer_map, (across<<1),  (down<<1),
-                    bright(st, dx, grayscale(st, XGetPixel(st->orig_map, (across<<1) + gradx, (down<<1) + grady))));
-          XPutPixel(st->buffer_map, (across<<1)+1,(down<<1),
-                    bright(st, dx, grayscale(st, XGetPixel(st->orig_map, (across<<1) + gradx1,(down<<1) + grady))));
-          XPutPixel(st->buffer_map, (across<<1),  (down<<1)+1,
-                    bright(st, dx, grayscale(st, XGetPixel(st->orig_map, (across<<1) + gradx, (down<<1) + grady1))));
-          XPutPixel(st->buffer_map, (across<<1)+1,(down<<1)+1,
-                    bright(st, dx, grayscale(st, XGetPixel(st->orig_map, (across<<1) + gradx1,(down<<1) + grady1))));
+          PUT_BUFFER(st, (across<<1),  (down<<1),
+                     bright(st, dx, GET_ORIG(st, (across<<1) + gradx, (down<<1) + grady)));
+          PUT_BUFFER(st, (across<<1)+1,(down<<1),
+                     bright(st, dx, GET_ORIG(st, (across<<1) + gradx1,(down<<1) + grady)));
+          PUT_BUFFER(st, (across<<1),  (down<<1)+1,
+                     bright(st, dx, GET_ORIG(st, (across<<1) + gradx, (down<<1) + grady1)));
+          PUT_BUFFER(st, (across<<1)+1,(down<<1)+1,
+                     bright(st, dx, GET_ORIG(st, (across<<1) + gradx1,(down<<1) + grady1)));
         } else {
           /* Could use XCopyArea, but XPutPixel is faster */
-          XPutPixel(st->buffer_map, (across<<1),  (down<<1),
-                    grayscale(st, XGetPixel(st->orig_map, (across<<1) + gradx, (down<<1) + grady)));
-          XPutPixel(st->buffer_map, (across<<1)+1,(down<<1),
-                    grayscale(st, XGetPixel(st->orig_map, (across<<1) + gradx1,(down<<1) + grady)));
-          XPutPixel(st->buffer_map, (across<<1),  (down<<1)+1,
-                    grayscale(st, XGetPixel(st->orig_map, (across<<1) + gradx, (down<<1) + grady1)));
-          XPutPixel(st->buffer_map, (across<<1)+1,(down<<1)+1,
-                    grayscale(st, XGetPixel(st->orig_map, (across<<1) + gradx1,(down<<1) + grady1)));
+          PUT_BUFFER(st, (across<<1),  (down<<1),
+                     GET_ORIG(st, (across<<1) + gradx, (down<<1) + grady));
+          PUT_BUFFER(st, (across<<1)+1,(down<<1),
+                     GET_ORIG(st, (across<<1) + gradx1,(down<<1) + grady));
+          PUT_BUFFER(st, (across<<1),  (down<<1)+1,
+                     GET_ORIG(st, (across<<1) + gradx, (down<<1) + grady1));
+          PUT_BUFFER(st, (across<<1)+1,(down<<1)+1,
+                     GET_ORIG(st, (across<<1) + gradx1,(down<<1) + grady1));
         }
       }
     }
@@ -815,6 +866,11 @@ init_ripples(struct state *st, int ndrops, int splash)
 {
   int i;
 
+  if (st->bufferA) free(st->bufferA);
+  if (st->bufferB) free(st->bufferB);
+  if (st->temp) free(st->temp);
+  if (st->dirty_buffer) free(st->dirty_buffer);
+
   st->bufferA = (short *)calloc(st->width * st->height, sizeof(*st->bufferA));
   st->bufferB = (short *)calloc(st->width * st->height, sizeof(*st->bufferB));
   st->temp = (short *)calloc(st->width * st->height, sizeof(*st->temp));
@@ -824,21 +880,24 @@ init_ripples(struct state *st, int ndrops, int splash)
   for (i = 0; i < ndrops; i++)
     add_drop(st, ripple_blob, splash);
 
+  st->direct_p = (direct_image_p(st->buffer_map) &&
+                  (!st->orig_map || direct_image_p(st->orig_map)));
+
   if (st->transparent) {
+    /* The renderers only ever copy pixels out of orig_map, so do the
+       grayscale conversion once, here, rather than on every frame. */
     if (st->grayscale_p)
     {
       int across, down;
       for (down = 0; down < st->bigheight; down++)
         for (across = 0; across < st->bigwidth; across++)
-          XPutPixel(st->buffer_map, across, down,
+          XPutPixel(st->orig_map, across, down,
                     grayscale(st, XGetPixel(st->orig_map, across, down)));
     }
-    else
-    {  
+
     /* There's got to be a better way of doing this  XCopyArea? */
     memcpy(st->buffer_map->data, st->orig_map->data,
            st->bigheight * st->buffer_map->bytes_per_line);
-    }
   } else {
     int across, down, color;
 
@@ -888,65 +947,259 @@ init_ripples(struct state *st, int ndrops, int splash)
  n>4 (eg 8 or 12) more fluid, waves die out slowly
  */
 
+/* One row of the wave equation: out = (sum of 4 neighbors)/2 - prev,
+   and then, if damp_p, damped by 1/2^fluidity.  out may be prev.
+   This is done in ints and truncated back to short at the end, so the
+   SSE2 version widens to 32 bits to get the same overflow behaviour.
+ */
 static void
-ripple(struct state *st)
+wave_row(short *out, const short *src, const short *prev, int width, int n,
+         int fluidity, Bool damp_p)
 {
-  int across, down, pixel;
-  short *src, *dest;
+  int i = 0;
+
+#ifdef __SSE2__
+  __m128i shift = _mm_cvtsi32_si128(fluidity);
+# define WIDEN_LO(v) _mm_srai_epi32(_mm_unpacklo_epi16((v), (v)), 16)
+# define WIDEN_HI(v) _mm_srai_epi32(_mm_unpackhi_epi16((v), (v)), 16)
+# define NARROW(v) _mm_srai_epi32(_mm_slli_epi32((v), 16), 16)
+
+  for (; i + 8 <= n; i += 8) {
+    __m128i l = _mm_loadu_si128((const __m128i *) (src + i - 1));
+    __m128i r = _mm_loadu_si128((const __m128i *) (src + i + 1));
+    __m128i u = _mm_loadu_si128((const __m128i *) (src + i - width));
+    __m128i d = _mm_loadu_si128((const __m128i *) (src + i + width));
+    __m128i p = _mm_loadu_si128((const __m128i *) (prev + i));
+    __m128i lo = _mm_add_epi32(_mm_add_epi32(WIDEN_LO(l), WIDEN_LO(r)),
+                               _mm_add_epi32(WIDEN_LO(u), WIDEN_LO(d)));
+    __m128i hi = _mm_add_epi32(_mm_add_epi32(WIDEN_HI(l), WIDEN_HI(r)),
+                               _mm_add_epi32(WIDEN_HI(u), WIDEN_HI(d)));
+
+    /* Divide by 2, rounding towards zero as C does. */
+    lo = _mm_srai_epi32(_mm_add_epi32(lo, _mm_srli_epi32(lo, 31)), 1);
+    hi = _mm_srai_epi32(_mm_add_epi32(hi, _mm_srli_epi32(hi, 31)), 1);
+    lo = _mm_sub_epi32(lo, WIDEN_LO(p));
+    hi = _mm_sub_epi32(hi, WIDEN_HI(p));
+
+    if (damp_p) {
+      lo = _mm_sub_epi32(lo, _mm_sra_epi32(lo, shift));
+      hi = _mm_sub_epi32(hi, _mm_sra_epi32(hi, shift));
+    }
+
+    _mm_storeu_si128((__m128i *) (out + i),
+                     _mm_packs_epi32(NARROW(lo), NARROW(hi)));
+  }
+#endif /* __SSE2__ */
+
+  for (; i < n; i++) {
+    int damp = ((src[i - 1] + src[i + 1] +
+                 src[i - width] + src[i + width]) / 2) - prev[i];
+    out[i] = damp_p ? damp - (damp >> fluidity) : damp;
+  }
+}
+
+
+/* One row of the smoothing pass: the 3x3 average of temp, damped,
+   except where temp is 0.  The SSE2 version divides by 9 in floats,
+   which gives the same answer as the integer division: the sums are
+   exact, and no quotient can round across an integer.
+ */
+static void
+smooth_row(short *out, const short *t, int width, int n, int fluidity)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  __m128i shift = _mm_cvtsi32_si128(fluidity);
+  __m128 ninth = _mm_set1_ps(9.0f);
+
+  for (; i + 8 <= n; i += 8) {
+    const short *a = t + i - width;
+    const short *b = t + i;
+    const short *c = t + i + width;
+    __m128i v[9];
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128(), zero;
+    int k;
+
+    v[0] = _mm_loadu_si128((const __m128i *) (a - 1));
+    v[1] = _mm_loadu_si128((const __m128i *) (a));
+    v[2] = _mm_loadu_si128((const __m128i *) (a + 1));
+    v[3] = _mm_loadu_si128((const __m128i *) (b - 1));
+    v[4] = _mm_loadu_si128((const __m128i *) (b));
+    v[5] = _mm_loadu_si128((const __m128i *) (b + 1));
+    v[6] = _mm_loadu_si128((const __m128i *) (c - 1));
+    v[7] = _mm_loadu_si128((const __m128i *) (c));
+    v[8] = _mm_loadu_si128((const __m128i *) (c + 1));
+    for (k = 0; k < 9; k++) {
+      lo = _mm_add_epi32(lo, WIDEN_LO(v[k]));
+      hi = _mm_add_epi32(hi, WIDEN_HI(v[k]));
+    }
+
+    lo = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(lo), ninth));
+    hi = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(hi), ninth));
+    lo = _mm_sub_epi32(lo, _mm_sra_epi32(lo, shift));
+    hi = _mm_sub_epi32(hi, _mm_sra_epi32(hi, shift));
+
+    zero = _mm_cmpeq_epi16(v[4], _mm_setzero_si128());
+    _mm_storeu_si128((__m128i *) (out + i),
+                     _mm_andnot_si128(zero,
+                                      _mm_packs_epi32(NARROW(lo), NARROW(hi))));
+  }
+# undef WIDEN_LO
+# undef WIDEN_HI
+# undef NARROW
+#endif /* __SSE2__ */
+
+  for (; i < n; i++) {
+    if (t[i] != 0) { /* Close enough for government work */
+      int damp =
+        (t[i - 1] + t[i + 1] +
+         t[i - width] + t[i + width] +
+         t[i - width - 1] + t[i - width + 1] +
+         t[i + width - 1] + t[i + width + 1] +
+         t[i]) / 9;
+      out[i] = damp - (damp >> fluidity);
+    } else
+      out[i] = 0;
+  }
+}
+
+
+/* Splits the rows [lo, hi) evenly between the threads.
+ */
+static void
+thread_rows(const struct ripple_thread *self, int lo, int hi,
+            int *start, int *end)
+{
+  unsigned count = self->st->threadpool.count;
+  if (count < 1) count = 1;
+  *start = lo + (hi - lo) * (int) self->id / (int) count;
+  *end   = lo + (hi - lo) * (int) (self->id + 1) / (int) count;
+}
+
+
+static void
+ripple_wave_pass(void *self_raw)
+{
+  const struct ripple_thread *self = (const struct ripple_thread *) self_raw;
+  struct state *st = self->st;
+  int down, start, end;
+
+  thread_rows(self, 1, st->height - 1, &start, &end);
+  for (down = start; down < end; down++) {
+    int pixel = down * st->width + 1;
+    wave_row(st->wave_dest + pixel, st->wave_src + pixel, st->wave_dest + pixel,
+             st->width, st->width - 2, st->fluidity, True);
+  }
+}
+
+
+static void
+ripple_temp_pass(void *self_raw)
+{
+  const struct ripple_thread *self = (const struct ripple_thread *) self_raw;
+  struct state *st = self->st;
+  int down, start, end;
+
+  thread_rows(self, 1, st->height - 1, &start, &end);
+  for (down = start; down < end; down++) {
+    int pixel = down * st->width + 1;
+    wave_row(st->temp + pixel, st->wave_src + pixel, st->wave_dest + pixel,
+             st->width, st->width - 2, st->fluidity, False);
+  }
+}
+
+
+static void
+ripple_smooth_pass(void *self_raw)
+{
+  const struct ripple_thread *self = (const struct ripple_thread *) self_raw;
+  struct state *st = self->st;
+  int down, start, end;
+
+  thread_rows(self, 1, st->height - 1, &start, &end);
+  for (down = start; down < end; down++) {
+    int pixel = down * st->width + 1;
+    smooth_row(st->wave_dest + pixel, st->temp + pixel,
+               st->width, st->width - 2, st->fluidity);
+  }
+}
 
+
+static void
+ripple_draw_pass(void *self_raw)
+{
+  const struct ripple_thread *self = (const struct ripple_thread *) self_raw;
+  struct state *st = self->st;
+  int start, end;
+
+  if (st->transparent) {
+    thread_rows(self, 0, st->height - 2, &start, &end);
+    st->draw_transparent(st, st->wave_dest, start, end);
+  } else {
+    thread_rows(self, 0, st->height - 1, &start, &end);
+    draw_ripple(st, st->wave_dest, start, end);
+  }
+}
+
+
+static void
+run_pass(struct state *st, void (*pass)(void *))
+{
+  if (st->threadpool.count) {
+    threadpool_run(&st->threadpool, pass);
+    threadpool_wait(&st->threadpool);
+  } else {
+    struct ripple_thread self;
+    self.st = st;
+    self.id = 0;
+    pass(&self);
+  }
+}
+
+
+static void
+ripple(struct state *st)
+{
   if (st->draw_toggle == 0) {
-    src = st->bufferA;
-    dest = st->bufferB;
+    st->wave_src = st->bufferA;
+    st->wave_dest = st->bufferB;
     st->draw_toggle = 1;
   } else {
-    src = st->bufferB;
-    dest = st->bufferA;
+    st->wave_src = st->bufferB;
+    st->wave_dest = st->bufferA;
     st->draw_toggle = 0;
   }
 
   switch (st->draw_count) {
   case 0: case 1:
-    pixel = 1 * st->width + 1;
-    for (down = 1; down < st->height - 1; down++, pixel += 2 * 1)
-      for (across = 1; across < st->width - 1; across++, pixel++) {
-        st->temp[pixel] =
-          (((src[pixel - 1] + src[pixel + 1] +
-             src[pixel - st->width] + src[pixel + st->width]) / 2)) - dest[pixel];
-      }
-
+    run_pass(st, ripple_temp_pass);
     /* Smooth the output */
-    pixel = 1 * st->width + 1;
-    for (down = 1; down < st->height - 1; down++, pixel += 2 * 1)
-      for (across = 1; across < st->width - 1; across++, pixel++) {
-        if (st->temp[pixel] != 0) { /* Close enough for government work */
-          int damp =
-            (st->temp[pixel - 1] + st->temp[pixel + 1] +
-             st->temp[pixel - st->width] + st->temp[pixel + st->width] +
-             st->temp[pixel - st->width - 1] + st->temp[pixel - st->width + 1] +
-             st->temp[pixel + st->width - 1] + st->temp[pixel + st->width + 1] +
-             st->temp[pixel]) / 9;
-          dest[pixel] = damp - (damp >> st->fluidity);
-        } else
-          dest[pixel] = 0;
-      }
+    run_pass(st, ripple_smooth_pass);
     break;
   case 2: case 3:
-    pixel = 1 * st->width + 1;
-    for (down = 1; down < st->height - 1; down++, pixel += 2 * 1)
-      for (across = 1; across < st->width - 1; across++, pixel++) {
-        int damp =
-          (((src[pixel - 1] + src[pixel + 1] +
-             src[pixel - st->width] + src[pixel + st->width]) / 2)) - dest[pixel];
-        dest[pixel] = damp - (damp >> st->fluidity);
-      }
+    run_pass(st, ripple_wave_pass);
     break;
   }
   if (++st->draw_count > 3) st->draw_count = 0;
 
-  if (st->transparent)
-    st->draw_transparent(st, dest);
-  else
-    draw_ripple(st, dest);
+  run_pass(st, ripple_draw_pass);
+}
+
+
+static int
+ripple_thread_create(void *self_raw, struct threadpool *pool, unsigned id)
+{
+  struct ripple_thread *self = (struct ripple_thread *) self_raw;
+  self->st = GET_PARENT_OBJ(struct state, threadpool, pool);
+  self->id = id;
+  return 0;
+}
+
+
+static void
+ripple_thread_destroy(void *self_raw)
+{
 }
 
 
@@ -982,6 +1235,18 @@ ripples_init (Display *disp, Window win)
   init_cos_tab(st);
   setup_X(st);
 
+  {
+    static const struct threadpool_class cls = {
+      sizeof(struct ripple_thread),
+      ripple_thread_create,
+      ripple_thread_destroy
+    };
+
+    if (threadpool_create(&st->threadpool, &cls, disp,
+                          hardware_concurrency(disp)))
+      st->threadpool.count = 0; /* See the note in thread_util.h. */
+  }
+
   st->ncolors = get_integer_resource (disp, "colors", "Colors");
   if (0 == st->ncolors)		/* English spelling? */
     st->ncolors = get_integer_resource (disp, "colours", "Colors");
@@ -1034,6 +1299,7 @@ ripples_draw (Display *dpy, Window window, void *closure)
         XWindowAttributes xgwa;
         XGetWindowAttributes(st->dpy, st->window, &xgwa);
         st->start_time = time ((time_t) 0);
+        if (st->orig_map) XDestroyImage (st->orig_map);
         st->orig_map = XGetImage (st->dpy, st->window, 0, 0, 
                                   xgwa.width, xgwa.height,
                                   ~0L, ZPixmap);
@@ -1084,6 +1350,8 @@ static void
 ripples_free (Display *dpy, Window window, void *closure)
 {
   struct state *st = (struct state *) closure;
+  if (st->threadpool.count)
+    threadpool_destroy (&st->threadpool);
   free (st);
 }
 
@@ -1103,6 +1371,7 @@ static const char *ripples_defaults[] =
   "*fluidity: 		6",
   "*light: 		4",
   "*grayscale: 		False",
+  THREAD_DEFAULTS
 #ifdef HAVE_XSHM_EXTENSION
   "*useSHM: True",
 #else
@@ -1130,6 +1399,7 @@ static XrmOptionDescRec ripples_options[] =
   {"-grayscale",	".grayscale",	XrmoptionNoArg, "True"},
   {"-shm",	".useSHM",	XrmoptionNoArg, "True"},
   {"-no-shm",	".useSHM",	XrmoptionNoArg, "False"},
+  THREAD_OPTIONS
   {0, 0, 0, 0}
 };
 
@@ -28,22 +28,41 @@
 
 #include <math.h>
 #include "screenhack.h"
+#include "thread_util.h"
+
+#ifdef HAVE_STDINT_H
+# include <stdint.h>
+#else
+typedef unsigned int uint32_t;
+#endif
+
+#ifdef __AVX2__
+# include <immintrin.h>
+#endif
 
 #ifdef HAVE_XSHM_EXTENSION
 #include "xshm.h"
 #endif
 
+/* Pixels are walked in chunks of this many, so the source coordinates fit
+   on the stack. */
+#define ROW_CHUNK 256
+
 struct zoom_area {
   int w, h;		/* rectangle width and height */
   int inc1, inc2;	/* rotation and zoom angle increments */
   int dx, dy;		/* translation increments */
   int a1, a2;		/* rotation and zoom angular variables */
-  int ox, oy;		/* origin in the background copy */
   int xx, yy;		/* left-upper corner position (* 256) */
   int x, y;		/* left-upper corner position */
   int ww, hh;		/* valid area to place left-upper corner */
   int n;		/* number of iteractions */
   int count;		/* current iteraction */
+
+  int c, s;		/* this frame's rotation and zoom (* 8192) */
+  double cth, sth;	/* this frame's rotation, circle mode */
+  float *polar;		/* r cos(th), r sin(th) for each pixel, circle mode */
+  int polar_w;		/* size the polar table was built for */
 };
 
 struct state {
@@ -66,6 +85,14 @@ struct state {
   int duration;
   time_t start_time;
 
+  /* Bytes per pixel when orig_map and buffer_map share a pixel format that
+     can be copied directly, otherwise 0. */
+  int pixel_bytes;
+
+  /* The rows of each zoom area are split across the threads. */
+  struct threadpool threadpool;
+  struct zoom_area *current;
+
   async_load_state *img_loader;
 
 #ifdef HAVE_XSHM_EXTENSION
@@ -74,57 +101,233 @@ struct state {
 #endif
 };
 
+struct rotzoom_thread {
+  struct state *st;
+  unsigned id;
+};
+
+
+/* Returns v mod n, in [0, n).
+ */
+static int
+wrap_coord (int v, int n)
+{
+  if ((unsigned) v < (unsigned) n)
+    return v;
+  v %= n;
+  return v < 0 ? v + n : v;
+}
+
 
+/* The circle mode's polar coordinates depend only on a pixel's offset from
+   the center of the box, so they only need computing when the box changes
+   size.
+ */
 static void
-rotzoom (struct state *st, struct zoom_area *za)
+make_polar_table (struct zoom_area *za)
+{
+  int x, y;
+  int cx = za->w / 2, cy = za->h / 2;
+  float *p;
+
+  free (za->polar);
+  za->polar = (float *) malloc (za->w * za->h * 2 * sizeof(*za->polar));
+  za->polar_w = za->w;
+  if (!za->polar) return;
+
+  p = za->polar;
+  for (y = 0; y < za->h; y++) {
+    int dy = y - cy;
+    for (x = 0; x < za->w; x++) {
+      int dx = x - cx;
+      double r = sqrt ((double) (dx*dx + dy*dy));
+      double th = atan ((double)dy / (double) (dx == 0 ? 1 : dx));
+      *p++ = r * cos (th);
+      *p++ = r * sin (th);
+    }
+  }
+}
+
+
+/* Works out where n pixels of row y, starting at x, come from in circle
+   mode.
+ */
+static void
+circle_chunk (const struct state *st, const struct zoom_area *za,
+              int x, int y, int n, int *ox, int *oy)
 {
-  int x, y, c, s, zoom, z;
-  int x2 = za->x + za->w - 1, y2 = za->y + za->h - 1;
-  int ox = 0, oy = 0;
+  int cx = za->x + za->w / 2;
+  int cy = za->y + za->h / 2;
   int w2 = (za->w/2) * (za->w/2);
+  int dy = y - cy;
+  const float *p = za->polar + ((y - za->y) * za->w + (x - za->x)) * 2;
+  int i;
 
-  z = 8100 * sin (M_PI * za->a2 / 8192);
-  zoom = 8192 + z;
+  for (i = 0; i < n; i++, p += 2) {
+    int dx = x + i - cx;
+    if ((dx*dx) + (dy*dy) > w2) {
+      ox[i] = x + i;
+      oy[i] = y;
+    } else {
+      ox[i] = wrap_coord (10 + cx + (int) (p[0] * za->cth - p[1] * za->sth),
+                          st->width);
+      oy[i] = wrap_coord (10 + cy + (int) (p[1] * za->cth + p[0] * za->sth),
+                          st->height);
+    }
+  }
+}
 
-  for (y = za->y; y <= y2; y++) {
-    for (x = za->x; x <= x2; x++) {
-      c = zoom * cos (M_PI * za->a1 / 8192);
-      s = zoom * sin (M_PI * za->a1 / 8192);
-      if (st->circle) {
-        int cx = za->x + za->w / 2;
-        int cy = za->y + za->h / 2;
-        int dx = x - cx;
-        int dy = y - cy;
-        int d2 = (dx*dx) + (dy*dy);
-
-        ox = x;
-        oy = y;
-
-        if (d2 > w2) {
-          ox = x;
-          oy = y;
-        } else {
-          double r = sqrt ((double) d2);
-          double th = atan ((double)dy / (double) (dx == 0 ? 1 : dx));
-          th += M_PI * (za->a1 / 300.0);
-          ox = 10 + cx + (int) (r * cos(th));
-          oy = 10 + cy + (int) (r * sin(th));
-        }
-      } else {
-        ox = (x * c + y * s) >> 13;
-        oy = (-x * s + y * c) >> 13;
+
+/* Copies the n source pixels at (ox[i], oy[i]) to row y of the buffer,
+   starting at x.
+ */
+static void
+copy_pixels (const struct state *st, int x, int y, int n,
+             const int *ox, const int *oy)
+{
+  const XImage *from = st->orig_map;
+  XImage *to = st->buffer_map;
+  const char *src = from->data;
+  char *dst = to->data + y * to->bytes_per_line;
+  int bpl = from->bytes_per_line;
+  int i;
+
+  switch (st->pixel_bytes) {
+  case 4:
+    {
+      uint32_t *out = (uint32_t *) dst + x;
+      i = 0;
+# ifdef __AVX2__
+      for (; i + 8 <= n; i += 8) {
+        __m256i xs = _mm256_loadu_si256 ((const __m256i *) (ox + i));
+        __m256i ys = _mm256_loadu_si256 ((const __m256i *) (oy + i));
+        __m256i off = _mm256_add_epi32 (_mm256_mullo_epi32 (ys,
+                                          _mm256_set1_epi32 (bpl)),
+                                        _mm256_slli_epi32 (xs, 2));
+        _mm256_storeu_si256 ((__m256i *) (out + i),
+                             _mm256_i32gather_epi32 ((const int *) src,
+                                                     off, 1));
       }
+# endif /* __AVX2__ */
+      for (; i < n; i++)
+        out[i] = *(const uint32_t *) (src + oy[i] * bpl + ox[i] * 4);
+    }
+    break;
+  case 2:
+    {
+      unsigned short *out = (unsigned short *) dst + x;
+      for (i = 0; i < n; i++)
+        out[i] = *(const unsigned short *) (src + oy[i] * bpl + ox[i] * 2);
+    }
+    break;
+  case 1:
+    {
+      unsigned char *out = (unsigned char *) dst + x;
+      for (i = 0; i < n; i++)
+        out[i] = *(const unsigned char *) (src + oy[i] * bpl + ox[i]);
+    }
+    break;
+  default:
+    for (i = 0; i < n; i++)
+      XPutPixel (to, x + i, y, XGetPixel ((XImage *) from, ox[i], oy[i]));
+    break;
+  }
+}
+
 
-      while (ox < 0)
-        ox += st->width;
-      while (oy < 0)
-        oy += st->height;
-      while (ox >= st->width)
-        ox -= st->width;
-      while (oy >= st->height)
-        oy -= st->height;
+/* Draws row y of a zoom area.
 
-      XPutPixel (st->buffer_map, x, y, XGetPixel (st->orig_map, ox, oy));
+   Outside of circle mode, the source position is an affine function of the
+   destination, so it's walked a pixel at a time in 19.13 fixed point.  The
+   accumulators are kept in [0, width << 13), which wraps the coordinates
+   with one compare per step: the zoom is under 2, so no step can cross more
+   than one edge.
+ */
+static void
+rotzoom_row (const struct state *st, const struct zoom_area *za, int y)
+{
+  int ox[ROW_CHUNK], oy[ROW_CHUNK];
+  int wrap_x = st->width << 13, wrap_y = st->height << 13;
+  int ax = 0, ay = 0;
+  int x, x2 = za->x + za->w;
+
+  if (!st->circle) {
+    ax = wrap_coord (za->x * za->c + y * za->s, wrap_x);
+    ay = wrap_coord (-za->x * za->s + y * za->c, wrap_y);
+  }
+
+  for (x = za->x; x < x2; x += ROW_CHUNK) {
+    int i, n = x2 - x;
+    if (n > ROW_CHUNK) n = ROW_CHUNK;
+
+    if (st->circle) {
+      circle_chunk (st, za, x, y, n, ox, oy);
+    } else {
+      for (i = 0; i < n; i++) {
+        ox[i] = ax >> 13;
+        oy[i] = ay >> 13;
+
+        ax += za->c;
+        if (ax >= wrap_x) ax -= wrap_x;
+        else if (ax < 0)  ax += wrap_x;
+
+        ay -= za->s;
+        if (ay >= wrap_y) ay -= wrap_y;
+        else if (ay < 0)  ay += wrap_y;
+      }
+    }
+
+    copy_pixels (st, x, y, n, ox, oy);
+  }
+}
+
+
+static void
+rotzoom_pass (void *self_raw)
+{
+  const struct rotzoom_thread *self = (const struct rotzoom_thread *) self_raw;
+  const struct state *st = self->st;
+  const struct zoom_area *za = st->current;
+  unsigned count = st->threadpool.count ? st->threadpool.count : 1;
+  int y0 = za->y + za->h * (int) self->id / (int) count;
+  int y1 = za->y + za->h * (int) (self->id + 1) / (int) count;
+  int y;
+
+  for (y = y0; y < y1; y++)
+    rotzoom_row (st, za, y);
+}
+
+
+static void
+rotzoom (struct state *st, struct zoom_area *za)
+{
+  int z, zoom;
+
+  z = 8100 * sin (M_PI * za->a2 / 8192);
+  zoom = 8192 + z;
+  za->c = zoom * cos (M_PI * za->a1 / 8192);
+  za->s = zoom * sin (M_PI * za->a1 / 8192);
+
+  if (st->circle) {
+    double th = M_PI * (za->a1 / 300.0);
+    za->cth = cos (th);
+    za->sth = sin (th);
+    if (za->polar_w != za->w || !za->polar)
+      make_polar_table (za);
+  }
+
+  /* Areas are drawn one after another, so overlapping ones still stack in
+     order. */
+  if (!st->circle || za->polar) {
+    st->current = za;
+    if (st->threadpool.count) {
+      threadpool_run (&st->threadpool, rotzoom_pass);
+      threadpool_wait (&st->threadpool);
+    } else {
+      struct rotzoom_thread self;
+      self.st = st;
+      self.id = 0;
+      rotzoom_pass (&self);
     }
   }
 
@@ -134,13 +337,26 @@ rotzoom (struct state *st, struct zoom_area *za)
   za->a2 += za->inc2;		/* Zoom */
   za->a2 &= 0x3fff;
 
-  za->ox = ox;			/* Save state for next iteration */
-  za->oy = oy;
-
   za->count++;
 }
 
 
+static int
+rotzoom_thread_create (void *self_raw, struct threadpool *pool, unsigned id)
+{
+  struct rotzoom_thread *self = (struct rotzoom_thread *) self_raw;
+  self->st = GET_PARENT_OBJ(struct state, threadpool, pool);
+  self->id = id;
+  return 0;
+}
+
+
+static void
+rotzoom_thread_destroy (void *self_raw)
+{
+}
+
+
 static void
 reset_zoom (struct state *st, struct zoom_area *za)
 {
@@ -269,7 +485,7 @@ create_zoom (struct state *st)
 {
   struct zoom_area *za;
 
-  za = malloc (sizeof (struct zoom_area));
+  za = calloc (1, sizeof (struct zoom_area));
   reset_zoom (st, za);
 
   return za;
@@ -320,17 +536,41 @@ DisplayImage (struct state *st, int x, int y, int w, int h)
 }
 
 
+static void
+free_zooms (struct state *st)
+{
+  int i;
+  if (!st->zoom_box) return;
+  for (i = 0; i < st->num_zoom; i++) {
+    free (st->zoom_box[i]->polar);
+    free (st->zoom_box[i]);
+  }
+  free (st->zoom_box);
+  st->zoom_box = 0;
+}
+
+
 static void
 init_hack (struct state *st)
 {
   int i;
 
   st->start_time = time ((time_t) 0);
+  free_zooms (st);
   st->zoom_box = calloc (st->num_zoom, sizeof (struct zoom_area *));
   for (i = 0; i < st->num_zoom; i++) {
     st->zoom_box[i] = create_zoom (st);
   }
 
+  /* Copy pixels as plain integers when both images agree on the format. */
+  st->pixel_bytes = 0;
+  if (st->orig_map->bits_per_pixel == st->buffer_map->bits_per_pixel &&
+      st->orig_map->byte_order == st->buffer_map->byte_order &&
+      (st->buffer_map->bits_per_pixel == 8 ||
+       st->buffer_map->bits_per_pixel == 16 ||
+       st->buffer_map->bits_per_pixel == 32))
+    st->pixel_bytes = st->buffer_map->bits_per_pixel / 8;
+
   if (st->height && st->orig_map->data)
     memcpy (st->buffer_map->data, st->orig_map->data,
 	    st->height * st->buffer_map->bytes_per_line);
@@ -350,6 +590,8 @@ rotzoomer_draw (Display *disp, Window win, void *closure)
     {
       st->img_loader = load_image_async_simple (st->img_loader, 0, 0, 0, 0, 0);
       if (! st->img_loader) {  /* just finished */
+        if (st->orig_map)
+          XDestroyImage (st->orig_map);
 	st->orig_map = XGetImage (st->dpy, st->window, 0, 0, 
                                   st->width, st->height, ~0L, ZPixmap);
         init_hack (st);
@@ -490,6 +732,18 @@ rotzoomer_init (Display *dpy, Window window)
 
   setup_X (st);
 
+  {
+    static const struct threadpool_class cls = {
+      sizeof(struct rotzoom_thread),
+      rotzoom_thread_create,
+      rotzoom_thread_destroy
+    };
+
+    if (threadpool_create (&st->threadpool, &cls, dpy,
+                           hardware_concurrency (dpy)))
+      st->threadpool.count = 0; /* See the note in thread_util.h. */
+  }
+
   return st;
 }
 
@@ -509,6 +763,9 @@ static void
 rotzoomer_free (Display *dpy, Window window, void *closure)
 {
   struct state *st = (struct state *) closure;
+  if (st->threadpool.count)
+    threadpool_destroy (&st->threadpool);
+  free_zooms (st);
   free (st);
 }
 
@@ -527,6 +784,7 @@ static const char *rotzoomer_defaults[] = {
   "*numboxes: 2",
   "*delay: 10000",
   "*duration: 120",
+  THREAD_DEFAULTS
 #ifdef USE_IPHONE
   "*ignoreRotation: True",
 #endif
@@ -546,6 +804,7 @@ static XrmOptionDescRec rotzoomer_options[] = {
   { "-delay",	".delay",	XrmoptionSepArg, 0      },
   {"-duration",	".duration",	XrmoptionSepArg, 0      },
   { "-n",	".numboxes",	XrmoptionSepArg, 0      },
+  THREAD_OPTIONS
   { 0, 0, 0, 0 }
 };
 
@@ -144,6 +144,7 @@ static XrmOptionDescRec default_options [] = {
   { "-window-id", ".windowID",		XrmoptionSepArg, 0 },
   { "-fps",	".doFPS",		XrmoptionNoArg, "True" },
   { "-no-fps",  ".doFPS",		XrmoptionNoArg, "False" },
+  { "-fps-log",	".fpsLog",		XrmoptionNoArg, "True" },
 
 # ifdef DEBUG_PAIR
   { "-pair",	".pair",		XrmoptionNoArg, "True" },
@@ -157,6 +158,7 @@ static char *default_defaults[] = {
   "*mono:		false",
   "*installColormap:	false",
   "*doFPS:		false",
+  "*fpsLog:		false",
   "*multiSample:	false",
   "*visualID:		default",
   "*windowID:		",
@@ -39,6 +39,11 @@
 
 #include <math.h>
 #include "screenhack.h"
+#include "index_image.h"
+
+#ifdef HAVE_XSHM_EXTENSION
+# include "xshm.h"
+#endif /* HAVE_XSHM_EXTENSION */
 
 /* #define VERBOSE */
 
@@ -52,6 +57,9 @@ static const char *shadebobs_defaults [] = {
   "*cycles:   10",
   "*ncolors:  64",    /* changing this doesn't work particularly well */
   "*delay:    10000",
+#ifdef HAVE_XSHM_EXTENSION
+  "*useSHM:   True",
+#endif /* HAVE_XSHM_EXTENSION */
 #ifdef USE_IPHONE
   "*ignoreRotation: True",
 #endif
@@ -65,6 +73,10 @@ static XrmOptionDescRec shadebobs_options [] = {
   { "-count",   ".count",   XrmoptionSepArg, 0 },
   { "-delay",   ".delay",   XrmoptionSepArg, 0 },
   { "-cycles",  ".cycles",  XrmoptionSepArg, 0 },
+#ifdef HAVE_XSHM_EXTENSION
+  { "-shm",     ".useSHM",  XrmoptionNoArg, "True" },
+  { "-no-shm",  ".useSHM",  XrmoptionNoArg, "False" },
+#endif /* HAVE_XSHM_EXTENSION */
   { 0, 0, 0, 0 }
 };
 
@@ -93,6 +105,11 @@ struct state {
   signed short iColorCount;
   int cycles;
   XImage *pImage;
+  unsigned char *aiIndexes;	/* The palette index of every pixel in pImage. */
+  Bool use_shm, shared;
+#ifdef HAVE_XSHM_EXTENSION
+  XShmSegmentInfo shminfo;
+#endif /* HAVE_XSHM_EXTENSION */
   unsigned char nShadeBobCount, iShadeBob;
   SShadeBob *aShadeBobs;
   GC gc;
@@ -133,7 +150,7 @@ static void InitShadeBob( struct state *st, SShadeBob *pShadeBob, Bool bDark )
 			nDelta = 9 - ( ( sqrt( pow( iWidth+0.5, 2 ) + pow( iHeight+0.5, 2 ) ) / st->iBobRadius ) * 8 );
 			if( nDelta < 0 )  nDelta = 0;
 			if( bDark ) nDelta = -nDelta;
-			pShadeBob->anDeltaMap[ ( iWidth + st->iBobRadius ) * st->iBobDiameter + iHeight + st->iBobRadius ] = (char)nDelta;
+			pShadeBob->anDeltaMap[ ( iHeight + st->iBobRadius ) * st->iBobDiameter + iWidth + st->iBobRadius ] = (char)nDelta;
 		}
   
 	ResetShadeBob( st, pShadeBob );
@@ -174,43 +191,64 @@ static void MoveShadeBob( struct state *st, SShadeBob *pShadeBob )
 }
 
 
-static void Execute( struct state *st, SShadeBob *pShadeBob )
+/* Shades the columns [iPixelX, iPixelX + iWidth) of the bob's rows, with the
+   bob's own columns starting at iOffset, and sends them to the window. */
+static void ShadeBlock( struct state *st, SShadeBob *pShadeBob,
+			int iPixelX, int iPixelY, int iOffset,
+			int iWidth, int iRow, int iHeight )
 {
-	unsigned long iColor;
-	short iColorVal;
-	int iPixelX, iPixelY;
-	unsigned int iWidth, iHeight;
+	unsigned char iMax = st->iColorCount - 1;
+	int i;
 
-	MoveShadeBob( st, pShadeBob );
-	
-	for( iHeight=0; iHeight<st->iBobDiameter; iHeight++ )
+	for( i=0; i<iHeight; i++ )
 	{
-		iPixelY = pShadeBob->nPosY + iHeight;
-		if( iPixelY >= st->iWinHeight )	iPixelY -= st->iWinHeight;
+		unsigned char *pIndexes = st->aiIndexes + ( iPixelY + i ) * st->iWinWidth + iPixelX;
+		index_add_delta( pIndexes,
+				 pShadeBob->anDeltaMap + ( iRow + i ) * st->iBobDiameter + iOffset,
+				 iWidth, iMax );
+		index_put_row( st->pImage, iPixelX, iPixelY + i, pIndexes, iWidth, st->aiColorVals );
+	}
 
-		for( iWidth=0; iWidth<st->iBobDiameter; iWidth++ )
-		{
-			iPixelX = pShadeBob->nPosX + iWidth;
-			if( iPixelX >= st->iWinWidth )	iPixelX -= st->iWinWidth;
+#ifdef HAVE_XSHM_EXTENSION
+	if( st->shared )
+		XShmPutImage( st->dpy, st->window, st->gc, st->pImage,
+			      iPixelX, iPixelY, iPixelX, iPixelY, iWidth, iHeight, False );
+	else
+#endif /* HAVE_XSHM_EXTENSION */
+		XPutImage( st->dpy, st->window, st->gc, st->pImage,
+			   iPixelX, iPixelY, iPixelX, iPixelY, iWidth, iHeight );
+}
 
-			iColor = XGetPixel( st->pImage, iPixelX, iPixelY );
 
-			/*  FIXME: Here is a loop I'd love to take out. */
-			for( iColorVal=0; iColorVal<st->iColorCount; iColorVal++ )
-				if( st->aiColorVals[ iColorVal ] == iColor )
-					break;
+static void Execute( struct state *st, SShadeBob *pShadeBob )
+{
+	int iPixelX, iPixelY;
+	int iWidth, iHeight;
 
-			iColorVal += pShadeBob->anDeltaMap[ iWidth * st->iBobDiameter + iHeight ];
-			if( iColorVal >= st->iColorCount ) iColorVal = st->iColorCount - 1;
-			if( iColorVal < 0 )			   iColorVal = 0;
+	MoveShadeBob( st, pShadeBob );
 
-			XPutPixel( st->pImage, iPixelX, iPixelY, st->aiColorVals[ iColorVal ] );
-		}
+	iPixelX = pShadeBob->nPosX;
+	iPixelY = pShadeBob->nPosY;
+	if( iPixelX >= st->iWinWidth )	iPixelX -= st->iWinWidth;
+	if( iPixelY >= st->iWinHeight )	iPixelY -= st->iWinHeight;
+
+	/* The bob wraps around the edges of the screen, so it lands in up to
+	   four separate blocks. */
+	iWidth = st->iWinWidth - iPixelX;
+	if( iWidth > st->iBobDiameter ) iWidth = st->iBobDiameter;
+	iHeight = st->iWinHeight - iPixelY;
+	if( iHeight > st->iBobDiameter ) iHeight = st->iBobDiameter;
+
+	ShadeBlock( st, pShadeBob, iPixelX, iPixelY, 0, iWidth, 0, iHeight );
+	if( iWidth < st->iBobDiameter )
+		ShadeBlock( st, pShadeBob, 0, iPixelY, iWidth, st->iBobDiameter - iWidth, 0, iHeight );
+	if( iHeight < st->iBobDiameter )
+	{
+		ShadeBlock( st, pShadeBob, iPixelX, 0, 0, iWidth, iHeight, st->iBobDiameter - iHeight );
+		if( iWidth < st->iBobDiameter )
+			ShadeBlock( st, pShadeBob, 0, 0, iWidth, st->iBobDiameter - iWidth,
+				    iHeight, st->iBobDiameter - iHeight );
 	}
-
-	/* FIXME: if it's next to the top or left sides of screen this will break. However, it's not noticable. */
-	XPutImage( st->dpy, st->window, st->gc, st->pImage,
-             pShadeBob->nPosX, pShadeBob->nPosY, pShadeBob->nPosX, pShadeBob->nPosY, st->iBobDiameter, st->iBobDiameter );
 }
 
 
@@ -326,12 +364,29 @@ static void Initialize( struct state *st )
 	/*  Create the GC. */
 	st->gc = XCreateGC( st->dpy, st->window, 0, &gcValues );
 
-	st->pImage = XCreateImage( st->dpy, XWinAttribs.visual, XWinAttribs.depth, ZPixmap, 0, NULL,
-							  XWinAttribs.width, XWinAttribs.height, 8 /*BitmapPad( st->dpy )*/, 0 );
-	st->pImage->data = calloc((st->pImage)->bytes_per_line, (st->pImage)->height);
+	st->pImage = 0;
+	st->shared = False;
+#ifdef HAVE_XSHM_EXTENSION
+	st->use_shm = get_boolean_resource( st->dpy, "useSHM", "Boolean" );
+	if( st->use_shm )
+	{
+		st->pImage = create_xshm_image( st->dpy, XWinAttribs.visual, XWinAttribs.depth, ZPixmap,
+						NULL, &st->shminfo, XWinAttribs.width, XWinAttribs.height );
+		if( st->pImage )
+			st->shared = True;
+	}
+#endif /* HAVE_XSHM_EXTENSION */
+
+	if( !st->pImage )
+	{
+		st->pImage = XCreateImage( st->dpy, XWinAttribs.visual, XWinAttribs.depth, ZPixmap, 0, NULL,
+					   XWinAttribs.width, XWinAttribs.height, 8 /*BitmapPad( st->dpy )*/, 0 );
+		st->pImage->data = calloc((st->pImage)->bytes_per_line, (st->pImage)->height);
+	}
 
 	st->iWinWidth = XWinAttribs.width;
 	st->iWinHeight = XWinAttribs.height;
+	st->aiIndexes = calloc( st->iWinWidth, st->iWinHeight );
 
 	/*  These are precalculations used in Execute(). */
 	st->iBobDiameter = ( ( st->iWinWidth < st->iWinHeight ) ? st->iWinWidth : st->iWinHeight ) / 25;
@@ -409,24 +464,20 @@ shadebobs_draw (Display *dpy, Window window, void *closure)
       XGetWindowAttributes( st->dpy, st->window, &XWinAttribs );
 
       st->draw_i = 0;
-#if 0
-      memset( st->pImage->data, 0, st->pImage->bytes_per_line * st->pImage->height );
-#else
-      {
-        /* fill the image with the actual value of the black pixel, not 0. */
-        unsigned long black = BlackPixelOfScreen (XWinAttribs.screen);
-        int x, y;
-        for (y = 0; y < XWinAttribs.height; y++)
-          for (x = 0; x < XWinAttribs.width; x++)
-            XPutPixel (st->pImage, x, y, black);
-      }
-#endif
-
       for( st->iShadeBob=0; st->iShadeBob<st->nShadeBobCount; st->iShadeBob++ )
         ResetShadeBob( st, &st->aShadeBobs[ st->iShadeBob ] );
       XFreeColors( st->dpy, XWinAttribs.colormap, st->aiColorVals, st->iColorCount, 0 );
       free( st->aiColorVals );
       st->aiColorVals = SetPalette( st );
+
+      /* Start over from color 0, which is black. */
+      memset( st->aiIndexes, 0, st->iWinWidth * st->iWinHeight );
+      {
+        int y;
+        for (y = 0; y < st->iWinHeight; y++)
+          index_put_row (st->pImage, 0, y, st->aiIndexes + y * st->iWinWidth,
+                         st->iWinWidth, st->aiColorVals);
+      }
       XClearWindow( st->dpy, st->window );
     }
 
@@ -454,8 +505,13 @@ shadebobs_free (Display *dpy, Window window, void *closure)
   struct state *st = (struct state *) closure;
 	free( st->anSinTable );
 	free( st->anCosTable );
-	/* free( st->pImage->data ); */
-	XDestroyImage( st->pImage );
+#ifdef HAVE_XSHM_EXTENSION
+	if( st->shared )
+		destroy_xshm_image( st->dpy, st->pImage, &st->shminfo );
+	else
+#endif /* HAVE_XSHM_EXTENSION */
+		XDestroyImage( st->pImage );
+	free( st->aiIndexes );
 	for( st->iShadeBob=0; st->iShadeBob<st->nShadeBobCount; st->iShadeBob++ )
 		free( st->aShadeBobs[ st->iShadeBob ].anDeltaMap );
 	free( st->aShadeBobs );
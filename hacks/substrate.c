@@ -31,6 +31,17 @@
 
 #include <math.h>
 #include "screenhack.h"
+#include "thread_util.h"
+
+#ifdef HAVE_XSHM_EXTENSION
+# include "xshm.h"
+#endif /* HAVE_XSHM_EXTENSION */
+
+#ifdef HAVE_STDINT_H
+# include <stdint.h>
+#else
+typedef unsigned int uint32_t;
+#endif
 
 /* this program goes faster if some functions are inline.  The following is
  * borrowed from ifs.c */
@@ -41,6 +52,13 @@
 
 #define STEP 0.42
 
+/* The window is pushed in strips of this many rows, each with its own
+ * dirty span.  Threads blend whole strips, so no two share a pixel. */
+#define STRIP 32
+
+/* Fewest grains in a cycle worth waking the threads for. */
+#define THREAD_GRAINS 16384
+
 /* Raw colormap extracted from pollockEFF.gif */
 static const char *rgb_colormap[] = {
     "#201F21", "#262C2E", "#352626", "#372B27",
@@ -84,13 +102,19 @@ typedef struct {
 
     int curved;
 
-    unsigned long sandcolor;
+    uint32_t sandcolor; /* 0xRRGGBB */
     float sandp, sandg;
 
     float degrees_drawn;
 
     int crack_num;
 
+    /* Random numbers for the next move, drawn before the cracks are moved
+     * in parallel, so that they come out the same with any thread count */
+    float jitter_x, jitter_y, gain;
+
+    int pos; /* pixel the crack moved onto this cycle, or -1 */
+
 } crack;
 
 struct field {
@@ -109,15 +133,25 @@ struct field {
     crack *cracks; /* grid of cracks */
     int *cgrid; /* grid of actual crack placement */
 
-    /* Raw map of pixels we need to keep for alpha blending */
-    unsigned long int *off_img;
+    /* Where each crack's grains of sand landed this cycle, grains per
+     * crack, or -1 for those that fell off the window */
+    int *grain_pos;
+    unsigned int *grain_alpha; /* opacity of each grain, out of 256 */
+
+    /* Raw map of pixels we need to keep for alpha blending, as 0xRRGGBB */
+    uint32_t *off_img;
+
+    /* Columns changed in each strip since it was last pushed */
+    int *dirty_x0, *dirty_x1;
+    int strips;
    
     /* color parms */
     int numcolors;
     unsigned long *parsedcolors;
+    uint32_t *sandcolors; /* parsedcolors as 0xRRGGBB */
     unsigned long fgcolor;
     unsigned long bgcolor;
-    int visdepth;
+    uint32_t fgrgb, bgrgb;
 
     unsigned int cycles;
 
@@ -134,6 +168,29 @@ struct state {
   GC fgc;
   XWindowAttributes xgwa;
   XGCValues gcv;
+
+  /* Copy of off_img in the window's format */
+  XImage *image;
+#ifdef HAVE_XSHM_EXTENSION
+  Bool use_shm;
+  XShmSegmentInfo shm_info;
+#endif /* HAVE_XSHM_EXTENSION */
+  Bool direct_p; /* image is 32 bits per pixel in our byte order */
+
+  /* 0xRRGGBB to pixel: one table per channel on TrueColor visuals, or
+   * the nearest allocated color to each 15-bit RGB otherwise */
+  unsigned long rtab[256], gtab[256], btab[256];
+  unsigned long *nearest;
+
+  /* Each cycle moves the cracks, then blends their sand, on the threads */
+  struct threadpool threadpool;
+  unsigned nthreads; /* threads running the current pass */
+  unsigned int moving; /* cracks being moved this cycle */
+};
+
+struct substrate_thread {
+  struct state *st;
+  unsigned id;
 };
 
 
@@ -159,14 +216,21 @@ static struct field
     f->max_num = 0;
     f->cracks = NULL;
     f->cgrid = NULL;
+    f->grain_pos = NULL;
+    f->grain_alpha = NULL;
     f->off_img = NULL;
+    f->dirty_x0 = NULL;
+    f->dirty_x1 = NULL;
+    f->strips = 0;
     f->numcolors = 0;
     f->parsedcolors = NULL;
+    f->sandcolors = NULL;
     f->cycles = 0;
     f->wireframe = 0;
     f->fgcolor = 0;
     f->bgcolor = 0;
-    f->visdepth = 0;
+    f->fgrgb = 0;
+    f->bgrgb = 0;
     f->grains = 0;
     f->circle_percent = 0;
     return f;
@@ -255,17 +319,16 @@ static inline void make_crack(struct field *f)
     crack *cr;
 
     if (f->num < f->max_num) {
-        /* make a new crack */
-        f->cracks = (crack *) xrealloc(f->cracks, sizeof(crack) * (f->num + 1));
-
+        /* make a new crack; build_substrate made room for max_num */
         cr = &(f->cracks[f->num]);
         /* assign colors */
         cr->sandp = 0;
         cr->sandg = (frand(0.2) - 0.01);
-        cr->sandcolor = f->parsedcolors[random() % f->numcolors];
+        cr->sandcolor = f->sandcolors[random() % f->numcolors];
         cr->crack_num = f->num;
         cr->curved = 0;
         cr->degrees_drawn = 0;
+        cr->pos = -1;
 
         /* We could use these values in the timeout case of start_crack */
 
@@ -280,121 +343,40 @@ static inline void make_crack(struct field *f)
     }
 }
 
-static inline void point2rgb(int depth, unsigned long c, int *r, int *g, int *b) 
-{
-    switch(depth) {
-        case 32:
-        case 24:
-#ifdef HAVE_COCOA
-            /* This program idiotically does not go through a color map, so
-               we have to hardcode in knowledge of how jwxyz.a packs pixels!
-               Fix it to go through st->colors[st->ncolors] instead!
-             */
-            *r = (c & 0x00ff0000) >> 16; 
-            *g = (c & 0x0000ffff) >>  8;
-            *b = (c & 0x000000ff); 
-#else
-            *g = (c & 0xff00) >> 8; 
-            *r = (c & 0xff0000) >> 16; 
-            *b = c & 0xff; 
-#endif
-            break;
-        case 16:
-            *g = ((c >> 5) & 0x3f) << 2;
-            *r = ((c >> 11) & 0x1f) << 3; 
-            *b = (c & 0x1f) << 3; 
-            break;
-        case 15:
-            *g = ((c >> 5) & 0x1f) << 3;
-            *r = ((c >> 10) & 0x1f) << 3;
-            *b = (c & 0x1f) << 3;
-            break;
-    }
-}
-
-static inline unsigned long rgb2point(int depth, int r, int g, int b) 
-{
-    unsigned long ret = 0;
-
-    switch(depth) {
-        case 32:
-        case 24:
-#ifdef HAVE_COCOA
-            /* This program idiotically does not go through a color map, so
-               we have to hardcode in knowledge of how jwxyz.a packs pixels!
-               Fix it to go through st->colors[st->ncolors] instead!
-             */
-            ret = 0xFF000000 | (r << 16) | (g << 8) | b;
-#else
-            ret |= (r << 16) | (g << 8) | b;
-#endif
-            break;
-        case 16:
-            ret = ((r>>3) << 11) | ((g>>2)<<5) | (b>>3);
-            break;
-        case 15:
-            ret = ((r>>3) << 10) | ((g>>3)<<5) | (b>>3);
-            break;
-    }
-
-    return ret;
-}
-
-/* alpha blended point drawing -- this is Not Right and will likely fail on 
- * non-intel platforms as it is now, needs fixing */
-static inline unsigned long
-trans_point(struct state *st,
-            int x1, int y1, unsigned long myc, float a, 
-            struct field *f) 
+/* Moves d toward s by alpha/256, rounding each channel to nearest.  Red
+ * and blue are done together in one multiply, with green in the gap
+ * between them; borrows between the channels fall in the masked-off bits. */
+static inline uint32_t
+blend_pixel(uint32_t d, uint32_t s, unsigned int alpha)
 {
-    if ((x1 >= 0) && (x1 < f->width) && (y1 >= 0) && (y1 < f->height)) {
-        if (a >= 1.0) {
-            ref_pixel(f, x1, y1) = myc;
-        } else {
-            int or = 0, og = 0, ob = 0;
-            int r = 0, g = 0, b = 0;
-            int nr, ng, nb;
-            unsigned long c;
+    uint32_t rb = d & 0xFF00FF;
+    uint32_t g = d & 0x00FF00;
 
-            c = ref_pixel(f, x1, y1);
-
-            point2rgb(f->visdepth, c, &or, &og, &ob);
-            point2rgb(f->visdepth, myc, &r, &g, &b);
-
-            nr = or + (r - or) * a;
-            ng = og + (g - og) * a;
-            nb = ob + (b - ob) * a;
-
-            c = rgb2point(f->visdepth, nr, ng, nb);
-
-            ref_pixel(f, x1, y1) = c;
-
-            return c;
-        }
-    }
-
-    return f->bgcolor;
+    rb = (rb + ((((s & 0xFF00FF) - rb) * alpha + 0x800080) >> 8)) & 0xFF00FF;
+    g = (g + ((((s & 0x00FF00) - g) * alpha + 0x008000) >> 8)) & 0x00FF00;
+    return rb | g;
 }
 
 static inline void 
-region_color(struct state *st, GC fgc, struct field *f, crack *cr) 
+region_color(struct field *f, crack *cr, int *grain_pos) 
 {
     /* synthesis of Crack::regionColor() and SandPainter::render() */
 
     float rx = cr->x;
     float ry = cr->y;
+    float dx = (0.81 * sin(cr->t * M_PI/180));
+    float dy = (0.81 * cos(cr->t * M_PI/180));
     int openspace = 1;
     int cx, cy;
     float maxg;
     int grains, i;
     float w;
-    float drawx, drawy;
-    unsigned long c;
+    int drawx, drawy;
 
     while (openspace) {
         /* move perpendicular to crack */
-        rx += (0.81 * sin(cr->t * M_PI/180));
-        ry -= (0.81 * cos(cr->t * M_PI/180));
+        rx += dx;
+        ry -= dy;
 
         cx = (int) rx;
         cy = (int) ry;
@@ -414,7 +396,7 @@ region_color(struct state *st, GC fgc, struct field *f, crack *cr)
     /* SandPainter stuff here */
 
     /* Modulate gain */
-    cr->sandg += (frand(0.1) - 0.050);
+    cr->sandg += cr->gain;
     maxg = 1.0;
 
     if (cr->sandg < 0)
@@ -425,19 +407,19 @@ region_color(struct state *st, GC fgc, struct field *f, crack *cr)
 
     grains = f->grains;
 
-    /* Lay down grains of sand */
-    w = cr->sandg / (grains - 1);
+    /* Lay down grains of sand; they are blended in later, in order */
+    w = (grains > 1 ? cr->sandg / (grains - 1) : 0);
 
     for (i = 0; i < grains; i++) {
-        drawx = (cr->x + (rx - cr->x) * sin(cr->sandp + sin((float) i * w)));
-        drawy = (cr->y + (ry - cr->y) * sin(cr->sandp + sin((float) i * w)));
-
-        /* Draw sand bit */
-        c = trans_point(st, drawx, drawy, cr->sandcolor, (0.1 - i / (grains * 10.0)), f);
-
-        XSetForeground(st->dpy, fgc, c);
-        XDrawPoint(st->dpy, st->window, fgc, (int) drawx, (int) drawy);
-        XSetForeground(st->dpy, fgc, f->fgcolor);
+        float a = sin(cr->sandp + sin((float) i * w));
+        drawx = (cr->x + (rx - cr->x) * a);
+        drawy = (cr->y + (ry - cr->y) * a);
+
+        if ((drawx >= 0) && (drawx < f->width) &&
+            (drawy >= 0) && (drawy < f->height))
+            grain_pos[i] = drawy * f->width + drawx;
+        else
+            grain_pos[i] = -1;
     }
 }
 
@@ -460,6 +442,11 @@ static void build_substrate(struct field *f)
 
     f->num = 0;
 
+    f->cracks = (crack *) xrealloc(f->cracks, sizeof(crack) * f->max_num);
+    f->grain_pos = (int *) xrealloc(f->grain_pos,
+                                    sizeof(int) * f->max_num *
+                                    (f->grains ? f->grains : 1));
+
     /* erase the crack grid */
     f->cgrid = (int *) xrealloc(f->cgrid, sizeof(int) * f->height * f->width);
     memset(f->cgrid, 10001, f->height * f->width * sizeof(int));
@@ -479,13 +466,12 @@ static void build_substrate(struct field *f)
 }
 
 
+/* The part of Crack::move() that only touches this crack, which is run on
+ * all the cracks at once */
 static inline void
-movedrawcrack(struct state *st, GC fgc, struct field *f, int cracknum) 
+move_crack(struct field *f, crack *cr, int *grain_pos) 
 {
-    /* Basically Crack::move() */
-
     int cx, cy;
-    crack *cr = &(f->cracks[cracknum]);
 
     /* continue cracking */
     if ( !cr->curved ) {
@@ -505,30 +491,41 @@ movedrawcrack(struct state *st, GC fgc, struct field *f, int cracknum)
 
     /* bounds check */
     /* modification of random(-0.33,0.33) */
-    cx = (int) (cr->x + (frand(0.66) - 0.33));
-    cy = (int) (cr->y + (frand(0.66) - 0.33));
-
+    cx = (int) (cr->x + cr->jitter_x);
+    cy = (int) (cr->y + cr->jitter_y);
 
     if ((cx >= 0) && (cx < f->width) && (cy >= 0) && (cy < f->height)) {
+        cr->pos = cy * f->width + cx;
+
         /* draw sand painter if we're not wireframe */
         if (!f->wireframe)
-            region_color(st, fgc, f, cr);
+            region_color(f, cr, grain_pos);
+    } else {
+        cr->pos = -1;
+    }
+}
+
 
-        /* draw fgcolor crack */
-        ref_pixel(f, cx, cy) = f->fgcolor;
-        XDrawPoint(st->dpy, st->window, fgc, cx, cy);
+/* The rest of Crack::move(), which sees the cracks moved before this one
+ * and may start new ones, so is run on one crack at a time, in order */
+static inline void
+check_crack(struct field *f, int cracknum) 
+{
+    crack *cr = &(f->cracks[cracknum]);
+    int i = cr->pos;
 
+    if (i >= 0) {
         if ( cr->curved && (cr->degrees_drawn > 360) ) {
             /* completed the circle, stop cracking */
             start_crack(f, cr); /* restart ourselves */
             make_crack(f); /* generate a new crack */
         }
         /* safe to check */
-        else if ((f->cgrid[cy * f->width + cx] > 10000) ||
-                 (abs(f->cgrid[cy * f->width + cx] - cr->t) < 5)) {
+        else if ((f->cgrid[i] > 10000) ||
+                 (abs(f->cgrid[i] - cr->t) < 5)) {
             /* continue cracking */
-            f->cgrid[cy * f->width + cx] = (int) cr->t;
-        } else if (abs(f->cgrid[cy * f->width + cx] - cr->t) > 2) {
+            f->cgrid[i] = (int) cr->t;
+        } else if (abs(f->cgrid[i] - cr->t) > 2) {
             /* crack encountered (not self), stop cracking */
             start_crack(f, cr); /* restart ourselves */
             make_crack(f); /* generate a new crack */
@@ -544,22 +541,390 @@ movedrawcrack(struct state *st, GC fgc, struct field *f, int cracknum)
         start_crack(f, cr); /* restart ourselves */
         make_crack(f); /* generate a new crack */
     }
+}
+
+
+static inline unsigned long
+rgb_to_pixel(struct state *st, uint32_t c)
+{
+    if (st->nearest)
+        return st->nearest[((c >> 9) & 0x7C00) | ((c >> 6) & 0x03E0) |
+                           ((c >> 3) & 0x001F)];
+    return (st->rtab[(c >> 16) & 0xFF] | st->gtab[(c >> 8) & 0xFF] |
+            st->btab[c & 0xFF]);
+}
+
+
+/* Copies rows y0 to y1, columns x0 to x1, of off_img into the image */
+static void
+convert_rect(struct state *st, int x0, int y0, int x1, int y1)
+{
+    struct field *f = st->f;
+    int x, y;
+
+    for (y = y0; y < y1; y++) {
+        const uint32_t *src = f->off_img + y * f->width;
+        if (st->direct_p) {
+            uint32_t *dst = (uint32_t *)
+                (st->image->data + y * st->image->bytes_per_line);
+            for (x = x0; x < x1; x++)
+                dst[x] = (uint32_t) rgb_to_pixel(st, src[x]);
+        } else {
+            for (x = x0; x < x1; x++)
+                XPutPixel(st->image, x, y, rgb_to_pixel(st, src[x]));
+        }
+    }
+}
+
+
+/* Splits [lo, hi) evenly between the threads running this pass */
+static void
+thread_range(const struct substrate_thread *self, int lo, int hi,
+             int *start, int *end)
+{
+    unsigned count = self->st->nthreads;
+    *start = lo + (hi - lo) * (int) self->id / (int) count;
+    *end   = lo + (hi - lo) * (int) (self->id + 1) / (int) count;
+}
+
+
+static void
+move_pass(void *self_raw)
+{
+    const struct substrate_thread *self =
+        (const struct substrate_thread *) self_raw;
+    struct field *f = self->st->f;
+    int i, start, end;
+
+    thread_range(self, 0, self->st->moving, &start, &end);
+    for (i = start; i < end; i++)
+        move_crack(f, &f->cracks[i], f->grain_pos + i * f->grains);
+}
+
+
+/* Each thread owns a band of strips, and blends every grain that landed
+ * in it, crack by crack in order, so the result doesn't depend on how
+ * many threads there are. */
+static void
+blend_pass(void *self_raw)
+{
+    const struct substrate_thread *self =
+        (const struct substrate_thread *) self_raw;
+    struct state *st = self->st;
+    struct field *f = st->f;
+    int s0, s1, lo, hi, i, j, s;
+    int grains = (f->wireframe ? 0 : f->grains);
+
+    thread_range(self, 0, f->strips, &s0, &s1);
+    lo = s0 * STRIP * f->width;
+    hi = s1 * STRIP * f->width;
+
+    for (i = 0; i < st->moving; i++) {
+        const crack *cr = &f->cracks[i];
+        const int *grain_pos = f->grain_pos + i * f->grains;
+
+        if (cr->pos < 0)
+            continue;
+
+        for (j = 0; j <= grains; j++) {
+            int p, x, y;
+            if (j < grains) {
+                p = grain_pos[j];
+                if (p < lo || p >= hi)
+                    continue;
+                f->off_img[p] = blend_pixel(f->off_img[p], cr->sandcolor,
+                                            f->grain_alpha[j]);
+            } else {
+                /* draw fgcolor crack, over its own sand */
+                p = cr->pos;
+                if (p < lo || p >= hi)
+                    continue;
+                f->off_img[p] = f->fgrgb;
+            }
+
+            y = p / f->width;
+            x = p - y * f->width;
+            s = y / STRIP;
+            if (x < f->dirty_x0[s]) f->dirty_x0[s] = x;
+            if (x >= f->dirty_x1[s]) f->dirty_x1[s] = x + 1;
+        }
+    }
 
+    for (s = s0; s < s1; s++)
+        if (f->dirty_x0[s] < f->dirty_x1[s]) {
+            int y1 = (s + 1) * STRIP;
+            if (y1 > f->height) y1 = f->height;
+            convert_rect(st, f->dirty_x0[s], s * STRIP, f->dirty_x1[s], y1);
+        }
+}
+
+
+static void
+run_pass(struct state *st, void (*pass)(void *), Bool threaded)
+{
+    if (threaded && st->threadpool.count > 1) {
+        st->nthreads = st->threadpool.count;
+        threadpool_run(&st->threadpool, pass);
+        threadpool_wait(&st->threadpool);
+    } else {
+        struct substrate_thread self;
+        self.st = st;
+        self.id = 0;
+        st->nthreads = 1;
+        pass(&self);
+    }
+}
+
+
+static void
+put_rect(struct state *st, int x, int y, int w, int h)
+{
+#ifdef HAVE_XSHM_EXTENSION
+    if (st->use_shm) {
+        XShmPutImage(st->dpy, st->window, st->fgc, st->image,
+                     x, y, x, y, w, h, False);
+        return;
+    }
+#endif /* HAVE_XSHM_EXTENSION */
+    XPutImage(st->dpy, st->window, st->fgc, st->image, x, y, x, y, w, h);
+}
+
+
+/* Pushes the changed part of each run of dirty strips in one request */
+static void
+put_dirty(struct state *st)
+{
+    struct field *f = st->f;
+    int s, run = -1, x0 = 0, x1 = 0;
+
+    for (s = 0; s <= f->strips; s++) {
+        if (s < f->strips && f->dirty_x0[s] < f->dirty_x1[s]) {
+            if (run < 0) {
+                run = s;
+                x0 = f->dirty_x0[s];
+                x1 = f->dirty_x1[s];
+            } else {
+                if (f->dirty_x0[s] < x0) x0 = f->dirty_x0[s];
+                if (f->dirty_x1[s] > x1) x1 = f->dirty_x1[s];
+            }
+            f->dirty_x0[s] = f->width;
+            f->dirty_x1[s] = 0;
+        } else if (run >= 0) {
+            int y1 = s * STRIP;
+            if (y1 > f->height) y1 = f->height;
+            put_rect(st, x0, run * STRIP, x1 - x0, y1 - run * STRIP);
+            run = -1;
+        }
+    }
+}
+
+
+static void
+cycle(struct state *st)
+{
+    struct field *f = st->f;
+    int i;
+    Bool threaded;
+
+    /* Draw the random numbers here, one crack after another */
+    st->moving = f->num;
+    for (i = 0; i < st->moving; i++) {
+        crack *cr = &f->cracks[i];
+        cr->jitter_x = (frand(0.66) - 0.33);
+        cr->jitter_y = (frand(0.66) - 0.33);
+        cr->gain = (frand(0.1) - 0.050);
+    }
+
+    threaded = (st->moving * (f->grains + 1) >= THREAD_GRAINS);
+    run_pass(st, move_pass, threaded);
+
+    /* Cracks started here are first moved next cycle */
+    for (i = 0; i < st->moving; i++)
+        check_crack(f, i);
+
+    run_pass(st, blend_pass, threaded);
+    put_dirty(st);
+}
+
+
+static uint32_t
+xcolor_to_rgb(const XColor *c)
+{
+    return (((uint32_t) (c->red >> 8) << 16) |
+            ((uint32_t) (c->green >> 8) << 8) |
+            (c->blue >> 8));
+}
+
+
+/* Given a bitmask, returns the position and width of the field. */
+static void
+decode_mask(unsigned long mask, int *pos_ret, int *size_ret)
+{
+    int i = 0, j = 0;
+    while (i < 32 && !(mask & (1UL << i)))
+        i++;
+    *pos_ret = i;
+    while (i < 32 && (mask & (1UL << i))) {
+        i++;
+        j++;
+    }
+    *size_ret = j;
+}
+
+
+static void
+init_pixels(struct state *st)
+{
+    Visual *v = st->xgwa.visual;
+    struct field *f = st->f;
+    int i;
+
+    if (v->red_mask && v->green_mask && v->blue_mask) {
+        unsigned long *tabs[3];
+        unsigned long masks[3];
+        int c;
+
+        tabs[0] = st->rtab; masks[0] = v->red_mask;
+        tabs[1] = st->gtab; masks[1] = v->green_mask;
+        tabs[2] = st->btab; masks[2] = v->blue_mask;
+
+        for (c = 0; c < 3; c++) {
+            int pos, size;
+            decode_mask(masks[c], &pos, &size);
+            for (i = 0; i < 256; i++) {
+                unsigned long n = (size < 8
+                                   ? (unsigned long) i >> (8 - size)
+                                   : (unsigned long) i << (size - 8));
+                tabs[c][i] = (n << pos) & masks[c];
+            }
+        }
+#ifdef HAVE_COCOA
+        /* jwxyz pixels have an alpha channel, which must be opaque. */
+        for (i = 0; i < 256; i++)
+            st->rtab[i] |= 0xFF000000;
+#endif
+    } else {
+        /* No way to make a pixel from RGB, so use the closest of the
+         * colors we allocated. */
+        st->nearest = (unsigned long *)
+            xrealloc(st->nearest, sizeof(unsigned long) * 32768);
+        for (i = 0; i < 32768; i++) {
+            int r = ((i >> 10) & 0x1F) << 3;
+            int g = ((i >>  5) & 0x1F) << 3;
+            int b = (i & 0x1F) << 3;
+            int n = f->numcolors;
+            int j, best = 0;
+            long best_d = 0;
+            for (j = 0; j < n + 2; j++) {
+                uint32_t c = (j < n ? f->sandcolors[j] :
+                              j == n ? f->fgrgb : f->bgrgb);
+                long dr = r - (int) ((c >> 16) & 0xFF);
+                long dg = g - (int) ((c >> 8) & 0xFF);
+                long db = b - (int) (c & 0xFF);
+                long d = dr * dr + dg * dg + db * db;
+                if (j == 0 || d < best_d) {
+                    best = j;
+                    best_d = d;
+                }
+            }
+            st->nearest[i] = (best < n ? f->parsedcolors[best] :
+                              best == n ? f->fgcolor : f->bgcolor);
+        }
+    }
 }
 
 
-static void build_img(Display *dpy, Window window, XWindowAttributes xgwa, GC fgc, 
-               struct field *f) 
+static void
+free_img(struct state *st)
+{
+    if (!st->image)
+        return;
+#ifdef HAVE_XSHM_EXTENSION
+    if (st->use_shm)
+        destroy_xshm_image(st->dpy, st->image, &st->shm_info);
+    else
+#endif /* HAVE_XSHM_EXTENSION */
+        XDestroyImage(st->image);
+    st->image = NULL;
+}
+
+
+static Bool
+direct_image_p(XImage *image)
 {
+    union { int i; char c[sizeof(int)]; } u;
+    u.i = 1;
+    return (image->bits_per_pixel == 32 &&
+            image->byte_order == (u.c[0] ? LSBFirst : MSBFirst));
+}
+
+
+static void build_img(struct state *st) 
+{
+    struct field *f = st->f;
+    int i;
+
     if (f->off_img) {
         free(f->off_img);
         f->off_img = NULL;
     }
 
-    f->off_img = (unsigned long *) xrealloc(f->off_img, sizeof(unsigned long) * 
-                                            f->width * f->height);
+    f->off_img = (uint32_t *) xrealloc(f->off_img, sizeof(uint32_t) * 
+                                       f->width * f->height);
 
-    memset(f->off_img, f->bgcolor, sizeof(unsigned long) * f->width * f->height);
+    for (i = 0; i < f->width * f->height; i++)
+        f->off_img[i] = f->bgrgb;
+
+    f->strips = (f->height + STRIP - 1) / STRIP;
+    f->dirty_x0 = (int *) xrealloc(f->dirty_x0, sizeof(int) * f->strips);
+    f->dirty_x1 = (int *) xrealloc(f->dirty_x1, sizeof(int) * f->strips);
+    for (i = 0; i < f->strips; i++) {
+        f->dirty_x0[i] = f->width;
+        f->dirty_x1[i] = 0;
+    }
+
+    free_img(st);
+
+#ifdef HAVE_XSHM_EXTENSION
+    st->use_shm = get_boolean_resource(st->dpy, "useSHM", "Boolean");
+    if (st->use_shm) {
+        st->image = create_xshm_image(st->dpy, st->xgwa.visual,
+                                      st->xgwa.depth, ZPixmap, 0,
+                                      &st->shm_info, f->width, f->height);
+        if (!st->image)
+            st->use_shm = False;
+    }
+#endif /* HAVE_XSHM_EXTENSION */
+
+    if (!st->image) {
+        st->image = XCreateImage(st->dpy, st->xgwa.visual, st->xgwa.depth,
+                                 ZPixmap, 0, 0, f->width, f->height, 32, 0);
+        if (!st->image) {
+            fprintf(stderr, "%s: out of memory\n", progname);
+            exit(1);
+        }
+        st->image->data = (char *)
+            xrealloc(NULL, st->image->bytes_per_line * f->height);
+    }
+
+    st->direct_p = direct_image_p(st->image);
+    convert_rect(st, 0, 0, f->width, f->height);
+}
+
+
+static int
+substrate_thread_create(void *self_raw, struct threadpool *pool, unsigned id)
+{
+    struct substrate_thread *self = (struct substrate_thread *) self_raw;
+    self->st = GET_PARENT_OBJ(struct state, threadpool, pool);
+    self->id = id;
+    return 0;
+}
+
+
+static void
+substrate_thread_destroy(void *self_raw)
+{
 }
 
 
@@ -568,6 +933,7 @@ substrate_init (Display *dpy, Window window)
 {
     struct state *st = (struct state *) calloc (1, sizeof(*st));
     XColor tmpcolor;
+    int i;
 
     st->dpy = dpy;
     st->window = window;
@@ -606,7 +972,6 @@ substrate_init (Display *dpy, Window window)
 
     st->f->height = st->xgwa.height;
     st->f->width = st->xgwa.width;
-    st->f->visdepth = st->xgwa.depth;
  
     /* Count the colors in our map and assign them in a horrifically inefficient 
      * manner but it only happens once */
@@ -614,6 +979,9 @@ substrate_init (Display *dpy, Window window)
         st->f->parsedcolors = (unsigned long *) xrealloc(st->f->parsedcolors, 
                                                      sizeof(unsigned long) * 
                                                      (st->f->numcolors + 1));
+        st->f->sandcolors = (uint32_t *) xrealloc(st->f->sandcolors,
+                                                  sizeof(uint32_t) *
+                                                  (st->f->numcolors + 1));
         if (!XParseColor(st->dpy, st->xgwa.colormap, rgb_colormap[st->f->numcolors], &tmpcolor)) {
             fprintf(stderr, "%s: couldn't parse color %s\n", progname,
                     rgb_colormap[st->f->numcolors]);
@@ -627,6 +995,7 @@ substrate_init (Display *dpy, Window window)
         }
 
         st->f->parsedcolors[st->f->numcolors] = tmpcolor.pixel;
+        st->f->sandcolors[st->f->numcolors] = xcolor_to_rgb(&tmpcolor);
 
         st->f->numcolors++;
     }
@@ -640,8 +1009,38 @@ substrate_init (Display *dpy, Window window)
     st->f->fgcolor = st->gcv.foreground;
     st->f->bgcolor = st->gcv.background;
 
+    tmpcolor.pixel = st->f->fgcolor;
+    XQueryColor(st->dpy, st->xgwa.colormap, &tmpcolor);
+    st->f->fgrgb = xcolor_to_rgb(&tmpcolor);
+    tmpcolor.pixel = st->f->bgcolor;
+    XQueryColor(st->dpy, st->xgwa.colormap, &tmpcolor);
+    st->f->bgrgb = xcolor_to_rgb(&tmpcolor);
+
+    /* Grains fade out along the stroke */
+    if (st->f->grains < 0)
+        st->f->grains = 0;
+    st->f->grain_alpha = (unsigned int *)
+        xrealloc(st->f->grain_alpha, sizeof(unsigned int) * (st->f->grains + 1));
+    for (i = 0; i < st->f->grains; i++)
+        st->f->grain_alpha[i] =
+            (0.1 - i / (st->f->grains * 10.0)) * 256 + 0.5;
+
+    init_pixels(st);
+
+    {
+        static const struct threadpool_class cls = {
+            sizeof(struct substrate_thread),
+            substrate_thread_create,
+            substrate_thread_destroy
+        };
+
+        if (threadpool_create(&st->threadpool, &cls, st->dpy,
+                              hardware_concurrency(st->dpy)))
+            st->threadpool.count = 0; /* See the note in thread_util.h. */
+    }
+
     /* Initialize stuff */
-    build_img(st->dpy, st->window, st->xgwa, st->fgc, st->f);
+    build_img(st);
     build_substrate(st->f);
     
     return st;
@@ -651,7 +1050,6 @@ static unsigned long
 substrate_draw (Display *dpy, Window window, void *closure)
 {
   struct state *st = (struct state *) closure;
-  int tempx;
 
   if ((st->f->cycles % 10) == 0) {
 
@@ -661,25 +1059,22 @@ substrate_draw (Display *dpy, Window window, void *closure)
     if (st->f->height != st->xgwa.height || st->f->width != st->xgwa.width) {
       st->f->height = st->xgwa.height;
       st->f->width = st->xgwa.width;
-      st->f->visdepth = st->xgwa.depth;
 
       build_substrate(st->f);
-      build_img(st->dpy, st->window, st->xgwa, st->fgc, st->f);
+      build_img(st);
       XSetForeground(st->dpy, st->fgc, st->gcv.background);
       XFillRectangle(st->dpy, st->window, st->fgc, 0, 0, st->xgwa.width, st->xgwa.height);
       XSetForeground(st->dpy, st->fgc, st->gcv.foreground);
     }
   }
 
-  for (tempx = 0; tempx < st->f->num; tempx++) {
-    movedrawcrack(st, st->fgc, st->f, tempx);
-  }
+  cycle(st);
 
   st->f->cycles++;
 
   if (st->f->cycles >= st->max_cycles && st->max_cycles != 0) {
     build_substrate(st->f);
-    build_img(st->dpy, st->window, st->xgwa, st->fgc, st->f);
+    build_img(st);
     XSetForeground(st->dpy, st->fgc, st->gcv.background);
     XFillRectangle(st->dpy, st->window, st->fgc, 0, 0, st->xgwa.width, st->xgwa.height);
     XSetForeground(st->dpy, st->fgc, st->gcv.foreground);
@@ -706,6 +1101,24 @@ static void
 substrate_free (Display *dpy, Window window, void *closure)
 {
   struct state *st = (struct state *) closure;
+  struct field *f = st->f;
+
+  if (st->threadpool.count)
+    threadpool_destroy (&st->threadpool);
+  free_img (st);
+  XFreeGC (dpy, st->fgc);
+
+  free (f->cracks);
+  free (f->cgrid);
+  free (f->grain_pos);
+  free (f->grain_alpha);
+  free (f->off_img);
+  free (f->dirty_x0);
+  free (f->dirty_x1);
+  free (f->parsedcolors);
+  free (f->sandcolors);
+  free (f);
+  free (st->nearest);
   free (st);
 }
 
@@ -720,6 +1133,10 @@ static const char *substrate_defaults[] = {
     "*maxCracks: 100",
     "*sandGrains: 64",
     "*circlePercent: 33",
+#ifdef HAVE_XSHM_EXTENSION
+    "*useSHM: True",
+#endif /* HAVE_XSHM_EXTENSION */
+    THREAD_DEFAULTS
 #ifdef USE_IPHONE
   "*ignoreRotation: True",
 #endif
@@ -736,6 +1153,11 @@ static XrmOptionDescRec substrate_options[] = {
     {"-max-cracks", ".maxCracks", XrmoptionSepArg, 0},
     {"-sand-grains", ".sandGrains", XrmoptionSepArg, 0},
     {"-circle-percent", ".circlePercent", XrmoptionSepArg, 0},
+#ifdef HAVE_XSHM_EXTENSION
+    {"-shm", ".useSHM", XrmoptionNoArg, "True"},
+    {"-no-shm", ".useSHM", XrmoptionNoArg, "False"},
+#endif /* HAVE_XSHM_EXTENSION */
+    THREAD_OPTIONS
     {0, 0, 0, 0}
 };
 
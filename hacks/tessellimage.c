@@ -11,6 +11,14 @@
 
 #include "screenhack.h"
 #include "delaunay.h"
+#include "index_image.h"
+#include "thread_util.h"
+
+#ifdef HAVE_STDINT_H
+# include <stdint.h>
+#else
+typedef unsigned int uint32_t;
+#endif
 
 #undef DO_VORONOI
 
@@ -34,17 +42,39 @@ struct state {
   int max_depth;
   double start_time, start_time2;
 
-  XImage *img, *delta;
+  XImage *img;
+  unsigned char *delta;     /* Color distance at each pixel of img. */
   Pixmap image, output, deltap;
   int nthreshes, threshes[256], vsizes[256];
   int thresh, dthresh;
   Pixmap cache[256];
 
+  delaunay *tri;        /* Holds the first ninserted control points. */
+  XYZ *control;         /* Pixels by decreasing delta, for every thresh. */
+  int *vertex;          /* The vertex number of each inserted point. */
+  int ncontrol, ninserted;
+
+  struct threadpool threadpool;
+  XImage *img2;             /* What scale_pass writes, from img. */
+  int *scale_x;             /* The column of img for each of img2. */
+  double scale;
+  int cy;
+  unsigned long rmsk, gmsk, bmsk;
+  unsigned int rpos, gpos, bpos;
+  int dist_r[511], dist_g[511], dist_b[511];  /* By channel difference. */
+  unsigned char *cube_root;
+  unsigned long *histos;    /* 256 for each thread. */
+
   async_load_state *img_loader;
   XRectangle geom;
   Bool button_down_p;
 };
 
+struct tess_thread {
+  struct state *st;
+  unsigned id;
+};
+
 
 /* Returns the current time in seconds as a double.
  */
@@ -63,6 +93,58 @@ double_time (void)
 }
 
 
+static int
+tess_thread_create (void *self_raw, struct threadpool *pool, unsigned id)
+{
+  struct tess_thread *self = (struct tess_thread *) self_raw;
+  self->st = GET_PARENT_OBJ(struct state, threadpool, pool);
+  self->id = id;
+  return 0;
+}
+
+static void
+tess_thread_destroy (void *self_raw)
+{
+}
+
+
+/* Runs the pass on every thread, each of which does one band of rows.
+ */
+static void
+run_pass (struct state *st, void (*pass) (void *))
+{
+  if (st->threadpool.count)
+    {
+      threadpool_run (&st->threadpool, pass);
+      threadpool_wait (&st->threadpool);
+    }
+  else
+    {
+      struct tess_thread self;
+      self.st = st;
+      self.id = 0;
+      pass (&self);
+    }
+}
+
+static void
+band (const struct tess_thread *self, int h, int *y0, int *y1)
+{
+  unsigned count = self->st->threadpool.count ? self->st->threadpool.count : 1;
+  *y0 = h * self->id / count;
+  *y1 = h * (self->id + 1) / count;
+}
+
+
+static Bool
+native_32bpp_p (const XImage *image)
+{
+  const union { uint32_t i; char c[4]; } u = { 1 };
+  return (image->bits_per_pixel == 32 &&
+          image->byte_order == (u.c[0] ? LSBFirst : MSBFirst));
+}
+
+
 static void *
 tessellimage_init (Display *dpy, Window window)
 {
@@ -93,6 +175,18 @@ tessellimage_init (Display *dpy, Window window)
 
   XClearWindow(st->dpy, st->window);
 
+  {
+    static const struct threadpool_class cls = {
+      sizeof(struct tess_thread),
+      tess_thread_create,
+      tess_thread_destroy
+    };
+
+    if (threadpool_create (&st->threadpool, &cls, st->dpy,
+                           hardware_concurrency (st->dpy)))
+      st->threadpool.count = 0; /* See the note in thread_util.h. */
+  }
+
   return st;
 }
 
@@ -117,83 +211,44 @@ decode_mask (unsigned int mask, unsigned int *pos_ret, unsigned int *size_ret)
 }
 
 
-static unsigned long
-pixel_distance (Visual *v, unsigned long p1, unsigned long p2)
-{
-  static int initted_p = 0;
-  static unsigned int rmsk=0, gmsk=0, bmsk=0;
-  static unsigned int rpos=0, gpos=0, bpos=0;
-  static unsigned int rsiz=0, gsiz=0, bsiz=0;
-
-  unsigned char r1, g1, b1;
-  unsigned char r2, g2, b2;
-  long distance;
-
-  if (!p1 && !p2) return 0;
-
-  if (! initted_p) {
-    rmsk = v->red_mask;
-    gmsk = v->green_mask;
-    bmsk = v->blue_mask;
-    decode_mask (rmsk, &rpos, &rsiz);
-    decode_mask (gmsk, &gpos, &gsiz);
-    decode_mask (bmsk, &bpos, &bsiz);
-    initted_p = 1;
-  }
+/* Sets up the tables that pixel distances are computed from: the
+   distance between two pixels is
+   cube_root[dist_r[r2-r1+255] + dist_g[g2-g1+255] + dist_b[b2-b1+255]].
 
-  r1 = (p1 & rmsk) >> rpos;
-  g1 = (p1 & gmsk) >> gpos;
-  b1 = (p1 & bmsk) >> bpos;
+   That's the distance in luminance-weighted RGB space.  (Linear RGB, and
+   brightness-weighted HSV, were slower and didn't look any better.)
+ */
+static void
+init_distance (struct state *st)
+{
+  Visual *v = st->xgwa.visual;
+  unsigned int rsiz=0, gsiz=0, bsiz=0;
+  int i, max;
 
-  r2 = (p2 & rmsk) >> rpos;
-  g2 = (p2 & gmsk) >> gpos;
-  b2 = (p2 & bmsk) >> bpos;
+  st->rmsk = v->red_mask;
+  st->gmsk = v->green_mask;
+  st->bmsk = v->blue_mask;
+  decode_mask (st->rmsk, &st->rpos, &rsiz);
+  decode_mask (st->gmsk, &st->gpos, &gsiz);
+  decode_mask (st->bmsk, &st->bpos, &bsiz);
 
-#if 0
-  /* Compute the distance in linear RGB space.
-   */
-  distance = cbrt (((r2 - r1) * (r2 - r1)) +
-                   ((g2 - g1) * (g2 - g1)) +
-                   ((b2 - b1) * (b2 - b1)));
+  if (st->cube_root) return;
 
-# elif 1
-  /* Compute the distance in luminance-weighted RGB space.
-   */
-  {
-    int rd = (r2 - r1) * 0.2989 * (1 / 0.5870);
-    int gd = (g2 - g1) * 0.5870 * (1 / 0.5870);
-    int bd = (b2 - b1) * 0.1140 * (1 / 0.5870);
-    distance = cbrt ((rd * rd) + (gd * gd) + (bd * bd));
-  }
-# else
-  /* Compute the distance in brightness-weighted HSV space.
-     (Slower, and doesn't seem to look better than luminance RGB.)
-   */
-  {
-    int h1, h2;
-    double s1, s2;
-    double v1, v2;
-    double hd, sd, vd, dd;
-    rgb_to_hsv (r1, g1, b1, &h1, &s1, &v1);
-    rgb_to_hsv (r2, g2, b2, &h2, &s2, &v2);
-
-    hd = abs (h2 - h1);
-    if (hd >= 180) hd -= 180;
-    hd /= 180.0;
-    sd = fabs (s2 - s1);
-    vd = fabs (v2 - v1);
-
-    /* [hsv]d are now the distance as 0.0 - 1.0. */
-    /* Compute the overall distance, giving more weight to V. */
-    dd = (hd * 0.25 + sd * 0.25 + vd * 0.5);
-
-    if (dd < 0 || dd > 1.0) abort();
-    distance = dd * 255;
-  }
-# endif
+  for (i = -255; i <= 255; i++)
+    {
+      int rd = i * 0.2989 * (1 / 0.5870);
+      int gd = i * 0.5870 * (1 / 0.5870);
+      int bd = i * 0.1140 * (1 / 0.5870);
+      st->dist_r[i+255] = rd * rd;
+      st->dist_g[i+255] = gd * gd;
+      st->dist_b[i+255] = bd * bd;
+    }
 
-  if (distance < 0) distance = -distance;
-  return distance;
+  max = st->dist_r[0] + st->dist_g[0] + st->dist_b[0];
+  st->cube_root = (unsigned char *) malloc (max + 1);
+  if (! st->cube_root) abort();
+  for (i = 0; i <= max; i++)
+    st->cube_root[i] = cbrt (i);
 }
 
 
@@ -215,6 +270,40 @@ flush_cache (struct state *st)
 }
 
 
+static void
+scale_pass (void *self_raw)
+{
+  struct tess_thread *self = (struct tess_thread *) self_raw;
+  const struct state *st = self->st;
+  const XImage *img = st->img;
+  XImage *img2 = st->img2;
+  Bool fast_p = native_32bpp_p (img) && native_32bpp_p (img2);
+  int x, y, y0, y1;
+
+  band (self, img2->height, &y0, &y1);
+  for (y = y0; y < y1; y++)
+    {
+      int y2 = st->cy + ((y - st->cy) * st->scale);
+      if (y2 < 0 || y2 >= img->height)
+        continue;                               /* img2 starts black */
+      if (fast_p)
+        {
+          const uint32_t *in = (const uint32_t *)
+            (img->data + y2 * img->bytes_per_line);
+          uint32_t *out = (uint32_t *) (img2->data + y * img2->bytes_per_line);
+          for (x = 0; x < img2->width; x++)
+            if (st->scale_x[x] >= 0)
+              out[x] = in[st->scale_x[x]];
+        }
+      else
+        for (x = 0; x < img2->width; x++)
+          if (st->scale_x[x] >= 0)
+            XPutPixel (img2, x, y,
+                       XGetPixel ((XImage *) img, st->scale_x[x], y2));
+    }
+}
+
+
 /* Scale up the bits in st->img so that it fills the screen, centered.
  */
 static void
@@ -222,7 +311,7 @@ scale_image (struct state *st)
 {
   double scale, s1, s2;
   XImage *img2;
-  int x, y, cx, cy;
+  int x, cx, cy;
 
   if (st->geom.width <= 0 || st->geom.height <= 0)
     return;
@@ -244,17 +333,23 @@ scale_image (struct state *st)
   if (st->geom.width < st->geom.height)  /* portrait: aim toward the top */
     cy = st->img->height / (2 / scale);
 
-  for (y = 0; y < img2->height; y++)
-    for (x = 0; x < img2->width; x++)
-      {
-        int x2 = cx + ((x - cx) * scale);
-        int y2 = cy + ((y - cy) * scale);
-        unsigned long p = 0;
-        if (x2 >= 0 && y2 >= 0 &&
-            x2 < st->img->width && y2 < st->img->height)
-          p = XGetPixel (st->img, x2, y2);
-        XPutPixel (img2, x, y, p);
-      }
+  /* Columns map the same way on every row, so work them out once. */
+  st->scale_x = (int *) malloc (img2->width * sizeof(*st->scale_x));
+  if (! st->scale_x) abort();
+  for (x = 0; x < img2->width; x++)
+    {
+      int x2 = cx + ((x - cx) * scale);
+      st->scale_x[x] = (x2 >= 0 && x2 < st->img->width ? x2 : -1);
+    }
+
+  st->img2 = img2;
+  st->scale = scale;
+  st->cy = cy;
+  run_pass (st, scale_pass);
+  st->img2 = 0;
+  free (st->scale_x);
+  st->scale_x = 0;
+
   free (st->img->data);
   st->img->data = 0;
   XDestroyImage (st->img);
@@ -267,6 +362,105 @@ scale_image (struct state *st)
 }
 
 
+/* Splits row y of the image into channels, after a black pixel at x = -1.
+   Rows off the image are black too.
+ */
+static void
+split_row (const struct state *st, int y,
+           unsigned char *r, unsigned char *g, unsigned char *b)
+{
+  const XImage *img = st->img;
+  int x;
+
+  *r++ = *g++ = *b++ = 0;
+  if (y < 0 || y >= img->height)
+    {
+      memset (r, 0, img->width);
+      memset (g, 0, img->width);
+      memset (b, 0, img->width);
+    }
+  else if (native_32bpp_p (img))
+    {
+      const uint32_t *in = (const uint32_t *)
+        (img->data + y * img->bytes_per_line);
+      for (x = 0; x < img->width; x++)
+        {
+          uint32_t p = in[x];
+          r[x] = (p & st->rmsk) >> st->rpos;
+          g[x] = (p & st->gmsk) >> st->gpos;
+          b[x] = (p & st->bmsk) >> st->bpos;
+        }
+    }
+  else
+    for (x = 0; x < img->width; x++)
+      {
+        unsigned long p = XGetPixel ((XImage *) img, x, y);
+        r[x] = (p & st->rmsk) >> st->rpos;
+        g[x] = (p & st->gmsk) >> st->gpos;
+        b[x] = (p & st->bmsk) >> st->bpos;
+      }
+}
+
+
+/* Computes the delta map and histogram for one band of rows: the average
+   distance between each pixel and its neighbors to the upper left, up,
+   left and lower left, with black off the edges.
+ */
+static void
+delta_pass (void *self_raw)
+{
+  struct tess_thread *self = (struct tess_thread *) self_raw;
+  const struct state *st = self->st;
+  int w = st->img->width, w1 = w + 1;
+  unsigned long *histo = st->histos + 256 * self->id;
+  unsigned char *rows, *r[3], *g[3], *b[3];
+  int x, y, y0, y1, i;
+
+  band (self, st->img->height, &y0, &y1);
+  memset (histo, 0, 256 * sizeof(*histo));
+  if (y0 >= y1) return;
+
+  rows = (unsigned char *) malloc (9 * w1);
+  if (! rows) abort();
+  for (i = 0; i < 3; i++)
+    {
+      r[i] = rows + (3*i + 0) * w1;
+      g[i] = rows + (3*i + 1) * w1;
+      b[i] = rows + (3*i + 2) * w1;
+    }
+  split_row (st, y0 - 1, r[0], g[0], b[0]);
+  split_row (st, y0,     r[1], g[1], b[1]);
+
+  for (y = y0; y < y1; y++)
+    {
+      /* [0] is the row above, [1] this row, [2] the row below, with the
+         pixel at x at index x+1. */
+      unsigned char *out = st->delta + y * w;
+      unsigned char *t;
+      split_row (st, y + 1, r[2], g[2], b[2]);
+
+      for (x = 1; x <= w; x++)
+        {
+          int cr = 255 - r[1][x], cg = 255 - g[1][x], cb = 255 - b[1][x];
+# define DIST(I,X) \
+          st->cube_root[st->dist_r[r[I][X] + cr] + \
+                        st->dist_g[g[I][X] + cg] + \
+                        st->dist_b[b[I][X] + cb]]
+          int d = (DIST (0, x-1) + DIST (0, x) +
+                   DIST (1, x-1) + DIST (2, x-1)) / 4;
+# undef DIST
+          out[x-1] = d;
+          histo[d]++;
+        }
+
+      t = r[0]; r[0] = r[1]; r[1] = r[2]; r[2] = t;
+      t = g[0]; g[0] = g[1]; g[1] = g[2]; g[2] = t;
+      t = b[0]; b[0] = b[1]; b[1] = b[2]; b[2] = t;
+    }
+
+  free (rows);
+}
+
 
 static void
 analyze (struct state *st)
@@ -296,49 +490,25 @@ analyze (struct state *st)
   /* Create the delta map: color space distance between each pixel.
      Maybe doing running a Sobel Filter matrix on this would be a
      better idea.  That might be a bit faster, but I think it would
-     make no visual difference.
+     make no visual difference.  Each thread also collects a histogram
+     of every distance value in its rows.
    */
-  if (st->delta)
-    {
-      free (st->delta->data);
-      st->delta->data = 0;
-      XDestroyImage (st->delta);
-    }
-  st->delta = XCreateImage (st->dpy, st->xgwa.visual, d, ZPixmap, 0, NULL,
-                            w, h, 32, 0);
-  st->delta->data = (char *)
-    calloc (st->delta->height, st->delta->bytes_per_line);
+  init_distance (st);
+  free (st->delta);
+  st->delta = (unsigned char *) malloc (w * h);
+  st->histos = (unsigned long *)
+    calloc (st->threadpool.count ? st->threadpool.count : 1,
+            256 * sizeof(*st->histos));
+  if (!st->delta || !st->histos) abort();
 
-  for (y = 0; y < st->delta->height; y++)
-    {
-      for (x = 0; x < st->delta->width; x++)
-        {
-          unsigned long pixels[5];
-          int i = 0;
-          int distance = 0;
-          pixels[i++] =                     XGetPixel (st->img, x,   y);
-          pixels[i++] = (x > 0 && y > 0   ? XGetPixel (st->img, x-1, y-1) : 0);
-          pixels[i++] = (         y > 0   ? XGetPixel (st->img, x,   y-1) : 0);
-          pixels[i++] = (x > 0            ? XGetPixel (st->img, x-1, y)   : 0);
-          pixels[i++] = (x > 0 && y < h-1 ? XGetPixel (st->img, x-1, y+1) : 0);
-
-          for (i = 1; i < countof(pixels); i++)
-            distance += pixel_distance (st->xgwa.visual, pixels[0], pixels[i]);
-          distance /= countof(pixels)-1;
-          XPutPixel (st->delta, x, y, distance);
-        }
-    }
+  run_pass (st, delta_pass);
 
-  /* Collect a histogram of every distance value.
-   */
   memset (histo, 0, sizeof(histo));
-  for (y = 0; y < st->delta->height; y++)
-    for (x = 0; x < st->delta->width; x++)
-      {
-        unsigned long p = XGetPixel (st->delta, x, y);
-        if (p > sizeof(histo)) abort();
-        histo[p]++;
-      }
+  for (i = 0; i < (st->threadpool.count ? st->threadpool.count : 1); i++)
+    for (x = 0; x < countof(histo); x++)
+      histo[x] += st->histos[256 * i + x];
+  free (st->histos);
+  st->histos = 0;
 
   /* Convert that from "occurrences of N" to ">= N".
    */
@@ -386,6 +556,70 @@ analyze (struct state *st)
       }
   }
   
+  /* Sort the pixels that any threshold will use by decreasing delta, so
+     that the control points for each threshold are a prefix of the list,
+     and moving to another threshold only inserts or removes the points
+     that differ.  Within each delta they stay in raster order.
+   */
+  free (st->control);
+  free (st->vertex);
+  st->control = 0;
+  st->vertex = 0;
+  st->ncontrol = st->ninserted = 0;
+  if (st->tri) delaunay_free (st->tri);
+  st->tri = 0;
+
+  if (st->nthreshes > 0)
+    {
+      int lowest = st->threshes[st->nthreshes-1];
+      unsigned long next[256];
+
+      st->ncontrol = st->vsizes[st->nthreshes-1];
+      st->control = (XYZ *) calloc (st->ncontrol, sizeof(*st->control));
+      st->vertex = (int *) calloc (st->ncontrol, sizeof(*st->vertex));
+      if (!st->control || !st->vertex)
+        {
+          fprintf (stderr, "%s: out of memory (%d)\n", progname,
+                   st->ncontrol);
+          abort();
+        }
+
+      /* histo[i+1] pixels have a greater delta than i. */
+      for (i = lowest; i < countof(histo); i++)
+        next[i] = (i == countof(histo)-1 ? 0 : histo[i+1]);
+
+      for (y = 0; y < h; y++)
+        for (x = 0; x < w; x++)
+          {
+            unsigned int px = st->delta[y * w + x];
+            if (px >= lowest)
+              {
+                XYZ *c = &st->control[next[px]++];
+                c->x = x;
+                c->y = y;
+                c->z = px;
+              }
+          }
+    }
+
+  /* The corners of the screen are the triangulation's own; add control
+     points for the corners of the image.
+   */
+  if (st->geom.width  <= 0) st->geom.width  = st->img->width;
+  if (st->geom.height <= 0) st->geom.height = st->img->height;
+
+  st->tri = delaunay_new (0, 0, st->img->width-1, st->img->height-1);
+  if (st->tri)
+    for (y = 0; y <= 1; y++)
+      for (x = 0; x <= 1; x++)
+        {
+          XYZ c;
+          c.x = st->geom.x + (x ? st->geom.width-1  : 0);
+          c.y = st->geom.y + (y ? st->geom.height-1 : 0);
+          c.z = st->delta[(int) c.y * w + (int) c.x];
+          delaunay_insert (st->tri, &c);
+        }
+
   st->thresh = 0;   /* startup */
   st->dthresh = 1;  /* forward */
 
@@ -431,7 +665,7 @@ typedef struct {
 } voronoi_polygon;
 
 static voronoi_polygon *
-delaunay_to_voronoi (int np, XYZ *p, int nv, ITRIANGLE *v)
+delaunay_to_voronoi (int np, const delaunay *d, int nv, ITRIANGLE *v)
 {
   struct tri_list {
     int count, size;
@@ -511,8 +745,11 @@ delaunay_to_voronoi (int np, XYZ *p, int nv, ITRIANGLE *v)
       for (j = 0; j < out[i].npoints; j++)
         {
           ITRIANGLE *tt = &v[t->tri[j]];
-          out[i].p[j].x = (p[tt->p1].x + p[tt->p2].x + p[tt->p3].x) / 3;
-          out[i].p[j].y = (p[tt->p1].y + p[tt->p2].y + p[tt->p3].y) / 3;
+          const XYZ *p1 = delaunay_point (d, tt->p1);
+          const XYZ *p2 = delaunay_point (d, tt->p2);
+          const XYZ *p3 = delaunay_point (d, tt->p3);
+          out[i].p[j].x = (p1->x + p2->x + p3->x) / 3;
+          out[i].p[j].y = (p1->y + p2->y + p3->y) / 3;
 //printf(" [%d: %d %d]", j, out[i].p[j].x, out[i].p[j].y);
         }
 //printf("\n");
@@ -577,99 +814,69 @@ tessellate (struct state *st)
         XCopyArea (st->dpy, 
                    st->cache[st->thresh],
                    st->output, st->pgc,
-                   0, 0, st->delta->width, st->delta->height, 
+                   0, 0, st->img->width, st->img->height, 
                    0, 0);
     }
   else if (ticked_p)
     {
-      int threshold = st->threshes[st->thresh];
       int vsize = st->vsizes[st->thresh];
       ITRIANGLE *v;
-      XYZ *p = 0;
-      int nv = 0;
       int ntri = 0;
-      int x, y, i;
+      int i;
 
 #if 0
       fprintf(stderr, "%s: thresh %d/%d = %d=%d\n", 
-              progname, st->thresh, st->nthreshes, threshold, vsize);
+              progname, st->thresh, st->nthreshes,
+              st->threshes[st->thresh], vsize);
 #endif
 
-      /* Create a control point at every pixel where the delta is above
-         the current threshold.  Triangulate from those. */
-
-      vsize += 8;  /* corners of screen + corners of image */
+      /* Insert or remove control points until the triangulation has one
+         at every pixel where the delta is above the current threshold.
+         Neighboring thresholds differ by a few points, so this is much
+         cheaper than triangulating from scratch. */
 
-      p = (XYZ *) calloc (vsize+4, sizeof(*p));
-      v = (ITRIANGLE *) calloc (3*(vsize+4), sizeof(*v));
-      if (!p || !v)
+      if (st->tri)
         {
-          fprintf (stderr, "%s: out of memory (%d)\n", progname, vsize);
-          abort();
+          while (st->ninserted < vsize)
+            {
+              st->vertex[st->ninserted] =
+                delaunay_insert (st->tri, &st->control[st->ninserted]);
+              st->ninserted++;
+            }
+          while (st->ninserted > vsize)
+            delaunay_remove (st->tri, st->vertex[--st->ninserted]);
         }
 
-      /* Add control points for the corners of the screen, and for the
-         corners of the image.
-       */
-      if (st->geom.width  <= 0) st->geom.width  = st->delta->width;
-      if (st->geom.height <= 0) st->geom.height = st->delta->height;
-
-      for (y = 0; y <= 1; y++)
-        for (x = 0; x <= 1; x++)
-          {
-            p[nv].x = x ? st->delta->width-1  : 0;
-            p[nv].y = y ? st->delta->height-1 : 0;
-            p[nv].z = XGetPixel (st->delta, (int) p[nv].x, (int) p[nv].y);
-            nv++;
-            p[nv].x = st->geom.x + (x ? st->geom.width-1  : 0);
-            p[nv].y = st->geom.y + (y ? st->geom.height-1 : 0);
-            p[nv].z = XGetPixel (st->delta, (int) p[nv].x, (int) p[nv].y);
-            nv++;
-          }
-
-      /* Add control points for every pixel that exceeds the threshold.
-       */
-      for (y = 0; y < st->delta->height; y++)
-        for (x = 0; x < st->delta->width; x++)
-          {
-            unsigned long px = XGetPixel (st->delta, x, y);
-            if (px >= threshold)
-              {
-                if (nv >= vsize) abort();
-                p[nv].x = x;
-                p[nv].y = y;
-                p[nv].z = px;
-                nv++;
-              }
-          }
-
-      if (nv != vsize) abort();
-
-      qsort (p, nv, sizeof(*p), delaunay_xyzcompare);
-      if (delaunay (nv, p, v, &ntri))
+      v = (ITRIANGLE *)
+        calloc ((st->tri ? delaunay_count (st->tri) : 0) + 1, sizeof(*v));
+      if (!v)
         {
-          fprintf (stderr, "%s: out of memory\n", progname);
+          fprintf (stderr, "%s: out of memory (%d)\n", progname, vsize);
           abort();
         }
+      if (st->tri)
+        ntri = delaunay_triangles (st->tri, v);
 
       /* Create the output pixmap based on that triangulation. */
 
       if (st->output)
         XFreePixmap (st->dpy, st->output);
       st->output = XCreatePixmap (st->dpy, st->window,
-                                  st->delta->width, st->delta->height,
+                                  st->img->width, st->img->height,
                                   st->xgwa.depth);
       XFillRectangle (st->dpy, st->output, st->pgc, 
-                      0, 0, st->delta->width, st->delta->height);
+                      0, 0, st->img->width, st->img->height);
 
 #ifdef DO_VORONOI
 
-      voronoi_polygon *polys = delaunay_to_voronoi (nv, p, ntri, v);
-      for (i = 0; i < nv; i++)
+      int np = 8 + st->ncontrol;  /* Vertex numbers are less than this. */
+      voronoi_polygon *polys = delaunay_to_voronoi (np, st->tri, ntri, v);
+      for (i = 0; i < np; i++)
         {
-          if (polys[i].npoints >= 3)
+          const XYZ *p = delaunay_point (st->tri, i);
+          if (p && polys[i].npoints >= 3)
             {
-              unsigned long color = XGetPixel (st->img, p[i].x, p[i].y);
+              unsigned long color = XGetPixel (st->img, p->x, p->y);
               XSetForeground (st->dpy, st->pgc, color);
               XFillPolygon (st->dpy, st->output, st->pgc,
                             polys[i].p, polys[i].npoints,
@@ -704,11 +911,14 @@ tessellate (struct state *st)
 
       for (i = 0; i < ntri; i++)
         {
+          const XYZ *p1 = delaunay_point (st->tri, v[i].p1);
+          const XYZ *p2 = delaunay_point (st->tri, v[i].p2);
+          const XYZ *p3 = delaunay_point (st->tri, v[i].p3);
           XPoint xp[3];
           unsigned long color;
-          xp[0].x = p[v[i].p1].x; xp[0].y = p[v[i].p1].y;
-          xp[1].x = p[v[i].p2].x; xp[1].y = p[v[i].p2].y;
-          xp[2].x = p[v[i].p3].x; xp[2].y = p[v[i].p3].y;
+          xp[0].x = p1->x; xp[0].y = p1->y;
+          xp[1].x = p2->x; xp[1].y = p2->y;
+          xp[2].x = p3->x; xp[2].y = p3->y;
 
           /* Set the color of this triangle to the pixel at its midpoint. */
           color = XGetPixel (st->img,
@@ -740,14 +950,13 @@ tessellate (struct state *st)
         }
 #endif /* !DO_VORONOI */
 
-      free (p);
       free (v);
 
       if (st->cache_p && !st->cache[st->thresh])
         {
           st->cache[st->thresh] =
             XCreatePixmap (st->dpy, st->window,
-                           st->delta->width, st->delta->height,
+                           st->img->width, st->img->height,
                            st->xgwa.depth);
           if (! st->cache[st->thresh])
             {
@@ -759,7 +968,7 @@ tessellate (struct state *st)
                        st->output,
                        st->cache[st->thresh],
                        st->pgc,
-                       0, 0, st->delta->width, st->delta->height, 
+                       0, 0, st->img->width, st->img->height, 
                        0, 0);
         }
     }
@@ -773,24 +982,21 @@ tessellate (struct state *st)
 static Pixmap
 get_deltap (struct state *st)
 {
-  int x, y;
-  int w = st->delta->width;
-  int h = st->delta->height;
+  int y, i;
+  int w = st->img->width;
+  int h = st->img->height;
   XImage *dimg;
-
-  Visual *v = st->xgwa.visual;
-  unsigned int rmsk=0, gmsk=0, bmsk=0;
-  unsigned int rpos=0, gpos=0, bpos=0;
-  unsigned int rsiz=0, gsiz=0, bsiz=0;
+  unsigned long palette[256];
 
   if (st->deltap) return st->deltap;
 
-  rmsk = v->red_mask;
-  gmsk = v->green_mask;
-  bmsk = v->blue_mask;
-  decode_mask (rmsk, &rpos, &rsiz);
-  decode_mask (gmsk, &gpos, &gsiz);
-  decode_mask (bmsk, &bpos, &bsiz);
+  for (i = 0; i < countof(palette); i++)
+    {
+      unsigned long v = (unsigned long) i << 5;
+      palette[i] = (((v << st->rpos) & st->rmsk) |
+                    ((v << st->gpos) & st->gmsk) |
+                    ((v << st->bpos) & st->bmsk));
+    }
 
   dimg = XCreateImage (st->dpy, st->xgwa.visual, st->xgwa.depth,
                        ZPixmap, 0, NULL, w, h, 8, 0);
@@ -799,14 +1005,7 @@ get_deltap (struct state *st)
   if (! dimg->data) abort();
 
   for (y = 0; y < h; y++)
-    for (x = 0; x < w; x++)
-      {
-        unsigned long v = XGetPixel (st->delta, x, y) << 5;
-        unsigned long p = (((v << rpos) & rmsk) |
-                           ((v << gpos) & gmsk) |
-                           ((v << bpos) & bmsk));
-        XPutPixel (dimg, x, y, p);
-      }
+    index_put_row (dimg, 0, y, st->delta + y * w, w, palette);
 
   st->deltap = XCreatePixmap (st->dpy, st->window, w, h, st->xgwa.depth);
   XPutImage (st->dpy, st->deltap, st->pgc, dimg, 0, 0, 0, 0, w, h);
@@ -853,9 +1052,9 @@ tessellimage_draw (Display *dpy, Window window, void *closure)
     XCopyArea (st->dpy, 
                (st->button_down_p ? get_deltap (st) : st->output),
                st->window, st->wgc,
-               0, 0, st->delta->width, st->delta->height, 
-               (st->xgwa.width  - st->delta->width)  / 2,
-               (st->xgwa.height - st->delta->height) / 2);
+               0, 0, st->img->width, st->img->height, 
+               (st->xgwa.width  - st->img->width)  / 2,
+               (st->xgwa.height - st->img->height) / 2);
 
  DONE:
   return st->delay;
@@ -922,7 +1121,14 @@ tessellimage_free (Display *dpy, Window window, void *closure)
   if (st->pgc) XFreeGC (dpy, st->pgc);
   if (st->image)  XFreePixmap (dpy, st->image);
   if (st->output) XFreePixmap (dpy, st->output);
-  if (st->delta)  XDestroyImage (st->delta);
+  if (st->img)    XDestroyImage (st->img);
+  free (st->delta);
+  free (st->cube_root);
+  if (st->tri)    delaunay_free (st->tri);
+  free (st->control);
+  free (st->vertex);
+  if (st->threadpool.count)
+    threadpool_destroy (&st->threadpool);
   free (st);
 }
 
@@ -944,6 +1150,7 @@ static const char *tessellimage_defaults [] = {
 #ifdef USE_IPHONE
   "*ignoreRotation:             True",
 #endif
+  THREAD_DEFAULTS
   0
 };
 
@@ -958,6 +1165,7 @@ static XrmOptionDescRec tessellimage_options [] = {
   { "-no-fill-screen",	".fillScreen",		XrmoptionNoArg, "False" },
   { "-cache",		".cache",		XrmoptionNoArg, "True"  },
   { "-no-cache",	".cache",		XrmoptionNoArg, "False" },
+  THREAD_OPTIONS
   { 0, 0, 0, 0 }
 };
 
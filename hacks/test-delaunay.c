@@ -0,0 +1,248 @@
+/* test-delaunay.c --- checks and times delaunay.c the way tessellimage uses it.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee.  No
+ * representations are made about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * Usage: test-delaunay [points [width height [levels]]]
+ *
+ * Scatters distinct random pixels over the rectangle, and splits them into
+ * levels the way tessellimage's thresholds do: each level's points are the
+ * previous level's plus some more.  The levels are then visited up and back
+ * down twice over:
+ *
+ *   - rebuilding a triangulation from scratch at every level;
+ *   - stepping one triangulation from level to level, by inserting or
+ *     removing only the points that differ.
+ *
+ * After each step, the stepped triangulation must have as many triangles
+ * as the rebuilt one, and every edge in it must be locally Delaunay.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "delaunay.h"
+
+typedef struct {
+  int a, b;			/* Vertices, a < b. */
+  int opp;			/* The vertex across from the edge. */
+  int t;			/* The triangle it came from. */
+} EDGE;
+
+static unsigned long seed = 1;
+
+static unsigned long
+rnd (void)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 8) & 0xFFFFFF;
+}
+
+static double
+now (void)
+{
+  struct timeval tv;
+  gettimeofday (&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int
+cmp_edges (const void *a, const void *b)
+{
+  const EDGE *e = (const EDGE *) a, *f = (const EDGE *) b;
+  if (e->a != f->a) return e->a - f->a;
+  return e->b - f->b;
+}
+
+/* Positive if d is strictly inside the circle through a, b, c.  Exact in
+   doubles only while the points are less than 4096 apart.
+ */
+static double
+incircle (const XYZ *a, const XYZ *b, const XYZ *c, const XYZ *d)
+{
+  double adx = a->x - d->x, ady = a->y - d->y;
+  double bdx = b->x - d->x, bdy = b->y - d->y;
+  double cdx = c->x - d->x, cdy = c->y - d->y;
+  return ((adx * adx + ady * ady) * (bdx * cdy - cdx * bdy) +
+          (bdx * bdx + bdy * bdy) * (cdx * ady - adx * cdy) +
+          (cdx * cdx + cdy * cdy) * (adx * bdy - bdx * ady));
+}
+
+/* Returns the number of edges that are not locally Delaunay.
+ */
+static int
+check_delaunay (const delaunay *d, ITRIANGLE *v, EDGE *edges)
+{
+  int n = delaunay_triangles (d, v);
+  int i, ne = 0, bad = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      int k, p[3];
+      p[0] = v[i].p1; p[1] = v[i].p2; p[2] = v[i].p3;
+      for (k = 0; k < 3; k++)
+        {
+          int a = p[(k+1) % 3], b = p[(k+2) % 3];
+          edges[ne].a = (a < b ? a : b);
+          edges[ne].b = (a < b ? b : a);
+          edges[ne].opp = p[k];
+          edges[ne].t = i;
+          ne++;
+        }
+    }
+  qsort (edges, ne, sizeof(*edges), cmp_edges);
+
+  for (i = 0; i + 1 < ne; i++)
+    if (edges[i].a == edges[i+1].a && edges[i].b == edges[i+1].b)
+      {
+        const ITRIANGLE *t = &v[edges[i].t];
+        if (incircle (delaunay_point (d, t->p1), delaunay_point (d, t->p2),
+                      delaunay_point (d, t->p3),
+                      delaunay_point (d, edges[i+1].opp)) > 0)
+          bad++;
+        i++;
+      }
+  return bad;
+}
+
+int
+main (int argc, char **argv)
+{
+  int npoints = (argc > 1 ? atoi (argv[1]) : 30000);
+  int width   = (argc > 3 ? atoi (argv[2]) : 1920);
+  int height  = (argc > 3 ? atoi (argv[3]) : 1080);
+  int nlevels = (argc > 4 ? atoi (argv[4]) : 40);
+  int check = (width < 4096 && height < 4096);
+  unsigned char *used;
+  XYZ *pts;
+  int *vertex, *sizes, *visits;
+  ITRIANGLE *v;
+  EDGE *edges;
+  delaunay *d;
+  int i, n, nvisits, ninserted, errors = 0;
+  double t0, rebuild, step;
+
+  if (npoints <= 0 || width <= 1 || height <= 1 || nlevels <= 0 ||
+      npoints > (width - 2) * (height - 2) ||
+      width > DELAUNAY_MAX_SIZE || height > DELAUNAY_MAX_SIZE)
+    {
+      fprintf (stderr, "usage: %s [points [width height [levels]]]\n",
+               argv[0]);
+      exit (1);
+    }
+
+  used   = (unsigned char *) calloc ((size_t) width * height, 1);
+  pts    = (XYZ *) calloc (npoints, sizeof(*pts));
+  vertex = (int *) calloc (npoints, sizeof(*vertex));
+  sizes  = (int *) calloc (nlevels, sizeof(*sizes));
+  visits = (int *) calloc (4 * nlevels, sizeof(*visits));
+  v      = (ITRIANGLE *) calloc (2 * npoints + 8, sizeof(*v));
+  edges  = (EDGE *) calloc (3 * (2 * npoints + 8), sizeof(*edges));
+  if (!used || !pts || !vertex || !sizes || !visits || !v || !edges)
+    {
+      fprintf (stderr, "%s: out of memory\n", argv[0]);
+      exit (1);
+    }
+
+  /* Inside the rectangle, off its corners and edges, which are the
+     triangulation's own. */
+  for (i = 0; i < npoints; i++)
+    {
+      int x, y;
+      do {
+        x = 1 + rnd() % (width - 2);
+        y = 1 + rnd() % (height - 2);
+      } while (used[y * width + x]);
+      used[y * width + x] = 1;
+      pts[i].x = x;
+      pts[i].y = y;
+      pts[i].z = 0;
+    }
+
+  /* Like tessellimage's thresholds, the levels get closer together as
+     they gain points. */
+  for (i = 0; i < nlevels; i++)
+    sizes[i] = (int) ((double) npoints * (i + 1) * (i + 1) /
+                      ((double) nlevels * nlevels));
+
+  nvisits = 0;
+  for (n = 0; n < 2; n++)
+    {
+      for (i = 0; i < nlevels; i++)
+        visits[nvisits++] = sizes[i];
+      for (i = nlevels - 1; i >= 0; i--)
+        visits[nvisits++] = sizes[i];
+    }
+
+  t0 = now();
+  for (n = 0; n < nvisits; n++)
+    {
+      d = delaunay_new (0, 0, width - 1, height - 1);
+      for (i = 0; i < visits[n]; i++)
+        delaunay_insert (d, &pts[i]);
+      delaunay_free (d);
+    }
+  rebuild = now() - t0;
+
+  d = delaunay_new (0, 0, width - 1, height - 1);
+  ninserted = 0;
+  step = 0;
+  for (n = 0; n < nvisits; n++)
+    {
+      int want = 2 * (visits[n] + 1);	/* 2(n+4) - 2 - 4 corners. */
+      int got;
+
+      t0 = now();
+      while (ninserted < visits[n])
+        {
+          vertex[ninserted] = delaunay_insert (d, &pts[ninserted]);
+          ninserted++;
+        }
+      while (ninserted > visits[n])
+        delaunay_remove (d, vertex[--ninserted]);
+      step += now() - t0;
+
+      got = delaunay_count (d);
+      if (got != want)
+        {
+          fprintf (stderr, "%s: %d points: %d triangles, not %d\n",
+                   argv[0], visits[n], got, want);
+          errors++;
+        }
+      if (check)
+        {
+          int bad = check_delaunay (d, v, edges);
+          if (bad)
+            {
+              fprintf (stderr, "%s: %d points: %d non-Delaunay edges\n",
+                       argv[0], visits[n], bad);
+              errors++;
+            }
+        }
+    }
+  delaunay_free (d);
+
+  printf ("%d points on %dx%d, %d levels visited %d times:\n",
+          npoints, width, height, nlevels, nvisits);
+  printf ("  rebuilding every level: %.3f s\n", rebuild);
+  printf ("  stepping between them:  %.3f s\n", step);
+  if (!check)
+    printf ("  (too big to check the Delaunay property)\n");
+
+  free (used);
+  free (pts);
+  free (vertex);
+  free (sizes);
+  free (visits);
+  free (v);
+  free (edges);
+  return (errors ? 1 : 0);
+}
@@ -49,8 +49,13 @@
 
 #include "screenhack.h"
 #include "xpm-pixmap.h"
+#include "thread_util.h"
 #include <limits.h>
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 #undef countof
 #define countof(x) (sizeof((x))/sizeof((*x)))
 
@@ -62,6 +67,9 @@
 
 #define MAX_VAL             255
 
+/* Flame rows are expanded in chunks of this many cells. */
+#define ROW_CHUNK           256
+
 struct state {
   Display *dpy;
   Window window;
@@ -71,6 +79,7 @@ struct state {
   Colormap        colormap;
   Visual          *visual;
   Screen          *screen;
+  Bool            use_shm;
   Bool            shared;
   Bool            bloom;
   XImage          *xim;
@@ -95,9 +104,19 @@ struct state {
   int variance;
   int vartrend;
 
+  int draw_top;		/* first flame row that needs redrawing */
+
   int delay;
   int baseline;
   int theimx, theimy;
+
+  /* Each thread expands a band of flame rows into the image. */
+  struct threadpool threadpool;
+};
+
+struct flame_thread {
+  struct state *st;
+  unsigned id;
 };
 
 static void
@@ -125,21 +144,30 @@ MakeImage(struct state *st)
 {
   XGCValues gcv;
 
-  /* #### This probably leaks SHM every time the window is resized. */
   if (st->xim)
-    XDestroyImage (st->xim);
-
+    {
 #ifdef HAVE_XSHM_EXTENSION
-  st->shared = True;
-  st->xim = create_xshm_image (st->dpy, st->visual, st->depth, ZPixmap, NULL,
-                           &st->shminfo, st->width, st->height);
-#else  /* !HAVE_XSHM_EXTENSION */
+      if (st->shared)
+        destroy_xshm_image (st->dpy, st->xim, &st->shminfo);
+      else
+#endif /* HAVE_XSHM_EXTENSION */
+        XDestroyImage (st->xim);
+    }
+
   st->xim = 0;
-#endif /* !HAVE_XSHM_EXTENSION */
+  st->shared = False;
+#ifdef HAVE_XSHM_EXTENSION
+  if (st->use_shm)
+    {
+      st->xim = create_xshm_image (st->dpy, st->visual, st->depth, ZPixmap,
+                                   NULL, &st->shminfo, st->width, st->height);
+      if (st->xim)
+        st->shared = True;
+    }
+#endif /* HAVE_XSHM_EXTENSION */
 
   if (!st->xim)
     {
-      st->shared = False;
       st->xim = XCreateImage (st->dpy, st->visual, st->depth, ZPixmap, 0, NULL,
                           st->width, st->height, 32, 0);
       if (st->xim)
@@ -203,14 +231,15 @@ InitColors(struct state *st)
 static void
 DisplayImage(struct state *st)
 {
+  int y = (st->draw_top - 1) << 1;
 #ifdef HAVE_XSHM_EXTENSION
   if (st->shared)
-    XShmPutImage(st->dpy, st->window, st->gc, st->xim, 0,(st->top - 1) << 1, 0,
-                 (st->top - 1) << 1, st->width, st->height - ((st->top - 1) << 1), False);
+    XShmPutImage(st->dpy, st->window, st->gc, st->xim, 0, y, 0, y,
+                 st->width, st->height - y, False);
   else
 #endif /* HAVE_XSHM_EXTENSION */
-    XPutImage(st->dpy, st->window, st->gc, st->xim, 0, (st->top - 1) << 1, 0,
-              (st->top - 1) << 1, st->width, st->height - ((st->top - 1) << 1));
+    XPutImage(st->dpy, st->window, st->gc, st->xim, 0, y, 0, y,
+              st->width, st->height - y);
 }
 
 
@@ -231,6 +260,7 @@ InitFlame(struct state *st)
     }
 
   st->top      = 1;
+  st->draw_top = 1;
   st->ihspread  = get_integer_resource(st->dpy, "hspread", "Integer");
   st->ivspread  = get_integer_resource(st->dpy, "vspread", "Integer");
   st->iresidual = get_integer_resource(st->dpy, "residual", "Integer");
@@ -258,195 +288,155 @@ InitFlame(struct state *st)
 }
 
 
+/* out[x] = (a[x] + b[x]) >> 1, for n bytes.
+ */
 static void
-Flame2Image16(struct state *st)
+HalveRow(const unsigned char *a, const unsigned char *b,
+         unsigned char *out, int n)
 {
-  int x,y;
-  unsigned short *ptr;
-  unsigned char *ptr1;
-  int v1,v2,v3,v4;
-
-  ptr  = (unsigned short *)st->xim->data;
-  ptr += (st->top << 1) * st->width;
-  ptr1 = st->flame + 1 + (st->top * (st->fwidth + 2));
-
-  for(y = st->top; y < st->fheight; y++)
+  int x = 0;
+#ifdef __SSE2__
+  const __m128i one = _mm_set1_epi8(1);
+  for (; x + 16 <= n; x += 16)
     {
-      for( x = 0; x < st->fwidth; x++)
-        {
-          v1 = (int)*ptr1;
-          v2 = (int)*(ptr1 + 1);
-          v3 = (int)*(ptr1 + st->fwidth + 2);
-          v4 = (int)*(ptr1 + st->fwidth + 2 + 1);
-          ptr1++;
-          *ptr++ = (unsigned short)st->ctab[v1];
-          *ptr   = (unsigned short)st->ctab[(v1 + v2) >> 1];
-          ptr   += st->width - 1;
-          *ptr++ = (unsigned short)st->ctab[(v1 + v3) >> 1];
-          *ptr   = (unsigned short)st->ctab[(v1 + v4) >> 1];
-          ptr   -= st->width - 1;
-        }
-      ptr  += st->width;
-      ptr1 += 2;
+      __m128i va = _mm_loadu_si128((const __m128i *)(a + x));
+      __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+      /* pavgb rounds up; take the odd bit back off. */
+      __m128i avg = _mm_sub_epi8(_mm_avg_epu8(va, vb),
+                                 _mm_and_si128(_mm_xor_si128(va, vb), one));
+      _mm_storeu_si128((__m128i *)(out + x), avg);
     }
+#endif /* __SSE2__ */
+  for (; x < n; x++)
+    out[x] = (a[x] + b[x]) >> 1;
 }
 
-static void
-Flame2Image32(struct state *st)
-{
-  int x,y;
-  unsigned int *ptr;
-  unsigned char *ptr1;
-  int v1,v2,v3,v4;
-
-  ptr  = (unsigned int *)st->xim->data;
-  ptr += (st->top << 1) * st->width;
-  ptr1 = st->flame + 1 + (st->top * (st->fwidth + 2));
-
-  for( y = st->top; y < st->fheight; y++)
-    {
-      for( x = 0; x < st->fwidth; x++)
-        {
-          v1 = (int)*ptr1;
-          v2 = (int)*(ptr1 + 1);
-          v3 = (int)*(ptr1 + st->fwidth + 2);
-          v4 = (int)*(ptr1 + st->fwidth + 2 + 1);
-          ptr1++;
-          *ptr++ = (unsigned int)st->ctab[v1];
-          *ptr   = (unsigned int)st->ctab[(v1 + v2) >> 1];
-          ptr   += st->width - 1;
-          *ptr++ = (unsigned int)st->ctab[(v1 + v3) >> 1];
-          *ptr   = (unsigned int)st->ctab[(v1 + v4) >> 1];
-          ptr   -= st->width - 1;
-        }
-      ptr  += st->width;
-      ptr1 += 2;
-    }
-}
 
+/* Each flame cell becomes a 2x2 block of pixels: the cell itself, and its
+   averages with the cells to the right, below, and diagonally down-right.
+ */
 static void
-Flame2Image24(struct state *st)
+Flame2ImageRow(struct state *st, int y)
 {
-  int x,y;
-  unsigned char *ptr;
-  unsigned char *ptr1;
-  int v1,v2,v3,v4;
-
-  ptr  = (unsigned char *)st->xim->data;
-  ptr += (st->top << 1) * st->xim->bytes_per_line;
-  ptr1 = st->flame + 1 + (st->top * (st->fwidth + 2));
-
-  for( y = st->top; y < st->fheight; y++)
+  XImage *xim = st->xim;
+  int stride = st->fwidth + 2;
+  const unsigned char *c = st->flame + 1 + (y * stride);
+  unsigned char *row0 = (unsigned char *)xim->data +
+    (y << 1) * xim->bytes_per_line;
+  unsigned char *row1 = row0 + xim->bytes_per_line;
+  unsigned char h[ROW_CHUNK], v[ROW_CHUNK], d[ROW_CHUNK];
+  int x0;
+
+  for (x0 = 0; x0 < st->fwidth; x0 += ROW_CHUNK, c += ROW_CHUNK)
     {
-      unsigned char *last_ptr = ptr;
-      for( x = 0; x < st->fwidth; x++)
-        {
-          v1 = (int)*ptr1;
-          v2 = (int)*(ptr1 + 1);
-          v3 = (int)*(ptr1 + st->fwidth + 2);
-          v4 = (int)*(ptr1 + st->fwidth + 2 + 1);
-          ptr1++;
+      int x, n = st->fwidth - x0;
+      if (n > ROW_CHUNK) n = ROW_CHUNK;
 
-          ptr[2] = ((unsigned int)st->ctab[v1] & 0x00FF0000) >> 16;
-          ptr[1] = ((unsigned int)st->ctab[v1] & 0x0000FF00) >> 8;
-          ptr[0] = ((unsigned int)st->ctab[v1] & 0x000000FF);
-          ptr += 3;
-
-          ptr[2] = ((unsigned int)st->ctab[(v1 + v2) >> 1] & 0x00FF0000) >> 16;
-          ptr[1] = ((unsigned int)st->ctab[(v1 + v2) >> 1] & 0x0000FF00) >> 8;
-          ptr[0] = ((unsigned int)st->ctab[(v1 + v2) >> 1] & 0x000000FF);
-          ptr += ((st->width - 1) * 3);
-
-          ptr[2] = ((unsigned int)st->ctab[(v1 + v3) >> 1] & 0x00FF0000) >> 16;
-          ptr[1] = ((unsigned int)st->ctab[(v1 + v3) >> 1] & 0x0000FF00) >> 8;
-          ptr[0] = ((unsigned int)st->ctab[(v1 + v3) >> 1] & 0x000000FF);
-          ptr += 3;
-
-          ptr[2] = ((unsigned int)st->ctab[(v1 + v4) >> 1] & 0x00FF0000) >> 16;
-          ptr[1] = ((unsigned int)st->ctab[(v1 + v4) >> 1] & 0x0000FF00) >> 8;
-          ptr[0] = ((unsigned int)st->ctab[(v1 + v4) >> 1] & 0x000000FF);
-          ptr -= ((st->width - 1) * 3);
-        }
+      HalveRow(c, c + 1, h, n);
+      HalveRow(c, c + stride, v, n);
+      HalveRow(c, c + stride + 1, d, n);
 
-      ptr = last_ptr + (st->xim->bytes_per_line << 1);
-      ptr1 += 2;
-    }
-}
-
-static void
-Flame2Image8(struct state *st)
-{
-  int x,y;
-  unsigned char *ptr;
-  unsigned char *ptr1;
-  int v1,v2,v3,v4;
-
-  ptr  = (unsigned char *)st->xim->data;
-  ptr += (st->top << 1) * st->width;
-  ptr1 = st->flame + 1 + (st->top * (st->fwidth + 2));
-
-  for(y=st->top;y<st->fheight;y++)
-    {
-      for(x=0;x<st->fwidth;x++)
+      switch (xim->bits_per_pixel)
         {
-          v1 = (int)*ptr1;
-          v2 = (int)*(ptr1 + 1);
-          v3 = (int)*(ptr1 + st->fwidth + 2);
-          v4 = (int)*(ptr1 + st->fwidth + 2 + 1);
-          ptr1++;
-          *ptr++ = (unsigned char)st->ctab[v1];
-          *ptr   = (unsigned char)st->ctab[(v1 + v2) >> 1];
-          ptr   += st->width - 1;
-          *ptr++ = (unsigned char)st->ctab[(v1 + v3) >> 1];
-          *ptr   = (unsigned char)st->ctab[(v1 + v4) >> 1];
-          ptr   -= st->width - 1;
+        case 32:
+          {
+            unsigned int *p0 = (unsigned int *)row0 + (x0 << 1);
+            unsigned int *p1 = (unsigned int *)row1 + (x0 << 1);
+            for (x = 0; x < n; x++)
+              {
+                p0[x << 1]       = (unsigned int)st->ctab[c[x]];
+                p0[(x << 1) + 1] = (unsigned int)st->ctab[h[x]];
+                p1[x << 1]       = (unsigned int)st->ctab[v[x]];
+                p1[(x << 1) + 1] = (unsigned int)st->ctab[d[x]];
+              }
+          }
+          break;
+        case 24:
+          {
+            unsigned char *p0 = row0 + x0 * 6;
+            unsigned char *p1 = row1 + x0 * 6;
+            for (x = 0; x < n; x++, p0 += 6, p1 += 6)
+              {
+                unsigned int a = st->ctab[c[x]], b = st->ctab[h[x]];
+                unsigned int e = st->ctab[v[x]], f = st->ctab[d[x]];
+                p0[0] = a; p0[1] = a >> 8; p0[2] = a >> 16;
+                p0[3] = b; p0[4] = b >> 8; p0[5] = b >> 16;
+                p1[0] = e; p1[1] = e >> 8; p1[2] = e >> 16;
+                p1[3] = f; p1[4] = f >> 8; p1[5] = f >> 16;
+              }
+          }
+          break;
+        case 16:
+          {
+            unsigned short *p0 = (unsigned short *)row0 + (x0 << 1);
+            unsigned short *p1 = (unsigned short *)row1 + (x0 << 1);
+            for (x = 0; x < n; x++)
+              {
+                p0[x << 1]       = (unsigned short)st->ctab[c[x]];
+                p0[(x << 1) + 1] = (unsigned short)st->ctab[h[x]];
+                p1[x << 1]       = (unsigned short)st->ctab[v[x]];
+                p1[(x << 1) + 1] = (unsigned short)st->ctab[d[x]];
+              }
+          }
+          break;
+        case 8:
+          {
+            unsigned char *p0 = row0 + (x0 << 1);
+            unsigned char *p1 = row1 + (x0 << 1);
+            for (x = 0; x < n; x++)
+              {
+                p0[x << 1]       = (unsigned char)st->ctab[c[x]];
+                p0[(x << 1) + 1] = (unsigned char)st->ctab[h[x]];
+                p1[x << 1]       = (unsigned char)st->ctab[v[x]];
+                p1[(x << 1) + 1] = (unsigned char)st->ctab[d[x]];
+              }
+          }
+          break;
+        default:
+          if (xim->bits_per_pixel > 7)
+            abort();
+          for (x = 0; x < n; x++)
+            {
+              int px = (x0 + x) << 1;
+              XPutPixel(xim, px,     (y << 1),     st->ctab[c[x]]);
+              XPutPixel(xim, px + 1, (y << 1),     st->ctab[h[x]]);
+              XPutPixel(xim, px,     (y << 1) + 1, st->ctab[v[x]]);
+              XPutPixel(xim, px + 1, (y << 1) + 1, st->ctab[d[x]]);
+            }
+          break;
         }
-      ptr  += st->width;
-      ptr1 += 2;
     }
 }
 
 static void
-Flame2Image1234567(struct state *st)
+Flame2ImagePass(void *self_raw)
 {
-  int x,y;
-  unsigned char *ptr1;
-  int v1,v2,v3,v4;
-
-  ptr1 = st->flame + 1 + (st->top * (st->fwidth + 2));
-
-  for( y = st->top; y < st->fheight; y++)
-    {
-      for( x = 0; x < st->fwidth; x++)
-        {
-          v1 = (int)*ptr1;
-          v2 = (int)*(ptr1 + 1);
-          v3 = (int)*(ptr1 + st->fwidth + 2);
-          v4 = (int)*(ptr1 + st->fwidth + 2 + 1);
-          ptr1++;
-          XPutPixel(st->xim,(x << 1),    (y << 1),    st->ctab[v1]);
-          XPutPixel(st->xim,(x << 1) + 1,(y << 1),    st->ctab[(v1 + v2) >> 1]);
-          XPutPixel(st->xim,(x << 1),    (y << 1) + 1,st->ctab[(v1 + v3) >> 1]);
-          XPutPixel(st->xim,(x << 1) + 1,(y << 1) + 1,st->ctab[(v1 + v4) >> 1]);
-        }
-    }
+  const struct flame_thread *self = (const struct flame_thread *) self_raw;
+  struct state *st = self->st;
+  unsigned count = st->threadpool.count ? st->threadpool.count : 1;
+  int rows = st->fheight - st->draw_top;
+  int y1 = st->draw_top + rows * (int) self->id / (int) count;
+  int y2 = st->draw_top + rows * (int) (self->id + 1) / (int) count;
+  int y;
+
+  for (y = y1; y < y2; y++)
+    Flame2ImageRow(st, y);
 }
 
 static void
 Flame2Image(struct state *st)
 {
-  switch (st->xim->bits_per_pixel)
+  if (st->threadpool.count)
     {
-    case 32: Flame2Image32(st); break;
-    case 24: Flame2Image24(st); break;
-    case 16: Flame2Image16(st); break;
-    case 8:  Flame2Image8(st);  break;
-    default:
-      if (st->xim->bits_per_pixel <= 7)
-        Flame2Image1234567(st);
-      else
-        abort();
-      break;
+      threadpool_run(&st->threadpool, Flame2ImagePass);
+      threadpool_wait(&st->threadpool);
+    }
+  else
+    {
+      struct flame_thread self;
+      self.st = st;
+      self.id = 0;
+      Flame2ImagePass(&self);
     }
 }
 
@@ -483,69 +473,133 @@ FlameActive(struct state *st)
 }
 
 
+/* Spreads one row of flame, src, into the row above it, dst: each cell
+   adds (v * vspread) >> 8 to the cell above, and (v * hspread) >> 8 to the
+   cells above-left and above-right, saturating at MAX_VAL.  The additions
+   never go negative, so doing them all at once and saturating the total
+   gives the same bytes as saturating after each one.  Both rows start at
+   the first cell past the left gutter; the gutters of dst get the spill
+   from the edge cells.  Returns whether any cell of src was alight.
+
+   Then src decays by residual, unless it's the bottom row.
+ */
+static Bool
+FlameRow(unsigned char *src, unsigned char *dst, int n,
+         int hspread, int vspread, int residual, Bool decay)
+{
+  Bool used = False;
+  int x = 0;
+
+# define SPREAD(V,S) (((V) * (S)) >> 8)
+# define ADD(D,A) do { int _v = (D) + (A); \
+                       (D) = (_v > MAX_VAL ? MAX_VAL : _v); } while (0)
+
+  if (n <= 0) return False;
+
+  /* The gutters aren't flame, so the edge cells take the scalar path. */
+  ADD(dst[-1], SPREAD(src[0], hspread));
+  ADD(dst[0], SPREAD(src[0], vspread) +
+              (n > 1 ? SPREAD(src[1], hspread) : 0));
+  x = 1;
+
+#ifdef __SSE2__
+  /* The multiplies are done as mulhi(v << 8, spread), which is exact for
+     any spread under 65536. */
+  {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i hs = _mm_set1_epi16(hspread);
+    const __m128i vs = _mm_set1_epi16(vspread);
+    for (; x + 17 <= n; x += 16)
+      {
+        __m128i l = _mm_loadu_si128((const __m128i *)(src + x - 1));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + x));
+        __m128i r = _mm_loadu_si128((const __m128i *)(src + x + 1));
+        __m128i o = _mm_loadu_si128((const __m128i *)(dst + x));
+        __m128i lo, hi;
+
+        lo = _mm_add_epi16(_mm_unpacklo_epi8(o, zero),
+                           _mm_mulhi_epu16(_mm_unpacklo_epi8(zero, c), vs));
+        lo = _mm_add_epi16(lo, _mm_mulhi_epu16(_mm_unpacklo_epi8(zero, l), hs));
+        lo = _mm_add_epi16(lo, _mm_mulhi_epu16(_mm_unpacklo_epi8(zero, r), hs));
+        hi = _mm_add_epi16(_mm_unpackhi_epi8(o, zero),
+                           _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, c), vs));
+        hi = _mm_add_epi16(hi, _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, l), hs));
+        hi = _mm_add_epi16(hi, _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, r), hs));
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));
+      }
+  }
+#endif /* __SSE2__ */
+
+  for (; x < n - 1; x++)
+    ADD(dst[x], SPREAD(src[x - 1], hspread) + SPREAD(src[x], vspread) +
+                SPREAD(src[x + 1], hspread));
+
+  if (n > 1)
+    ADD(dst[n - 1], SPREAD(src[n - 2], hspread) + SPREAD(src[n - 1], vspread));
+  ADD(dst[n], SPREAD(src[n - 1], hspread));
+
+  /* Decay, now that the whole row has been spread from. */
+  x = 0;
+#ifdef __SSE2__
+  {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rs = _mm_set1_epi16(residual);
+    __m128i any = zero;
+    for (; x + 16 <= n; x += 16)
+      {
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + x));
+        any = _mm_or_si128(any, c);
+        if (decay)
+          _mm_storeu_si128((__m128i *)(src + x),
+            _mm_packus_epi16(
+              _mm_mulhi_epu16(_mm_unpacklo_epi8(zero, c), rs),
+              _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, c), rs)));
+      }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xFFFF)
+      used = True;
+  }
+#endif /* __SSE2__ */
+  for (; x < n; x++)
+    if (src[x])
+      {
+        used = True;
+        if (decay)
+          src[x] = SPREAD(src[x], residual);
+      }
+
+  /* clean up the right gutter */
+  src[n] = SPREAD(src[n], residual);
+
+# undef ADD
+# undef SPREAD
+  return used;
+}
+
+
 static void
 FlameAdvance(struct state *st)
 {
-  int x,y;
-  unsigned char *ptr2;
+  int y;
   int newtop = st->top;
 
   for (y = st->fheight + 1; y >= st->top; y--)
     {
-      int used = 0;
       unsigned char *ptr1 = st->flame + 1 + (y * (st->fwidth + 2));
-      for (x = 0; x < st->fwidth; x++)
-        {
-          int v1 = (int)*ptr1;
-          int v2, v3;
-          if (v1 > 0)
-            {
-              used = 1;
-              ptr2 = ptr1 - st->fwidth - 2;
-              v3   = (v1 * st->vspread) >> 8;
-              v2   = (int)*(ptr2);
-              v2  += v3;
-              if (v2 > MAX_VAL) 
-                v2 = MAX_VAL;
-
-              *(ptr2) = (unsigned char)v2;
-              v3  = (v1 * st->hspread) >> 8;
-              v2  = (int)*(ptr2 + 1);
-              v2 += v3;
-              if (v2 > MAX_VAL) 
-                v2 = MAX_VAL;
-          
-              *(ptr2 + 1) = (unsigned char)v2;
-              v2          = (int)*(ptr2 - 1);
-              v2         += v3;
-              if (v2 > MAX_VAL) 
-                v2 = MAX_VAL;
-          
-              *(ptr2 - 1) = (unsigned char)v2;
-        
-              if (y < st->fheight + 1)
-                {
-                  v1    = (v1 * st->residual) >> 8;
-                  *ptr1 = (unsigned char)v1;
-                }
-            }
-          ptr1++;
-          if (used) 
-            newtop = y - 1;
-        }
- 
-      /* clean up the right gutter */
-      {
-        int v1 = (int)*ptr1;
-        v1 = (v1 * st->residual) >> 8;
-        *ptr1 = (unsigned char)v1;
-      }
+      if (FlameRow(ptr1, ptr1 - st->fwidth - 2, st->fwidth,
+                   st->hspread, st->vspread, st->residual,
+                   y < st->fheight + 1))
+        newtop = y - 1;
     }
 
+  /* Rows that just went out still need drawing once, as black. */
+  st->draw_top = st->top;
+
   st->top = newtop - 1;
 
   if (st->top < 1)
     st->top = 1;
+  if (st->top < st->draw_top)
+    st->draw_top = st->top;
 }
 
 
@@ -711,6 +765,20 @@ loadBitmap(struct state *st, int *w, int *h)
 
 }
 
+static int
+flame_thread_create(void *self_raw, struct threadpool *pool, unsigned id)
+{
+  struct flame_thread *self = (struct flame_thread *) self_raw;
+  self->st = GET_PARENT_OBJ(struct state, threadpool, pool);
+  self->id = id;
+  return 0;
+}
+
+static void
+flame_thread_destroy(void *self_raw)
+{
+}
+
 static void *
 xflame_init (Display *dpy, Window win)
 {
@@ -722,6 +790,9 @@ xflame_init (Display *dpy, Window win)
   st->xim      = NULL;
   st->top      = 1;
   st->flame    = NULL;
+#ifdef HAVE_XSHM_EXTENSION
+  st->use_shm = get_boolean_resource (dpy, "useSHM", "Boolean");
+#endif /* HAVE_XSHM_EXTENSION */
 
   GetXInfo(st);
   InitColors(st);
@@ -731,6 +802,18 @@ xflame_init (Display *dpy, Window win)
   InitFlame(st);
   FlameFill(st,0);
 
+  {
+    static const struct threadpool_class cls = {
+      sizeof(struct flame_thread),
+      flame_thread_create,
+      flame_thread_destroy
+    };
+
+    if (threadpool_create(&st->threadpool, &cls, dpy,
+                          hardware_concurrency(dpy)))
+      st->threadpool.count = 0; /* See the note in thread_util.h. */
+  }
+
   return st;
 }
 
@@ -772,6 +855,19 @@ xflame_event (Display *dpy, Window window, void *closure, XEvent *event)
 static void
 xflame_free (Display *dpy, Window window, void *closure)
 {
+  struct state *st = (struct state *) closure;
+  if (st->threadpool.count)
+    threadpool_destroy (&st->threadpool);
+#ifdef HAVE_XSHM_EXTENSION
+  if (st->shared)
+    destroy_xshm_image (dpy, st->xim, &st->shminfo);
+  else
+#endif /* HAVE_XSHM_EXTENSION */
+    XDestroyImage (st->xim);
+  XFreeGC (dpy, st->gc);
+  free (st->flame);
+  free (st->theim);
+  free (st);
 }
 
 
@@ -791,6 +887,7 @@ static const char *xflame_defaults [] = {
   "*variance:       50",
   "*vartrend:       20",
   "*bloom:          True",   
+  THREAD_DEFAULTS
 
 #ifdef HAVE_XSHM_EXTENSION
   "*useSHM: False",   /* xshm turns out not to help. */
@@ -815,6 +912,7 @@ static XrmOptionDescRec xflame_options [] = {
   { "-shm",       ".useSHM",         XrmoptionNoArg, "True" },
   { "-no-shm",    ".useSHM",         XrmoptionNoArg, "False" },
 #endif /* HAVE_XSHM_EXTENSION */
+  THREAD_OPTIONS
   { 0, 0, 0, 0 }
 };
 
@@ -485,6 +485,10 @@ xlockmore_draw (Display *dpy, Window window, void *closure)
   unsigned long orig_pause = mi->pause;
   unsigned long this_pause;
 
+# ifdef USE_GL
+  xlockmore_gl_fps_frame_start (mi);
+# endif
+
   mi->xlmft->hack_draw (mi);
 
   this_pause = mi->pause;
@@ -39,6 +39,16 @@
 #include "screenhack.h"
 #include "yarandom.h"
 #include "hsv.h"
+#include "index_image.h"
+#include "thread_util.h"
+
+#ifdef HAVE_XSHM_EXTENSION
+# include "xshm.h"
+#endif /* HAVE_XSHM_EXTENSION */
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 #undef countof
 #define countof(x) (sizeof((x))/sizeof((*x)))
@@ -78,9 +88,13 @@ static const char *xlyap_defaults [] = {
   "*delay:              10000",
   "*linger:             5",
   "*colors:             200",
+#ifdef HAVE_XSHM_EXTENSION
+  "*useSHM:             True",
+#endif /* HAVE_XSHM_EXTENSION */
 #ifdef USE_IPHONE
   "*ignoreRotation:     True",
 #endif
+  THREAD_DEFAULTS
   0
 };
 
@@ -110,6 +124,11 @@ static XrmOptionDescRec xlyap_options [] = {
   { "-w", ".aRange",            XrmoptionSepArg, 0 },   /* r */
   { "-delay", ".delay",         XrmoptionSepArg, 0 },   /* delay */
   { "-linger", ".linger",       XrmoptionSepArg, 0 },   /* linger */
+#ifdef HAVE_XSHM_EXTENSION
+  { "-shm",       ".useSHM",    XrmoptionNoArg, "True" },
+  { "-no-shm",    ".useSHM",    XrmoptionNoArg, "False" },
+#endif /* HAVE_XSHM_EXTENSION */
+  THREAD_OPTIONS
   { 0, 0, 0, 0 }
 };
 
@@ -119,7 +138,6 @@ static XrmOptionDescRec xlyap_options [] = {
 #define Max(x,y) ((x > y)?x:y)
 
 #ifdef SIXTEEN_COLORS
-# define MAXPOINTS  128
 # ifdef BIGMEM
 #  define MAXFRAMES 4
 # else  /* !BIGMEM */
@@ -127,7 +145,6 @@ static XrmOptionDescRec xlyap_options [] = {
 # endif /* !BIGMEM */
 # define MAXCOLOR 16
 #else  /* !SIXTEEN_COLORS */
-# define MAXPOINTS  256
 # ifdef BIGMEM
 #  define MAXFRAMES 8
 # else  /* !BIGMEM */
@@ -149,10 +166,6 @@ static XrmOptionDescRec xlyap_options [] = {
 #endif
 
 
-typedef struct {
-  int x, y;
-} xy_t;
-
 #if 0
 typedef struct {
   int start_x, start_y;
@@ -168,11 +181,6 @@ typedef struct {
 /*  rubber_band_data_t rubber_band;*/
 } image_data_t;
 
-typedef struct points_t {
-  XPoint data[MAXCOLOR][MAXPOINTS];
-  int npoints[MAXCOLOR];
-} points_t;
-
 
 typedef double (*PFD)(double,double);
 
@@ -196,10 +204,21 @@ struct state {
   int dwell, settle;
   int width, height, xposition, yposition;
 
-  points_t Points;
 /*  image_data_t rubber_data;*/
 
-  GC Data_GC[MAXCOLOR]/*, RubberGC*/;
+  GC gc/*, RubberGC*/;
+  unsigned long pixels[MAXCOLOR];
+  int depth;
+  XImage *image;
+  unsigned char *indexes;	/* The color index of each pixel. */
+  Bool use_shm, shared;
+#ifdef HAVE_XSHM_EXTENSION
+  XShmSegmentInfo shminfo;
+#endif /* HAVE_XSHM_EXTENSION */
+
+  struct threadpool threadpool;
+  int block, row;		/* The progressive render's block size and band. */
+  int vector_map;
   PFD map, deriv;
 
   int aflag, bflag, wflag, hflag, Rflag;
@@ -208,9 +227,8 @@ struct state {
   int   funcmaxindex;
   double  min_a, min_b, a_range, b_range, minlyap;
   double  max_a, max_b;
-  double  start_x, lyapunov, a_inc, b_inc, a, b;
+  double  start_x, a_inc, b_inc;
   int   numcolors, numfreecols, lowrange;
-  xy_t  point;
 #ifdef BACKING_PIXMAP
   Pixmap  pixmap;
 #endif
@@ -222,12 +240,10 @@ struct state {
   int     expind[MAXFRAMES], resized[MAXFRAMES];
   int     numwheels, force, Force, negative;
   int     rgb_max, nostart, stripe_interval;
-  int     save, show, useprod, spinlength;
+  int     show, useprod, spinlength;
   int     maxframe, frame, dorecalc, mapindex, run;
   char    *outname;
 
-  int sendpoint_index;
-
   int   forcing[MAXINDEX];
   int   Forcing[FUNCMAXINDEX];
 
@@ -279,8 +295,6 @@ static void show_defaults(struct state *);
 static void TrackRubberBand(struct state *, image_data_t *, XEvent *);
 static void EndRubberBand(struct state *, image_data_t *, XEvent *);*/
 /*static void CreateXorGC(struct state *);*/
-static void InitBuffer(struct state *);
-static void BufferPoint(struct state *, int color, int x, int y);
 static void FlushBuffer(struct state *);
 static void init_data(struct state *);
 static void init_color(struct state *);
@@ -289,9 +303,8 @@ static void Clear(struct state *);
 static void setupmem(struct state *);
 static int complyap(struct state *);
 static Bool Getkey(struct state *, XKeyEvent *);
-static int sendpoint(struct state *, double expo);
+static int lyap_color(const struct state *, double expo);
 /*static void save_to_file(struct state *);*/
-static void setforcing(struct state *);
 static void check_params(struct state *, int mapnum, int parnum);
 static void usage(struct state *);
 static void Destroy_frame(struct state *);
@@ -317,128 +330,456 @@ static void print_values(struct state *);
  * calculate the logarithm of the absolute value of the derivative at that
  * point. Then average them over some large number of iterations. Some small
  * speed up is achieved by utilizing the fact that log(a*b) = log(a) + log(b).
+ *
+ * The picture is computed progressively: first one point out of every
+ * LYAP_BLOCK x LYAP_BLOCK block, which is painted over the whole block, then
+ * the points in between, halving the block size each time.  Every point is
+ * computed only once.  Each call to complyap() does one band of rows, and the
+ * threads split that band into interleaved tiles of columns.
+ *
+ * Most of the picture is periodic orbits, which settle down long before
+ * "settle" and "dwell" run out.  So at the end of each period of the forcing
+ * function, x is compared to where it was a few periods ago; once it comes
+ * back, the whole laps that are left would just repeat that one, so they are
+ * skipped and counted as copies of it.
  */
-static int
-complyap(struct state *st)
+
+#define LYAP_BLOCK 8		/* Coarsest block size; a power of 2. */
+#define LYAP_BAND(s) (4 * (s) * (s))	/* Rows per call, for block size s. */
+#define LYAP_TILE 32		/* Columns per tile; a multiple of LYAP_BLOCK. */
+#define LYAP_LAP 32		/* Minimum iterations between periodic checks. */
+
+struct lyap_orbit {
+  double x, prod, total;
+  double x_mark, t_mark;	/* x and total at the last periodic check. */
+  int settled, dwelt, mark, bindex;
+  Bool marked, dwelling;
+};
+
+struct lyap_thread {
+  struct state *st;
+  unsigned id;
+  int forcing[MAXINDEX];	/* For -R, which changes it as it goes. */
+  unsigned long seed;
+};
+
+
+static double
+force_random (unsigned long *seed)
 {
-  int i, bindex;
-  double total, prod, x, dx, r;
+  *seed = (*seed * 1103515245 + 12345) & 0x7fffffff;
+  return *seed / 2147483648.0;
+}
 
-  if (st->maxcolor > MAXCOLOR)
-    abort();
+static void
+setforcing(const struct state *st, int *forcing, unsigned long *seed)
+{
+  int i;
+  for (i=0;i<MAXINDEX;i++)
+    forcing[i] = (force_random(seed) > st->prob) ? 0 : 1;
+}
 
-  if (!st->run)
-    return TRUE;
-  st->a += st->a_inc;
-  if (st->a >= st->max_a) {
-    if (sendpoint(st, st->lyapunov) == TRUE)
-      return FALSE;
-    else {
-      FlushBuffer(st);
-      /*      if (savefile)
-              save_to_file(); */
-      return TRUE;
+
+static void
+lyap_start (const struct state *st, struct lyap_orbit *o)
+{
+  o->x = st->start_x;
+  o->prod = 1.0;
+  o->total = 0.0;
+  o->settled = o->dwelt = 0;
+  o->bindex = 0;
+  o->marked = o->dwelling = False;
+}
+
+/* Whether it's time for a periodic check, n iterations into settling or
+   dwelling.  This is only asked at the end of a period of the forcing. */
+#define LYAP_DUE(o, n) (!(o)->marked || (n) - (o)->mark >= LYAP_LAP)
+
+/* If x has come back to where it was at the last mark, the orbit is
+   periodic, and the whole laps left before *n reaches limit would only
+   repeat it: skip them, adding their share to the total, and return True.
+   Otherwise move the mark here.  t is the total of the logs so far. */
+static Bool
+lyap_periodic (struct lyap_orbit *o, int *n, int limit, double t)
+{
+  if (o->marked && ABS(o->x - o->x_mark) <= 1.0e-10 * (1.0 + ABS(o->x))) {
+    int lap = *n - o->mark;
+    int laps = (limit - *n) / lap;
+    *n += laps * lap;
+    o->total += laps * (t - o->t_mark);
+    o->marked = False;
+    return True;
+  }
+  o->marked = True;
+  o->mark = *n;
+  o->x_mark = o->x;
+  o->t_mark = t;
+  return False;
+}
+
+
+/* Runs the orbit from wherever it is to the end, and returns the exponent. */
+static double
+lyap_finish (const struct state *st, struct lyap_thread *self,
+             double a, double b, struct lyap_orbit *o)
+{
+  const int *forcing = st->Rflag ? self->forcing : st->forcing;
+  double r = forcing[o->bindex] ? b : a;
+  double dx;
+
+  while (o->settled < st->settle) { /* Here's where we let the thing */
+    o->x = st->map (o->x, r);       /* "settle down". There is usually */
+    o->settled++;                   /* some initial "noise" in the */
+    if (++o->bindex >= st->maxindex) { /* iterations. */
+      o->bindex = 0;
+      if (st->Rflag)
+        setforcing(st, self->forcing, &self->seed);
+      else if (LYAP_DUE(o, o->settled))
+        lyap_periodic (o, &o->settled, st->settle, 0.0);
     }
+    r = forcing[o->bindex] ? b : a;
   }
-  if (st->b >= st->max_b) {
-    FlushBuffer(st);
-    /*    if (savefile)
-          save_to_file();*/
-    return TRUE;
+
+  if (!o->dwelling) {
+    o->dwelling = True;
+    o->marked = False;
   }
-  prod = 1.0;
-  total = 0.0;
-  bindex = 0;
-  x = st->start_x;
-  r = (st->forcing[bindex]) ? st->b : st->a;
-#ifdef MAPS
-  findex = 0;
-  map = Maps[st->Forcing[findex]];
-#endif
-  for (i=0;i<st->settle;i++) {     /* Here's where we let the thing */
-    x = st->map (x, r);  /* "settle down". There is usually */
-    if (++bindex >= st->maxindex) { /* some initial "noise" in the */
-      bindex = 0;    /* iterations. How can we optimize */
-      if (st->Rflag)      /* the value of settle ??? */
-        setforcing(st);
+
+  while (o->dwelt < st->dwell) {
+    o->x = st->map (o->x, r);
+    dx = st->deriv (o->x, r); /* ABS is a macro, so don't be fancy */
+    dx = ABS(dx);
+    if (st->useprod) {      /* using log(a*b) */
+      if (dx == 0.0) {      /* log(0) is nasty so break out. */
+        o->dwelt++;
+        break;
+      }
+      o->prod *= dx;
+      /* we need to prevent overflow and underflow */
+      if ((o->prod > 1.0e12) || (o->prod < 1.0e-12)) {
+        o->total += log(o->prod);
+        o->prod = 1.0;
+      }
+    } else {                /* use log(a) + log(b) */
+      if (o->x == 0.0) {    /* log(0) check */
+        o->dwelt++;
+        break;
+      }
+      o->total += log(dx);
     }
-    r = (st->forcing[bindex]) ? st->b : st->a;
-#ifdef MAPS
-    if (++findex >= funcmaxindex)
-      findex = 0;
-    map = Maps[st->Forcing[findex]];
-#endif
+    o->dwelt++;
+    if (++o->bindex >= st->maxindex) {
+      o->bindex = 0;
+      if (st->Rflag)
+        setforcing(st, self->forcing, &self->seed);
+      else if (LYAP_DUE(o, o->dwelt))
+        lyap_periodic (o, &o->dwelt, st->dwell, o->total + log(o->prod));
+    }
+    r = forcing[o->bindex] ? b : a;
   }
-#ifdef MAPS
-  deriv = Derivs[st->Forcing[findex]];
-#endif
-  if (st->useprod) {      /* using log(a*b) */
-    for (i=0;i<st->dwell;i++) {
-      x = st->map (x, r);
-      dx = st->deriv (x, r); /* ABS is a macro, so don't be fancy */
-      dx = ABS(dx);
-      if (dx == 0.0) /* log(0) is nasty so break out. */
-        {
-          i++;
-          break;
+
+  return ((o->total + log(o->prod)) * M_LOG2E) / (double)o->dwelt;
+}
+
+
+#ifdef __SSE2__
+
+/* The polynomial maps and their derivatives, two points at a time, with the
+   operations in the same order as the scalar versions below so that the
+   results are identical. */
+static __m128d
+map_pd (int m, __m128d x, __m128d r)
+{
+  __m128d d = _mm_sub_pd (_mm_set1_pd (1.0), x);
+  __m128d rx = _mm_mul_pd (r, x);
+  switch (m) {
+  case 0:  return _mm_mul_pd (rx, d);
+  case 2:  return _mm_mul_pd (_mm_mul_pd (rx, d), d);
+  case 3:  return _mm_mul_pd (_mm_mul_pd (rx, x), d);
+  default: return _mm_mul_pd (_mm_mul_pd (_mm_mul_pd (rx, x), d), d);
+  }
+}
+
+static __m128d
+deriv_pd (int m, __m128d x, __m128d r)
+{
+  __m128d x2 = _mm_mul_pd (_mm_set1_pd (2.0), x);
+  __m128d x3x = _mm_mul_pd (_mm_mul_pd (_mm_set1_pd (3.0), x), x);
+  __m128d d;
+  switch (m) {
+  case 0:
+    return _mm_sub_pd (r, _mm_mul_pd (_mm_mul_pd (_mm_set1_pd (2.0), r), x));
+  case 2:
+    d = _mm_sub_pd (_mm_set1_pd (1.0), _mm_mul_pd (_mm_set1_pd (4.0), x));
+    return _mm_mul_pd (r, _mm_add_pd (d, x3x));
+  case 3:
+    return _mm_mul_pd (r, _mm_sub_pd (x2, x3x));
+  default:
+    d = _mm_mul_pd (x, x);
+    return _mm_mul_pd (r, _mm_add_pd (
+             _mm_sub_pd (x2, _mm_mul_pd (_mm_set1_pd (6.0), d)),
+             _mm_mul_pd (_mm_mul_pd (_mm_set1_pd (4.0), x), d)));
+  }
+}
+
+/* Computes the points (a0, b) and (a1, b) together, for polynomial map m,
+   using the product of the derivatives.  As soon as either one needs
+   something the other doesn't, they go their own ways in lyap_finish(). */
+static void
+lyap_pair (const struct state *st, struct lyap_thread *self, int m,
+           double a0, double a1, double b, double *out)
+{
+  const __m128d sign = _mm_set1_pd (-0.0);
+  const __m128d hi = _mm_set1_pd (1.0e12), lo = _mm_set1_pd (1.0e-12);
+  __m128d av = _mm_set_pd (a1, a0), bv = _mm_set1_pd (b);
+  __m128d x = _mm_set1_pd (st->start_x), prod = _mm_set1_pd (1.0);
+  __m128d r = st->forcing[0] ? bv : av;
+  __m128d xn, dx;
+  struct lyap_orbit o[2];
+  double xs[2], ps[2];
+  Bool skipped[2], dwelling = False;
+  int k, n, bindex = 0, split = 0;
+
+  lyap_start (st, &o[0]);
+  o[1] = o[0];
+  skipped[0] = skipped[1] = False;
+
+  for (n = 0; n < st->settle; ) {
+    x = map_pd (m, x, r);
+    n++;
+    if (++bindex >= st->maxindex) {
+      bindex = 0;
+      if (LYAP_DUE(&o[0], n)) {
+        _mm_storeu_pd (xs, x);
+        for (k = 0; k < 2; k++) {
+          o[k].x = xs[k];
+          o[k].settled = n;
+          if (lyap_periodic (&o[k], &o[k].settled, st->settle, 0.0))
+            split = skipped[k] = True;
         }
-      prod *= dx;
-      /* we need to prevent overflow and underflow */
-      if ((prod > 1.0e12) || (prod < 1.0e-12)) {
-        total += log(prod);
-        prod = 1.0;
+        if (split) break;
+      }
+    }
+    r = st->forcing[bindex] ? bv : av;
+  }
+
+  if (!split) {
+    dwelling = True;
+    for (k = 0; k < 2; k++) {
+      o[k].settled = st->settle;
+      o[k].dwelling = True;
+      o[k].marked = False;
+    }
+    for (n = 0; n < st->dwell; ) {
+      xn = map_pd (m, x, r);
+      dx = _mm_andnot_pd (sign, deriv_pd (m, xn, r));
+      if (_mm_movemask_pd (_mm_cmpeq_pd (dx, _mm_setzero_pd ()))) {
+        split = 1;          /* Let lyap_finish() redo this one. */
+        break;
+      }
+      x = xn;
+      prod = _mm_mul_pd (prod, dx);
+      if (_mm_movemask_pd (_mm_or_pd (_mm_cmpgt_pd (prod, hi),
+                                      _mm_cmplt_pd (prod, lo)))) {
+        _mm_storeu_pd (ps, prod);
+        for (k = 0; k < 2; k++)
+          if ((ps[k] > 1.0e12) || (ps[k] < 1.0e-12)) {
+            o[k].total += log(ps[k]);
+            ps[k] = 1.0;
+          }
+        prod = _mm_loadu_pd (ps);
       }
+      n++;
       if (++bindex >= st->maxindex) {
         bindex = 0;
-        if (st->Rflag)
-          setforcing(st);
+        if (LYAP_DUE(&o[0], n)) {
+          _mm_storeu_pd (xs, x);
+          _mm_storeu_pd (ps, prod);
+          for (k = 0; k < 2; k++) {
+            o[k].x = xs[k];
+            o[k].dwelt = n;
+            if (lyap_periodic (&o[k], &o[k].dwelt, st->dwell,
+                               o[k].total + log(ps[k])))
+              split = skipped[k] = True;
+          }
+          if (split) break;
+        }
       }
-      r = (st->forcing[bindex]) ? st->b : st->a;
-#ifdef MAPS
-      if (++findex >= funcmaxindex)
-        findex = 0;
-      map = Maps[st->Forcing[findex]];
-      deriv = Derivs[st->Forcing[findex]];
-#endif
+      r = st->forcing[bindex] ? bv : av;
     }
-    total += log(prod);
-    st->lyapunov = (total * M_LOG2E) / (double)i;   
   }
-  else {        /* use log(a) + log(b) */
-    for (i=0;i<st->dwell;i++) {
-      x = st->map (x, r);
-      dx = st->deriv (x, r); /* ABS is a macro, so don't be fancy */
-      dx = ABS(dx);
-      if (x == 0.0)  /* log(0) check */
-        {
-          i++;
-          break;
+
+  _mm_storeu_pd (xs, x);
+  _mm_storeu_pd (ps, prod);
+  for (k = 0; k < 2; k++) {
+    o[k].x = xs[k];
+    o[k].prod = ps[k];
+    o[k].bindex = bindex;
+    if (skipped[k])
+      ;
+    else if (dwelling)
+      o[k].dwelt = n;
+    else
+      o[k].settled = n;
+    out[k] = lyap_finish (st, self, k ? a1 : a0, b, &o[k]);
+  }
+}
+
+#endif /* __SSE2__ */
+
+
+/* The exponent of one point, computed from scratch. */
+static double
+lyap_point (const struct state *st, struct lyap_thread *self,
+            double a, double b)
+{
+  struct lyap_orbit o;
+  lyap_start (st, &o);
+  return lyap_finish (st, self, a, b, &o);
+}
+
+
+/* Computes this thread's tiles of the current band.  The new points at
+   block size s are the ones on the s grid that weren't already on the 2s
+   grid, and each one is painted over its s x s block. */
+static void
+lyap_pass (void *self_raw)
+{
+  struct lyap_thread *self = (struct lyap_thread *) self_raw;
+  struct state *st = self->st;
+  unsigned count = st->threadpool.count ? st->threadpool.count : 1;
+  int s = st->block;
+  int y0 = st->row, y1 = Min(st->row + LYAP_BAND(s), st->height);
+  double *exps = st->exponents[st->frame];
+  int tx, x, y, n, i, j;
+
+  for (tx = self->id * LYAP_TILE; tx < st->width; tx += count * LYAP_TILE) {
+    int x1 = Min(tx + LYAP_TILE, st->width);
+    for (y = y0; y < y1; y += s) {
+      int xs[LYAP_TILE];
+      double e[LYAP_TILE];
+      double b = st->min_b + y * st->b_inc;
+      int h = Min(s, st->height - y);
+
+      for (x = tx, n = 0; x < x1; x += s)
+        if (s == LYAP_BLOCK || (x | y) & s)
+          xs[n++] = x;
+
+      i = 0;
+#ifdef __SSE2__
+      if (st->vector_map >= 0)
+        for (; i + 2 <= n; i += 2)
+          lyap_pair (st, self, st->vector_map,
+                     st->min_a + xs[i] * st->a_inc,
+                     st->min_a + xs[i+1] * st->a_inc, b, e + i);
+#endif /* __SSE2__ */
+      for (; i < n; i++) {
+        if (st->Rflag) {
+          self->seed = (unsigned long) y * st->width + xs[i] + 1;
+          setforcing (st, self->forcing, &self->seed);
+        }
+        e[i] = lyap_point (st, self, st->min_a + xs[i] * st->a_inc, b);
+      }
+
+      for (i = 0; i < n; i++) {
+        int w = Min(s, st->width - xs[i]);
+        int color = lyap_color (st, e[i]);
+        for (j = 0; j < h; j++) {
+          long p = (long) (y + j) * st->width + xs[i];
+          memset (st->indexes + p, color, w);
+          for (x = 0; x < w; x++)
+            exps[p + x] = e[i];
         }
-      total += log(dx);
-      if (++bindex >= st->maxindex) {
-        bindex = 0;
-        if (st->Rflag)
-          setforcing(st);
       }
-      r = (st->forcing[bindex]) ? st->b : st->a;
-#ifdef MAPS
-      if (++findex >= funcmaxindex)
-        findex = 0;
-      map = Maps[st->Forcing[findex]];
-      deriv = Derivs[st->Forcing[findex]];
-#endif
     }
-    st->lyapunov = (total * M_LOG2E) / (double)i;
+
+    for (y = y0; y < y1; y++)
+      index_put_row (st->image, tx, y, st->indexes + (long) y * st->width + tx,
+                     x1 - tx, st->pixels);
   }
+}
 
-  if (sendpoint(st, st->lyapunov) == TRUE)
-    return FALSE;
-  else {
-    FlushBuffer(st);
-    /*    if (savefile)
-          save_to_file();*/
+
+static int
+lyap_thread_create (void *self_raw, struct threadpool *pool, unsigned id)
+{
+  struct lyap_thread *self = (struct lyap_thread *) self_raw;
+  self->st = GET_PARENT_OBJ(struct state, threadpool, pool);
+  self->id = id;
+  return 0;
+}
+
+static void
+lyap_thread_destroy (void *self_raw)
+{
+}
+
+
+/* Which of the polynomial maps lyap_pair() can do this is, or -1. */
+static int
+vector_map (const struct state *st)
+{
+  int i;
+  if (!st->useprod || st->Rflag)
+    return -1;
+  for (i = 0; i < NUMMAPS; i++)
+    if (st->map == Maps[i] && st->deriv == Derivs[i])
+      return (Maps[i] == circle ? -1 : i);
+  return -1;
+}
+
+
+static void
+put_rows (struct state *st, int y, int h)
+{
+#ifdef HAVE_XSHM_EXTENSION
+  if (st->shared)
+    XShmPutImage (st->dpy, st->canvas, st->gc, st->image,
+                  0, y, 0, y, st->width, h, False);
+  else
+#endif /* HAVE_XSHM_EXTENSION */
+    XPutImage (st->dpy, st->canvas, st->gc, st->image,
+               0, y, 0, y, st->width, h);
+}
+
+
+/* Computes and draws the next band.  Returns TRUE when the picture is done.
+ */
+static int
+complyap(struct state *st)
+{
+  int h;
+
+  if (st->maxcolor > MAXCOLOR)
+    abort();
+
+  if (!st->run || !st->block)
     return TRUE;
+
+  st->vector_map = vector_map (st);
+  if (st->threadpool.count) {
+    threadpool_run (&st->threadpool, lyap_pass);
+    threadpool_wait (&st->threadpool);
+  } else {
+    struct lyap_thread self;
+    self.st = st;
+    self.id = 0;
+    lyap_pass (&self);
+  }
+
+  h = Min(LYAP_BAND(st->block), st->height - st->row);
+  put_rows (st, st->row, h);
+
+  st->row += h;
+  if (st->block == LYAP_BLOCK)
+    st->expind[st->frame] = st->row * st->width;
+  if (st->row >= st->height) {
+    st->row = 0;
+    st->block /= 2;
+    if (!st->block)
+      return TRUE;
   }
+  return FALSE;
 }
 
 static double
@@ -522,15 +863,14 @@ init_data(struct state *st)
   st->lowrange = st->mincolindex - st->startcolor;
   st->a_inc = st->a_range / (double)st->width;
   st->b_inc = st->b_range / (double)st->height;
-  st->point.x = -1;
-  st->point.y = 0;
-  st->a = /*st->rubber_data.p_min = */st->min_a;
-  st->b = /*st->rubber_data.q_min = */st->min_b;
-/*  st->rubber_data.p_max = st->max_a;
+  st->block = LYAP_BLOCK;
+  st->row = 0;
+/*  st->rubber_data.p_min = st->min_a;
+  st->rubber_data.q_min = st->min_b;
+  st->rubber_data.p_max = st->max_a;
   st->rubber_data.q_max = st->max_b;*/
   if (st->show)
     show_defaults(st);
-  InitBuffer(st);
 }
 
 #if 0
@@ -560,16 +900,14 @@ init_color(struct state *st)
   make_smooth_colormap(st->screen, st->visual, st->cmap,
                        st->colors, &st->ncolors, True, NULL, True);
 
-  for (i = 0; i < st->maxcolor; i++) {
-    if (! st->Data_GC[i]) {
-      XGCValues gcv;
-      gcv.background = BlackPixelOfScreen(st->screen);
-      st->Data_GC[i] = XCreateGC(st->dpy, st->canvas, GCBackground, &gcv);
-    }
-    XSetForeground(st->dpy, st->Data_GC[i],
-                   st->colors[((int) ((i / ((float)st->maxcolor)) *
-                                      st->ncolors))].pixel);
+  if (! st->gc) {
+    XGCValues gcv;
+    gcv.background = BlackPixelOfScreen(st->screen);
+    st->gc = XCreateGC(st->dpy, st->canvas, GCBackground, &gcv);
   }
+  for (i = 0; i < st->maxcolor; i++)
+    st->pixels[i] = st->colors[((int) ((i / ((float)st->maxcolor)) *
+                                       st->ncolors))].pixel;
 }
 
 
@@ -621,7 +959,7 @@ parseargs(struct state *st)
 
   s = get_string_resource(st->dpy, "randomForce", "Float");
   if (s && *s) {
-    st->prob=atof(s); st->Rflag++; setforcing(st);
+    st->prob=atof(s); st->Rflag++;
   }
 
   st->settle = get_integer_resource(st->dpy, "settle", "Integer");
@@ -855,12 +1193,14 @@ Getkey(struct state *st, XKeyEvent *event)
         st->stripe_interval--;
         if (!mono_p) {
           init_color(st);
+          FlushBuffer(st);
         }
       }
       return True;
     case 'I': st->stripe_interval++;
       if (!mono_p) {
         init_color(st);
+        FlushBuffer(st);
       }
       return True;
     case 'K': if (st->minlyap > 0.05)
@@ -890,13 +1230,12 @@ Getkey(struct state *st, XKeyEvent *event)
       st->a_maximums[0] = st->max_a; st->b_maximums[0] = st->max_b;
       st->a_inc = st->a_range / (double)st->width;
       st->b_inc = st->b_range / (double)st->height;
-      st->point.x = -1;
-      st->point.y = 0;
-      st->a = /*st->rubber_data.p_min = */st->min_a;
-      st->b = /*st->rubber_data.q_min = */st->min_b;
-/*      st->rubber_data.p_max = st->max_a;
+/*      st->rubber_data.p_min = st->min_a;
+      st->rubber_data.q_min = st->min_b;
+      st->rubber_data.p_max = st->max_a;
       st->rubber_data.q_max = st->max_b;*/
       Clear(st);
+      Redraw(st);
       return True;
     case 'M': if (st->minlyap > 0.005)
         st->minlyap -= 0.005;
@@ -929,6 +1268,7 @@ Getkey(struct state *st, XKeyEvent *event)
         st->numwheels = 0;
       if (!mono_p) {
         init_color(st);
+        FlushBuffer(st);
       }
       return True;
     case 'w': if (st->numwheels > 0)
@@ -937,6 +1277,7 @@ Getkey(struct state *st, XKeyEvent *event)
         st->numwheels = MAXWHEELS;
       if (!mono_p) {
         init_color(st);
+        FlushBuffer(st);
       }
       return True;
     case 'x': Clear(st); return True;
@@ -975,12 +1316,10 @@ Getkey(struct state *st, XKeyEvent *event)
  * also greatly effect what details are seen. Play around with this.
  */
 static int
-sendpoint(struct state *st, double expo)
+lyap_color(const struct state *st, double expo)
 {
   double tmpexpo;
-
-  if (st->maxcolor > MAXCOLOR)
-    abort();
+  int index;
 
 #if 0
   /* The relationship st->minexp <= expo <= maxexp should always be true. This
@@ -991,47 +1330,32 @@ sendpoint(struct state *st, double expo)
     expo = maxexp;
 #endif
 
-  st->point.x++;
   tmpexpo = (st->negative) ? expo : -1.0 * expo;
   if (tmpexpo > 0) {
     if (!mono_p) {
-      st->sendpoint_index = (int)(tmpexpo*st->lowrange/st->maxexp);
-      st->sendpoint_index = ((st->sendpoint_index % st->lowrange) + 
-                             st->startcolor);
+      index = (int)(tmpexpo*st->lowrange/st->maxexp);
+      index = ((index % st->lowrange) + st->startcolor);
     }
     else
-      st->sendpoint_index = 0;
+      index = 0;
   }
   else {
     if (!mono_p) {
-      st->sendpoint_index = (int)(tmpexpo*st->numfreecols/st->minexp);
-      st->sendpoint_index = ((st->sendpoint_index % st->numfreecols)
-                             + st->mincolindex);
+      index = (int)(tmpexpo*st->numfreecols/st->minexp);
+      index = ((index % st->numfreecols) + st->mincolindex);
     }
     else
-      st->sendpoint_index = 1;
-  }
-  BufferPoint(st, st->sendpoint_index, st->point.x, st->point.y);
-  if (st->save) {
-    if (st->frame > MAXFRAMES)
-      abort();
-    st->exponents[st->frame][st->expind[st->frame]++] = expo;
-  }
-  if (st->point.x >= st->width) {
-    st->point.y++;
-    st->point.x = 0;
-    if (st->save) {
-      st->b += st->b_inc;
-      st->a = st->min_a;
-    }
-    if (st->point.y >= st->height)
-      return FALSE;
-    else
-      return TRUE;
+      index = 1;
   }
-  return TRUE;
-}
 
+  /* Guard against bogus color values. Shouldn't be necessary but paranoia
+     is good. */
+  if (index < 0)
+    index = 0;
+  else if (index >= st->maxcolor)
+    index = st->maxcolor - 1;
+  return index;
+}
 
 static void
 resize(struct state *st)
@@ -1052,59 +1376,40 @@ resize(struct state *st)
 #endif
   st->a_inc = st->a_range / (double)st->width;
   st->b_inc = st->b_range / (double)st->height;
-  st->point.x = -1;
-  st->point.y = 0;
-  st->run = 1;
-  st->a = /*st->rubber_data.p_min = */st->min_a;
-  st->b = /*st->rubber_data.q_min = */st->min_b;
-/*  st->rubber_data.p_max = st->max_a;
+/*  st->rubber_data.p_min = st->min_a;
+  st->rubber_data.q_min = st->min_b;
+  st->rubber_data.p_max = st->max_a;
   st->rubber_data.q_max = st->max_b;*/
   freemem(st);
   setupmem(st);
   for (n=0;n<MAXFRAMES;n++)
     if ((n <= st->maxframe) && (n != st->frame))
       st->resized[n] = 1;
-  InitBuffer(st);
   Clear(st);
   Redraw(st);
 }
 
+/* Recolors the first index points from exparray, and if cont is false,
+   starts computing them again. */
 static void
 redraw(struct state *st, double *exparray, int index, int cont)
 {
-  int i, x_sav, y_sav;
-
-  x_sav = st->point.x;
-  y_sav = st->point.y;
-
-  st->point.x = -1;
-  st->point.y = 0;
+  int i;
 
-  st->save=0;
   for (i=0;i<index;i++)
-    sendpoint(st, exparray[i]);
-  st->save=1;
-
-  if (cont) {
-    st->point.x = x_sav;
-    st->point.y = y_sav;
-  }
-  else {
-    st->a = st->point.x * st->a_inc + st->min_a;
-    st->b = st->point.y * st->b_inc + st->min_b;
-  }
+    st->indexes[i] = lyap_color(st, exparray[i]);
   FlushBuffer(st);
+
+  if (!cont)
+    Redraw(st);
 }
 
 static void
 Redraw(struct state *st)
 {
-  FlushBuffer(st);
-  st->point.x = -1;
-  st->point.y = 0;
+  st->block = LYAP_BLOCK;
+  st->row = 0;
   st->run = 1;
-  st->a = st->min_a;
-  st->b = st->min_b;
   st->expind[st->frame] = 0;
   st->resized[st->frame] = 0;
 }
@@ -1128,10 +1433,9 @@ Clear(struct state *st)
 {
   XClearWindow(st->dpy, st->canvas);
 #ifdef BACKING_PIXMAP
-  XCopyArea(st->dpy, st->canvas, st->pixmap, st->Data_GC[0],
+  XCopyArea(st->dpy, st->canvas, st->pixmap, st->gc,
             0, 0, st->width, st->height, 0, 0);
 #endif
-  InitBuffer(st);
 }
 
 static void
@@ -1296,10 +1600,6 @@ jumpwin(struct state *st)
   st->b_range = st->max_b - st->min_b;
   st->a_inc = st->a_range / (double)st->width;
   st->b_inc = st->b_range / (double)st->height;
-  st->point.x = -1;
-  st->point.y = 0;
-  st->a = st->min_a;
-  st->b = st->min_b;
   Clear(st);
   if (st->resized[st->frame])
     Redraw(st);
@@ -1331,63 +1631,16 @@ Destroy_frame(struct state *st)
   go_back(st);
 }
 
-static void
-InitBuffer(struct state *st)
-{
-  int i;
-
-  for (i = 0 ; i < st->maxcolor; ++i)
-    st->Points.npoints[i] = 0;
-}
-
-static void
-BufferPoint(struct state *st, int color, int x, int y)
-{
-  if (st->maxcolor > MAXCOLOR)
-    abort();
-
-  /* Guard against bogus color values. Shouldn't be necessary but paranoia
-     is good. */
-  if (color < 0)
-    color = 0;
-  else if (color >= st->maxcolor)
-    color = st->maxcolor - 1;
-
-  if (st->Points.npoints[color] == MAXPOINTS)
-    {
-      XDrawPoints(st->dpy, st->canvas, st->Data_GC[color],
-                  st->Points.data[color], st->Points.npoints[color], 
-                  CoordModeOrigin);
-#ifdef BACKING_PIXMAP
-      XDrawPoints(st->dpy, st->pixmap, st->Data_GC[color],
-                  st->Points.data[color], st->Points.npoints[color], 
-                  CoordModeOrigin);
-#endif
-      st->Points.npoints[color] = 0;
-    }
-  st->Points.data[color][st->Points.npoints[color]].x = x;
-  st->Points.data[color][st->Points.npoints[color]].y = y;
-  ++st->Points.npoints[color];
-}
-
+/* Expands all of the color indexes into the image, and puts it. */
 static void
 FlushBuffer(struct state *st)
 {
-  int color;
+  int y;
 
-  for (color = 0; color < st->maxcolor; ++color)
-    if (st->Points.npoints[color])
-      {
-        XDrawPoints(st->dpy, st->canvas, st->Data_GC[color],
-                    st->Points.data[color], st->Points.npoints[color],
-                    CoordModeOrigin);
-#ifdef BACKING_PIXMAP
-        XDrawPoints(st->dpy, st->pixmap, st->Data_GC[color],
-                    st->Points.data[color], st->Points.npoints[color],
-                    CoordModeOrigin);
-#endif
-        st->Points.npoints[color] = 0;
-      }
+  for (y = 0; y < st->height; y++)
+    index_put_row (st->image, 0, y, st->indexes + (long) y * st->width,
+                   st->width, st->pixels);
+  put_rows (st, 0, st->height);
 }
 
 static void
@@ -1455,6 +1708,13 @@ freemem(struct state *st)
   int i;
   for (i=0;i<MAXFRAMES;i++)
     free(st->exponents[i]);
+  free(st->indexes);
+#ifdef HAVE_XSHM_EXTENSION
+  if (st->shared)
+    destroy_xshm_image(st->dpy, st->image, &st->shminfo);
+  else
+#endif /* HAVE_XSHM_EXTENSION */
+    XDestroyImage(st->image);
 }
 
 static void
@@ -1463,19 +1723,32 @@ setupmem(struct state *st)
   int i;
   for (i=0;i<MAXFRAMES;i++) {
     if((st->exponents[i]=
-        (double *)malloc(sizeof(double)*st->width*(st->height+1)))==NULL){
+        (double *)calloc(st->width*(st->height+1), sizeof(double)))==NULL){
       fprintf(stderr,"Error malloc'ing exponent array.\n");
       exit(-1);
     }
   }
-}
+  st->indexes = (unsigned char *) calloc(st->width, st->height);
+  if (!st->indexes) {
+    fprintf(stderr,"Error malloc'ing index array.\n");
+    exit(-1);
+  }
 
-static void
-setforcing(struct state *st)
-{
-  int i;
-  for (i=0;i<MAXINDEX;i++)
-    st->forcing[i] = (random() > st->prob) ? 0 : 1;
+  st->image = 0;
+  st->shared = False;
+#ifdef HAVE_XSHM_EXTENSION
+  if (st->use_shm) {
+    st->image = create_xshm_image(st->dpy, st->visual, st->depth, ZPixmap,
+                                  NULL, &st->shminfo, st->width, st->height);
+    if (st->image)
+      st->shared = True;
+  }
+#endif /* HAVE_XSHM_EXTENSION */
+  if (!st->image) {
+    st->image = XCreateImage(st->dpy, st->visual, st->depth, ZPixmap, 0, NULL,
+                             st->width, st->height, BitmapPad(st->dpy), 0);
+    st->image->data = calloc(st->image->bytes_per_line, st->image->height);
+  }
 }
 
 /****************************************************************************/
@@ -1529,7 +1802,6 @@ do_defaults (struct state *st)
   st->rgb_max=65000;
   st->nostart=1;
   st->stripe_interval=7;
-  st->save=1;
   st->useprod=1;
   st->spinlength=256;
   st->run=1;
@@ -1782,8 +2054,10 @@ xlyap_init (Display *d, Window window)
   int builtin = -1;
   XGetWindowAttributes (d, window, &xgwa);
   st->dpy = d;
+  st->canvas = window;
   st->width = xgwa.width;
   st->height = xgwa.height;
+  st->depth = xgwa.depth;
   st->visual = xgwa.visual;
   st->screen = xgwa.screen;
   st->cmap = xgwa.colormap;
@@ -1804,6 +2078,9 @@ xlyap_init (Display *d, Window window)
     do_preset (st, builtin);
 
   st->background = BlackPixelOfScreen(st->screen);
+#ifdef HAVE_XSHM_EXTENSION
+  st->use_shm = get_boolean_resource(st->dpy, "useSHM", "Boolean");
+#endif /* HAVE_XSHM_EXTENSION */
   setupmem(st);
   init_data(st);
   if (!mono_p)
@@ -1811,10 +2088,6 @@ xlyap_init (Display *d, Window window)
   else
     st->foreground = WhitePixelOfScreen(st->screen);
 
-  /*
-   * Create the window to display the Lyapunov exponents
-   */
-  st->canvas = window;
   init_color(st);
 
 #ifdef BACKING_PIXMAP
@@ -1829,6 +2102,18 @@ xlyap_init (Display *d, Window window)
   st->linger = get_integer_resource(st->dpy, "linger", "Linger");
   if (st->linger < 1) st->linger = 1;
 
+  {
+    static const struct threadpool_class cls = {
+      sizeof(struct lyap_thread),
+      lyap_thread_create,
+      lyap_thread_destroy
+    };
+
+    if (threadpool_create(&st->threadpool, &cls, st->dpy,
+                          hardware_concurrency(st->dpy)))
+      st->threadpool.count = 0; /* See the note in thread_util.h. */
+  }
+
   return st;
 }
 
@@ -1837,7 +2122,6 @@ static unsigned long
 xlyap_draw (Display *dpy, Window window, void *closure)
 {
   struct state *st = (struct state *) closure;
-  int i;
 
   if (!st->run && st->reset_countdown) {
     st->reset_countdown--;
@@ -1855,13 +2139,11 @@ xlyap_draw (Display *dpy, Window window, void *closure)
     }
   }
 
-  for (i = 0; i < 1000; i++)
-    if (complyap(st) == TRUE)
-      {
-        st->run = 0;
-        st->reset_countdown = st->linger;
-        break;
-      }
+  if (complyap(st) == TRUE)
+    {
+      st->run = 0;
+      st->reset_countdown = st->linger;
+    }
   return st->delay;
 }
 
@@ -1902,17 +2184,17 @@ xlyap_event (Display *dpy, Window window, void *closure, XEvent *event)
 static void
 xlyap_free (Display *dpy, Window window, void *closure)
 {
-  int i;
   struct state *st = (struct state *) closure;
 
+  if (st->threadpool.count)
+    threadpool_destroy (&st->threadpool);
   freemem (st);
 
 #ifdef BACKING_PIXMAP
   XFreePixmap (st->dpy, st->pixmap);
 #endif
 /*  XFreeGC (st->dpy, st->RubberGC);*/
-  for (i = 0; i < st->maxcolor; i++)
-    XFreeGC (st->dpy, st->Data_GC[i]);
+  XFreeGC (st->dpy, st->gc);
 
   free (st);
 }
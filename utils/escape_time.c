@@ -0,0 +1,469 @@
+/* escape_time.c --- a shared escape-time fractal renderer.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee.  No
+ * representations are made about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ */
+
+/* Every point is iterated until |z|^2 > 4, until max_iter, or until z comes
+   back within ESCAPE_EPSILON of a point saved at the last power-of-two
+   iteration (Brent's cycle check), which catches most of the interior long
+   before max_iter.  The SSE2 loop runs four points at a time and counts
+   exactly the same iterations as the scalar escape_point().
+ */
+
+#include "utils.h"
+#include "escape_time.h"
+#include "index_image.h"
+#include "thread_util.h"
+
+#ifdef HAVE_XSHM_EXTENSION
+# include "xshm.h"
+#endif /* HAVE_XSHM_EXTENSION */
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#undef MIN
+#undef MAX
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#define MAX(a,b) ((a)>(b)?(a):(b))
+
+#define ESCAPE_BLOCK	8		/* The first pass does 8x8 blocks. */
+#define ESCAPE_BAND(s)	(16*(s)*(s))	/* Rows per band at block size s. */
+#define ESCAPE_TILE	64		/* Columns per thread work unit. */
+#define ESCAPE_FIRST	8		/* The first cycle check. */
+#define ESCAPE_EPSILON	1e-12
+
+struct escape_time {
+  Display *dpy;
+  int width, height;
+
+  XImage *image;
+  Bool shared;
+# ifdef HAVE_XSHM_EXTENSION
+  XShmSegmentInfo shminfo;
+# endif /* HAVE_XSHM_EXTENSION */
+
+  /* Index 0 is the inside pixel; n iterations map to 1 + n % npalette. */
+  unsigned char *indexes;
+  unsigned long palette[256];
+  int npalette;
+
+  struct threadpool threadpool;
+
+  struct escape_time_view view;
+  int block, row;		/* The next band; block is 0 when done. */
+  int dirty_y0, dirty_y1;	/* Rows not yet put. */
+};
+
+struct escape_thread {
+  struct escape_time *et;
+  unsigned id;
+};
+
+
+static double
+double_time (void)
+{
+  struct timeval now;
+# ifdef GETTIMEOFDAY_TWO_ARGS
+  gettimeofday (&now, NULL);
+# else
+  gettimeofday (&now);
+# endif
+  return now.tv_sec + now.tv_usec * 0.000001;
+}
+
+
+static void
+escape_init (const struct escape_time_view *v, int x, double py,
+             double *zr, double *zi, double *cr, double *ci)
+{
+  double px = v->x + x * v->dx;
+  if (v->julia_p)
+    {
+      *zr = px;
+      *zi = py;
+      *cr = v->cr;
+      *ci = v->ci;
+    }
+  else
+    {
+      *zr = *zi = 0;
+      *cr = px;
+      *ci = py;
+    }
+}
+
+
+#ifdef __SSE2__
+
+/* Iterates the n points xs[] of row py in groups of four: two lanes in each
+   of two vectors, so that one vector's multiplies can overlap the other's.
+   The points of a group start together, so they share their iteration count
+   and cycle checks; a lane that is done keeps iterating harmlessly until
+   the whole group is.
+ */
+static void
+escape_span (const struct escape_time_view *v, double py,
+             const int *xs, int n, int *out)
+{
+  const __m128d four = _mm_set1_pd (4);
+  const __m128d eps = _mm_set1_pd (ESCAPE_EPSILON);
+  const __m128d sign = _mm_set1_pd (-0.0);
+  int i;
+
+  for (i = 0; i < n; i += 4)
+    {
+      double zr[4], zi[4], cr[4], ci[4];
+      __m128d azr, azi, acr, aci, asr, asi;
+      __m128d bzr, bzi, bcr, bci, bsr, bsi;
+      int result[4];
+      int done = 0, iter = 0, check = ESCAPE_FIRST, l;
+
+      for (l = 0; l < 4; l++)
+        if (i + l < n)
+          escape_init (v, xs[i + l], py, zr + l, zi + l, cr + l, ci + l);
+        else
+          {
+            zr[l] = zi[l] = cr[l] = ci[l] = 0;
+            done |= 1 << l;
+          }
+
+      azr = asr = _mm_loadu_pd (zr);     bzr = bsr = _mm_loadu_pd (zr + 2);
+      azi = asi = _mm_loadu_pd (zi);     bzi = bsi = _mm_loadu_pd (zi + 2);
+      acr = _mm_loadu_pd (cr);           bcr = _mm_loadu_pd (cr + 2);
+      aci = _mm_loadu_pd (ci);           bci = _mm_loadu_pd (ci + 2);
+
+      while (iter < v->max_iter)
+        {
+          __m128d arr = _mm_mul_pd (azr, azr), brr = _mm_mul_pd (bzr, bzr);
+          __m128d aii = _mm_mul_pd (azi, azi), bii = _mm_mul_pd (bzi, bzi);
+          __m128d ari = _mm_mul_pd (azr, azi), bri = _mm_mul_pd (bzr, bzi);
+          __m128d ad, bd;
+          int m;
+
+          m = (_mm_movemask_pd (_mm_cmpgt_pd (_mm_add_pd (arr, aii), four))
+               | _mm_movemask_pd (_mm_cmpgt_pd (_mm_add_pd (brr, bii), four))
+               << 2) & ~done;
+          if (m)
+            {
+              for (l = 0; l < 4; l++)
+                if (m & (1 << l))
+                  result[l] = iter;
+              done |= m;
+              if (done == 15)
+                break;
+            }
+
+          azi = _mm_add_pd (_mm_add_pd (ari, ari), aci);
+          bzi = _mm_add_pd (_mm_add_pd (bri, bri), bci);
+          azr = _mm_add_pd (_mm_sub_pd (arr, aii), acr);
+          bzr = _mm_add_pd (_mm_sub_pd (brr, bii), bcr);
+          iter++;
+
+          ad = _mm_add_pd (_mm_andnot_pd (sign, _mm_sub_pd (azr, asr)),
+                           _mm_andnot_pd (sign, _mm_sub_pd (azi, asi)));
+          bd = _mm_add_pd (_mm_andnot_pd (sign, _mm_sub_pd (bzr, bsr)),
+                           _mm_andnot_pd (sign, _mm_sub_pd (bzi, bsi)));
+          m = (_mm_movemask_pd (_mm_cmplt_pd (ad, eps))
+               | _mm_movemask_pd (_mm_cmplt_pd (bd, eps)) << 2) & ~done;
+          if (m)
+            {
+              for (l = 0; l < 4; l++)
+                if (m & (1 << l))
+                  result[l] = -1;
+              done |= m;
+              if (done == 15)
+                break;
+            }
+
+          if (iter == check)
+            {
+              asr = azr;  bsr = bzr;
+              asi = azi;  bsi = bzi;
+              check *= 2;
+            }
+        }
+
+      for (l = 0; l < 4 && i + l < n; l++)
+        out[i + l] = (done & (1 << l)) ? result[l] : -1;
+    }
+}
+
+#else  /* !__SSE2__ */
+
+/* Returns the iteration at which z escaped, or -1 if it didn't. */
+static int
+escape_point (double zr, double zi, double cr, double ci, int max_iter)
+{
+  double sr = zr, si = zi;
+  int n = 0, check = ESCAPE_FIRST;
+
+  while (n < max_iter)
+    {
+      double rr = zr * zr, ii = zi * zi;
+      if (rr + ii > 4)
+        return n;
+      zi = 2 * zr * zi + ci;
+      zr = rr - ii + cr;
+      n++;
+      if (fabs (zr - sr) + fabs (zi - si) < ESCAPE_EPSILON)
+        break;
+      if (n == check)
+        {
+          sr = zr;
+          si = zi;
+          check *= 2;
+        }
+    }
+  return -1;
+}
+
+
+static void
+escape_span (const struct escape_time_view *v, double py,
+             const int *xs, int n, int *out)
+{
+  int i;
+  for (i = 0; i < n; i++)
+    {
+      double zr, zi, cr, ci;
+      escape_init (v, xs[i], py, &zr, &zi, &cr, &ci);
+      out[i] = escape_point (zr, zi, cr, ci, v->max_iter);
+    }
+}
+
+#endif /* !__SSE2__ */
+
+
+/* Computes this thread's tiles of the current band.  The new points at
+   block size s are the ones on the s grid that weren't already on the 2s
+   grid, and each one is painted over its s x s block.
+ */
+static void
+escape_pass (void *self_raw)
+{
+  struct escape_thread *self = (struct escape_thread *) self_raw;
+  struct escape_time *et = self->et;
+  const struct escape_time_view *v = &et->view;
+  unsigned count = et->threadpool.count ? et->threadpool.count : 1;
+  int s = et->block;
+  int y0 = et->row, y1 = MIN (et->row + ESCAPE_BAND (s), et->height);
+  int tx, x, y, n, i, j;
+
+  for (tx = self->id * ESCAPE_TILE; tx < et->width; tx += count * ESCAPE_TILE)
+    {
+      int x1 = MIN (tx + ESCAPE_TILE, et->width);
+      for (y = y0; y < y1; y += s)
+        {
+          int xs[ESCAPE_TILE], iters[ESCAPE_TILE];
+          int h = MIN (s, et->height - y);
+
+          for (x = tx, n = 0; x < x1; x += s)
+            if (s == ESCAPE_BLOCK || (x | y) & s)
+              xs[n++] = x;
+
+          escape_span (v, v->y + y * v->dy, xs, n, iters);
+
+          for (i = 0; i < n; i++)
+            {
+              int w = MIN (s, et->width - xs[i]);
+              int c = iters[i] < 0 ? 0 : 1 + iters[i] % et->npalette;
+              for (j = 0; j < h; j++)
+                memset (et->indexes + (long) (y + j) * et->width + xs[i],
+                        c, w);
+            }
+        }
+
+      for (y = y0; y < y1; y++)
+        index_put_row (et->image, tx, y,
+                       et->indexes + (long) y * et->width + tx,
+                       x1 - tx, et->palette);
+    }
+}
+
+
+static int
+escape_thread_create (void *self_raw, struct threadpool *pool, unsigned id)
+{
+  struct escape_thread *self = (struct escape_thread *) self_raw;
+  self->et = GET_PARENT_OBJ(struct escape_time, threadpool, pool);
+  self->id = id;
+  return 0;
+}
+
+static void
+escape_thread_destroy (void *self_raw)
+{
+}
+
+
+struct escape_time *
+escape_time_new (Display *dpy, Visual *visual, unsigned int depth,
+                 int width, int height, Bool use_shm,
+                 const unsigned long *palette, int npalette,
+                 unsigned long inside)
+{
+  static const struct threadpool_class cls = {
+    sizeof(struct escape_thread),
+    escape_thread_create,
+    escape_thread_destroy
+  };
+
+  struct escape_time *et = (struct escape_time *) calloc (1, sizeof(*et));
+  if (!et)
+    return 0;
+
+  et->dpy = dpy;
+  et->width = width;
+  et->height = height;
+
+  et->npalette = MAX (1, MIN (npalette, 255));
+  et->palette[0] = inside;
+  if (npalette > 0)
+    memcpy (et->palette + 1, palette, et->npalette * sizeof(*palette));
+  else
+    et->palette[1] = inside;
+
+# ifdef HAVE_XSHM_EXTENSION
+  if (use_shm)
+    {
+      et->image = create_xshm_image (dpy, visual, depth, ZPixmap, NULL,
+                                     &et->shminfo, width, height);
+      if (et->image)
+        et->shared = True;
+    }
+# endif /* HAVE_XSHM_EXTENSION */
+
+  if (!et->image)
+    {
+      et->image = XCreateImage (dpy, visual, depth, ZPixmap, 0, NULL,
+                                width, height, BitmapPad (dpy), 0);
+      if (et->image)
+        et->image->data = calloc (et->image->bytes_per_line, height);
+    }
+
+  et->indexes = (unsigned char *) calloc (width, height);
+
+  if (!et->image || !et->image->data || !et->indexes)
+    {
+      escape_time_free (et);
+      return 0;
+    }
+
+  if (threadpool_create (&et->threadpool, &cls, dpy,
+                         hardware_concurrency (dpy)))
+    et->threadpool.count = 0; /* See the note in thread_util.h. */
+
+  return et;
+}
+
+
+void
+escape_time_free (struct escape_time *et)
+{
+  if (et->threadpool.count)
+    threadpool_destroy (&et->threadpool);
+  if (et->image)
+    {
+# ifdef HAVE_XSHM_EXTENSION
+      if (et->shared)
+        destroy_xshm_image (et->dpy, et->image, &et->shminfo);
+      else
+# endif /* HAVE_XSHM_EXTENSION */
+        XDestroyImage (et->image);
+    }
+  free (et->indexes);
+  free (et);
+}
+
+
+void
+escape_time_start (struct escape_time *et, const struct escape_time_view *v)
+{
+  et->view = *v;
+  if (et->view.max_iter < 1)
+    et->view.max_iter = 1;
+  et->block = ESCAPE_BLOCK;
+  et->row = 0;
+}
+
+
+void
+escape_time_damage (struct escape_time *et, int y, int h)
+{
+  int y1 = MIN (y + h, et->height);
+  y = MAX (y, 0);
+  if (y1 <= y)
+    return;
+  if (et->dirty_y1 <= et->dirty_y0)
+    {
+      et->dirty_y0 = y;
+      et->dirty_y1 = y1;
+    }
+  else
+    {
+      et->dirty_y0 = MIN (et->dirty_y0, y);
+      et->dirty_y1 = MAX (et->dirty_y1, y1);
+    }
+}
+
+
+Bool
+escape_time_render (struct escape_time *et, double secs)
+{
+  double start = double_time ();
+
+  while (et->block)
+    {
+      int h = MIN (ESCAPE_BAND (et->block), et->height - et->row);
+
+      if (et->threadpool.count)
+        {
+          threadpool_run (&et->threadpool, escape_pass);
+          threadpool_wait (&et->threadpool);
+        }
+      else
+        {
+          struct escape_thread self;
+          self.et = et;
+          self.id = 0;
+          escape_pass (&self);
+        }
+
+      escape_time_damage (et, et->row, h);
+      et->row += h;
+      if (et->row >= et->height)
+        {
+          et->row = 0;
+          et->block /= 2;
+        }
+
+      if (double_time () - start >= secs)
+        break;
+    }
+
+  return !et->block;
+}
+
+
+void
+escape_time_put (struct escape_time *et, Drawable d, GC gc, int x, int y)
+{
+  int y0 = et->dirty_y0, h = et->dirty_y1 - et->dirty_y0;
+  if (h <= 0)
+    return;
+# ifdef HAVE_XSHM_EXTENSION
+  if (et->shared)
+    XShmPutImage (et->dpy, d, gc, et->image,
+                  0, y0, x, y + y0, et->width, h, False);
+  else
+# endif /* HAVE_XSHM_EXTENSION */
+    XPutImage (et->dpy, d, gc, et->image,
+               0, y0, x, y + y0, et->width, h);
+  et->dirty_y0 = et->dirty_y1 = 0;
+}
@@ -0,0 +1,70 @@
+/* escape_time.h --- a shared escape-time fractal renderer.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee.  No
+ * representations are made about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ */
+
+/* An escape-time renderer for z -> z^2 + c fractals (Julia and Mandelbrot
+   sets), for hacks that want to redraw one every frame.
+
+   The picture is computed coarse to fine: first one point per 8x8 block,
+   then the points that split each block into four, and so on down to
+   single pixels, each point computed only once.  Each call to
+   escape_time_render() does as much of that as fits in the time it is
+   given, spread across the threadpool, so a hack can keep its frame rate
+   and let the detail fill in over the following frames.
+
+   Pixels that escape after n iterations get palette[n % npalette]; pixels
+   that don't escape within max_iter, or that are caught in a cycle first,
+   get the inside pixel.
+ */
+
+#ifndef __ESCAPE_TIME_H__
+#define __ESCAPE_TIME_H__
+
+struct escape_time_view {
+  double x, y;          /* The point at the top left pixel. */
+  double dx, dy;        /* The size of a pixel. */
+  double cr, ci;        /* The constant, for Julia sets. */
+  Bool julia_p;         /* False: Mandelbrot, with c at each pixel. */
+  int max_iter;
+};
+
+struct escape_time;
+
+/* Returns NULL if the image can't be allocated.  The palette holds up to
+   255 pixels, and is copied.
+ */
+extern struct escape_time *
+escape_time_new (Display *dpy, Visual *visual, unsigned int depth,
+                 int width, int height, Bool use_shm,
+                 const unsigned long *palette, int npalette,
+                 unsigned long inside);
+extern void escape_time_free (struct escape_time *);
+
+/* Starts a new picture.  The old one stays in the image until the first
+   pass of the new one overwrites it.
+ */
+extern void escape_time_start (struct escape_time *,
+                               const struct escape_time_view *);
+
+/* Computes until the picture is done or about `secs' seconds have passed,
+   whichever comes first, but always at least one band of rows.  Returns
+   True when the picture is done.
+ */
+extern Bool escape_time_render (struct escape_time *, double secs);
+
+/* Copies the rows that changed since the last call to (x, y) of the
+   drawable.
+ */
+extern void escape_time_put (struct escape_time *, Drawable, GC,
+                             int x, int y);
+
+/* Makes the next escape_time_put() copy rows [y, y+h) too, e.g. to erase
+   something the caller drew over the picture.
+ */
+extern void escape_time_damage (struct escape_time *, int y, int h);
+
+#endif /* __ESCAPE_TIME_H__ */
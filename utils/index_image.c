@@ -0,0 +1,133 @@
+/* index_image.c --- shades indexed images into XImages.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee.  No
+ * representations are made about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ */
+
+/* The SSE2 loops below produce exactly the same bytes as the scalar tails;
+   they just do sixteen pixels at a time.
+ */
+
+#include "utils.h"
+#include "index_image.h"
+
+#ifdef HAVE_STDINT_H
+# include <stdint.h>
+#else
+typedef unsigned int uint32_t;
+typedef unsigned short uint16_t;
+#endif
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+void
+index_add_clamp (unsigned char *dst, const unsigned char *src,
+                 unsigned long n, unsigned char max)
+{
+  unsigned long i = 0;
+
+#ifdef __SSE2__
+  __m128i m = _mm_set1_epi8 ((char) max);
+  for (; i + 16 <= n; i += 16)
+    {
+      __m128i d = _mm_loadu_si128 ((const __m128i *) (dst + i));
+      __m128i s = _mm_loadu_si128 ((const __m128i *) (src + i));
+      _mm_storeu_si128 ((__m128i *) (dst + i),
+                        _mm_min_epu8 (_mm_adds_epu8 (d, s), m));
+    }
+#endif /* __SSE2__ */
+
+  for (; i < n; i++)
+    {
+      unsigned v = dst[i] + src[i];
+      dst[i] = v > max ? max : v;
+    }
+}
+
+
+void
+index_add_delta (unsigned char *dst, const signed char *delta,
+                 unsigned long n, unsigned char max)
+{
+  unsigned long i = 0;
+
+#ifdef __SSE2__
+  __m128i m = _mm_set1_epi8 ((char) max);
+  __m128i zero = _mm_setzero_si128 ();
+  for (; i + 16 <= n; i += 16)
+    {
+      __m128i d = _mm_loadu_si128 ((const __m128i *) (dst + i));
+      __m128i s = _mm_loadu_si128 ((const __m128i *) (delta + i));
+      /* Split the signed deltas into an unsigned increment and decrement. */
+      __m128i neg = _mm_cmpgt_epi8 (zero, s);
+      __m128i up = _mm_andnot_si128 (neg, s);
+      __m128i down = _mm_and_si128 (neg, _mm_sub_epi8 (zero, s));
+      d = _mm_subs_epu8 (_mm_adds_epu8 (d, up), down);
+      _mm_storeu_si128 ((__m128i *) (dst + i), _mm_min_epu8 (d, m));
+    }
+#endif /* __SSE2__ */
+
+  for (; i < n; i++)
+    {
+      int v = dst[i] + delta[i];
+      dst[i] = v < 0 ? 0 : v > max ? max : v;
+    }
+}
+
+
+static Bool
+native_byte_order_p (const XImage *image)
+{
+  const union { uint32_t i; char c[4]; } u = { 1 };
+  return image->byte_order == (u.c[0] ? LSBFirst : MSBFirst);
+}
+
+
+void
+index_put_row (XImage *image, int x, int y,
+               const unsigned char *src, unsigned long n,
+               const unsigned long *palette)
+{
+  char *row = image->data + y * image->bytes_per_line;
+  unsigned long i;
+
+  if (image->bits_per_pixel == 32 && native_byte_order_p (image))
+    {
+      uint32_t *out = (uint32_t *) row + x;
+      for (i = 0; i < n; i++)
+        out[i] = (uint32_t) palette[src[i]];
+    }
+  else if (image->bits_per_pixel == 16 && native_byte_order_p (image))
+    {
+      uint16_t *out = (uint16_t *) row + x;
+      for (i = 0; i < n; i++)
+        out[i] = (uint16_t) palette[src[i]];
+    }
+  else if (image->bits_per_pixel == 24)
+    {
+      unsigned char *out = (unsigned char *) row + x * 3;
+      int lsb = image->byte_order == LSBFirst;
+      for (i = 0; i < n; i++, out += 3)
+        {
+          unsigned long p = palette[src[i]];
+          out[lsb ? 0 : 2] = p;
+          out[1] = p >> 8;
+          out[lsb ? 2 : 0] = p >> 16;
+        }
+    }
+  else if (image->bits_per_pixel == 8)
+    {
+      unsigned char *out = (unsigned char *) row + x;
+      for (i = 0; i < n; i++)
+        out[i] = (unsigned char) palette[src[i]];
+    }
+  else
+    {
+      for (i = 0; i < n; i++)
+        XPutPixel (image, x + i, y, palette[src[i]]);
+    }
+}
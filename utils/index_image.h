@@ -0,0 +1,35 @@
+/* index_image.h --- shades indexed images into XImages.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee.  No
+ * representations are made about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ */
+
+/* Helpers for hacks that render into a byte-per-pixel buffer of palette
+   indexes and then expand that buffer into an XImage: saturating adds of
+   index rows, and a row-at-a-time palette lookup that writes the pixels
+   directly when the XImage's format allows it.
+ */
+
+#ifndef __INDEX_IMAGE_H__
+#define __INDEX_IMAGE_H__
+
+/* dst[i] = min (dst[i] + src[i], max).  Every dst[i] must already be <= max.
+ */
+extern void index_add_clamp (unsigned char *dst, const unsigned char *src,
+                             unsigned long n, unsigned char max);
+
+/* dst[i] = dst[i] + delta[i], clamped to [0, max].  Every dst[i] must
+   already be <= max.
+ */
+extern void index_add_delta (unsigned char *dst, const signed char *delta,
+                             unsigned long n, unsigned char max);
+
+/* Stores palette[src[i]] at (x + i, y) of the image, for i in [0, n).
+ */
+extern void index_put_row (XImage *image, int x, int y,
+                           const unsigned char *src, unsigned long n,
+                           const unsigned long *palette);
+
+#endif /* __INDEX_IMAGE_H__ */